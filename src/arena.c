@@ -0,0 +1,178 @@
+/*
+ * uefi-md5sum: UEFI MD5Sum validator - Run memory arena
+ * Copyright © 2024 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "boot.h"
+
+/* Minimum size of the chunks of memory that the arena obtains from the firmware */
+#define ARENA_CHUNK_SIZE    (4 * 1024 * 1024)
+
+/* Alignment of the allocations, suitable for cache lines and SIMD loads */
+#define ARENA_ALIGNMENT     64
+
+/* Chunk of memory, with its data area following the header */
+struct _ARENA_CHUNK {
+	struct _ARENA_CHUNK*    Next;   /* The chunk that was in use before this one, or the next free chunk */
+	UINTN                   Size;   /* The size of the data area */
+};
+typedef struct _ARENA_CHUNK ARENA_CHUNK;
+
+#define CHUNK_DATA(c)       ((UINT8*)(((UINTN)((c) + 1) + ARENA_ALIGNMENT - 1) & ~((UINTN)ARENA_ALIGNMENT - 1)))
+
+/* The run arena */
+STATIC struct {
+	ARENA_CHUNK*    Current;    /* The chunk that allocations are made from */
+	UINTN           Used;       /* The amount of data allocated from the current chunk */
+	ARENA_CHUNK*    Free;       /* Chunks that were released, and are kept for reuse */
+} Arena = { 0 };
+
+/**
+  Allocate a chunk of memory from the firmware.
+
+  @param[in]  Size              The minimum size of the data area.
+
+  @retval A pointer to the new chunk, or NULL on allocation error.
+**/
+STATIC ARENA_CHUNK* NewChunk(
+	IN CONST UINTN Size
+)
+{
+	ARENA_CHUNK* Chunk;
+	UINTN DataSize = MAX(Size, ARENA_CHUNK_SIZE);
+
+	Chunk = AllocatePool(sizeof(ARENA_CHUNK) + ARENA_ALIGNMENT + DataSize);
+	if (Chunk == NULL)
+		return NULL;
+	Chunk->Next = NULL;
+	Chunk->Size = DataSize;
+	return Chunk;
+}
+
+/**
+  Set up the arena that serves the memory used during a run, and that is then
+  released all at once by FreeArena().
+
+  @retval EFI_SUCCESS           The arena was set up.
+  @retval EFI_OUT_OF_RESOURCES  A memory allocation error occurred.
+**/
+EFI_STATUS InitArena(VOID)
+{
+	if (Arena.Current != NULL || Arena.Free != NULL)
+		return EFI_SUCCESS;
+	Arena.Free = NewChunk(0);
+	return (Arena.Free == NULL) ? EFI_OUT_OF_RESOURCES : EFI_SUCCESS;
+}
+
+/**
+  Allocate memory from the run arena. The memory is not zeroed, and is aligned
+  to a cache line. It is released by ArenaRelease() or FreeArena().
+
+  @param[in]  Size              The size of the allocation.
+
+  @retval A pointer to the allocated buffer, or NULL on allocation error.
+**/
+VOID* ArenaAllocate(
+	IN CONST UINTN Size
+)
+{
+	ARENA_CHUNK *Chunk, **Prev, **Best = NULL;
+	UINTN Offset;
+
+	if (Arena.Current != NULL) {
+		Offset = (Arena.Used + ARENA_ALIGNMENT - 1) & ~((UINTN)ARENA_ALIGNMENT - 1);
+		if (Offset <= Arena.Current->Size && Size <= Arena.Current->Size - Offset) {
+			Arena.Used = Offset + Size;
+			return &CHUNK_DATA(Arena.Current)[Offset];
+		}
+	}
+
+	// Reuse the smallest released chunk that is large enough, or get a new one
+	for (Prev = &Arena.Free; *Prev != NULL; Prev = &(*Prev)->Next) {
+		if ((*Prev)->Size >= Size && (Best == NULL || (*Prev)->Size < (*Best)->Size))
+			Best = Prev;
+	}
+	if (Best != NULL) {
+		Chunk = *Best;
+		*Best = Chunk->Next;
+	} else {
+		Chunk = NewChunk(Size);
+		if (Chunk == NULL)
+			return NULL;
+	}
+	// Whatever is left in the previous chunk stays unused until it is released
+	Chunk->Next = Arena.Current;
+	Arena.Current = Chunk;
+	Arena.Used = Size;
+	return CHUNK_DATA(Chunk);
+}
+
+/**
+  Record the current position of the run arena, so that the allocations made
+  after this call can be released with ArenaRelease().
+
+  @retval The current position of the arena.
+**/
+ARENA_MARK ArenaGetMark(VOID)
+{
+	ARENA_MARK Mark;
+
+	Mark.Chunk = Arena.Current;
+	Mark.Used = Arena.Used;
+	return Mark;
+}
+
+/**
+  Release all the allocations that were made from the run arena since a mark
+  was recorded. The chunks that are no longer in use are kept, to serve the
+  next allocations without going back to the firmware.
+
+  @param[in]  Mark              A mark obtained from ArenaGetMark().
+**/
+VOID ArenaRelease(
+	IN CONST ARENA_MARK Mark
+)
+{
+	ARENA_CHUNK* Chunk;
+
+	while (Arena.Current != NULL && Arena.Current != Mark.Chunk) {
+		Chunk = Arena.Current;
+		Arena.Current = Chunk->Next;
+		Chunk->Next = Arena.Free;
+		Arena.Free = Chunk;
+	}
+	Arena.Used = (Arena.Current == NULL) ? 0 : Mark.Used;
+}
+
+/**
+  Release all the memory of the run arena back to the firmware.
+**/
+VOID FreeArena(VOID)
+{
+	ARENA_CHUNK* Chunk;
+
+	while (Arena.Current != NULL) {
+		Chunk = Arena.Current;
+		Arena.Current = Chunk->Next;
+		FreePool(Chunk);
+	}
+	while (Arena.Free != NULL) {
+		Chunk = Arena.Free;
+		Arena.Free = Chunk->Next;
+		FreePool(Chunk);
+	}
+	Arena.Used = 0;
+}
@@ -51,6 +51,32 @@ STATIC CHAR16* Arch = L"loongarch64";
 #error Unsupported architecture
 #endif
 
+/**
+  Open the root directory of the volume held by a device.
+
+  @param[in]  DeviceHandle      A handle to the device.
+  @param[out] Root              A pointer to the root file handle.
+
+  @retval EFI_SUCCESS           The root file handle was successfully populated.
+  @retval other                 The device does not hold a volume that can be opened.
+**/
+STATIC EFI_STATUS OpenRootHandle(
+	IN CONST EFI_HANDLE DeviceHandle,
+	OUT EFI_FILE_HANDLE* RootHandle
+)
+{
+	EFI_STATUS Status;
+	EFI_SIMPLE_FILE_SYSTEM_PROTOCOL* Volume;
+
+	Status = gBS->OpenProtocol(DeviceHandle,
+		&gEfiSimpleFileSystemProtocolGuid, (VOID**)&Volume,
+		gMainImageHandle, NULL, EFI_OPEN_PROTOCOL_GET_PROTOCOL);
+	if (EFI_ERROR(Status))
+		return Status;
+
+	return Volume->OpenVolume(Volume, RootHandle);
+}
+
 /**
   Obtain the device and root handle of the current volume.
 
@@ -67,7 +93,6 @@ STATIC EFI_STATUS GetRootHandle(
 {
 	EFI_STATUS Status;
 	EFI_LOADED_IMAGE_PROTOCOL* LoadedImage;
-	EFI_SIMPLE_FILE_SYSTEM_PROTOCOL* Volume;
 
 	if (DeviceHandle == NULL || RootHandle == NULL)
 		return EFI_INVALID_PARAMETER;
@@ -81,19 +106,50 @@ STATIC EFI_STATUS GetRootHandle(
 	*DeviceHandle = LoadedImage->DeviceHandle;
 
 	// Open the the root directory on the boot volume
-	Status = gBS->OpenProtocol(LoadedImage->DeviceHandle,
-		&gEfiSimpleFileSystemProtocolGuid, (VOID**)&Volume,
-		gMainImageHandle, NULL, EFI_OPEN_PROTOCOL_GET_PROTOCOL);
+	return OpenRootHandle(LoadedImage->DeviceHandle, RootHandle);
+}
+
+/**
+  Open one of the volumes, besides the boot volume, that a hash list references.
+
+  @param[in]  Id                The label or partition GUID of the volume, from the hash list.
+  @param[out] Volume            A pointer to the HASH_VOLUME to set up.
+
+  @retval EFI_SUCCESS           The volume was opened.
+  @retval EFI_NOT_FOUND         The volume could not be found.
+  @retval other                 The volume could not be opened.
+**/
+STATIC EFI_STATUS OpenHashVolume(
+	IN CONST CHAR8* Id,
+	OUT HASH_VOLUME* Volume
+)
+{
+	EFI_STATUS Status;
+	CHAR16 VolumeId[VOLUME_ID_MAX + 1];
+
+	ZeroMem(Volume, sizeof(HASH_VOLUME));
+	Status = Utf8ToUcs2(Id, VolumeId, ARRAY_SIZE(VolumeId));
 	if (EFI_ERROR(Status))
 		return Status;
-
-	return Volume->OpenVolume(Volume, RootHandle);
+	Status = LocateVolume(VolumeId, &Volume->DeviceHandle);
+	if (EFI_ERROR(Status))
+		return Status;
+	Status = OpenRootHandle(Volume->DeviceHandle, &Volume->Root);
+	if (EFI_ERROR(Status)) {
+		Volume->Root = NULL;
+		return Status;
+	}
+	// As with the boot volume, direct access is only an optimization
+	if (EFI_ERROR(OpenVolume(Volume->DeviceHandle, &Volume->Volume)))
+		Volume->Volume = NULL;
+	return EFI_SUCCESS;
 }
 
 /**
   Fix the casing of a path to match the actual case of the referenced elements.
 
   @param[in]     Root            A handle to the root partition.
+  @param[in]     Index           (Optional) A directory index to look the path up from.
   @param[in/out] Path            The path to update.
 
   @retval EFI_SUCCESS            The path was successfully updated.
@@ -103,12 +159,14 @@ STATIC EFI_STATUS GetRootHandle(
 **/
 STATIC EFI_STATUS SetPathCase(
 	CONST IN EFI_FILE_HANDLE Root,
+	OPTIONAL IN DIR_INDEX* Index,
 	IN CHAR16* Path
 )
 {
 	CONST UINTN FileInfoSize = sizeof(EFI_FILE_INFO) + PATH_MAX * sizeof(CHAR16);
 	EFI_FILE_HANDLE FileHandle = NULL;
 	EFI_FILE_INFO* FileInfo;
+	DIR_INDEX_ENTRY* Entry;
 	UINTN i, Len;
 	UINTN Size;
 	EFI_STATUS Status;
@@ -116,6 +174,11 @@ STATIC EFI_STATUS SetPathCase(
 	if ((Root == NULL) || (Path == NULL) || (Path[0] != L'\\'))
 		return EFI_INVALID_PARAMETER;
 
+	// The index already has the case of the elements from the directories it read
+	Entry = LookupDirIndex(Index, Path);
+	if (Entry != NULL)
+		return GetDirIndexPath(Entry, Path, SafeStrLen(Path) + 1);
+
 	FileInfo = (EFI_FILE_INFO*)AllocatePool(FileInfoSize);
 	if (FileInfo == NULL)
 		return EFI_OUT_OF_RESOURCES;
@@ -130,7 +193,7 @@ STATIC EFI_STATUS SetPathCase(
 	if (i != 0) {
 		Path[i] = 0;
 		// Recursively fix the case
-		Status = SetPathCase(Root, Path);
+		Status = SetPathCase(Root, NULL, Path);
 		if (EFI_ERROR(Status))
 			goto out;
 	}
@@ -287,6 +350,120 @@ STATIC EFI_STATUS ExitProcess(
 	return Status;
 }
 
+/**
+  Set up the volumes of a session for a window of the hash list, by opening the
+  volumes that are referenced for the first time and indexing the files of the
+  window on each of them. The boot volume is always indexed, for the lookup of
+  the original bootloader.
+
+  @param[in/out] Session         A pointer to the HASH_SESSION holding the volumes.
+  @param[in]     List            A pointer to the HASH_LIST holding the window.
+  @param[in/out] IsSetUp         An array of HASH_VOLUMES_MAX flags, for the volumes that were set up.
+  @param[in]     BuggyNtfsDriver Whether the boot volume is served by a buggy NTFS driver.
+  @param[out]    TotalBytes      A pointer to receive the total size of the files from the window,
+                                 or 0 if some of these files could not be indexed.
+**/
+STATIC VOID SetUpHashVolumes(
+	IN OUT HASH_SESSION* Session,
+	IN CONST HASH_LIST* List,
+	IN OUT BOOLEAN* IsSetUp,
+	IN CONST BOOLEAN BuggyNtfsDriver,
+	OUT UINT64* TotalBytes
+)
+{
+	HASH_VOLUME* Volume;
+	BOOLEAN IsIndexed = TRUE;
+	UINTN i, NumEntries[HASH_VOLUMES_MAX];
+	UINT64 VolumeBytes;
+
+	ZeroMem(NumEntries, sizeof(NumEntries));
+	for (i = 0; i < List->NumEntries; i++)
+		NumEntries[List->VolumeIndex[i]]++;
+
+	*TotalBytes = 0;
+	for (i = 0; i < List->NumVolumes; i++) {
+		Volume = &Session->Volumes[i];
+		// The index of the previous window was released with that window
+		Volume->Index = NULL;
+		if (i != 0 && NumEntries[i] == 0)
+			continue;
+		if (!IsSetUp[i]) {
+			IsSetUp[i] = TRUE;
+			// The files from a volume that can't be found are reported
+			// as failed, like files that can't be found.
+			if (i != 0 && EFI_ERROR(OpenHashVolume(List->VolumeId[i], Volume)))
+				PrintWarning(L"Could not open volume '%a'", List->VolumeId[i]);
+			// Only bypass the firmware NTFS driver if it is known to be buggy, or if
+			// md5sum.txt requested it, since our reader does not support every file.
+			if (Volume->Volume != NULL && Volume->Volume->Type == FS_TYPE_NTFS) {
+				if ((i == 0) ? BuggyNtfsDriver : IsProblematicNtfsDriver(Volume->DeviceHandle)) {
+					PrintInfo(L"Reading NTFS data directly from the disk, to avoid the buggy driver.");
+				} else if (!List->NtfsDirect) {
+					CloseVolume(Volume->Volume);
+					Volume->Volume = NULL;
+				}
+			}
+		}
+		// Since the index is only an optimization, we can do without it
+		VolumeBytes = 0;
+		if (Volume->Root == NULL ||
+			EFI_ERROR(CreateDirIndex(Volume->Root, List, i, &Volume->Index, &VolumeBytes)))
+			Volume->Index = NULL;
+		// Byte progress from the index requires every volume with files to be indexed
+		if (NumEntries[i] != 0 && VolumeBytes == 0)
+			IsIndexed = FALSE;
+		*TotalBytes += VolumeBytes;
+	}
+	Session->NumVolumes = List->NumVolumes;
+	if (!IsIndexed)
+		*TotalBytes = 0;
+}
+
+/**
+  Get the number of entries of a hash list, or an estimate of it, from the
+  entries that were parsed so far and the share of the file they came from.
+
+  @param[in]  List        A pointer to the HASH_LIST holding the current window.
+  @param[in]  NumEntries  The number of entries from the windows before the current one.
+
+  @retval The number of entries of the list, estimated if the current window is not the last.
+**/
+STATIC UINT64 GetNumEntries(
+	IN CONST HASH_LIST* List,
+	IN CONST UINTN NumEntries
+)
+{
+	UINT64 Total = NumEntries + List->NumEntries;
+
+	if (List->EndOfList || List->FileParsed == 0)
+		return Total;
+	// Stay above the entries we know of, so that progress doesn't complete early
+	return MAX(DivU64x64Remainder(MultU64x64(Total, List->FileSize), List->FileParsed, NULL), Total + 1);
+}
+
+/**
+  Get the total size of the files of a hash list window, from the sizes that the
+  md5sum_size comments of the list provide.
+
+  @param[in]  List        A pointer to the HASH_LIST holding the current window.
+
+  @retval The total size of the files, or 0 if the size of some of them is unknown.
+**/
+STATIC UINT64 GetExpectedBytes(
+	IN CONST HASH_LIST* List
+)
+{
+	UINT64 Total = 0;
+	UINTN i;
+
+	for (i = 0; i < List->NumEntries; i++) {
+		if (List->ExpectedSize[i] == HASH_SIZE_UNKNOWN)
+			return 0;
+		Total += List->ExpectedSize[i];
+	}
+	return Total;
+}
+
 /*
  * Application entry-point
  * NB: This must be set to 'efi_main' for gnu-efi crt0 compatibility
@@ -300,12 +477,18 @@ EFI_STATUS EFIAPI efi_main(
 	EFI_HANDLE DeviceHandle;
 	EFI_FILE_HANDLE Root;
 	EFI_DEVICE_PATH* DevicePath = NULL;
+	HASH_SESSION Session = { 0 };
+	BOOLEAN BuggyNtfsDriver, IsComplete = FALSE, IsSetUp[HASH_VOLUMES_MAX] = { FALSE };
 	HASH_LIST HashList = { 0 };
-	CHAR8 c;
-	CHAR16 Path[PATH_MAX + 1], Message[128], LoaderPath[64];
-	UINT8 ComputedHash[MD5_HASHSIZE], ExpectedHash[MD5_HASHSIZE];
-	UINTN i, Index, NumFailed = 0;
+	HASH_BATCH_ENTRY* Batch = NULL;
+	EFI_STATUS LastResult = EFI_SUCCESS, *Results = NULL;
+	CHAR16 *BatchPaths = NULL, Message[128], LoaderPath[64], Path[PATH_MAX + 1];
+	UINTN i, j, d, Index, BatchSize, NumOrdered, NumReported, NumVolumes, *Order = NULL, *Duplicate = NULL;
+	UINTN NumEntries = 0, NumProcessed = 0, NumFailed = 0;
+	FILE_LOCATION* Location = NULL;
+	ARENA_MARK WindowMark;
 	PROGRESS_DATA Progress = { 0 };
+	UINT64 TotalBytes = 0, ExpectedBytes;
 
 	// Keep a global copy of the bootloader's image handle
 	gMainImageHandle = BaseImageHandle;
@@ -321,11 +504,22 @@ EFI_STATUS EFIAPI efi_main(
 
 	InitConsole();
 
+	// Set up the arena that serves the memory we use during the run
+	Status = InitArena();
+	if (EFI_ERROR(Status)) {
+		PrintError(L"Could not allocate memory");
+		goto out;
+	}
+
 	Status = GetRootHandle(&DeviceHandle, &Root);
 	if (EFI_ERROR(Status)) {
 		PrintError(L"Could not open root directory");
 		goto out;
 	}
+	// The boot volume is always the first volume of the session
+	Session.Volumes[0].DeviceHandle = DeviceHandle;
+	Session.Volumes[0].Root = Root;
+	Session.NumVolumes = 1;
 
 	// Detect if we are booting on an early AMI UEFI v2.0 system
 	if (IsEarlyAmiUefi()) {
@@ -336,33 +530,91 @@ EFI_STATUS EFIAPI efi_main(
 
 	// Detect if we are booting from an NTFS partition served by the buggy
 	// AMI NTFS driver and alert the user if that is the case.
-	if (IsProblematicNtfsDriver(DeviceHandle)) {
+	BuggyNtfsDriver = IsProblematicNtfsDriver(DeviceHandle);
+	if (BuggyNtfsDriver) {
 		PrintWarning(L"Buggy AMI NTFS driver detected!");
 		PrintWarning(L"This driver may produce unexpected checksum errors.");
 		PrintWarning(L"For details, see https://github.com/pbatard/AmiNtfsBug.");
 	}
 
+	// Validate the MD5 kernels that this platform supports and select the fastest
+	Status = Md5SelectKernels();
+	if (EFI_ERROR(Status)) {
+		PrintError(L"Could not validate MD5 implementation");
+		goto out;
+	}
+
+	// Try to access the volume directly, for faster reads. If the file
+	// system is not one we support, we just use the firmware driver.
+	if (EFI_ERROR(OpenVolume(DeviceHandle, &Session.Volumes[0].Volume)))
+		Session.Volumes[0].Volume = NULL;
+
+	// Open md5sum.txt, that we parse one window at a time, so that we can start
+	// hashing before the whole file has been read and so that the memory we use
+	// doesn't depend on its size.
+	Status = OpenHashList(Root, HASH_FILE, &HashList);
+
+	// Set up the batch of files to hash and the application processors, that
+	// must remain allocated when the memory used for a window is released.
+	if (!EFI_ERROR(Status)) {
+		Batch = ArenaAllocate(HASH_BATCH_SIZE * sizeof(HASH_BATCH_ENTRY));
+		BatchPaths = ArenaAllocate(HASH_BATCH_SIZE * (PATH_MAX + 1) * sizeof(CHAR16));
+		if (Batch == NULL || BatchPaths == NULL) {
+			Status = EFI_OUT_OF_RESOURCES;
+			PrintError(L"Could not allocate hash batch");
+		} else {
+			for (i = 0; i < HASH_BATCH_SIZE; i++)
+				Batch[i].Path = &BatchPaths[i * (PATH_MAX + 1)];
+			// The workers are only started once the list is ready to be hashed
+			if (CreateHashWorkers(&Session.Workers) != EFI_SUCCESS)
+				Session.Workers = NULL;
+		}
+	}
+	WindowMark = ArenaGetMark();
+
+	// Parse the first window, unless the list has a binary index that we can
+	// load instead, and read the directories that it references in one pass,
+	// to get the sizes and the case of the files without querying each one.
+	if (!EFI_ERROR(Status) && LoadHashIndex(Root, HASH_INDEX_FILE, &HashList) != EFI_SUCCESS)
+		Status = ParseHashList(&HashList);
+	if (EFI_ERROR(Status)) {
+		// We still need the index of the boot volume to chain load
+		if (EFI_ERROR(CreateDirIndex(Root, NULL, 0, &Session.Volumes[0].Index, NULL)))
+			Session.Volumes[0].Index = NULL;
+	} else {
+		// Print any extra data we want to validate
+		PrintTest(L"TotalBytes = 0x%lx", HashList.TotalBytes);
+		SetUpHashVolumes(&Session, &HashList, IsSetUp, BuggyNtfsDriver, &TotalBytes);
+	}
+
 	// Look up the original boot loader for chain loading
 	UnicodeSPrint(LoaderPath, ARRAY_SIZE(LoaderPath),
 		L"\\efi\\boot\\boot%s_original.efi", Arch);
-	if (SetPathCase(Root, LoaderPath) == EFI_SUCCESS)
+	if (SetPathCase(Root, Session.Volumes[0].Index, LoaderPath) == EFI_SUCCESS)
 		DevicePath = FileDevicePath(DeviceHandle, LoaderPath);
 
-	// Parse md5sum.txt to construct a hash list.
-	// We parse the full file, rather than process it line by line so that we
-	// can report progress and, unless md5sum_totalbytes is always specified at
-	// the beginning, progress requires knowing how many files we have to hash.
-	Status = Parse(Root, HASH_FILE, &HashList);
 	if (EFI_ERROR(Status))
 		goto out;
-	V_ASSERT(HashList.Entry != NULL);
-
-	// Print any extra data we want to validate
-	PrintTest(L"TotalBytes = 0x%lx", HashList.TotalBytes);
-
-	// Set up the progress bar data
-	Progress.Type = (HashList.TotalBytes == 0) ? PROGRESS_TYPE_FILE : PROGRESS_TYPE_BYTE;
-	Progress.Maximum = (HashList.TotalBytes == 0) ? HashList.NumEntries : HashList.TotalBytes;
+	V_ASSERT(HashList.Digest != NULL);
+
+	// Align reads to the volume geometry, before the read size gets tuned
+	InitReadTuning(&Session);
+
+	// Set up the progress bar data. If md5sum_totalbytes was not specified, we
+	// can still report byte progress when md5sum_size comments or the index have
+	// all the file sizes, which requires the whole list to be in the first window.
+	// The sizes from the list are preferred, since they weight each entry exactly.
+	// Otherwise, we report file progress, with an estimate of the number of files
+	// until the last window is parsed.
+	ExpectedBytes = HashList.EndOfList ? GetExpectedBytes(&HashList) : 0;
+	if (HashList.TotalBytes != 0)
+		TotalBytes = HashList.TotalBytes;
+	else if (ExpectedBytes != 0)
+		TotalBytes = ExpectedBytes;
+	else if (!HashList.EndOfList)
+		TotalBytes = 0;
+	Progress.Type = (TotalBytes == 0) ? PROGRESS_TYPE_FILE : PROGRESS_TYPE_BYTE;
+	Progress.Maximum = (TotalBytes == 0) ? GetNumEntries(&HashList, 0) : TotalBytes;
 	Progress.Message = L"Media validation";
 	Progress.YPos = gConsole.Rows / 2 - 3;
 	InitProgress(&Progress);
@@ -381,62 +633,155 @@ EFI_STATUS EFIAPI efi_main(
 		goto out;
 	}
 
-	// Now go through each entry we parsed
-	for (Index = 0; Index < HashList.NumEntries; Index++) {
-		// Convert the expected hexascii hash to a binary value we can use
-		ZeroMem(ExpectedHash, sizeof(ExpectedHash));
-		for (i = 0; i < MD5_HASHSIZE * 2; i++) {
-			c = HashList.Entry[Index].Hash[i];
-			// The Parse() call should have filtered any invalid string
-			V_ASSERT(IsValidHexAscii(c));
-			ExpectedHash[i / 2] <<= 4;
-			ExpectedHash[i / 2] |= c >= 'a' ? (c - 'a' + 0x0A) : c - '0';
+	Session.WatchDogBytes = WATCHDOG_RESETSIZE;
+
+	// Hand the hashing over to the application processors, if there are enough
+	// of them to outpace the BSP, so that the BSP only has to issue the reads.
+	// They are started now, rather than during the setup, since they would just
+	// spin until then.
+	if (Session.Workers != NULL && (StartHashWorkers(Session.Workers) != EFI_SUCCESS ||
+		Session.Workers->NumWorkers < HASH_WORKERS_MIN)) {
+		StopHashWorkers(Session.Workers);
+		Session.Workers = NULL;
+	}
+
+	// Process the list one window at a time
+	while (1) {
+		// Work out the order in which to hash the files, so that we seek as little
+		// as possible. Results are still reported in the order of the hash list.
+		// Entries that reference a file which is already in the schedule, are
+		// left out of it, and get their result from that file.
+		Status = ScheduleHashList(&Session, &HashList, &Order, &NumOrdered, &Duplicate, &Location);
+		Results = ArenaAllocate(HashList.NumEntries * sizeof(EFI_STATUS));
+		if (EFI_ERROR(Status) || Results == NULL) {
+			Status = EFI_OUT_OF_RESOURCES;
+			PrintError(L"Could not allocate hash schedule");
+			goto out;
 		}
+		for (i = 0; i < HashList.NumEntries; i++)
+			Results[i] = EFI_NOT_STARTED;
+
+		// Now go through each entry of the window, processing them in batches
+		// so that multiple files can be hashed in parallel.
+		NumReported = 0;
+		for (Index = 0; Index < NumOrdered; ) {
+			BatchSize = MIN(NumOrdered - Index, HASH_BATCH_SIZE);
+			for (j = 0; j < BatchSize; j++) {
+				// The paths were converted by the parser, and entries that
+				// have an invalid path are just reported as failed.
+				GetHashEntryPath(&HashList, Order[Index + j], Batch[j].Path);
+				Batch[j].Volume = HashList.VolumeIndex[Order[Index + j]];
+				Batch[j].Location = &Location[Order[Index + j]];
+				Batch[j].ExpectedSize = HashList.ExpectedSize[Order[Index + j]];
+				Batch[j].Status = (HashList.Flags[Order[Index + j]] & HASH_ENTRY_INVALID_PATH) ?
+					EFI_INVALID_PARAMETER : EFI_SUCCESS;
+			}
 
-		// Convert the UTF-8 path to UCS-2
-		Status = Utf8ToUcs2(HashList.Entry[Index].Path, Path, ARRAY_SIZE(Path));
-		if (EFI_ERROR(Status)) {
-			// Conversion failed but we want a UCS-2 Path for the failure
-			// report so just filter out anything that is non lower ASCII.
-			V_ASSERT(AsciiStrLen(HashList.Entry[Index].Path) < ARRAY_SIZE(Path));
-			for (i = 0; i < AsciiStrLen(HashList.Entry[Index].Path); i++) {
-				c = HashList.Entry[Index].Path[i];
-				if (c < ' ' || c > 0x80)
-					c = '?';
-				Path[i] = (CHAR16)c;
+			// Hash the files from the batch. Since individual results are
+			// reported through each entry, we don't need the returned status.
+			HashFileBatch(&Session, Batch, BatchSize, &Progress);
+
+			for (j = 0; j < BatchSize; j++, Index++) {
+				// Compare the result to the expected value
+				Status = Batch[j].Status;
+				if (Status == EFI_SUCCESS &&
+					(CompareMem(Batch[j].Hash, HashList.Digest[Order[Index]], MD5_HASHSIZE) != 0))
+					Status = EFI_CRC_ERROR;
+
+				Results[Order[Index]] = Status;
+
+				// Reuse the hash for the entries that reference the same file, which
+				// also catches the entries that list the same file with another hash.
+				for (d = Duplicate[Order[Index]]; d != HASH_ENTRY_NONE; d = Duplicate[d]) {
+					Results[d] = Batch[j].Status;
+					if (Results[d] != EFI_SUCCESS)
+						continue;
+					if (CompareMem(Batch[j].Hash, HashList.Digest[d], MD5_HASHSIZE) != 0)
+						Results[d] = EFI_CRC_ERROR;
+					// Account for the file as if it had been read again
+					Progress.Current += (Progress.Type == PROGRESS_TYPE_FILE) ? 1 : Batch[j].Size;
+					UpdateProgress(&Progress);
+				}
+
+				// Check for user cancellation
+				if (Status == EFI_ABORTED)
+					break;
 			}
-			Path[i] = L'\0';
-		} else {
-			// Hash the file and compare the result to the expected value
-			Status = HashFile(Root, Path, &Progress, ComputedHash);
-			if (Status == EFI_SUCCESS &&
-				(CompareMem(ComputedHash, ExpectedHash, MD5_HASHSIZE) != 0))
-				Status = EFI_CRC_ERROR;
-		}
 
-		// Check for user cancellation
+			// Report failures in the order of the hash list, once all the
+			// entries that come before them have been processed.
+			while (NumReported < HashList.NumEntries && Results[NumReported] != EFI_NOT_STARTED &&
+				Results[NumReported] != EFI_ABORTED) {
+				if (EFI_ERROR(Results[NumReported])) {
+					NumFailed++;
+					GetHashEntryPath(&HashList, NumReported, Path);
+					PrintFailedEntry(Results[NumReported], Path);
+				}
+				NumReported++;
+			}
+			if (Status == EFI_ABORTED)
+				break;
+		}
+		NumEntries += HashList.NumEntries;
+		NumProcessed += NumReported;
+		if (NumReported != 0 && NumReported == HashList.NumEntries)
+			LastResult = Results[NumReported - 1];
 		if (Status == EFI_ABORTED)
 			break;
+		if (HashList.EndOfList) {
+			IsComplete = TRUE;
+			break;
+		}
 
-		// Report failures
-		if (EFI_ERROR(Status)) {
-			NumFailed++;
-			PrintFailedEntry(Status, Path);
+		// Move on to the next window, releasing the memory of the current one
+		ArenaRelease(WindowMark);
+		Status = ParseHashList(&HashList);
+		if (EFI_ERROR(Status))
+			break;
+		NumVolumes = Session.NumVolumes;
+		SetUpHashVolumes(&Session, &HashList, IsSetUp, BuggyNtfsDriver, &TotalBytes);
+		if (Session.NumVolumes != NumVolumes)
+			InitReadTuning(&Session);
+		if (Progress.Type == PROGRESS_TYPE_FILE) {
+			Progress.Maximum = GetNumEntries(&HashList, NumEntries);
+			UpdateProgress(&Progress);
 		}
 	}
+	// Like the reports, the final status is that of the last entry from the list
+	if (IsComplete && NumProcessed != 0 && NumProcessed == NumEntries)
+		Status = LastResult;
+
+	// Once the media has been validated, save the index of the list for the
+	// next run, if the list asked for it, since the media is otherwise left
+	// untouched. This fails silently on read-only media. We never write through
+	// an NTFS driver that is known to be buggy, or that the list asked us to
+	// bypass.
+	if (IsComplete && NumFailed == 0 && !BuggyNtfsDriver && !HashList.NtfsDirect && HashList.SaveIndex &&
+		SaveHashIndex(Root, HASH_INDEX_FILE, &HashList) == EFI_SUCCESS)
+		PrintTest(L"Saved '%s'", HASH_INDEX_FILE);
 
 	ExitScrollSection();
 
 	// Final report
 	UnicodeSPrint(Message, ARRAY_SIZE(Message), L"%d/%d file%s processed [%d failed]",
-		Index, HashList.NumEntries, (HashList.NumEntries == 1) ? L"" : L"s", NumFailed);
+		NumProcessed, NumEntries, (NumEntries == 1) ? L"" : L"s", NumFailed);
 	PrintCentered(Message, Progress.YPos + 2);
 	if (Status == EFI_SUCCESS && HashList.TotalBytes != 0 &&
 		Progress.Current != HashList.TotalBytes)
 		PrintWarning(L"Actual 'md5sum_totalbytes' was 0x%lx", Progress.Current);
 
 out:
-	SafeFree(HashList.Buffer);
+	// The APs must be idle before we release their memory or chain load
+	StopHashWorkers(Session.Workers);
+	for (i = 0; i < Session.NumVolumes; i++) {
+		CloseVolume(Session.Volumes[i].Volume);
+		// Close the roots of the other volumes, that were opened for the session
+		if (i != 0 && Session.Volumes[i].Root != NULL)
+			Session.Volumes[i].Root->Close(Session.Volumes[i].Root);
+	}
+	CloseHashList(&HashList);
+	// Release everything we allocated for the run at once, before chain loading
+	FreeArena();
 	if (NumFailed != 0)
 		Status = EFI_CRC_ERROR;
 	return ExitProcess(Status, DevicePath);
@@ -22,6 +22,46 @@
 #include <efilib.h>
 #include <libsmbios.h>
 
+/* MP Services, from the UEFI Platform Initialization specifications */
+#ifndef EFI_MP_SERVICES_PROTOCOL_GUID
+#define EFI_MP_SERVICES_PROTOCOL_GUID \
+	{ 0x3fdda605, 0xa76e, 0x4f46, { 0xad, 0x29, 0x12, 0xf4, 0x53, 0x1b, 0x3d, 0x08 } }
+typedef VOID (EFIAPI *EFI_AP_PROCEDURE)(IN OUT VOID* Buffer);
+typedef struct _EFI_MP_SERVICES_PROTOCOL EFI_MP_SERVICES_PROTOCOL;
+struct _EFI_MP_SERVICES_PROTOCOL {
+	EFI_STATUS (EFIAPI *GetNumberOfProcessors)(IN EFI_MP_SERVICES_PROTOCOL* This,
+		OUT UINTN* NumberOfProcessors, OUT UINTN* NumberOfEnabledProcessors);
+	VOID* GetProcessorInfo;
+	VOID* StartupAllAPs;
+	EFI_STATUS (EFIAPI *StartupThisAP)(IN EFI_MP_SERVICES_PROTOCOL* This,
+		IN EFI_AP_PROCEDURE Procedure, IN UINTN ProcessorNumber, IN EFI_EVENT WaitEvent OPTIONAL,
+		IN UINTN TimeoutInMicroseconds, IN VOID* ProcedureArgument OPTIONAL, OUT BOOLEAN* Finished OPTIONAL);
+	VOID* SwitchBSP;
+	VOID* EnableDisableAP;
+	EFI_STATUS (EFIAPI *WhoAmI)(IN EFI_MP_SERVICES_PROTOCOL* This, OUT UINTN* ProcessorNumber);
+};
+#endif
+
+/* BaseLib functions that gnu-efi doesn't provide */
+#if defined(_MSC_VER)
+#include <intrin.h>
+#if defined(_M_ARM64)
+#define MemoryFence()       do { _ReadWriteBarrier(); __dmb(_ARM64_BARRIER_SY); } while (0)
+#define CpuPause()          __yield()
+#else
+/* MemoryBarrier() comes from winnt.h, which we can't include, so use the fence it expands to */
+#define MemoryFence()       do { _ReadWriteBarrier(); _mm_mfence(); } while (0)
+#define CpuPause()          _mm_pause()
+#endif
+#elif defined(__GNUC__) || defined(__clang__)
+#define MemoryFence()       __sync_synchronize()
+#if defined(__x86_64__) || defined(__i386__)
+#define CpuPause()          __builtin_ia32_pause()
+#else
+#define CpuPause()          __asm__ __volatile__("" ::: "memory")
+#endif
+#endif
+
 #else /* EDK2 */
 
 #include <Base.h>
@@ -38,11 +78,13 @@
 #include <Library/UefiLib.h>
 #include <Library/UefiRuntimeServicesTableLib.h>
 
+#include <Protocol/BlockIo.h>
 #include <Protocol/ComponentName.h>
 #include <Protocol/ComponentName2.h>
 #include <Protocol/DiskIo.h>
 #include <Protocol/DiskIo2.h>
 #include <Protocol/LoadedImage.h>
+#include <Protocol/MpService.h>
 
 #include <Guid/FileInfo.h>
 #include <Guid/FileSystemInfo.h>
@@ -90,6 +132,9 @@ extern UINTN                gAlertYPos;
 /* Name of the file containing the list of hashes */
 #define HASH_FILE           L"md5sum.txt"
 
+/* Name of the binary index of the list of hashes, that is kept next to it */
+#define HASH_INDEX_FILE     L"md5sum.idx"
+
 /* Minimum dimensions we expect the console to accomodate */
 #define COLS_MIN            50
 #define ROWS_MIN            20
@@ -103,9 +148,43 @@ extern UINTN                gAlertYPos;
 /* Size of the hexascii representation of a hash */
 #define HASH_HEXASCII_SIZE  (MD5_HASHSIZE * 2)
 
-/* Buffer size for file reads and MD5 hashing */
+/* Initial buffer size for file reads and MD5 hashing, before it is tuned */
 #define READ_BUFFERSIZE     (1024 * 1024)
 
+/* Range of read sizes that the read size tuning can select from */
+#define READ_BUFFERSIZE_MIN (256 * 1024)
+#define READ_BUFFERSIZE_MAX (16 * 1024 * 1024)
+
+/* Maximum amount of memory to use for the read buffers of all the lanes */
+#define READ_BUFFERPOOL_MAX (64 * 1024 * 1024)
+
+/* Minimum amount of data to read, for each read size throughput measurement */
+#define READ_TUNING_WINDOW  (32 * 1024 * 1024)
+
+/* Number of reads kept in flight for each file, when the file system supports ReadEx() */
+#define READ_QUEUE_DEPTH    2
+
+/* Maximum number of files that a multi-buffer MD5 engine can hash in parallel */
+#define MD5_MAX_LANES       8
+
+/* Number of hash list entries that are submitted together for hashing */
+#define HASH_BATCH_SIZE     256
+
+/* Number of directory handles that are kept open, to open files relative to their parent */
+#define DIR_CACHE_SIZE      16
+
+/* Number of hashing jobs that can be queued for each application processor */
+#define HASH_RING_SIZE      4
+
+/* Minimum number of application processors for hashing to be handed over to them */
+#define HASH_WORKERS_MIN    4
+
+/* Maximum number of volumes that a hash list can reference, including the boot volume */
+#define HASH_VOLUMES_MAX    8
+
+/* Maximum length of the label or partition GUID used to reference a volume */
+#define VOLUME_ID_MAX       64
+
 /* Number of bytes to process between watchdog resets */
 #define WATCHDOG_RESETSIZE  (128 * 1024 * 1024)
 
@@ -121,10 +200,13 @@ extern UINTN                gAlertYPos;
 typedef UINT32              CHAR32;
 
 /* Maximum size allowed for the hash file we process */
-#define HASH_FILE_SIZE_MAX  (64 * 1024 * 1024)
+#define HASH_FILE_SIZE_MAX  (256 * 1024 * 1024)
 
-/* Maximum number of lines allowed in a hash file */
-#define HASH_FILE_LINES_MAX 100000
+/* Maximum decompressed size allowed for a gzip compressed hash file, which must fit in 32 bits */
+#define HASH_FILE_GZ_SIZE_MAX   (1024 * 1024 * 1024)
+
+/* Size of the windows that the hash file is parsed in, which no line may exceed */
+#define HASH_WINDOW_SIZE    (1024 * 1024)
 
 /* Maximum size for the File Info structure we query */
 #define FILE_INFO_SIZE      (SIZE_OF_EFI_FILE_INFO + PATH_MAX * sizeof(CHAR16))
@@ -229,20 +311,260 @@ typedef struct ALIGNED(64) {
 	UINT64      ByteCount;
 } HASH_CONTEXT;
 
-/* Hash entry, comprised of the (hexascii) hash value and the path it applies to */
+/* Function that updates a hash context with a section of data */
+typedef VOID (*HASH_UPDATE)(
+	IN OUT HASH_CONTEXT* Context,
+	IN CONST UINT8* Data,
+	IN UINTN Length
+);
+
+/* Hashing job, for an application processor */
+typedef struct {
+	HASH_UPDATE         Update;
+	HASH_CONTEXT*       Context;
+	CONST UINT8*        Data;
+	UINTN               Length;
+} HASH_JOB;
+
+/*
+ * Application processor that hashes data for the BSP. Jobs are handed over
+ * through a lock-free ring, with a single producer (the BSP, that advances
+ * Head) and a single consumer (the AP, that advances Tail).
+ */
+typedef struct {
+	HASH_JOB            Job[HASH_RING_SIZE];
+	volatile UINTN      Head;       /* The number of jobs submitted */
+	volatile UINTN      Tail;       /* The number of jobs completed */
+	volatile BOOLEAN    Stop;       /* Set by the BSP, for the AP to return once its ring is empty */
+	EFI_EVENT           Event;      /* Signaled by MP Services when the AP has returned */
+} HASH_WORKER;
+
+/* Application processors that hash data, once they were started */
+typedef struct {
+	EFI_MP_SERVICES_PROTOCOL* Mp;
+	UINTN               Bsp;            /* The processor number of the BSP */
+	UINTN               NumProcessors;
+	UINTN               NumWorkers;     /* The number of workers that were started */
+	HASH_WORKER*        Worker[MD5_MAX_LANES];  /* The workers, with the ones that were started first */
+} HASH_WORKERS;
+
+/* CPU features that the MD5 kernels may require */
+#define CPU_FEATURE_SSE2    0x00000001
+#define CPU_FEATURE_AVX2    0x00000002
+#define CPU_FEATURE_NEON    0x00000004
+
+/* Multi-buffer MD5 transform, processing NumBlocks consecutive blocks for each lane */
+typedef VOID (*MD5_MB_TRANSFORM)(
+	IN HASH_CONTEXT** Context,
+	IN CONST UINT8** Data,
+	IN CONST UINTN NumBlocks
+);
+
+/* Multi-buffer MD5 engine */
+typedef struct {
+	CONST CHAR16*       Name;
+	UINTN               NumLanes;
+	UINT32              Features;   /* The CPU_FEATURE_### flags required by this engine */
+	MD5_MB_TRANSFORM    Transform;
+} MD5_MB_ENGINE;
+
+/* Contiguous run of file data on a volume */
+typedef struct {
+	UINT64      Offset;     /* Byte offset of the run on the volume */
+	UINT64      Length;     /* Length of the run, in bytes */
+} FILE_EXTENT;
+
+/* Location of the data of a file, on a volume opened for direct access */
 typedef struct {
-	CHAR8*      Hash;
-	CHAR8*      Path;
-} HASH_ENTRY;
+	FILE_EXTENT*    Extents;    /* The extents of the file data, or NULL if it wasn't located */
+	UINTN           NumExtents;
+	UINT64          FileSize;   /* The size of the file, that the extents cover */
+} FILE_LOCATION;
 
-/* Hash list of <Size> Hash entries */
+/* Entry of a batch of files to hash, along with the hashing result */
 typedef struct {
-	HASH_ENTRY* Entry;
+	CHAR16*     Path;
+	UINTN       Volume;         /* The index of the volume holding the file, in the HASH_SESSION */
+	CONST FILE_LOCATION* Location;  /* (Optional) Where the file data is on the volume */
+	EFI_STATUS  Status;
+	UINT64      ExpectedSize;   /* The size the file must have, or HASH_SIZE_UNKNOWN */
+	UINT64      Size;           /* The size of the file, once it was hashed */
+	UINT8       Hash[MD5_HASHSIZE];
+} HASH_BATCH_ENTRY;
+
+/* Flags of a hash list entry */
+#define HASH_ENTRY_INVALID_PATH     0x01    /* The path is not valid UTF-8, and only its ASCII characters were kept */
+
+/* Entry index value for the end of a chain of entries from a hash list */
+#define HASH_ENTRY_NONE             ((UINTN)-1)
+
+/* Expected size value for the entries that have no md5sum_size comment */
+#define HASH_SIZE_UNKNOWN           ((UINT64)-1)
+
+/* Number of directories held by each block of the directory trie of a hash list */
+#define HASH_DIR_BLOCK_SIZE         4096
+
+/* Directory node value for the entries that have no directory component */
+#define HASH_DIR_NONE               ((UINT32)-1)
+
+/* Directory from the paths of a hash list, as a node of the trie that the paths are split into */
+typedef struct {
+	UINT32      Parent;         /* The node of the parent directory, or HASH_DIR_NONE */
+	UINT32      Name;           /* The offset of the name of the directory, in HASH_LIST.Paths */
+	UINT32      Next;           /* The next node from the same hash bucket */
+} HASH_DIR;
+
+/* Decompression stream for a gzip compressed file */
+typedef struct _GZIP_STREAM GZIP_STREAM;
+
+/*
+ * Hash list, that is parsed from the hash file one window of <NumEntries> entries at a time.
+ * The entries are kept as separate arrays, with the hashes decoded to binary and the paths
+ * converted to UCS-2 by the parser, so that nothing needs to be decoded per file. The paths
+ * are split into a trie of directories, with the name of each directory stored only once,
+ * and the name of the entry. GetHashEntryPath() returns the full path of an entry.
+ */
+typedef struct {
+	UINT8       (*Digest)[MD5_HASHSIZE];    /* The expected hash of each entry */
+	UINT32*     DirId;          /* The directory of each entry, in DirBlock, or HASH_DIR_NONE */
+	UINT32*     NameOffset;     /* The offset of the name of each entry, in Paths */
+	UINT8*      VolumeIndex;    /* The volume holding the file of each entry, in VolumeId */
+	UINT8*      Flags;          /* The HASH_ENTRY_### flags of each entry */
+	UINT64*     ExpectedSize;   /* The size of the file of each entry, or HASH_SIZE_UNKNOWN */
+	CHAR16*     Paths;          /* The NUL-terminated UCS-2 names of the entries and directories */
+	UINTN       PathsSize;      /* The number of characters used in Paths */
+	HASH_DIR**  DirBlock;       /* The blocks of HASH_DIR_BLOCK_SIZE directories of the trie */
+	UINTN       NumDirs;
+	UINT32*     DirBucket;      /* The hash buckets used to look up the directories of the trie */
+	UINTN       NumDirBuckets;  /* Always a power of 2 */
 	UINTN       NumEntries;
-	UINT8*      Buffer;
+	UINTN       MaxEntries;     /* The number of entries that the arrays can hold */
+	BOOLEAN     EndOfList;      /* The current window holds the last entries of the list */
+	BOOLEAN     IsFromIndex;    /* The entries were loaded from the binary index of the list */
+	BOOLEAN     HasFileDigest;  /* FileDigest was computed, which requires the file to fit a window */
+	UINT8       FileDigest[MD5_HASHSIZE];   /* The MD5 hash of the hash list file */
+	EFI_FILE_HANDLE File;
+	GZIP_STREAM* Stream;        /* (Optional) The decompression stream, if the file is compressed */
+	UINT64      FileSize;       /* The size of the data from the file, once decompressed */
+	UINT64      FileRead;       /* The amount of data that was read from the file */
+	UINT64      FileParsed;     /* The amount of data from the file that the windows so far covered */
+	UINT8*      Buffer;         /* The data of the current window */
+	UINTN       BufferSize;
+	UINTN       DataSize;       /* The amount of data held in the buffer */
+	UINTN       DataParsed;     /* The amount of data from the buffer that the current window covers */
 	UINT64      TotalBytes;
+	UINT64      PendingSize;    /* The size from an md5sum_size comment, for the entry that follows it */
+	BOOLEAN     NtfsDirect;     /* Always use our own reader for NTFS volumes */
+	BOOLEAN     SaveIndex;      /* Save the binary index of the list once validated (md5sum_index = 1) */
+	UINTN       Volume;         /* The volume of the entries that follow, in VolumeId */
+	UINTN       NumVolumes;     /* The number of volumes referenced, including the boot volume */
+	CHAR8       VolumeId[HASH_VOLUMES_MAX][VOLUME_ID_MAX + 1];  /* The label or partition GUID of each volume, or empty for the boot volume */
 } HASH_LIST;
 
+/* Get a directory from the trie of a hash list */
+#define HASH_LIST_DIR(List, d)      (&(List)->DirBlock[(d) / HASH_DIR_BLOCK_SIZE][(d) % HASH_DIR_BLOCK_SIZE])
+
+/* Position in the run arena, that allocations can be released back to */
+typedef struct {
+	struct _ARENA_CHUNK*    Chunk;
+	UINTN                   Used;
+} ARENA_MARK;
+
+/* Directory index entry, with the information that the file system reported for it */
+typedef struct _DIR_INDEX_ENTRY {
+	struct _DIR_INDEX_ENTRY*    Next;       /* The next entry from the same hash bucket */
+	struct _DIR_INDEX_ENTRY*    Parent;     /* The directory holding the entry, or NULL for the root */
+	UINT64                      FileSize;
+	UINT64                      Attribute;
+	UINTN                       State;      /* Whether the content of a directory was indexed */
+	CHAR16                      Name[1];    /* The name of the entry, with its case from the media */
+} DIR_INDEX_ENTRY;
+
+/* Index of the directories referenced by a hash list */
+typedef struct _DIR_INDEX DIR_INDEX;
+
+/* File systems that we can read file data from directly, bypassing the firmware driver */
+#define FS_TYPE_FAT12       1
+#define FS_TYPE_FAT16       2
+#define FS_TYPE_FAT32       3
+#define FS_TYPE_EXFAT       4
+#define FS_TYPE_NTFS        5
+
+/* Little endian accessors for on-disk structures */
+#define READ_LE16(p)        ((UINT16)((p)[0] | ((p)[1] << 8)))
+#define READ_LE32(p)        ((UINT32)READ_LE16(p) | ((UINT32)READ_LE16((p) + 2) << 16))
+#define READ_LE64(p)        ((UINT64)READ_LE32(p) | ((UINT64)READ_LE32((p) + 4) << 32))
+
+/* Size of the buffer used to read file system metadata */
+#define VOLUME_BUFFER_SIZE  (16 * 1024)
+
+/* Size of the cache used for file allocation table lookups */
+#define VOLUME_CACHE_SIZE   4096
+
+/* File or directory from a volume opened for direct access */
+typedef struct {
+	UINT32      Cluster;        /* First cluster, or 0 for the FAT12/FAT16 root directory (FAT or exFAT) */
+	UINT64      Reference;      /* File reference (NTFS) */
+	UINT64      Size;           /* Size, in bytes (FAT or exFAT, not recorded for FAT directories) */
+	BOOLEAN     IsDirectory;    /* (FAT or exFAT, and the root directory) */
+	BOOLEAN     Contiguous;     /* Data that is not recorded in the allocation table (exFAT) */
+} FS_NODE;
+
+/* Volume opened for direct access */
+typedef struct {
+	EFI_DISK_IO_PROTOCOL*   DiskIo;
+	EFI_DISK_IO2_PROTOCOL*  DiskIo2;        /* NULL if the disk doesn't support asynchronous I/O */
+	UINT32                  MediaId;
+	UINT32                  Type;           /* One of the FS_TYPE_### values */
+	UINT32                  SectorSize;     /* Sector size, in bytes */
+	UINT32                  ClusterSize;    /* Cluster size, in bytes */
+	UINT32                  NumClusters;    /* Number of clusters in the data area */
+	UINT32                  RootCluster;    /* First cluster of the root directory (FAT32 or exFAT) */
+	UINT64                  FatOffset;      /* Offset of the first allocation table */
+	UINT64                  DataOffset;     /* Offset of the data area (cluster #2) */
+	UINT64                  RootOffset;     /* Offset of the root directory (FAT12 or FAT16) */
+	UINT32                  RootSize;       /* Size of the root directory (FAT12 or FAT16) */
+	FS_NODE                 RootDir;        /* The root directory, that lookups start from */
+	UINT64                  CacheOffset;    /* Offset of the data held in Cache */
+	UINT8*                  Cache;          /* VOLUME_CACHE_SIZE cache for allocation table lookups */
+	UINT8*                  Buffer;         /* VOLUME_BUFFER_SIZE buffer for metadata reads */
+	UINT32                  RecordSize;     /* Size of a file record (NTFS) */
+	UINT32                  IndexSize;      /* Size of a directory index block (NTFS) */
+	FILE_EXTENT*            MftExtents;     /* Location of the Master File Table (NTFS) */
+	UINTN                   NumMftExtents;
+	CHAR16*                 UpCase;         /* Table used for case insensitive name collation (NTFS) */
+	UINT8*                  Record;         /* RecordSize buffer for file records (NTFS) */
+} FS_VOLUME;
+
+/* Volume that files from the hash list are read from */
+typedef struct {
+	EFI_HANDLE          DeviceHandle;   /* The handle of the device holding the volume */
+	EFI_FILE_HANDLE     Root;           /* A file handle to the root directory, or NULL if the volume was not found */
+	FS_VOLUME*          Volume;         /* (Optional) The volume holding Root, for direct access */
+	DIR_INDEX*          Index;          /* (Optional) The index of the directories from the list */
+} HASH_VOLUME;
+
+/* Read size tuning data, that persists across batches */
+typedef struct {
+	UINTN               Size;       /* The size to use for reads */
+	UINTN               Capacity;   /* The size of the read buffers of the current batch */
+	UINTN               Alignment;  /* The block or cluster size, that Size must be a multiple of */
+	INTN                Step;       /* 1 when trying larger reads, -1 for smaller ones, 0 once settled */
+	UINTN               BestSize;   /* The read size with the highest throughput so far */
+	UINT64              BestRate;   /* The throughput measured for BestSize */
+	UINT64              WindowStart;  /* The timestamp at which the current measurement started */
+	UINT64              WindowBytes;  /* The amount of data read since WindowStart */
+} READ_TUNING;
+
+/* Hashing state, that persists across the batches of a run */
+typedef struct {
+	HASH_VOLUME         Volumes[HASH_VOLUMES_MAX];  /* The volumes, in the order of HASH_LIST.VolumeId */
+	UINTN               NumVolumes;
+	HASH_WORKERS*       Workers;        /* (Optional) The application processors that hash data */
+	UINT64              WatchDogBytes;  /* The amount of data processed since the last watchdog reset */
+	READ_TUNING         ReadTuning;     /* Set up by InitReadTuning() */
+} HASH_SESSION;
+
 /* Check for a valid lowercase hex ASCII value */
 STATIC __inline BOOLEAN IsValidHexAscii(CHAR8 c)
 {
@@ -404,50 +726,708 @@ BOOLEAN IsProblematicNtfsDriver(
 );
 
 /**
-  Parse a hash sum list file and populate a HASH_LIST structure from it.
+  Set up the arena that serves the memory used during a run, and that is then
+  released all at once by FreeArena().
+
+  @retval EFI_SUCCESS           The arena was set up.
+  @retval EFI_OUT_OF_RESOURCES  A memory allocation error occurred.
+**/
+EFI_STATUS InitArena(VOID);
+
+/**
+  Allocate memory from the run arena. The memory is not zeroed, and is aligned
+  to a cache line. It is released by ArenaRelease() or FreeArena().
+
+  @param[in]  Size              The size of the allocation.
+
+  @retval A pointer to the allocated buffer, or NULL on allocation error.
+**/
+VOID* ArenaAllocate(
+	IN CONST UINTN Size
+);
+
+/**
+  Record the current position of the run arena, so that the allocations made
+  after this call can be released with ArenaRelease().
+
+  @retval The current position of the arena.
+**/
+ARENA_MARK ArenaGetMark(VOID);
+
+/**
+  Release all the allocations that were made from the run arena since a mark
+  was recorded. The chunks that are no longer in use are kept, to serve the
+  next allocations without going back to the firmware.
+
+  @param[in]  Mark              A mark obtained from ArenaGetMark().
+**/
+VOID ArenaRelease(
+	IN CONST ARENA_MARK Mark
+);
+
+/**
+  Release all the memory of the run arena back to the firmware.
+**/
+VOID FreeArena(VOID);
+
+/**
+  Open a hash sum list file, for its entries to be parsed one window at a time.
+  If the file does not exist, its gzip compressed version (with a .gz extension)
+  is used instead. The window buffer and entries are allocated from the run arena.
 
   @param[in]  Root   A file handle to the root directory.
   @param[in]  Path   A pointer to the CHAR16 string.
-  @param[out] List   A pointer to the HASH_LIST structure to populate.
+  @param[out] List   A pointer to the HASH_LIST structure to set up.
 
-  @retval EFI_SUCCESS           The file was successfully parsed and the hash list is populated.
+  @retval EFI_SUCCESS           The file was opened and the hash list can be parsed.
   @retval EFI_INVALID_PARAMETER One or more of the input parameters are invalid.
   @retval EFI_OUT_OF_RESOURCES  A memory allocation error occurred.
   @retval EFI_NOT_FOUND         The hash list file does not exist.
-  @retval EFI_UNSUPPORTED       The hash list file is too small or too large.
+  @retval EFI_UNSUPPORTED       The hash list file is too small, too large or not a valid gzip file.
+**/
+EFI_STATUS OpenHashList(
+	IN CONST EFI_FILE_HANDLE Root,
+	IN CONST CHAR16* Path,
+	OUT HASH_LIST* List
+);
+
+/**
+  Read the next data of a hash list file, decompressing it if needed.
+
+  @param[in/out] List   A pointer to the HASH_LIST structure, set up by OpenHashList().
+  @param[out]    Buffer A pointer to the buffer to receive the data.
+  @param[in/out] Size   On input, the amount of data to read, which must not go past
+                        List->FileSize. On output, the amount of data that was read.
+
+  @retval EFI_SUCCESS   The data was read.
+  @retval Other         The file could not be read, or its compressed data is invalid.
+**/
+EFI_STATUS ReadHashFile(
+	IN OUT HASH_LIST* List,
+	OUT UINT8* Buffer,
+	IN OUT UINTN* Size
+);
+
+/**
+  Parse the next window of a hash sum list file. The entries of the previous
+  window are no longer valid after this call.
+
+  @param[in/out] List   A pointer to the HASH_LIST structure, set up by OpenHashList().
+
+  @retval EFI_SUCCESS           The window was parsed, with List->EndOfList set if it is the last one.
+  @retval EFI_INVALID_PARAMETER One or more of the input parameters are invalid.
+  @retval EFI_UNSUPPORTED       The hash list file has a line that does not fit in a window.
   @retval EFI_END_OF_FILE       The hash list file could not be read.
   @retval EFI_ABORTED           The hash list file contains invalid data.
+  @retval EFI_OUT_OF_RESOURCES  A memory allocation error occurred.
+**/
+EFI_STATUS ParseHashList(
+	IN OUT HASH_LIST* List
+);
+
+/**
+  Get the full path of an entry from the current window of a hash list.
+
+  @param[in]  List   A pointer to the HASH_LIST structure.
+  @param[in]  Index  The index of the entry in the window.
+  @param[out] Path   A buffer of PATH_MAX + 1 characters, to receive the path.
+**/
+VOID GetHashEntryPath(
+	IN CONST HASH_LIST* List,
+	IN CONST UINTN Index,
+	OUT CHAR16* Path
+);
+
+/**
+  Close the hash sum list file of a hash list.
+
+  @param[in/out] List   (Optional) A pointer to the HASH_LIST structure.
+**/
+VOID CloseHashList(
+	OPTIONAL IN OUT HASH_LIST* List
+);
+
+/**
+  Load the entries of a hash list from its binary index, instead of parsing
+  them, if the index was created from the same hash list file. This requires
+  the hash list file to fit in a single window, that is read to compute the
+  key of the index. The index is ignored if it is stale or invalid.
+
+  @param[in]     Root           A file handle to the directory holding the index.
+  @param[in]     Path           The path of the index.
+  @param[in/out] List           A pointer to the HASH_LIST, set up by OpenHashList().
+
+  @retval EFI_SUCCESS           The entries were loaded, and ParseHashList() must not be called.
+  @retval EFI_INVALID_PARAMETER One or more of the input parameters are invalid.
+  @retval EFI_UNSUPPORTED       The hash list file does not fit in a single window.
+  @retval EFI_NOT_FOUND         There is no valid index for the hash list file.
+  @retval EFI_END_OF_FILE       The hash list file could not be read.
+  @retval EFI_OUT_OF_RESOURCES  A memory allocation error occurred.
 **/
-EFI_STATUS Parse(
+EFI_STATUS LoadHashIndex(
 	IN CONST EFI_FILE_HANDLE Root,
 	IN CONST CHAR16* Path,
-	OUT HASH_LIST* List
+	IN OUT HASH_LIST* List
+);
+
+/**
+  Save the entries of a hash list to a binary index, for LoadHashIndex() to use
+  on the next run. This is only possible for a list that was parsed in a single
+  window, and nothing is written if the list was loaded from its index already.
+
+  @param[in]  Root              A file handle to the directory to write the index into.
+  @param[in]  Path              The path of the index.
+  @param[in]  List              A pointer to the HASH_LIST, holding its last window.
+
+  @retval EFI_SUCCESS           The index was written.
+  @retval EFI_INVALID_PARAMETER One or more of the input parameters are invalid.
+  @retval EFI_UNSUPPORTED       The list can not be indexed, or references the index.
+  @retval EFI_OUT_OF_RESOURCES  A memory allocation error occurred.
+  @retval EFI_WRITE_PROTECTED   The volume is read-only.
+**/
+EFI_STATUS SaveHashIndex(
+	IN CONST EFI_FILE_HANDLE Root,
+	IN CONST CHAR16* Path,
+	IN CONST HASH_LIST* List
+);
+
+/**
+  Open a gzip compressed file as a stream, that ReadGzipStream() decompresses.
+
+  @param[in]  File              A handle to the compressed file, positioned at its start.
+  @param[in]  FileSize          The size of the compressed file.
+  @param[out] Stream            A pointer to receive the GZIP_STREAM, allocated from the run arena.
+  @param[out] Size              A pointer to receive the size of the decompressed data.
+
+  @retval EFI_SUCCESS           The stream was opened.
+  @retval EFI_INVALID_PARAMETER One or more of the input parameters are invalid.
+  @retval EFI_OUT_OF_RESOURCES  A memory allocation error occurred.
+  @retval EFI_VOLUME_CORRUPTED  The file is not a valid gzip file.
+  @retval EFI_UNSUPPORTED       The file uses a compression method other than DEFLATE.
+**/
+EFI_STATUS OpenGzipStream(
+	IN CONST EFI_FILE_HANDLE File,
+	IN CONST UINT64 FileSize,
+	OUT GZIP_STREAM** Stream,
+	OUT UINT64* Size
+);
+
+/**
+  Read decompressed data from a gzip stream.
+
+  @param[in/out] Stream         A pointer to the GZIP_STREAM, set up by OpenGzipStream().
+  @param[out]    Buffer         A pointer to the buffer to receive the data.
+  @param[in/out] Size           On input, the size of the buffer. On output, the amount of data read.
+
+  @retval EFI_SUCCESS           The data was read.
+  @retval EFI_INVALID_PARAMETER One or more of the input parameters are invalid.
+  @retval EFI_VOLUME_CORRUPTED  The compressed data is invalid.
+  @retval EFI_CRC_ERROR         The data does not match the trailer of the stream.
+**/
+EFI_STATUS ReadGzipStream(
+	IN OUT GZIP_STREAM* Stream,
+	OUT UINT8* Buffer,
+	IN OUT UINTN* Size
+);
+
+/**
+  Create an index of the directories that a hash list references, by enumerating
+  each of them once. The index then provides the information of the files from
+  the list, without having to query the file system driver for each of them.
+
+  @param[in]  Root              A file handle to the root directory.
+  @param[in]  List              (Optional) A pointer to the HASH_LIST to index.
+  @param[in]  Volume            The index of the volume that Root belongs to, in List->VolumeId.
+                                Only the entries from the list that are on this volume are indexed.
+  @param[out] Index             A pointer to receive the DIR_INDEX, allocated from the run arena.
+  @param[out] TotalBytes        (Optional) A pointer to receive the total size of the files from
+                                the list, or 0 if some of these files could not be indexed.
+
+  @retval EFI_SUCCESS           The index was created.
+  @retval EFI_INVALID_PARAMETER One or more of the input parameters are invalid.
+  @retval EFI_OUT_OF_RESOURCES  A memory allocation error occurred.
+**/
+EFI_STATUS CreateDirIndex(
+	IN CONST EFI_FILE_HANDLE Root,
+	OPTIONAL IN CONST HASH_LIST* List,
+	IN CONST UINTN Volume,
+	OUT DIR_INDEX** Index,
+	OPTIONAL OUT UINT64* TotalBytes
+);
+
+/**
+  Look up a path in the directory index. Directories that haven't been indexed
+  yet are enumerated as needed.
+
+  @param[in]  Index             A pointer to the DIR_INDEX.
+  @param[in]  Path              The path to look up, relative to the root directory.
+
+  @retval A pointer to the DIR_INDEX_ENTRY for the path, or NULL if the path could not be
+          resolved from the index, in which case the file system should be queried instead.
+**/
+DIR_INDEX_ENTRY* LookupDirIndex(
+	IN DIR_INDEX* Index,
+	IN CONST CHAR16* Path
+);
+
+/**
+  Get the path of an entry from the directory index, with its case from the media.
+
+  @param[in]  Entry             A pointer to the DIR_INDEX_ENTRY.
+  @param[out] Path              A buffer to receive the path.
+  @param[in]  Size              The size of the buffer, in characters.
+
+  @retval EFI_SUCCESS           The path was copied.
+  @retval EFI_INVALID_PARAMETER One or more of the input parameters are invalid.
+  @retval EFI_BUFFER_TOO_SMALL  The buffer is too small for the path.
+**/
+EFI_STATUS GetDirIndexPath(
+	IN CONST DIR_INDEX_ENTRY* Entry,
+	OUT CHAR16* Path,
+	IN CONST UINTN Size
+);
+
+/**
+  Compute the order in which the entries of a hash list should be processed, so
+  that the media is read with as little seeking as possible. When a volume is
+  available for direct access, its files are sorted by the location of their data.
+  Files that can't be located are grouped by directory and sorted by name.
+  The files from different volumes are interleaved, so that all the volumes are
+  read from at the same time.
+  Entries that reference the same file as an earlier entry, either because their
+  data is at the same location, such as for hard links, or because their path
+  resolves to the same entry of the directory index, are left out of the order.
+  The paths that can't be resolved must match exactly instead. These entries are
+  chained to that earlier entry, so that the file is only read once.
+
+  @param[in]  Session           A pointer to the HASH_SESSION holding the volumes of the list.
+  @param[in]  List              A pointer to the HASH_LIST to schedule.
+  @param[out] Order             A pointer to receive an array of List->NumEntries indexes into
+                                the entries of List, in the order they should be processed. The
+                                array is allocated from the run arena.
+  @param[out] NumOrdered        A pointer to receive the number of entries from Order, that
+                                excludes the duplicates.
+  @param[out] Duplicate         A pointer to receive an array of List->NumEntries indexes, with
+                                the next entry from the list that references the same file as
+                                each entry, or HASH_ENTRY_NONE. The array is allocated from the
+                                run arena.
+  @param[out] Location          A pointer to receive an array of List->NumEntries FILE_LOCATION,
+                                with the location of the data of each entry on its volume, if
+                                it could be located. The array is allocated from the run arena.
+
+  @retval EFI_SUCCESS           The schedule was computed.
+  @retval EFI_INVALID_PARAMETER One or more of the input parameters are invalid.
+  @retval EFI_OUT_OF_RESOURCES  A memory allocation error occurred.
+**/
+EFI_STATUS ScheduleHashList(
+	IN CONST HASH_SESSION* Session,
+	IN CONST HASH_LIST* List,
+	OUT UINTN** Order,
+	OUT UINTN* NumOrdered,
+	OUT UINTN** Duplicate,
+	OUT FILE_LOCATION** Location
 );
 
 /**
-  Compute the MD5 hash of a single file.
+  Set up the read size tuning for the volumes of a session, by aligning reads to
+  the block size reported by each file system, as well as to the cluster size of
+  the volumes that were opened for direct access.
 
-  @param[in]   Root             A file handle to the root directory.
-  @param[in]   Path             A pointer to the CHAR16 string with the target path.
-  @param[in]   Progress         (Optional) A pointer to a PROGRESS_DATA structure. If provided then
+  @param[in/out] Session        A pointer to the HASH_SESSION holding the volumes.
+**/
+VOID InitReadTuning(
+	IN OUT HASH_SESSION* Session
+);
+
+/**
+  Compute the MD5 hashes of a batch of files.
+  When a multi-buffer MD5 engine is available, up to NumLanes files are processed
+  in parallel, else the files are processed one at a time. When the session has
+  workers, the data is hashed by the application processors instead.
+
+  @param[in/out] Session        A pointer to the HASH_SESSION of the run. For the volumes that
+                                were opened for direct access, file data is read directly from
+                                the disk whenever the entry provides the location of the file.
+  @param[in/out] Entries        An array of HASH_BATCH_ENTRY. On input, Path, Volume, Location and
+                                ExpectedSize must be set for each entry, as well as Status, to EFI_SUCCESS for entries
+                                that should be processed, or to an error code for entries that should
+                                be skipped. On output, Status and Hash are set for each entry.
+  @param[in]     NumEntries     The number of entries in the array.
+  @param[in]     Progress       (Optional) A pointer to a PROGRESS_DATA structure. If provided then
                                 the current progress value will be updated by this call.
-  @param[out]  Hash             A pointer to the 16-byte array that is to receive the hash.
 
-  @retval EFI_SUCCESS           The file was successfully processed and the hash has been populated.
-  @retval EFI_INVALID_PARAMETER One or more of the input parameters are invalid or one of the paths
-                                from the hash list points to a directory.
+  @retval EFI_SUCCESS           The batch was processed. Individual results are set in each entry.
+  @retval EFI_INVALID_PARAMETER One or more of the input parameters are invalid.
   @retval EFI_OUT_OF_RESOURCES  A memory allocation error occurred.
-  @retval EFI_NOT_FOUND         The target file could not be found on the media.
-  @retval EFI_END_OF_FILE       The file could not be read in full.
   @retval EFI_ABORTED           User cancelled the operation.
 **/
-EFI_STATUS HashFile(
-	IN CONST EFI_FILE_HANDLE Root,
+EFI_STATUS HashFileBatch(
+	IN OUT HASH_SESSION* Session,
+	IN OUT HASH_BATCH_ENTRY* Entries,
+	IN CONST UINTN NumEntries,
+	OPTIONAL IN PROGRESS_DATA* Progress
+);
+
+/**
+  Set up the workers that StartHashWorkers() starts, for the application processors
+  reported by MP Services. This is separate from starting them, so that the workers
+  can be allocated along with the data that must last for the whole run, while the
+  APs are only started once there is data for them to hash.
+
+  @param[out] Workers           A pointer to receive the HASH_WORKERS, allocated from the run arena.
+
+  @retval EFI_SUCCESS           The workers were set up.
+  @retval EFI_INVALID_PARAMETER One or more of the input parameters are invalid.
+  @retval EFI_UNSUPPORTED       MP Services are not available, or there are no APs.
+  @retval EFI_OUT_OF_RESOURCES  A memory allocation error occurred.
+**/
+EFI_STATUS CreateHashWorkers(
+	OUT HASH_WORKERS** Workers
+);
+
+/**
+  Start application processors, through MP Services, to hash data for the BSP.
+  Since boot services can only be used by the BSP, the workers only hash data
+  that the BSP has read, and must be stopped before boot services are used for
+  anything else than I/O, such as to load an image.
+
+  @param[in/out] Workers        A pointer to the HASH_WORKERS, from CreateHashWorkers().
+
+  @retval EFI_SUCCESS           At least one worker was started.
+  @retval EFI_INVALID_PARAMETER One or more of the input parameters are invalid.
+  @retval EFI_UNSUPPORTED       No AP could be started.
+**/
+EFI_STATUS StartHashWorkers(
+	IN OUT HASH_WORKERS* Workers
+);
+
+/**
+  Stop the workers, once they have completed the jobs that were submitted.
+
+  @param[in]  Workers           (Optional) A pointer to the HASH_WORKERS to stop.
+**/
+VOID StopHashWorkers(
+	OPTIONAL IN HASH_WORKERS* Workers
+);
+
+/**
+  Submit a hashing job to a worker.
+
+  @param[in]  Worker            A pointer to the HASH_WORKER.
+  @param[in]  Job               A pointer to the HASH_JOB, that is copied into the ring of the worker.
+
+  @retval A non zero ticket, that IsHashJobDone() can be called with, or 0 if the ring is full.
+**/
+UINTN SubmitHashJob(
+	IN HASH_WORKER* Worker,
+	IN CONST HASH_JOB* Job
+);
+
+/**
+  Check whether a hashing job has been completed by its worker.
+
+  @param[in]  Worker            A pointer to the HASH_WORKER.
+  @param[in]  Ticket            The ticket returned by SubmitHashJob() for the job.
+
+  @retval TRUE if the job was completed, in which case its results can be used, FALSE otherwise.
+**/
+BOOLEAN IsHashJobDone(
+	IN HASH_WORKER* Worker,
+	IN CONST UINTN Ticket
+);
+
+/**
+  Open the volume from a device for direct access, so that file data can be read
+  with large disk reads, rather than through the firmware file system driver.
+
+  @param[in]  DeviceHandle      A handle to the device holding the volume.
+  @param[out] Volume            A pointer to receive the newly allocated FS_VOLUME.
+
+  @retval EFI_SUCCESS           The volume was opened for direct access.
+  @retval EFI_INVALID_PARAMETER One or more of the input parameters are invalid.
+  @retval EFI_UNSUPPORTED       The file system of the volume is not supported.
+  @retval EFI_OUT_OF_RESOURCES  A memory allocation error occurred.
+  @retval other                 The disk could not be accessed.
+**/
+EFI_STATUS OpenVolume(
+	IN CONST EFI_HANDLE DeviceHandle,
+	OUT FS_VOLUME** Volume
+);
+
+/**
+  Release a volume that was opened with OpenVolume().
+
+  @param[in]  Volume            (Optional) A pointer to the FS_VOLUME to release.
+**/
+VOID CloseVolume(
+	OPTIONAL IN FS_VOLUME* Volume
+);
+
+/**
+  Locate a volume from its label, or from the unique GUID of its GPT partition.
+
+  @param[in]  Id                The label of the volume, or its partition GUID in registry format,
+                                with or without braces. Labels are compared case insensitively.
+  @param[out] DeviceHandle      A pointer to receive the handle of the device holding the volume.
+
+  @retval EFI_SUCCESS           The volume was found.
+  @retval EFI_INVALID_PARAMETER One or more of the input parameters are invalid.
+  @retval EFI_NOT_FOUND         No volume matches Id.
+  @retval EFI_OUT_OF_RESOURCES  A memory allocation error occurred.
+**/
+EFI_STATUS LocateVolume(
+	IN CONST CHAR16* Id,
+	OUT EFI_HANDLE* DeviceHandle
+);
+
+/**
+  Read data from a volume.
+
+  @param[in]  Volume            A pointer to the FS_VOLUME to read from.
+  @param[in]  Offset            The byte offset to read from.
+  @param[in]  Size              The number of bytes to read.
+  @param[out] Buffer            A pointer to the buffer receiving the data.
+
+  @retval EFI_SUCCESS           The data was read.
+  @retval other                 The disk could not be read.
+**/
+EFI_STATUS ReadVolume(
+	IN FS_VOLUME* Volume,
+	IN CONST UINT64 Offset,
+	IN CONST UINTN Size,
+	OUT VOID* Buffer
+);
+
+/**
+  Append a run of data to an array of file extents, merging it with the last extent if contiguous.
+
+  @param[in/out] Extents        A pointer to the (reallocated as needed) FILE_EXTENT array.
+  @param[in/out] NumExtents     A pointer to the number of extents in the array.
+  @param[in]     Offset         The byte offset of the run on the volume.
+  @param[in]     Length         The length of the run, in bytes.
+
+  @retval EFI_SUCCESS           The extent was added.
+  @retval EFI_OUT_OF_RESOURCES  A memory allocation error occurred.
+**/
+EFI_STATUS AddFileExtent(
+	IN OUT FILE_EXTENT** Extents,
+	IN OUT UINTN* NumExtents,
+	IN CONST UINT64 Offset,
+	IN CONST UINT64 Length
+);
+
+/**
+  Look up several names in a directory of a volume. The directory is only read
+  once for all of the names, or until they have all been found.
+
+  @param[in]  Volume            A pointer to the FS_VOLUME the directory resides on.
+  @param[in]  Dir               (Optional) The FS_NODE of the directory, or NULL for the root.
+  @param[in]  Names             An array of NumNames names, that must not contain separators.
+  @param[in]  NumNames          The number of names to look up.
+  @param[out] Nodes             An array of NumNames FS_NODE, to receive the node of each name.
+  @param[out] Results           An array of NumNames EFI_STATUS, to receive the result of the
+                                lookup of each name, which is EFI_SUCCESS when the name was found,
+                                EFI_NOT_FOUND when it wasn't, EFI_UNSUPPORTED if it can't be
+                                accessed directly, or an error from reading the directory.
+
+  @retval EFI_SUCCESS           The names were looked up.
+  @retval EFI_INVALID_PARAMETER One or more of the input parameters are invalid.
+**/
+EFI_STATUS LookupVolumeNames(
+	IN FS_VOLUME* Volume,
+	OPTIONAL IN CONST FS_NODE* Dir,
+	IN CONST CHAR16* CONST* Names,
+	IN CONST UINTN NumNames,
+	OUT FS_NODE* Nodes,
+	OUT EFI_STATUS* Results
+);
+
+/**
+  Look up a path on a volume.
+
+  @param[in]  Volume            A pointer to the FS_VOLUME the path resides on.
+  @param[in]  Dir               (Optional) The FS_NODE of the directory the path is relative to,
+                                or NULL for the root.
+  @param[in]  Path              The path to look up.
+  @param[out] Node              A pointer to receive the FS_NODE of the path.
+
+  @retval EFI_SUCCESS           The path was found.
+  @retval EFI_INVALID_PARAMETER One or more of the input parameters are invalid.
+  @retval EFI_NOT_FOUND         The path could not be located.
+  @retval EFI_UNSUPPORTED       The path can't be accessed directly.
+  @retval EFI_VOLUME_CORRUPTED  The file system metadata is inconsistent.
+  @retval other                 The disk could not be read.
+**/
+EFI_STATUS LookupVolumePath(
+	IN FS_VOLUME* Volume,
+	OPTIONAL IN CONST FS_NODE* Dir,
 	IN CONST CHAR16* Path,
-	OPTIONAL IN PROGRESS_DATA* Progress,
+	OUT FS_NODE* Node
+);
+
+/**
+  Resolve a file to the list of extents holding its data on a volume.
+
+  @param[in]  Volume            A pointer to the FS_VOLUME the file resides on.
+  @param[in]  Node              The FS_NODE of the file, from LookupVolumeNames() or LookupVolumePath().
+  @param[out] Extents           A pointer to receive the newly allocated FILE_EXTENT array
+                                (NULL for an empty file).
+  @param[out] NumExtents        A pointer to receive the number of extents.
+  @param[out] FileSize          A pointer to receive the size of the file.
+
+  @retval EFI_SUCCESS           The extents were resolved.
+  @retval EFI_UNSUPPORTED       The node is a directory, or the file can't be accessed directly.
+  @retval EFI_VOLUME_CORRUPTED  The file system metadata is inconsistent.
+  @retval EFI_OUT_OF_RESOURCES  A memory allocation error occurred.
+**/
+EFI_STATUS GetFileExtents(
+	IN FS_VOLUME* Volume,
+	IN CONST FS_NODE* Node,
+	OUT FILE_EXTENT** Extents,
+	OUT UINTN* NumExtents,
+	OUT UINT64* FileSize
+);
+
+/**
+  Set up a volume for direct access, if it holds a FAT12, FAT16, FAT32 or exFAT file system.
+
+  @param[in/out] Volume         A pointer to the FS_VOLUME, with its disk access fields set.
+  @param[in]     BootSector     The first 512 bytes of the volume.
+
+  @retval EFI_SUCCESS           The volume holds a valid FAT or exFAT file system.
+  @retval EFI_UNSUPPORTED       The volume does not hold a FAT or exFAT file system.
+**/
+EFI_STATUS FatMountVolume(
+	IN OUT FS_VOLUME* Volume,
+	IN CONST UINT8* BootSector
+);
+
+/**
+  Look up several names in a directory of a FAT or exFAT volume. Only the names
+  which result is EFI_NOT_FOUND on input are looked up.
+  See LookupVolumeNames() for the parameters.
+
+  @retval EFI_SUCCESS           The directory was read.
+  @retval other                 The directory could not be read.
+**/
+EFI_STATUS FatLookupNames(
+	IN FS_VOLUME* Volume,
+	IN CONST FS_NODE* Dir,
+	IN CONST CHAR16* CONST* Names,
+	IN CONST UINTN NumNames,
+	OUT FS_NODE* Nodes,
+	IN OUT EFI_STATUS* Results
+);
+
+/**
+  Resolve a file to the list of extents holding its data on a FAT or exFAT volume.
+  See GetFileExtents() for the parameters and return values.
+**/
+EFI_STATUS FatGetFileExtents(
+	IN FS_VOLUME* Volume,
+	IN CONST FS_NODE* Node,
+	OUT FILE_EXTENT** Extents,
+	OUT UINTN* NumExtents,
+	OUT UINT64* FileSize
+);
+
+/**
+  Set up a volume for direct access, if it holds an NTFS file system.
+
+  @param[in/out] Volume         A pointer to the FS_VOLUME, with its disk access fields set.
+  @param[in]     BootSector     The first 512 bytes of the volume.
+
+  @retval EFI_SUCCESS           The volume holds a valid NTFS file system.
+  @retval EFI_UNSUPPORTED       The volume does not hold an NTFS file system we can access.
+  @retval EFI_VOLUME_CORRUPTED  The file system metadata is inconsistent.
+  @retval EFI_OUT_OF_RESOURCES  A memory allocation error occurred.
+  @retval other                 The disk could not be read.
+**/
+EFI_STATUS NtfsMountVolume(
+	IN OUT FS_VOLUME* Volume,
+	IN CONST UINT8* BootSector
+);
+
+/**
+  Look up several names in a directory of an NTFS volume. Only the names which
+  result is EFI_NOT_FOUND on input are looked up.
+  See LookupVolumeNames() for the parameters.
+
+  @retval EFI_SUCCESS           The directory was read.
+  @retval other                 The directory could not be read.
+**/
+EFI_STATUS NtfsLookupNames(
+	IN FS_VOLUME* Volume,
+	IN CONST FS_NODE* Dir,
+	IN CONST CHAR16* CONST* Names,
+	IN CONST UINTN NumNames,
+	OUT FS_NODE* Nodes,
+	IN OUT EFI_STATUS* Results
+);
+
+/**
+  Resolve a file to the list of extents holding its data on an NTFS volume.
+  See GetFileExtents() for the parameters and return values.
+**/
+EFI_STATUS NtfsGetFileExtents(
+	IN FS_VOLUME* Volume,
+	IN CONST FS_NODE* Node,
+	OUT FILE_EXTENT** Extents,
+	OUT UINTN* NumExtents,
+	OUT UINT64* FileSize
+);
+
+/**
+  Return the list of multi-buffer MD5 engines available for this architecture.
+  Note that the CPU may not support all of these (see MD5_MB_ENGINE.Features).
+
+  @retval A NULL terminated array of MD5_MB_ENGINE pointers.
+**/
+CONST MD5_MB_ENGINE* CONST* Md5MbGetEngines(VOID);
+
+/**
+  Select the MD5 kernels to use for this platform. Every candidate kernel that
+  is supported by the CPU is first validated through a known-answer test, and
+  then timed, with the fastest one being retained.
+
+  @retval EFI_SUCCESS           An MD5 kernel was successfully selected.
+  @retval EFI_CRC_ERROR         None of the MD5 kernels passed the self-test.
+**/
+EFI_STATUS Md5SelectKernels(VOID);
+
+/**
+  Compute the MD5 hash of a buffer, with the selected single buffer kernel.
+
+  @param[in]  Data              A pointer to the data to hash.
+  @param[in]  Size              The size of the data.
+  @param[out] Hash              A buffer of MD5_HASHSIZE bytes, to receive the hash.
+**/
+VOID Md5HashBuffer(
+	IN CONST VOID* Data,
+	IN CONST UINTN Size,
 	OUT UINT8* Hash
 );
 
+/**
+  Convert a UTF-8 encoded string of known size to a UCS-2 encoded string.
+  Any invalid UTF-8 sequence results in an error.
+
+  @param[in]  Utf8String      A pointer to the input UTF-8 encoded string.
+  @param[in]  Utf8StringSize  The size of Utf8String (in CHAR8), not including any NUL terminator.
+  @param[out] Ucs2String      A pointer to the output UCS-2 encoded string.
+  @param[in]  Ucs2StringSize  The size of the Ucs2String buffer (in CHAR16).
+
+  @retval EFI_SUCCESS            The conversion was successful.
+  @retval EFI_INVALID_PARAMETER  One or more of the input parameters are invalid.
+  @retval EFI_BUFFER_TOO_SMALL   The output buffer is too small to hold the result.
+**/
+EFI_STATUS Utf8ToUcs2N(
+	IN CONST CHAR8* Utf8String,
+	IN CONST UINTN Utf8StringSize,
+	OUT CHAR16* Ucs2String,
+	IN CONST UINTN Ucs2StringSize
+);
+
 /**
   Convert a UTF-8 encoded string to a UCS-2 encoded string.
 
@@ -182,9 +182,12 @@ VOID PrintFailedEntry(
 		(Scroll.YPos + Scroll.MaxLines >= gConsole.Rows))
 		return;
 
-	// Display a more explicit message (than "CRC Error") for files that fail MD5
+	// Display a more explicit message (than "CRC Error") for files that fail MD5,
+	// and (than "Bad Buffer Size") for files that don't have the expected size
 	if (Status == EFI_CRC_ERROR)
 		UnicodeSPrint(ErrorMsg, ARRAY_SIZE(ErrorMsg), L": [27] Checksum Error");
+	else if (Status == EFI_BAD_BUFFER_SIZE)
+		UnicodeSPrint(ErrorMsg, ARRAY_SIZE(ErrorMsg), L": [4] Size Mismatch");
 	else
 		UnicodeSPrint(ErrorMsg, ARRAY_SIZE(ErrorMsg), L": [%d] %r", (Status & 0x7FFFFFFF), Status);
 	if (gIsTestMode)
@@ -0,0 +1,438 @@
+/*
+ * uefi-md5sum: UEFI MD5Sum validator - Directory index
+ * Copyright © 2024 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "boot.h"
+
+/* Size of the blocks that index entries are allocated from */
+#define INDEX_BLOCK_SIZE    (64 * 1024)
+
+/* Bounds for the number of hash buckets of the index */
+#define INDEX_BUCKETS_MIN   1024
+#define INDEX_BUCKETS_MAX   (1024 * 1024)
+
+/* Indexing state of a directory */
+#define INDEX_STATE_NONE    0
+#define INDEX_STATE_DONE    1
+#define INDEX_STATE_FAILED  2
+
+/* Index of directory entries, hashed on their parent and their (case insensitive) name */
+struct _DIR_INDEX {
+	EFI_FILE_HANDLE     Root;
+	DIR_INDEX_ENTRY     RootEntry;
+	DIR_INDEX_ENTRY**   Bucket;
+	UINTN               NumBuckets;     /* Always a power of 2 */
+	UINT8*              Block;          /* The block that entries are allocated from */
+	UINTN               BlockUsed;
+	EFI_FILE_INFO*      Info;           /* A FILE_INFO_SIZE buffer for directory reads */
+	CHAR16*             Path;           /* A PATH_MAX + 1 buffer for the directories to open */
+};
+
+/* Compute the bucket for the name of an entry, which is Len characters long */
+STATIC UINTN HashName(
+	IN CONST DIR_INDEX* Index,
+	IN CONST DIR_INDEX_ENTRY* Parent,
+	IN CONST CHAR16* Name,
+	IN CONST UINTN Len
+)
+{
+	UINT32 Hash = 2166136261U ^ (UINT32)((UINTN)Parent >> 3);
+	UINTN i;
+
+	// FNV-1a, with the case folded the same way as for _StriCmp()
+	for (i = 0; i < Len; i++)
+		Hash = (Hash ^ _tolower(Name[i])) * 16777619U;
+	return Hash & (Index->NumBuckets - 1);
+}
+
+/**
+  Add an entry to the directory index.
+
+  @param[in]  Index             A pointer to the DIR_INDEX.
+  @param[in]  Parent            The directory holding the entry.
+  @param[in]  Info              The information of the entry, as read from its directory.
+
+  @retval A pointer to the new entry, or NULL on allocation error.
+**/
+STATIC DIR_INDEX_ENTRY* AddEntry(
+	IN DIR_INDEX* Index,
+	IN DIR_INDEX_ENTRY* Parent,
+	IN CONST EFI_FILE_INFO* Info
+)
+{
+	DIR_INDEX_ENTRY* Entry;
+	UINTN Bucket, Len, Size;
+
+	Len = SafeStrLen(Info->FileName);
+	Size = (sizeof(DIR_INDEX_ENTRY) + Len * sizeof(CHAR16) + sizeof(UINT64) - 1) & ~(sizeof(UINT64) - 1);
+	if (Index->Block == NULL || Size > INDEX_BLOCK_SIZE - Index->BlockUsed) {
+		Index->Block = ArenaAllocate(MAX(Size, INDEX_BLOCK_SIZE));
+		if (Index->Block == NULL)
+			return NULL;
+		Index->BlockUsed = 0;
+	}
+	Entry = (DIR_INDEX_ENTRY*)&Index->Block[Index->BlockUsed];
+	Index->BlockUsed += Size;
+
+	Entry->Parent = Parent;
+	Entry->FileSize = Info->FileSize;
+	Entry->Attribute = Info->Attribute;
+	Entry->State = INDEX_STATE_NONE;
+	CopyMem(Entry->Name, Info->FileName, Len * sizeof(CHAR16));
+	Entry->Name[Len] = L'\0';
+	Bucket = HashName(Index, Parent, Entry->Name, Len);
+	Entry->Next = Index->Bucket[Bucket];
+	Index->Bucket[Bucket] = Entry;
+	return Entry;
+}
+
+/**
+  Find an entry from an indexed directory.
+
+  @param[in]  Index             A pointer to the DIR_INDEX.
+  @param[in]  Parent            The directory to look into.
+  @param[in]  Name              The name of the entry, which does not need to be NUL terminated.
+  @param[in]  Len               The length of the name.
+
+  @retval A pointer to the entry, or NULL if the directory doesn't have it. An entry which name
+          has the same case is preferred, for file systems that are case sensitive.
+**/
+STATIC DIR_INDEX_ENTRY* FindEntry(
+	IN CONST DIR_INDEX* Index,
+	IN CONST DIR_INDEX_ENTRY* Parent,
+	IN CONST CHAR16* Name,
+	IN CONST UINTN Len
+)
+{
+	DIR_INDEX_ENTRY *Entry, *Match = NULL;
+	BOOLEAN SameCase;
+	UINTN i;
+
+	for (Entry = Index->Bucket[HashName(Index, Parent, Name, Len)]; Entry != NULL; Entry = Entry->Next) {
+		if (Entry->Parent != Parent)
+			continue;
+		SameCase = TRUE;
+		for (i = 0; i < Len && Entry->Name[i] != L'\0'; i++) {
+			if (_tolower(Entry->Name[i]) != _tolower(Name[i]))
+				break;
+			SameCase = SameCase && (Entry->Name[i] == Name[i]);
+		}
+		if (i != Len || Entry->Name[i] != L'\0')
+			continue;
+		if (SameCase)
+			return Entry;
+		if (Match == NULL)
+			Match = Entry;
+	}
+	return Match;
+}
+
+/**
+  Get the path of an entry from the directory index, with its case from the media.
+
+  @param[in]  Entry             A pointer to the DIR_INDEX_ENTRY.
+  @param[out] Path              A buffer to receive the path.
+  @param[in]  Size              The size of the buffer, in characters.
+
+  @retval EFI_SUCCESS           The path was copied.
+  @retval EFI_INVALID_PARAMETER One or more of the input parameters are invalid.
+  @retval EFI_BUFFER_TOO_SMALL  The buffer is too small for the path.
+**/
+EFI_STATUS GetDirIndexPath(
+	IN CONST DIR_INDEX_ENTRY* Entry,
+	OUT CHAR16* Path,
+	IN CONST UINTN Size
+)
+{
+	CONST DIR_INDEX_ENTRY* e;
+	UINTN Len = 0, NameLen;
+
+	if (Entry == NULL || Path == NULL || Size < 2)
+		return EFI_INVALID_PARAMETER;
+
+	for (e = Entry; e->Parent != NULL; e = e->Parent)
+		Len += 1 + SafeStrLen(e->Name);
+	if (Len >= Size)
+		return EFI_BUFFER_TOO_SMALL;
+
+	if (Len == 0) {
+		Path[0] = L'\\';
+		Path[1] = L'\0';
+		return EFI_SUCCESS;
+	}
+	// Fill the path from its end
+	Path[Len] = L'\0';
+	for (e = Entry; e->Parent != NULL; e = e->Parent) {
+		NameLen = SafeStrLen(e->Name);
+		Len -= NameLen;
+		CopyMem(&Path[Len], e->Name, NameLen * sizeof(CHAR16));
+		Path[--Len] = L'\\';
+	}
+	return EFI_SUCCESS;
+}
+
+/**
+  Add the content of a directory to the index, by reading all of its entries.
+  On error, the directory is flagged so that lookups fall back to the driver.
+
+  @param[in]  Index             A pointer to the DIR_INDEX.
+  @param[in]  Dir               The directory to enumerate.
+**/
+STATIC VOID IndexDirectory(
+	IN DIR_INDEX* Index,
+	IN DIR_INDEX_ENTRY* Dir
+)
+{
+	EFI_STATUS Status;
+	EFI_FILE_HANDLE Handle;
+	UINTN Size;
+
+	Dir->State = INDEX_STATE_FAILED;
+	if (EFI_ERROR(GetDirIndexPath(Dir, Index->Path, PATH_MAX + 1)))
+		return;
+	Status = Index->Root->Open(Index->Root, &Handle, Index->Path, EFI_FILE_MODE_READ, 0);
+	if (EFI_ERROR(Status))
+		return;
+
+	// Make sure we always start at the top of the directory list
+	Handle->SetPosition(Handle, 0);
+
+	while (1) {
+		Size = FILE_INFO_SIZE;
+		ZeroMem(Index->Info, Size);
+		Status = Handle->Read(Handle, &Size, Index->Info);
+		if (EFI_ERROR(Status))
+			goto out;
+		if (Size == 0)
+			break;
+		if (StrCmp(Index->Info->FileName, L".") == 0 || StrCmp(Index->Info->FileName, L"..") == 0)
+			continue;
+		if (AddEntry(Index, Dir, Index->Info) == NULL)
+			goto out;
+	}
+	Dir->State = INDEX_STATE_DONE;
+
+out:
+	Handle->Close(Handle);
+}
+
+/**
+  Walk the directory index along a path. Directories that haven't been indexed
+  yet are enumerated as needed.
+
+  @param[in]  Index             A pointer to the DIR_INDEX.
+  @param[in]  Entry             The entry to start from.
+  @param[in]  Path              The path to walk, relative to Entry.
+
+  @retval A pointer to the DIR_INDEX_ENTRY that the path leads to, which is Entry if the path
+          has no component to walk, or NULL if the path could not be resolved from the index.
+**/
+STATIC DIR_INDEX_ENTRY* WalkDirIndex(
+	IN DIR_INDEX* Index,
+	IN DIR_INDEX_ENTRY* Entry,
+	IN CONST CHAR16* Path
+)
+{
+	DIR_INDEX_ENTRY* Dir;
+	UINTN Len;
+
+	while (*Path != L'\0') {
+		if (*Path == L'\\' || *Path == L'/') {
+			Path++;
+			continue;
+		}
+		for (Len = 0; Path[Len] != L'\0' && Path[Len] != L'\\' && Path[Len] != L'/'; Len++);
+		if (Len == 1 && Path[0] == L'.') {
+			Path++;
+			continue;
+		}
+		// Leave paths that go up to the driver
+		if (Len == 2 && Path[0] == L'.' && Path[1] == L'.')
+			return NULL;
+		if (!(Entry->Attribute & EFI_FILE_DIRECTORY))
+			return NULL;
+		Dir = Entry;
+		if (Dir->State == INDEX_STATE_NONE)
+			IndexDirectory(Index, Dir);
+		if (Dir->State != INDEX_STATE_DONE)
+			return NULL;
+		Entry = FindEntry(Index, Dir, Path, Len);
+		if (Entry == NULL)
+			return NULL;
+		Path += Len;
+	}
+	return Entry;
+}
+
+/**
+  Look up a path in the directory index. Directories that haven't been indexed
+  yet are enumerated as needed.
+
+  @param[in]  Index             A pointer to the DIR_INDEX.
+  @param[in]  Path              The path to look up, relative to the root directory.
+
+  @retval A pointer to the DIR_INDEX_ENTRY for the path, or NULL if the path could not be
+          resolved from the index, in which case the file system should be queried instead.
+**/
+DIR_INDEX_ENTRY* LookupDirIndex(
+	IN DIR_INDEX* Index,
+	IN CONST CHAR16* Path
+)
+{
+	DIR_INDEX_ENTRY* Entry;
+
+	if (Index == NULL || Path == NULL)
+		return NULL;
+
+	// The root directory itself is left to the driver
+	Entry = WalkDirIndex(Index, &Index->RootEntry, Path);
+	return (Entry == &Index->RootEntry) ? NULL : Entry;
+}
+
+/**
+  Look up a directory from the trie of a hash list in the index, after the parents
+  that haven't been looked up yet. Each directory is looked up from its parent, so
+  that the part of the path that the directories share is only walked once.
+
+  @param[in]     Index          A pointer to the DIR_INDEX.
+  @param[in]     List           A pointer to the HASH_LIST holding the trie.
+  @param[in]     Dir            The directory to look up, or HASH_DIR_NONE for the root.
+  @param[in/out] DirEntries     The entries that the directories of the trie were resolved to.
+  @param[in/out] IsResolved     Whether each directory of the trie has been looked up.
+
+  @retval A pointer to the DIR_INDEX_ENTRY for the directory, or NULL if it could not be resolved.
+**/
+STATIC DIR_INDEX_ENTRY* LookupTrieDir(
+	IN DIR_INDEX* Index,
+	IN CONST HASH_LIST* List,
+	IN CONST UINT32 Dir,
+	IN OUT DIR_INDEX_ENTRY** DirEntries,
+	IN OUT BOOLEAN* IsResolved
+)
+{
+	DIR_INDEX_ENTRY* Parent;
+	UINT32 d, Stack[PATH_MAX];
+	UINTN Depth = 0;
+
+	// Go up to the first directory that was looked up, or to the root.
+	// Since each directory takes at least a separator, the depth is bounded.
+	for (d = Dir; d != HASH_DIR_NONE && !IsResolved[d]; d = HASH_LIST_DIR(List, d)->Parent) {
+		V_ASSERT(Depth < ARRAY_SIZE(Stack));
+		Stack[Depth++] = d;
+	}
+	Parent = (d == HASH_DIR_NONE) ? &Index->RootEntry : DirEntries[d];
+
+	// Then look the directories up on the way down
+	while (Depth > 0) {
+		d = Stack[--Depth];
+		DirEntries[d] = (Parent == NULL) ? NULL :
+			WalkDirIndex(Index, Parent, &List->Paths[HASH_LIST_DIR(List, d)->Name]);
+		IsResolved[d] = TRUE;
+		Parent = DirEntries[d];
+	}
+	return Parent;
+}
+
+/**
+  Create an index of the directories that a hash list references, by enumerating
+  each of them once. The index then provides the information of the files from
+  the list, without having to query the file system driver for each of them.
+
+  @param[in]  Root              A file handle to the root directory.
+  @param[in]  List              (Optional) A pointer to the HASH_LIST to index.
+  @param[in]  Volume            The index of the volume that Root belongs to, in List->VolumeId.
+                                Only the entries from the list that are on this volume are indexed.
+  @param[out] Index             A pointer to receive the DIR_INDEX, allocated from the run arena.
+  @param[out] TotalBytes        (Optional) A pointer to receive the total size of the files from
+                                the list, or 0 if some of these files could not be indexed.
+
+  @retval EFI_SUCCESS           The index was created.
+  @retval EFI_INVALID_PARAMETER One or more of the input parameters are invalid.
+  @retval EFI_OUT_OF_RESOURCES  A memory allocation error occurred.
+**/
+EFI_STATUS CreateDirIndex(
+	IN CONST EFI_FILE_HANDLE Root,
+	OPTIONAL IN CONST HASH_LIST* List,
+	IN CONST UINTN Volume,
+	OUT DIR_INDEX** Index,
+	OPTIONAL OUT UINT64* TotalBytes
+)
+{
+	DIR_INDEX_ENTRY *Entry, *Dir, **DirEntries = NULL;
+	BOOLEAN Complete = (List != NULL), *IsResolved = NULL;
+	UINT64 Total = 0;
+	UINTN i;
+
+	if (Root == NULL || Index == NULL)
+		return EFI_INVALID_PARAMETER;
+	if (TotalBytes != NULL)
+		*TotalBytes = 0;
+
+	*Index = ArenaAllocate(sizeof(DIR_INDEX));
+	if (*Index == NULL)
+		return EFI_OUT_OF_RESOURCES;
+	ZeroMem(*Index, sizeof(DIR_INDEX));
+	(*Index)->Root = Root;
+	(*Index)->RootEntry.Attribute = EFI_FILE_DIRECTORY;
+	(*Index)->RootEntry.State = INDEX_STATE_NONE;
+	for ((*Index)->NumBuckets = INDEX_BUCKETS_MIN; (List != NULL) &&
+		((*Index)->NumBuckets < 2 * List->NumEntries) &&
+		((*Index)->NumBuckets < INDEX_BUCKETS_MAX); (*Index)->NumBuckets *= 2);
+	(*Index)->Bucket = ArenaAllocate((*Index)->NumBuckets * sizeof(DIR_INDEX_ENTRY*));
+	(*Index)->Info = ArenaAllocate(FILE_INFO_SIZE);
+	(*Index)->Path = ArenaAllocate((PATH_MAX + 1) * sizeof(CHAR16));
+	if ((*Index)->Bucket == NULL || (*Index)->Info == NULL || (*Index)->Path == NULL) {
+		*Index = NULL;
+		return EFI_OUT_OF_RESOURCES;
+	}
+	ZeroMem((*Index)->Bucket, (*Index)->NumBuckets * sizeof(DIR_INDEX_ENTRY*));
+	if (List != NULL && List->NumDirs != 0) {
+		DirEntries = ArenaAllocate(List->NumDirs * sizeof(DIR_INDEX_ENTRY*));
+		IsResolved = ArenaAllocate(List->NumDirs * sizeof(BOOLEAN));
+		if (DirEntries == NULL || IsResolved == NULL) {
+			*Index = NULL;
+			return EFI_OUT_OF_RESOURCES;
+		}
+		ZeroMem(IsResolved, List->NumDirs * sizeof(BOOLEAN));
+	}
+
+	// Enumerate the directories from the list, in the order they are referenced.
+	// Each directory from the trie of the list is only looked up once, and the
+	// files are then looked up from their directory.
+	for (i = 0; List != NULL && i < List->NumEntries; i++) {
+		if (List->VolumeIndex[i] != Volume)
+			continue;
+		Entry = NULL;
+		Dir = NULL;
+		if (!(List->Flags[i] & HASH_ENTRY_INVALID_PATH))
+			Dir = LookupTrieDir(*Index, List, List->DirId[i], DirEntries, IsResolved);
+		if (Dir != NULL) {
+			Entry = WalkDirIndex(*Index, Dir, &List->Paths[List->NameOffset[i]]);
+			// As with LookupDirIndex(), the root directory itself is left to the driver
+			if (Entry == &(*Index)->RootEntry)
+				Entry = NULL;
+		}
+		if (Entry == NULL || (Entry->Attribute & EFI_FILE_DIRECTORY))
+			Complete = FALSE;
+		else
+			Total += Entry->FileSize;
+	}
+
+	if (TotalBytes != NULL && Complete)
+		*TotalBytes = Total;
+	return EFI_SUCCESS;
+}
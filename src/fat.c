@@ -0,0 +1,697 @@
+/*
+ * uefi-md5sum: UEFI MD5Sum validator - FAT/exFAT extent mapper
+ * Copyright © 2024 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "boot.h"
+
+/*
+ * This is a minimal read-only implementation, that only resolves the location
+ * of file data. Anything it does not fully understand is reported as an error,
+ * so that the caller falls back to the firmware file system driver.
+ */
+
+/* Size of a directory entry, for both FAT and exFAT */
+#define DIR_ENTRY_SIZE      32
+
+/* Maximum length of a file name, for both FAT and exFAT */
+#define FAT_NAME_MAX        255
+
+/* Value returned for the end of a cluster chain */
+#define FAT_CLUSTER_END     0xFFFFFFFF
+
+/* FAT directory entry attributes and markers */
+#define FAT_ATTR_VOLUME_ID  0x08
+#define FAT_ATTR_DIRECTORY  0x10
+#define FAT_ATTR_LFN        0x0F
+#define FAT_ATTR_MASK       0x3F
+#define FAT_ENTRY_FREE      0xE5
+#define FAT_LFN_LAST        0x40
+#define FAT_LFN_CHARS       13
+
+/* exFAT directory entry types and flags */
+#define EXFAT_ENTRY_FILE    0x85
+#define EXFAT_ENTRY_STREAM  0xC0
+#define EXFAT_ENTRY_NAME    0xC1
+#define EXFAT_NO_FAT_CHAIN  0x02
+#define EXFAT_NAME_CHARS    15
+
+/* Entry index value for the end of a chain of names to look up */
+#define FAT_NAME_NONE       ((UINTN)-1)
+
+/* Minimum number of names to look up in a directory, for them to be hashed */
+#define FAT_LOOKUP_HASH_MIN 8
+
+/* State used to walk through the entries of a directory */
+typedef struct {
+	FS_NODE     Dir;
+	UINT32      Cluster;        /* The cluster being read */
+	UINT32      NumClusters;    /* The number of clusters read so far */
+	UINT64      Offset;         /* The volume offset of the next read */
+	UINT64      Left;           /* The amount of data left to read from the cluster or root */
+	UINTN       Pos;            /* The position of the next entry in the volume buffer */
+	UINTN       Len;            /* The amount of data in the volume buffer */
+} FAT_DIR_ITERATOR;
+
+/* Offset of a cluster on the volume */
+STATIC __inline UINT64 ClusterOffset(FS_VOLUME* Volume, UINT32 Cluster)
+{
+	return Volume->DataOffset + (UINT64)(Cluster - 2) * Volume->ClusterSize;
+}
+
+/* Check that a cluster number is within the data area */
+STATIC __inline BOOLEAN IsValidCluster(FS_VOLUME* Volume, UINT32 Cluster)
+{
+	return (Cluster >= 2 && Cluster - 2 < Volume->NumClusters);
+}
+
+/* Names to look up in a directory, that are hashed when there are enough of them */
+typedef struct {
+	CONST CHAR16* CONST* Names;
+	UINTN       NumNames;
+	UINTN       NumLeft;        /* The number of names that were not found yet */
+	UINTN*      Bucket;         /* (Optional) The first name from each hash bucket */
+	UINTN*      Next;           /* The next name from the same hash bucket */
+	UINTN       NumBuckets;     /* Always a power of 2 */
+	FS_NODE*    Nodes;
+	EFI_STATUS* Results;
+} FAT_LOOKUP;
+
+/* Case insensitive comparison of a name with a name we look up */
+STATIC BOOLEAN NameMatch(CONST CHAR16* Name, CONST CHAR16* Target)
+{
+	while (*Name != L'\0' && _tolower(*Name) == _tolower(*Target))
+		Name++, Target++;
+	return (*Name == L'\0' && *Target == L'\0');
+}
+
+/* FNV-1a hash of a name, with the case folded the same way as for NameMatch() */
+STATIC UINTN HashName(CONST FAT_LOOKUP* Lookup, CONST CHAR16* Name)
+{
+	UINT32 Hash = 2166136261U;
+
+	for (; *Name != L'\0'; Name++)
+		Hash = (Hash ^ _tolower(*Name)) * 16777619U;
+	return Hash & (Lookup->NumBuckets - 1);
+}
+
+/**
+  Report a directory entry for all the names it matches, that were not found yet.
+
+  @param[in/out] Lookup         A pointer to the FAT_LOOKUP.
+  @param[in]     Name           The name of the directory entry.
+  @param[in]     Node           The FS_NODE of the directory entry.
+  @param[in]     Status         The result to report for the names that match.
+**/
+STATIC VOID MatchNames(
+	IN OUT FAT_LOOKUP* Lookup,
+	IN CONST CHAR16* Name,
+	IN CONST FS_NODE* Node,
+	IN CONST EFI_STATUS Status
+)
+{
+	UINTN i;
+
+	i = (Lookup->Bucket != NULL) ? Lookup->Bucket[HashName(Lookup, Name)] : 0;
+	while (i != FAT_NAME_NONE && i < Lookup->NumNames) {
+		if (Lookup->Results[i] == EFI_NOT_FOUND && NameMatch(Name, Lookup->Names[i])) {
+			Lookup->Nodes[i] = *Node;
+			Lookup->Results[i] = Status;
+			Lookup->NumLeft--;
+		}
+		i = (Lookup->Bucket != NULL) ? Lookup->Next[i] : i + 1;
+	}
+}
+
+/**
+  Set up a volume for direct access, if it holds a FAT12, FAT16, FAT32 or exFAT file system.
+
+  @param[in/out] Volume         A pointer to the FS_VOLUME, with its disk access fields set.
+  @param[in]     BootSector     The first 512 bytes of the volume.
+
+  @retval EFI_SUCCESS           The volume holds a valid FAT or exFAT file system.
+  @retval EFI_UNSUPPORTED       The volume does not hold a FAT or exFAT file system.
+**/
+EFI_STATUS FatMountVolume(
+	IN OUT FS_VOLUME* Volume,
+	IN CONST UINT8* BootSector
+)
+{
+	CONST UINT8* b = BootSector;
+	UINT32 SectorShift, ClusterShift, SectorsPerCluster, Reserved, NumFats;
+	UINT32 RootEntries, FatSectors, TotalSectors, RootSectors, MetaSectors;
+
+	if (READ_LE16(&b[510]) != 0xAA55)
+		return EFI_UNSUPPORTED;
+
+	if (CompareMem(&b[3], "EXFAT   ", 8) == 0) {
+		SectorShift = b[108];
+		ClusterShift = b[109];
+		if (SectorShift < 9 || SectorShift > 12 || SectorShift + ClusterShift > 25 || b[110] == 0)
+			return EFI_UNSUPPORTED;
+		Volume->Type = FS_TYPE_EXFAT;
+		Volume->SectorSize = 1U << SectorShift;
+		Volume->ClusterSize = 1U << (SectorShift + ClusterShift);
+		Volume->FatOffset = (UINT64)READ_LE32(&b[80]) << SectorShift;
+		Volume->DataOffset = (UINT64)READ_LE32(&b[88]) << SectorShift;
+		Volume->NumClusters = READ_LE32(&b[92]);
+		Volume->RootCluster = READ_LE32(&b[96]);
+		if (!IsValidCluster(Volume, Volume->RootCluster))
+			return EFI_UNSUPPORTED;
+		Volume->RootDir.Cluster = Volume->RootCluster;
+		Volume->RootDir.IsDirectory = TRUE;
+		return EFI_SUCCESS;
+	}
+
+	Volume->SectorSize = READ_LE16(&b[11]);
+	SectorsPerCluster = b[13];
+	Reserved = READ_LE16(&b[14]);
+	NumFats = b[16];
+	RootEntries = READ_LE16(&b[17]);
+	TotalSectors = (READ_LE16(&b[19]) != 0) ? READ_LE16(&b[19]) : READ_LE32(&b[32]);
+	FatSectors = (READ_LE16(&b[22]) != 0) ? READ_LE16(&b[22]) : READ_LE32(&b[36]);
+	if ((Volume->SectorSize != 512 && Volume->SectorSize != 1024 && Volume->SectorSize != 2048 &&
+		Volume->SectorSize != 4096) || SectorsPerCluster == 0 ||
+		(SectorsPerCluster & (SectorsPerCluster - 1)) != 0 || Reserved == 0 || NumFats == 0 ||
+		FatSectors == 0 || (b[0] != 0xEB && b[0] != 0xE9))
+		return EFI_UNSUPPORTED;
+
+	// Determine the FAT type from the number of clusters, as per the specifications
+	RootSectors = (RootEntries * DIR_ENTRY_SIZE + Volume->SectorSize - 1) / Volume->SectorSize;
+	MetaSectors = Reserved + NumFats * FatSectors + RootSectors;
+	if (TotalSectors <= MetaSectors)
+		return EFI_UNSUPPORTED;
+	Volume->ClusterSize = SectorsPerCluster * Volume->SectorSize;
+	Volume->NumClusters = (TotalSectors - MetaSectors) / SectorsPerCluster;
+	if (Volume->NumClusters < 4085)
+		Volume->Type = FS_TYPE_FAT12;
+	else if (Volume->NumClusters < 65525)
+		Volume->Type = FS_TYPE_FAT16;
+	else
+		Volume->Type = FS_TYPE_FAT32;
+
+	Volume->FatOffset = (UINT64)Reserved * Volume->SectorSize;
+	Volume->RootOffset = (UINT64)(Reserved + NumFats * FatSectors) * Volume->SectorSize;
+	Volume->RootSize = RootSectors * Volume->SectorSize;
+	Volume->DataOffset = Volume->RootOffset + Volume->RootSize;
+	if (Volume->Type == FS_TYPE_FAT32) {
+		Volume->RootCluster = READ_LE32(&b[44]);
+		if (RootEntries != 0 || !IsValidCluster(Volume, Volume->RootCluster))
+			return EFI_UNSUPPORTED;
+	} else if (RootEntries == 0) {
+		return EFI_UNSUPPORTED;
+	}
+	// The FAT12/FAT16 root directory is not a cluster chain, which cluster 0 denotes
+	Volume->RootDir.Cluster = (Volume->Type == FS_TYPE_FAT32) ? Volume->RootCluster : 0;
+	Volume->RootDir.IsDirectory = TRUE;
+	return EFI_SUCCESS;
+}
+
+/**
+  Read a byte from the allocation table, through the volume cache.
+
+  @param[in]  Volume            A pointer to the FS_VOLUME.
+  @param[in]  Offset            The offset of the byte in the allocation table.
+  @param[out] Byte              A pointer to receive the value.
+
+  @retval EFI_SUCCESS           The byte was read.
+  @retval other                 The disk could not be read.
+**/
+STATIC EFI_STATUS ReadFatByte(
+	IN FS_VOLUME* Volume,
+	IN CONST UINT64 Offset,
+	OUT UINT8* Byte
+)
+{
+	EFI_STATUS Status;
+	UINT64 CacheOffset = Volume->FatOffset + (Offset & ~((UINT64)VOLUME_CACHE_SIZE - 1));
+
+	if (CacheOffset != Volume->CacheOffset) {
+		Status = ReadVolume(Volume, CacheOffset, VOLUME_CACHE_SIZE, Volume->Cache);
+		if (EFI_ERROR(Status)) {
+			Volume->CacheOffset = (UINT64)-1;
+			return Status;
+		}
+		Volume->CacheOffset = CacheOffset;
+	}
+	*Byte = Volume->Cache[Offset & (VOLUME_CACHE_SIZE - 1)];
+	return EFI_SUCCESS;
+}
+
+/**
+  Look up the cluster that follows another one in a cluster chain.
+
+  @param[in]  Volume            A pointer to the FS_VOLUME.
+  @param[in]  Cluster           The current cluster.
+  @param[out] Next              A pointer to receive the next cluster, or FAT_CLUSTER_END.
+
+  @retval EFI_SUCCESS           The next cluster was retrieved.
+  @retval EFI_VOLUME_CORRUPTED  The allocation table entry is invalid.
+  @retval other                 The disk could not be read.
+**/
+STATIC EFI_STATUS GetNextCluster(
+	IN FS_VOLUME* Volume,
+	IN CONST UINT32 Cluster,
+	OUT UINT32* Next
+)
+{
+	EFI_STATUS Status = EFI_SUCCESS;
+	UINT8 b[4] = { 0 };
+	UINT64 Offset;
+	UINT32 Value, End;
+	UINTN i, Size;
+
+	switch (Volume->Type) {
+	case FS_TYPE_FAT12:
+		Offset = Cluster + Cluster / 2;
+		Size = 2;
+		End = 0xFF7;
+		break;
+	case FS_TYPE_FAT16:
+		Offset = (UINT64)Cluster * 2;
+		Size = 2;
+		End = 0xFFF7;
+		break;
+	case FS_TYPE_FAT32:
+		Offset = (UINT64)Cluster * 4;
+		Size = 4;
+		End = 0x0FFFFFF7;
+		break;
+	default:
+		Offset = (UINT64)Cluster * 4;
+		Size = 4;
+		End = 0xFFFFFFF7;
+		break;
+	}
+	for (i = 0; i < Size && !EFI_ERROR(Status); i++)
+		Status = ReadFatByte(Volume, Offset + i, &b[i]);
+	if (EFI_ERROR(Status))
+		return Status;
+
+	Value = READ_LE32(b);
+	if (Volume->Type == FS_TYPE_FAT12)
+		Value = (Cluster & 1) ? (Value >> 4) : (Value & 0xFFF);
+	else if (Volume->Type == FS_TYPE_FAT32)
+		Value &= 0x0FFFFFFF;
+
+	// Anything above the bad cluster marker denotes the end of the chain
+	if (Value > End) {
+		*Next = FAT_CLUSTER_END;
+		return EFI_SUCCESS;
+	}
+	if (!IsValidCluster(Volume, Value))
+		return EFI_VOLUME_CORRUPTED;
+	*Next = Value;
+	return EFI_SUCCESS;
+}
+
+/**
+  Get the next 32-byte entry from a directory.
+
+  @param[in]     Volume         A pointer to the FS_VOLUME.
+  @param[in/out] It             A pointer to the FAT_DIR_ITERATOR for the directory.
+  @param[out]    Entry          A pointer to receive the address of the entry data.
+
+  @retval EFI_SUCCESS           The next entry was retrieved.
+  @retval EFI_NOT_FOUND         There are no more entries in the directory.
+  @retval EFI_VOLUME_CORRUPTED  The directory cluster chain is invalid.
+  @retval other                 The disk could not be read.
+**/
+STATIC EFI_STATUS NextDirEntry(
+	IN FS_VOLUME* Volume,
+	IN OUT FAT_DIR_ITERATOR* It,
+	OUT UINT8** Entry
+)
+{
+	EFI_STATUS Status;
+	UINTN Size;
+
+	if (It->Pos >= It->Len) {
+		if (It->Left == 0) {
+			// Fixed FAT12/FAT16 root directory
+			if (It->Dir.Cluster == 0)
+				return EFI_NOT_FOUND;
+			if (It->Dir.Contiguous) {
+				if ((UINT64)It->NumClusters * Volume->ClusterSize >= It->Dir.Size)
+					return EFI_NOT_FOUND;
+				It->Cluster++;
+			} else {
+				Status = GetNextCluster(Volume, It->Cluster, &It->Cluster);
+				if (EFI_ERROR(Status))
+					return Status;
+				if (It->Cluster == FAT_CLUSTER_END)
+					return EFI_NOT_FOUND;
+			}
+			// Guard against cluster chain loops
+			if (!IsValidCluster(Volume, It->Cluster) || ++It->NumClusters > Volume->NumClusters)
+				return EFI_VOLUME_CORRUPTED;
+			It->Offset = ClusterOffset(Volume, It->Cluster);
+			It->Left = Volume->ClusterSize;
+		}
+		Size = (UINTN)MIN(It->Left, VOLUME_BUFFER_SIZE);
+		Status = ReadVolume(Volume, It->Offset, Size, Volume->Buffer);
+		if (EFI_ERROR(Status))
+			return Status;
+		It->Offset += Size;
+		It->Left -= Size;
+		It->Pos = 0;
+		It->Len = Size;
+	}
+	*Entry = &Volume->Buffer[It->Pos];
+	It->Pos += DIR_ENTRY_SIZE;
+	return EFI_SUCCESS;
+}
+
+/* Set up an iterator for the entries of a directory */
+STATIC VOID InitDirIterator(FS_VOLUME* Volume, FAT_DIR_ITERATOR* It, CONST FS_NODE* Dir)
+{
+	ZeroMem(It, sizeof(*It));
+	It->Dir = *Dir;
+	if (Dir->Cluster == 0) {
+		It->Offset = Volume->RootOffset;
+		It->Left = Volume->RootSize;
+	} else {
+		It->Cluster = Dir->Cluster;
+		It->NumClusters = 1;
+		It->Offset = ClusterOffset(Volume, Dir->Cluster);
+		It->Left = Volume->ClusterSize;
+	}
+}
+
+/* Checksum of an 8.3 name, that long file name entries refer to */
+STATIC UINT8 ShortNameChecksum(CONST UINT8* Name)
+{
+	UINT8 Sum = 0;
+	UINTN i;
+
+	for (i = 0; i < 11; i++)
+		Sum = (UINT8)(((Sum & 1) << 7) + (Sum >> 1) + Name[i]);
+	return Sum;
+}
+
+/**
+  Look up names in a FAT directory, matching either their long or their 8.3 name.
+  The directory is read until all the names have been found.
+
+  @param[in]     Volume         A pointer to the FS_VOLUME.
+  @param[in]     Dir            The FS_NODE of the directory.
+  @param[in/out] Lookup         A pointer to the FAT_LOOKUP holding the names.
+
+  @retval EFI_SUCCESS           The directory was read.
+  @retval other                 The directory could not be read.
+**/
+STATIC EFI_STATUS FatFindEntries(
+	IN FS_VOLUME* Volume,
+	IN CONST FS_NODE* Dir,
+	IN OUT FAT_LOOKUP* Lookup
+)
+{
+	STATIC CONST UINT8 LfnOffsets[FAT_LFN_CHARS] = { 1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30 };
+	EFI_STATUS Status;
+	FAT_DIR_ITERATOR It;
+	FS_NODE Node;
+	CHAR16 LongName[FAT_NAME_MAX + 1], ShortName[13];
+	UINT8 *e, Checksum = 0;
+	UINTN i, j, Seq, Expected = 0;
+	BOOLEAN HasLongName;
+
+	LongName[0] = L'\0';
+	InitDirIterator(Volume, &It, Dir);
+	while (Lookup->NumLeft > 0) {
+		Status = NextDirEntry(Volume, &It, &e);
+		if (Status == EFI_NOT_FOUND)
+			break;
+		if (EFI_ERROR(Status))
+			return Status;
+		if (e[0] == 0x00)
+			break;
+		if (e[0] == FAT_ENTRY_FREE) {
+			Expected = 0;
+			LongName[0] = L'\0';
+			continue;
+		}
+
+		// Long file name entries, which precede the 8.3 entry in reverse order
+		if ((e[11] & FAT_ATTR_MASK) == FAT_ATTR_LFN) {
+			Seq = e[0] & 0x1F;
+			if (e[0] & FAT_LFN_LAST) {
+				if (Seq == 0 || Seq * FAT_LFN_CHARS > FAT_NAME_MAX + FAT_LFN_CHARS - 1) {
+					Expected = 0;
+					LongName[0] = L'\0';
+					continue;
+				}
+				Checksum = e[13];
+				LongName[MIN(Seq * FAT_LFN_CHARS, FAT_NAME_MAX)] = L'\0';
+			} else if (Seq != Expected || e[13] != Checksum) {
+				Expected = 0;
+				LongName[0] = L'\0';
+				continue;
+			}
+			for (i = 0; i < FAT_LFN_CHARS; i++) {
+				j = (Seq - 1) * FAT_LFN_CHARS + i;
+				if (j < FAT_NAME_MAX)
+					LongName[j] = READ_LE16(&e[LfnOffsets[i]]);
+			}
+			Expected = Seq - 1;
+			continue;
+		}
+		HasLongName = (Expected == 0 && LongName[0] != L'\0' && Checksum == ShortNameChecksum(e));
+		Expected = 0;
+		LongName[0] = (HasLongName) ? LongName[0] : L'\0';
+		if (e[11] & FAT_ATTR_VOLUME_ID) {
+			LongName[0] = L'\0';
+			continue;
+		}
+
+		// 8.3 name. Characters outside of ASCII depend on the OEM code page,
+		// so we make sure they never match.
+		for (i = 0, j = 0; i < 11; i++) {
+			if (i == 8 && e[8] != ' ')
+				ShortName[j++] = L'.';
+			if (e[i] == ' ')
+				continue;
+			ShortName[j++] = (i == 0 && e[0] == 0x05) ? 0xE5 :
+				((e[i] < 0x80) ? (CHAR16)e[i] : (CHAR16)0xFFFF);
+		}
+		ShortName[j] = L'\0';
+
+		ZeroMem(&Node, sizeof(Node));
+		Node.Cluster = READ_LE16(&e[26]);
+		if (Volume->Type == FS_TYPE_FAT32)
+			Node.Cluster |= (UINT32)READ_LE16(&e[20]) << 16;
+		Node.Size = READ_LE32(&e[28]);
+		Node.IsDirectory = (e[11] & FAT_ATTR_DIRECTORY) ? TRUE : FALSE;
+		Status = (Node.IsDirectory && !IsValidCluster(Volume, Node.Cluster)) ?
+			EFI_VOLUME_CORRUPTED : EFI_SUCCESS;
+		if (HasLongName)
+			MatchNames(Lookup, LongName, &Node, Status);
+		MatchNames(Lookup, ShortName, &Node, Status);
+		LongName[0] = L'\0';
+	}
+	return EFI_SUCCESS;
+}
+
+/**
+  Look up names in an exFAT directory. The directory is read until all the names
+  have been found. The files which data is not fully initialized on disk are
+  reported as EFI_UNSUPPORTED.
+
+  @param[in]     Volume         A pointer to the FS_VOLUME.
+  @param[in]     Dir            The FS_NODE of the directory.
+  @param[in/out] Lookup         A pointer to the FAT_LOOKUP holding the names.
+
+  @retval EFI_SUCCESS           The directory was read.
+  @retval other                 The directory could not be read.
+**/
+STATIC EFI_STATUS ExFatFindEntries(
+	IN FS_VOLUME* Volume,
+	IN CONST FS_NODE* Dir,
+	IN OUT FAT_LOOKUP* Lookup
+)
+{
+	EFI_STATUS Status;
+	FAT_DIR_ITERATOR It;
+	FS_NODE Node;
+	CHAR16 EntryName[FAT_NAME_MAX + 1];
+	UINT8* e;
+	UINT64 ValidSize = 0;
+	UINTN i, NameLength = 0, NamePos = 0, Secondary = 0;
+	BOOLEAN IsDirectory = FALSE;
+
+	ZeroMem(&Node, sizeof(Node));
+	InitDirIterator(Volume, &It, Dir);
+	while (Lookup->NumLeft > 0) {
+		Status = NextDirEntry(Volume, &It, &e);
+		if (Status == EFI_NOT_FOUND)
+			break;
+		if (EFI_ERROR(Status))
+			return Status;
+		if (e[0] == 0x00)
+			break;
+
+		if (Secondary == 0) {
+			// Start of a new entry set. We only care about files and directories.
+			if (e[0] != EXFAT_ENTRY_FILE || e[1] < 2)
+				continue;
+			Secondary = e[1];
+			IsDirectory = (READ_LE16(&e[4]) & FAT_ATTR_DIRECTORY) ? TRUE : FALSE;
+			NameLength = 0;
+			NamePos = 0;
+			continue;
+		}
+		Secondary--;
+
+		if (e[0] == EXFAT_ENTRY_STREAM && NameLength == 0) {
+			NameLength = e[3];
+			if (NameLength == 0) {
+				Secondary = 0;
+				continue;
+			}
+			Node.Contiguous = (e[1] & EXFAT_NO_FAT_CHAIN) ? TRUE : FALSE;
+			ValidSize = READ_LE64(&e[8]);
+			Node.Cluster = READ_LE32(&e[20]);
+			Node.Size = READ_LE64(&e[24]);
+			Node.IsDirectory = IsDirectory;
+		} else if (e[0] == EXFAT_ENTRY_NAME && NameLength != 0) {
+			for (i = 0; i < EXFAT_NAME_CHARS && NamePos < NameLength; i++)
+				EntryName[NamePos++] = READ_LE16(&e[2 + 2 * i]);
+		} else if (NameLength == 0 || NamePos < NameLength) {
+			// Malformed entry set
+			Secondary = 0;
+			continue;
+		}
+
+		if (NameLength != 0 && NamePos == NameLength) {
+			EntryName[NamePos] = L'\0';
+			// Prevent a match on the remaining secondary entries of this set
+			NameLength = 0;
+			NamePos = 1;
+			// The data past the valid size is undefined on disk, and reads as zeroes
+			MatchNames(Lookup, EntryName, &Node,
+				(!Node.IsDirectory && ValidSize != Node.Size) ? EFI_UNSUPPORTED : EFI_SUCCESS);
+		}
+	}
+	return EFI_SUCCESS;
+}
+
+/**
+  Look up several names in a directory of a FAT or exFAT volume. Only the names
+  which result is EFI_NOT_FOUND on input are looked up.
+  See LookupVolumeNames() for the parameters.
+
+  @retval EFI_SUCCESS           The directory was read.
+  @retval other                 The directory could not be read.
+**/
+EFI_STATUS FatLookupNames(
+	IN FS_VOLUME* Volume,
+	IN CONST FS_NODE* Dir,
+	IN CONST CHAR16* CONST* Names,
+	IN CONST UINTN NumNames,
+	OUT FS_NODE* Nodes,
+	IN OUT EFI_STATUS* Results
+)
+{
+	EFI_STATUS Status;
+	FAT_LOOKUP Lookup = { 0 };
+	ARENA_MARK Mark;
+	UINTN i, b;
+
+	Lookup.Names = Names;
+	Lookup.NumNames = NumNames;
+	Lookup.Nodes = Nodes;
+	Lookup.Results = Results;
+	for (i = 0; i < NumNames; i++) {
+		if (Results[i] == EFI_NOT_FOUND)
+			Lookup.NumLeft++;
+	}
+	if (!Dir->IsDirectory || Lookup.NumLeft == 0)
+		return EFI_SUCCESS;
+
+	// Hash the names, unless there are only a few of them, so that each entry
+	// from the directory doesn't have to be compared with all the names.
+	Mark = ArenaGetMark();
+	if (Lookup.NumLeft >= FAT_LOOKUP_HASH_MIN) {
+		for (Lookup.NumBuckets = 16; Lookup.NumBuckets < 2 * Lookup.NumLeft; Lookup.NumBuckets *= 2);
+		Lookup.Bucket = ArenaAllocate(Lookup.NumBuckets * sizeof(UINTN));
+		Lookup.Next = ArenaAllocate(NumNames * sizeof(UINTN));
+		if (Lookup.Bucket == NULL || Lookup.Next == NULL) {
+			// Comparing all the names gives the same result
+			Lookup.Bucket = NULL;
+		} else {
+			SetMem(Lookup.Bucket, Lookup.NumBuckets * sizeof(UINTN), 0xff);
+			for (i = NumNames; i-- > 0; ) {
+				if (Results[i] != EFI_NOT_FOUND)
+					continue;
+				b = HashName(&Lookup, Names[i]);
+				Lookup.Next[i] = Lookup.Bucket[b];
+				Lookup.Bucket[b] = i;
+			}
+		}
+	}
+
+	Status = (Volume->Type == FS_TYPE_EXFAT) ? ExFatFindEntries(Volume, Dir, &Lookup) :
+		FatFindEntries(Volume, Dir, &Lookup);
+	ArenaRelease(Mark);
+	return Status;
+}
+
+/**
+  Resolve a file to the list of extents holding its data on a FAT or exFAT volume.
+  See GetFileExtents() for the parameters and return values.
+**/
+EFI_STATUS FatGetFileExtents(
+	IN FS_VOLUME* Volume,
+	IN CONST FS_NODE* Node,
+	OUT FILE_EXTENT** Extents,
+	OUT UINTN* NumExtents,
+	OUT UINT64* FileSize
+)
+{
+	EFI_STATUS Status;
+	UINT64 Remaining;
+	UINT32 Cluster, Next, Count;
+
+	if (Node->IsDirectory)
+		return EFI_UNSUPPORTED;
+
+	*FileSize = Node->Size;
+	if (Node->Size == 0)
+		return EFI_SUCCESS;
+
+	// Convert the cluster allocation into contiguous runs
+	Cluster = Node->Cluster;
+	for (Remaining = Node->Size, Count = 0; Remaining > 0; Count++) {
+		if (!IsValidCluster(Volume, Cluster) || Count >= Volume->NumClusters)
+			return EFI_VOLUME_CORRUPTED;
+		Status = AddFileExtent(Extents, NumExtents, ClusterOffset(Volume, Cluster), Volume->ClusterSize);
+		if (EFI_ERROR(Status))
+			return Status;
+		Remaining -= MIN(Remaining, Volume->ClusterSize);
+		if (Remaining == 0)
+			break;
+		if (Node->Contiguous) {
+			Cluster++;
+		} else {
+			Status = GetNextCluster(Volume, Cluster, &Next);
+			if (EFI_ERROR(Status))
+				return Status;
+			if (Next == FAT_CLUSTER_END)
+				return EFI_VOLUME_CORRUPTED;
+			Cluster = Next;
+		}
+	}
+	return EFI_SUCCESS;
+}
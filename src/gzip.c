@@ -0,0 +1,573 @@
+/*
+ * uefi-md5sum: UEFI MD5Sum validator - gzip decompression
+ * Copyright © 2024 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "boot.h"
+
+/* Size of the history that DEFLATE matches can reference (RFC 1951) */
+#define GZIP_WINDOW_SIZE    32768
+
+/* Size of the buffer that the compressed data is read into */
+#define GZIP_INPUT_SIZE     (64 * 1024)
+
+/* Number of bits of a Huffman code that are resolved through a single lookup */
+#define GZIP_FAST_BITS      10
+
+/* Flags from the gzip header (RFC 1952) */
+#define GZIP_FLAG_FHCRC     0x02
+#define GZIP_FLAG_FEXTRA    0x04
+#define GZIP_FLAG_FNAME     0x08
+#define GZIP_FLAG_FCOMMENT  0x10
+#define GZIP_FLAG_RESERVED  0xE0
+
+/* Decompression state, between the calls to ReadGzipStream() */
+#define GZIP_STATE_BLOCK    0       /* At the start of a block, or of the trailer after the last one */
+#define GZIP_STATE_STORED   1       /* Copying the data of a stored block */
+#define GZIP_STATE_CODES    2       /* Decoding the symbols of a compressed block */
+#define GZIP_STATE_MATCH    3       /* Copying the data of a match */
+#define GZIP_STATE_DONE     4       /* The trailer was validated */
+
+/* Canonical Huffman code, that can be decoded one bit at a time or through a lookup */
+typedef struct {
+	UINT16      Count[16];      /* The number of codes of each length */
+	UINT16      Symbol[288];    /* The symbols, in the order of their codes */
+	UINT16      Fast[1 << GZIP_FAST_BITS];  /* The length and symbol of the codes of up to GZIP_FAST_BITS bits, or 0 */
+} HUFFMAN_CODE;
+
+struct _GZIP_STREAM {
+	EFI_FILE_HANDLE     File;
+	UINT8*              Input;
+	UINTN               InputPos;
+	UINTN               InputSize;
+	UINT64              BitBuffer;
+	UINTN               NumBits;
+	UINT8*              Window;
+	UINTN               WindowPos;
+	UINTN               State;      /* One of the GZIP_STATE_### values */
+	BOOLEAN             LastBlock;
+	UINTN               Remaining;  /* The bytes left to copy from a stored block or a match */
+	UINTN               Distance;   /* The distance of the match being copied */
+	UINT32              Crc;
+	UINT64              Total;      /* The amount of data that was decompressed */
+	EFI_STATUS          Status;     /* Errors are final, and reported by every subsequent read */
+	HUFFMAN_CODE        LitLen;
+	HUFFMAN_CODE        Dist;
+};
+
+/* Base values and extra bits of the length and distance symbols */
+STATIC CONST UINT16 LengthBase[29] = {
+	3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+	35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+STATIC CONST UINT8 LengthExtra[29] = {
+	0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+	3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+STATIC CONST UINT16 DistBase[30] = {
+	1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+	257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
+};
+STATIC CONST UINT8 DistExtra[30] = {
+	0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+	7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+
+/* Order in which the lengths of the code length code are stored */
+STATIC CONST UINT8 CodeLengthOrder[19] = {
+	16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15
+};
+
+/* CRC-32 table, for the polynomial used by gzip */
+STATIC UINT32 CrcTable[256];
+
+/* Update a CRC-32 with the content of a buffer */
+STATIC UINT32 UpdateCrc(
+	IN UINT32 Crc,
+	IN CONST UINT8* Data,
+	IN CONST UINTN Size
+)
+{
+	UINTN i;
+
+	Crc = ~Crc;
+	for (i = 0; i < Size; i++)
+		Crc = CrcTable[(Crc ^ Data[i]) & 0xFF] ^ (Crc >> 8);
+	return ~Crc;
+}
+
+/* Read more compressed data, returning FALSE if there is none left */
+STATIC BOOLEAN FillInput(
+	IN OUT GZIP_STREAM* Stream
+)
+{
+	EFI_STATUS Status;
+	UINTN Size = GZIP_INPUT_SIZE;
+
+	if (EFI_ERROR(Stream->Status))
+		return FALSE;
+	Status = Stream->File->Read(Stream->File, &Size, Stream->Input);
+	if (EFI_ERROR(Status)) {
+		Stream->Status = Status;
+		return FALSE;
+	}
+	Stream->InputPos = 0;
+	Stream->InputSize = Size;
+	return (Size != 0);
+}
+
+/* Make sure that at least Count bits (up to 56) are available, unless the input ended */
+STATIC BOOLEAN NeedBits(
+	IN OUT GZIP_STREAM* Stream,
+	IN CONST UINTN Count
+)
+{
+	while (Stream->NumBits < Count) {
+		if (Stream->InputPos >= Stream->InputSize && !FillInput(Stream))
+			return FALSE;
+		Stream->BitBuffer |= (UINT64)Stream->Input[Stream->InputPos++] << Stream->NumBits;
+		Stream->NumBits += 8;
+	}
+	return TRUE;
+}
+
+/* Consume Count bits (up to 32), that NeedBits() made available */
+STATIC UINT32 GetBits(
+	IN OUT GZIP_STREAM* Stream,
+	IN CONST UINTN Count
+)
+{
+	UINT32 Value = (UINT32)(Stream->BitBuffer & ((1ULL << Count) - 1));
+
+	Stream->BitBuffer >>= Count;
+	Stream->NumBits -= Count;
+	return Value;
+}
+
+/* Read Count bits (up to 32), or flag the stream as corrupted if the input ended */
+STATIC UINT32 ReadBits(
+	IN OUT GZIP_STREAM* Stream,
+	IN CONST UINTN Count
+)
+{
+	if (!NeedBits(Stream, Count)) {
+		if (!EFI_ERROR(Stream->Status))
+			Stream->Status = EFI_VOLUME_CORRUPTED;
+		return 0;
+	}
+	return GetBits(Stream, Count);
+}
+
+/**
+  Set up a canonical Huffman code from the length of the code of each symbol.
+  As for zlib, incomplete codes are accepted, and their unused codes are then
+  reported as invalid when decoded.
+
+  @param[out] Code              A pointer to the HUFFMAN_CODE to set up.
+  @param[in]  Lengths           The length of the code of each symbol, or 0 if the symbol is not used.
+  @param[in]  NumSymbols        The number of symbols.
+
+  @retval TRUE if the code is valid, FALSE if it is over-subscribed.
+**/
+STATIC BOOLEAN BuildCode(
+	OUT HUFFMAN_CODE* Code,
+	IN CONST UINT8* Lengths,
+	IN CONST UINTN NumSymbols
+)
+{
+	UINT16 Offset[16], Next[16];
+	UINTN i, Len, Symbol, Reversed;
+	INTN Left = 1;
+
+	ZeroMem(Code->Count, sizeof(Code->Count));
+	ZeroMem(Code->Fast, sizeof(Code->Fast));
+	for (Symbol = 0; Symbol < NumSymbols; Symbol++)
+		Code->Count[Lengths[Symbol]]++;
+	for (Len = 1; Len < 16; Len++) {
+		Left = (Left << 1) - Code->Count[Len];
+		if (Left < 0)
+			return FALSE;
+	}
+
+	// Sort the symbols by code, and compute the first code of each length
+	Offset[1] = 0;
+	Next[1] = 0;
+	for (Len = 1; Len < 15; Len++) {
+		Offset[Len + 1] = Offset[Len] + Code->Count[Len];
+		Next[Len + 1] = (Next[Len] + Code->Count[Len]) << 1;
+	}
+	for (Symbol = 0; Symbol < NumSymbols; Symbol++) {
+		Len = Lengths[Symbol];
+		if (Len == 0)
+			continue;
+		Code->Symbol[Offset[Len]++] = (UINT16)Symbol;
+		if (Len > GZIP_FAST_BITS) {
+			Next[Len]++;
+			continue;
+		}
+		// The codes are stored from their most significant bit, in the
+		// order that we read the bits, so the lookup uses them reversed.
+		for (Reversed = 0, i = 0; i < Len; i++)
+			Reversed |= ((Next[Len] >> i) & 1) << (Len - 1 - i);
+		Next[Len]++;
+		for (i = Reversed; i < ARRAY_SIZE(Code->Fast); i += (UINTN)1 << Len)
+			Code->Fast[i] = (UINT16)((Len << 9) | Symbol);
+	}
+	return TRUE;
+}
+
+/* Decode a symbol, returning -1 if the code is invalid or if the input ended */
+STATIC INTN DecodeSymbol(
+	IN OUT GZIP_STREAM* Stream,
+	IN CONST HUFFMAN_CODE* Code
+)
+{
+	UINTN Len, Entry, Index = 0;
+	INTN Value = 0, First = 0, Count;
+
+	// Near the end of the input, there may be fewer bits than the longest code
+	NeedBits(Stream, 15);
+	Entry = Code->Fast[Stream->BitBuffer & ((1 << GZIP_FAST_BITS) - 1)];
+	if (Entry != 0 && (Entry >> 9) <= Stream->NumBits) {
+		GetBits(Stream, Entry >> 9);
+		return (INTN)(Entry & 0x1FF);
+	}
+
+	// Longer codes are decoded one bit at a time
+	for (Len = 1; Len < 16 && Stream->NumBits != 0; Len++) {
+		Value |= (INTN)GetBits(Stream, 1);
+		Count = Code->Count[Len];
+		if (Value - First < Count)
+			return Code->Symbol[Index + (Value - First)];
+		Index += Count;
+		First = (First + Count) << 1;
+		Value <<= 1;
+	}
+	return -1;
+}
+
+/* Read the Huffman codes of a compressed block, that uses dynamic codes */
+STATIC BOOLEAN ReadDynamicCodes(
+	IN OUT GZIP_STREAM* Stream
+)
+{
+	UINT8 Lengths[286 + 30];
+	UINTN i, NumLitLen, NumDist, NumCodeLen, Repeat;
+	INTN Symbol;
+	UINT8 Len;
+
+	NumLitLen = ReadBits(Stream, 5) + 257;
+	NumDist = ReadBits(Stream, 5) + 1;
+	NumCodeLen = ReadBits(Stream, 4) + 4;
+	if (EFI_ERROR(Stream->Status) || NumLitLen > 286 || NumDist > 30)
+		return FALSE;
+
+	// The code lengths are themselves Huffman coded, which uses the
+	// distance code until the actual one can be set up.
+	ZeroMem(Lengths, sizeof(Lengths));
+	for (i = 0; i < NumCodeLen; i++)
+		Lengths[CodeLengthOrder[i]] = (UINT8)ReadBits(Stream, 3);
+	if (EFI_ERROR(Stream->Status) || !BuildCode(&Stream->Dist, Lengths, 19))
+		return FALSE;
+
+	for (i = 0; i < NumLitLen + NumDist; ) {
+		Symbol = DecodeSymbol(Stream, &Stream->Dist);
+		if (Symbol < 0)
+			return FALSE;
+		if (Symbol < 16) {
+			Lengths[i++] = (UINT8)Symbol;
+			continue;
+		}
+		if (Symbol == 16) {
+			if (i == 0)
+				return FALSE;
+			Len = Lengths[i - 1];
+			Repeat = 3 + ReadBits(Stream, 2);
+		} else {
+			Len = 0;
+			Repeat = (Symbol == 17) ? 3 + ReadBits(Stream, 3) : 11 + ReadBits(Stream, 7);
+		}
+		if (EFI_ERROR(Stream->Status) || i + Repeat > NumLitLen + NumDist)
+			return FALSE;
+		while (Repeat-- > 0)
+			Lengths[i++] = Len;
+	}
+
+	// A block always has an end of block code
+	if (Lengths[256] == 0)
+		return FALSE;
+	return BuildCode(&Stream->LitLen, Lengths, NumLitLen) &&
+		BuildCode(&Stream->Dist, &Lengths[NumLitLen], NumDist);
+}
+
+/* Set up the codes of a compressed block, that uses the fixed codes */
+STATIC VOID SetFixedCodes(
+	IN OUT GZIP_STREAM* Stream
+)
+{
+	UINT8 Lengths[288];
+	UINTN i;
+
+	for (i = 0; i < 288; i++)
+		Lengths[i] = (i < 144) ? 8 : ((i < 256) ? 9 : ((i < 280) ? 7 : 8));
+	BuildCode(&Stream->LitLen, Lengths, 288);
+	for (i = 0; i < 30; i++)
+		Lengths[i] = 5;
+	BuildCode(&Stream->Dist, Lengths, 30);
+}
+
+/* Read the header of the next block, or the trailer of the stream after the last block */
+STATIC VOID ReadBlockHeader(
+	IN OUT GZIP_STREAM* Stream
+)
+{
+	UINT32 Crc, Size, Len;
+
+	if (Stream->LastBlock) {
+		// The trailer starts on a byte boundary
+		GetBits(Stream, Stream->NumBits % 8);
+		Crc = ReadBits(Stream, 32);
+		Size = ReadBits(Stream, 32);
+		if (!EFI_ERROR(Stream->Status) && (Crc != Stream->Crc || Size != (UINT32)Stream->Total))
+			Stream->Status = EFI_CRC_ERROR;
+		Stream->State = GZIP_STATE_DONE;
+		return;
+	}
+
+	Stream->LastBlock = (ReadBits(Stream, 1) != 0);
+	switch (ReadBits(Stream, 2)) {
+	case 0:
+		GetBits(Stream, Stream->NumBits % 8);
+		Len = ReadBits(Stream, 16);
+		if (ReadBits(Stream, 16) != (~Len & 0xFFFF) && !EFI_ERROR(Stream->Status))
+			Stream->Status = EFI_VOLUME_CORRUPTED;
+		Stream->Remaining = Len;
+		Stream->State = GZIP_STATE_STORED;
+		break;
+	case 1:
+		SetFixedCodes(Stream);
+		Stream->State = GZIP_STATE_CODES;
+		break;
+	case 2:
+		if (!ReadDynamicCodes(Stream) && !EFI_ERROR(Stream->Status))
+			Stream->Status = EFI_VOLUME_CORRUPTED;
+		Stream->State = GZIP_STATE_CODES;
+		break;
+	default:
+		if (!EFI_ERROR(Stream->Status))
+			Stream->Status = EFI_VOLUME_CORRUPTED;
+		break;
+	}
+}
+
+/**
+  Open a gzip compressed file as a stream, that ReadGzipStream() decompresses.
+  Only the first member of the file is decompressed, and the size of the data is
+  taken from the trailer of the file, which must fit in 32 bits.
+
+  @param[in]  File              A handle to the compressed file, positioned at its start.
+  @param[in]  FileSize          The size of the compressed file.
+  @param[out] Stream            A pointer to receive the GZIP_STREAM, allocated from the run arena.
+  @param[out] Size              A pointer to receive the size of the decompressed data.
+
+  @retval EFI_SUCCESS           The stream was opened.
+  @retval EFI_INVALID_PARAMETER One or more of the input parameters are invalid.
+  @retval EFI_OUT_OF_RESOURCES  A memory allocation error occurred.
+  @retval EFI_VOLUME_CORRUPTED  The file is not a valid gzip file.
+  @retval EFI_UNSUPPORTED       The file uses a compression method other than DEFLATE.
+  @retval Other                 The file could not be read.
+**/
+EFI_STATUS OpenGzipStream(
+	IN CONST EFI_FILE_HANDLE File,
+	IN CONST UINT64 FileSize,
+	OUT GZIP_STREAM** Stream,
+	OUT UINT64* Size
+)
+{
+	EFI_STATUS Status;
+	UINT32 Crc, Flags;
+	UINT8 Trailer[4];
+	UINTN i, j, Len;
+
+	if (File == NULL || Stream == NULL || Size == NULL)
+		return EFI_INVALID_PARAMETER;
+	*Stream = NULL;
+	// Header, empty block and trailer
+	if (FileSize < 10 + 2 + 8)
+		return EFI_VOLUME_CORRUPTED;
+
+	// The size of the data is at the very end of the file
+	Len = sizeof(Trailer);
+	Status = File->SetPosition(File, FileSize - sizeof(Trailer));
+	if (!EFI_ERROR(Status))
+		Status = File->Read(File, &Len, Trailer);
+	if (!EFI_ERROR(Status) && Len != sizeof(Trailer))
+		Status = EFI_END_OF_FILE;
+	if (!EFI_ERROR(Status))
+		Status = File->SetPosition(File, 0);
+	if (EFI_ERROR(Status))
+		return Status;
+	*Size = READ_LE32(Trailer);
+
+	*Stream = ArenaAllocate(sizeof(GZIP_STREAM));
+	if (*Stream == NULL)
+		return EFI_OUT_OF_RESOURCES;
+	ZeroMem(*Stream, sizeof(GZIP_STREAM));
+	(*Stream)->File = File;
+	(*Stream)->Input = ArenaAllocate(GZIP_INPUT_SIZE);
+	(*Stream)->Window = ArenaAllocate(GZIP_WINDOW_SIZE);
+	if ((*Stream)->Input == NULL || (*Stream)->Window == NULL) {
+		*Stream = NULL;
+		return EFI_OUT_OF_RESOURCES;
+	}
+
+	if (CrcTable[1] == 0) {
+		for (i = 0; i < ARRAY_SIZE(CrcTable); i++) {
+			for (Crc = (UINT32)i, j = 0; j < 8; j++)
+				Crc = (Crc & 1) ? (Crc >> 1) ^ 0xEDB88320 : Crc >> 1;
+			CrcTable[i] = Crc;
+		}
+	}
+
+	// Skip the header, along with its optional fields
+	Status = EFI_SUCCESS;
+	if (ReadBits(*Stream, 16) != 0x8B1F)
+		Status = EFI_VOLUME_CORRUPTED;
+	else if (ReadBits(*Stream, 8) != 8)
+		Status = EFI_UNSUPPORTED;
+	Flags = ReadBits(*Stream, 8);
+	if (Flags & GZIP_FLAG_RESERVED)
+		Status = EFI_VOLUME_CORRUPTED;
+	// Modification time, extra flags and OS
+	for (i = 0; i < 6; i++)
+		ReadBits(*Stream, 8);
+	if (Flags & GZIP_FLAG_FEXTRA) {
+		for (Len = ReadBits(*Stream, 16); Len > 0 && !EFI_ERROR((*Stream)->Status); Len--)
+			ReadBits(*Stream, 8);
+	}
+	if (Flags & GZIP_FLAG_FNAME)
+		while (ReadBits(*Stream, 8) != 0 && !EFI_ERROR((*Stream)->Status));
+	if (Flags & GZIP_FLAG_FCOMMENT)
+		while (ReadBits(*Stream, 8) != 0 && !EFI_ERROR((*Stream)->Status));
+	if (Flags & GZIP_FLAG_FHCRC)
+		ReadBits(*Stream, 16);
+	if (EFI_ERROR((*Stream)->Status))
+		Status = (*Stream)->Status;
+	if (EFI_ERROR(Status))
+		*Stream = NULL;
+	return Status;
+}
+
+/**
+  Read decompressed data from a gzip stream. The data is validated against the
+  CRC-32 and size from the trailer, once the end of the stream has been reached,
+  which may require an extra read after all the data was returned.
+
+  @param[in/out] Stream         A pointer to the GZIP_STREAM, set up by OpenGzipStream().
+  @param[out]    Buffer         A pointer to the buffer to receive the data.
+  @param[in/out] Size           On input, the size of the buffer. On output, the amount of
+                                data that was read, which is only less than the size of the
+                                buffer at the end of the stream, or on error.
+
+  @retval EFI_SUCCESS           The data was read.
+  @retval EFI_INVALID_PARAMETER One or more of the input parameters are invalid.
+  @retval EFI_VOLUME_CORRUPTED  The compressed data is invalid.
+  @retval EFI_CRC_ERROR         The data does not match the trailer of the stream.
+  @retval Other                 The compressed file could not be read.
+**/
+EFI_STATUS ReadGzipStream(
+	IN OUT GZIP_STREAM* Stream,
+	OUT UINT8* Buffer,
+	IN OUT UINTN* Size
+)
+{
+	UINTN Pos = 0, CrcPos = 0, Len, i;
+	INTN Symbol;
+	UINT8 Byte;
+
+	if (Stream == NULL || Buffer == NULL || Size == NULL)
+		return EFI_INVALID_PARAMETER;
+
+	while (Pos < *Size && Stream->State != GZIP_STATE_DONE && !EFI_ERROR(Stream->Status)) {
+		switch (Stream->State) {
+		case GZIP_STATE_BLOCK:
+			// The CRC must cover all the data before we check the trailer
+			Stream->Crc = UpdateCrc(Stream->Crc, &Buffer[CrcPos], Pos - CrcPos);
+			CrcPos = Pos;
+			ReadBlockHeader(Stream);
+			break;
+		case GZIP_STATE_STORED:
+			Len = MIN(Stream->Remaining, *Size - Pos);
+			for (i = 0; i < Len; i++) {
+				Byte = (UINT8)ReadBits(Stream, 8);
+				Buffer[Pos++] = Byte;
+				Stream->Window[Stream->WindowPos++ % GZIP_WINDOW_SIZE] = Byte;
+			}
+			Stream->Total += Len;
+			Stream->Remaining -= Len;
+			if (Stream->Remaining == 0)
+				Stream->State = GZIP_STATE_BLOCK;
+			break;
+		case GZIP_STATE_MATCH:
+			Len = MIN(Stream->Remaining, *Size - Pos);
+			for (i = 0; i < Len; i++) {
+				Byte = Stream->Window[(Stream->WindowPos - Stream->Distance) % GZIP_WINDOW_SIZE];
+				Buffer[Pos++] = Byte;
+				Stream->Window[Stream->WindowPos++ % GZIP_WINDOW_SIZE] = Byte;
+			}
+			Stream->Total += Len;
+			Stream->Remaining -= Len;
+			if (Stream->Remaining == 0)
+				Stream->State = GZIP_STATE_CODES;
+			break;
+		case GZIP_STATE_CODES:
+			Symbol = DecodeSymbol(Stream, &Stream->LitLen);
+			if (Symbol < 0 || Symbol > 285) {
+				Stream->Status = EFI_ERROR(Stream->Status) ? Stream->Status : EFI_VOLUME_CORRUPTED;
+			} else if (Symbol < 256) {
+				Buffer[Pos++] = (UINT8)Symbol;
+				Stream->Window[Stream->WindowPos++ % GZIP_WINDOW_SIZE] = (UINT8)Symbol;
+				Stream->Total++;
+			} else if (Symbol == 256) {
+				Stream->State = GZIP_STATE_BLOCK;
+			} else {
+				Symbol -= 257;
+				Stream->Remaining = LengthBase[Symbol] + ReadBits(Stream, LengthExtra[Symbol]);
+				Symbol = DecodeSymbol(Stream, &Stream->Dist);
+				if (Symbol < 0 || Symbol > 29) {
+					Stream->Status = EFI_ERROR(Stream->Status) ? Stream->Status : EFI_VOLUME_CORRUPTED;
+					break;
+				}
+				Stream->Distance = DistBase[Symbol] + ReadBits(Stream, DistExtra[Symbol]);
+				// A match can't reference data from before the start of the stream
+				if (Stream->Distance > Stream->Total && !EFI_ERROR(Stream->Status))
+					Stream->Status = EFI_VOLUME_CORRUPTED;
+				Stream->State = GZIP_STATE_MATCH;
+			}
+			break;
+		default:
+			break;
+		}
+	}
+	Stream->Crc = UpdateCrc(Stream->Crc, &Buffer[CrcPos], Pos - CrcPos);
+
+	if (EFI_ERROR(Stream->Status)) {
+		*Size = 0;
+		return Stream->Status;
+	}
+	*Size = Pos;
+	return EFI_SUCCESS;
+}
@@ -28,6 +28,12 @@
 
 #include "boot.h"
 
+#if defined(_MSC_VER)
+#include <intrin.h>
+#elif (defined(__GNUC__) || defined(__clang__)) && defined(__x86_64__)
+#include <cpuid.h>
+#endif
+
 /*
  * Prefetch 64 bytes at address m, for read-only operation
  * We account for these built-in calls doing nothing if the
@@ -44,6 +50,63 @@
 #endif
 #endif
 
+/*
+ * Optimized assembly implementations of the MD5 transform are available for
+ * x64 and for AArch64 (GCC only). These process multiple consecutive blocks
+ * and read the data directly, without going through a local copy.
+ * Define MD5_NO_ASM to only use the C implementation.
+ */
+#if !defined(MD5_NO_ASM) && (defined(_M_X64) || defined(__x86_64__) || \
+	(defined(__aarch64__) && !defined(_MSC_VER)))
+#define MD5_ASM
+extern VOID EFIAPI Md5TransformAsm(UINT32* State, CONST UINT8* Data, UINTN NumBlocks);
+#endif
+
+/*
+ * Architecture specific tuning of the C MD5 transform:
+ * - The two terms of F2(x, y, z) = (x & z) | (y & ~z) never have bits in
+ *   common, so they can be added separately, which the compiler then folds into
+ *   the step additions. As (y & ~z) doesn't depend on the previous step, this
+ *   takes two instructions off the critical path, and it is a single
+ *   instruction on CPUs that have an and-not (bic on ARM, andn on LoongArch or
+ *   RISC-V with Zbb). We don't do it on IA32, which is short on registers, or
+ *   RISC-V without Zbb, where the extra 'not' costs more than it saves on
+ *   single issue cores.
+ * - F1 and F4 are left as is, since they already only have two operations that
+ *   depend on the previous step, and splitting F1 the same way doesn't help.
+ * - The rotations use the native rotate instruction where there is one (ror,
+ *   rotri.w, roriw with Zbb), and get merged into the following addition through
+ *   the barrel shifter on 32-bit ARM. GCC and Clang recognize the shift idiom for
+ *   this, whereas MSVC needs the intrinsic.
+ */
+#if defined(_M_X64) || defined(__x86_64__) || defined(_M_ARM64) || defined(__aarch64__) || \
+	defined(_M_ARM) || defined(__arm__) || defined(__loongarch__) || \
+	(defined(__riscv) && defined(__riscv_zbb))
+#define MD5_SPLIT_F2
+#endif
+#if defined(_MSC_VER)
+#define MD5_ROTL32(w, s)    _rotl(w, s)
+#else
+#define MD5_ROTL32(w, s)    ((w) << (s) | (w) >> (32 - (s)))
+#endif
+
+/* MD5 transform, processing NumBlocks consecutive blocks */
+typedef VOID (EFIAPI *MD5_TRANSFORM)(
+	IN OUT UINT32* State,
+	IN CONST UINT8* Data,
+	IN UINTN NumBlocks
+);
+
+/* Single buffer MD5 kernel */
+typedef struct {
+	CONST CHAR16*       Name;
+	UINT32              Features;   /* The CPU_FEATURE_### flags required by this kernel */
+	MD5_TRANSFORM       Transform;
+} MD5_KERNEL;
+
+/* Number of blocks that are hashed by each kernel during the timing probe */
+#define MD5_PROBE_BLOCKS    256
+
 /* Hash context initialisation */
 STATIC VOID Md5Init(HASH_CONTEXT* Context)
 {
@@ -55,14 +118,14 @@ STATIC VOID Md5Init(HASH_CONTEXT* Context)
 }
 
 /* Transform the message X which consists of 16 32-bit-words (MD5) */
-STATIC VOID Md5Transform(HASH_CONTEXT* Context, CONST UINT8* Data)
+STATIC VOID Md5Transform(UINT32* State, CONST UINT8* Data)
 {
 	UINT32 a, b, c, d, x[16];
 
-	a = Context->State[0];
-	b = Context->State[1];
-	c = Context->State[2];
-	d = Context->State[3];
+	a = State[0];
+	b = State[1];
+	c = State[2];
+	d = State[3];
 
 #ifdef BIG_ENDIAN_HOST
 	{
@@ -80,12 +143,16 @@ STATIC VOID Md5Transform(HASH_CONTEXT* Context, CONST UINT8* Data)
 #endif
 
 #define F1(x, y, z) (z ^ (x & (y ^ z)))
+#if defined(MD5_SPLIT_F2)
+#define F2(x, y, z) ((x & z) + (y & ~z))
+#else
 #define F2(x, y, z) F1(z, x, y)
+#endif
 #define F3(x, y, z) (x ^ y ^ z)
 #define F4(x, y, z) (y ^ (x | ~z))
 
 #define MD5STEP(f, w, x, y, z, Data, s) do { \
-	( w += f(x, y, z) + Data,  w = w<<s | w>>(32-s),  w += x ); } while(0)
+	( w += f(x, y, z) + Data,  w = MD5_ROTL32(w, s),  w += x ); } while(0)
 
 	MD5STEP(F1, a, b, c, d, x[0] + 0xd76aa478, 7);
 	MD5STEP(F1, d, a, b, c, x[1] + 0xe8c7b756, 12);
@@ -161,10 +228,45 @@ STATIC VOID Md5Transform(HASH_CONTEXT* Context, CONST UINT8* Data)
 	#undef F4
 
 	/* Update chaining vars */
-	Context->State[0] += a;
-	Context->State[1] += b;
-	Context->State[2] += c;
-	Context->State[3] += d;
+	State[0] += a;
+	State[1] += b;
+	State[2] += c;
+	State[3] += d;
+}
+
+/* Transform NumBlocks consecutive blocks of data, using the C implementation (MD5) */
+STATIC VOID EFIAPI Md5TransformC(UINT32* State, CONST UINT8* Data, UINTN NumBlocks)
+{
+	while (NumBlocks-- > 0) {
+		PREFETCH64(Data + MD5_BLOCKSIZE);
+		Md5Transform(State, Data);
+		Data += MD5_BLOCKSIZE;
+	}
+}
+
+/* All the single buffer kernels for this architecture, in order of preference */
+STATIC CONST MD5_KERNEL Md5Kernels[] = {
+#if defined(MD5_ASM) && (defined(_M_X64) || defined(__x86_64__))
+	{ L"x64 assembly", 0, Md5TransformAsm },
+#elif defined(MD5_ASM)
+	{ L"AArch64 assembly", 0, Md5TransformAsm },
+#endif
+	{ L"C", 0, Md5TransformC },
+};
+
+/*
+ * The MD5 kernels currently in use. These default to the C implementation
+ * and no multi-buffer hashing, until Md5SelectKernels() has been called.
+ */
+STATIC struct {
+	CONST MD5_KERNEL*       Kernel;
+	CONST MD5_MB_ENGINE*    Engine;
+} Md5Dispatch = { &Md5Kernels[ARRAY_SIZE(Md5Kernels) - 1], NULL };
+
+/* Transform NumBlocks consecutive blocks of data, using the selected kernel (MD5) */
+STATIC __inline VOID Md5TransformBlocks(HASH_CONTEXT* Context, CONST UINT8* Data, UINTN NumBlocks)
+{
+	Md5Dispatch.Kernel->Transform(Context->State, Data, NumBlocks);
 }
 
 /* Update the message digest with the contents of the buffer (MD5) */
@@ -181,21 +283,20 @@ STATIC VOID Md5Write(HASH_CONTEXT* Context, CONST UINT8* Buffer, UINTN Length)
 
 		Num = MD5_BLOCKSIZE - Num;
 		if (Length < Num) {
-			CopyMem(p, Buffer, Num);
+			CopyMem(p, Buffer, Length);
 			return;
 		}
 		CopyMem(p, Buffer, Num);
-		Md5Transform(Context, Context->Buffer);
+		Md5TransformBlocks(Context, Context->Buffer, 1);
 		Buffer += Num;
 		Length -= Num;
 	}
 
 	/* Process Data in blocksize chunks */
-	while (Length >= MD5_BLOCKSIZE) {
-		PREFETCH64(Buffer + MD5_BLOCKSIZE);
-		Md5Transform(Context, Buffer);
-		Buffer += MD5_BLOCKSIZE;
-		Length -= MD5_BLOCKSIZE;
+	if (Length >= MD5_BLOCKSIZE) {
+		Md5TransformBlocks(Context, Buffer, Length / MD5_BLOCKSIZE);
+		Buffer += Length & ~((UINTN)MD5_BLOCKSIZE - 1);
+		Length &= MD5_BLOCKSIZE - 1;
 	}
 
 	/* Handle any remaining bytes of Data. */
@@ -222,7 +323,7 @@ STATIC VOID Md5Final(HASH_CONTEXT* Context)
 	if (Count < 8) {
 		/* Two lots of padding: Pad the first block to blocksize */
 		ZeroMem(p, Count);
-		Md5Transform(Context, Context->Buffer);
+		Md5TransformBlocks(Context, Context->Buffer, 1);
 
 		/* Now fill the next block */
 		ZeroMem(Context->Buffer, MD5_BLOCKSIZE - 8);
@@ -241,7 +342,7 @@ STATIC VOID Md5Final(HASH_CONTEXT* Context)
 	Context->Buffer[MD5_BLOCKSIZE - 2] = (UINT8)(BitCount >> 48);
 	Context->Buffer[MD5_BLOCKSIZE - 1] = (UINT8)(BitCount >> 56);
 
-	Md5Transform(Context, Context->Buffer);
+	Md5TransformBlocks(Context, Context->Buffer, 1);
 
 	p = Context->Buffer;
 #ifdef BIG_ENDIAN_HOST
@@ -256,137 +357,1158 @@ STATIC VOID Md5Final(HASH_CONTEXT* Context)
 #undef X
 }
 
+/* Known answer tests, used to validate the MD5 kernels at startup */
+STATIC CONST CHAR8 Md5KatMessage[] =
+	"12345678901234567890123456789012345678901234567890123456789012345678901234567890";
+STATIC CONST UINT8 Md5KatDigest[2][MD5_HASHSIZE] = {
+	{ 0x57, 0xed, 0xf4, 0xa2, 0x2b, 0xe3, 0xc9, 0x55, 0xac, 0x49, 0xda, 0x2e, 0x21, 0x07, 0xb6, 0x7a },
+	{ 0xd9, 0x85, 0x19, 0xa2, 0x4c, 0x23, 0x8e, 0x7f, 0x24, 0x80, 0x25, 0x35, 0x8c, 0x0e, 0x6f, 0x82 },
+};
+#define MD5_KAT_PATTERN_SIZE    1020
+
+/* Return the CPU_FEATURE_### flags that are supported by the current platform */
+STATIC UINT32 GetCpuFeatures(VOID)
+{
+	UINT32 Features = 0;
+#if defined(_M_X64) || defined(__x86_64__)
+	UINT32 Regs[4] = { 0 };
+	UINT64 Xcr0;
+
+	// SSE2 is part of the x64 baseline
+	Features |= CPU_FEATURE_SSE2;
+
+	// AVX2 requires CPU support, as well as the OS having enabled the YMM state
+#if defined(_MSC_VER)
+	__cpuid((int*)Regs, 0);
+	if (Regs[0] < 7)
+		return Features;
+	__cpuid((int*)Regs, 1);
+#else
+	if (__get_cpuid_max(0, NULL) < 7)
+		return Features;
+	__cpuid(1, Regs[0], Regs[1], Regs[2], Regs[3]);
+#endif
+	// OSXSAVE and AVX
+	if ((Regs[2] & 0x18000000) != 0x18000000)
+		return Features;
+#if defined(_MSC_VER)
+	Xcr0 = _xgetbv(0);
+	__cpuidex((int*)Regs, 7, 0);
+#else
+	{
+		UINT32 Lo, Hi;
+		__asm__ __volatile__ ("xgetbv" : "=a" (Lo), "=d" (Hi) : "c" (0));
+		Xcr0 = ((UINT64)Hi << 32) | Lo;
+	}
+	__cpuid_count(7, 0, Regs[0], Regs[1], Regs[2], Regs[3]);
+#endif
+	// XMM and YMM state enabled, and AVX2
+	if ((Xcr0 & 0x06) == 0x06 && (Regs[1] & 0x20))
+		Features |= CPU_FEATURE_AVX2;
+#elif defined(_M_ARM64) || defined(__aarch64__)
+	UINT64 Pfr0;
+
+	// ID_AA64PFR0_EL1.AdvSIMD is 0xF when Advanced SIMD is not implemented
+#if defined(_MSC_VER)
+	Pfr0 = (UINT64)_ReadStatusReg(ARM64_SYSREG(3, 0, 0, 4, 0));
+#else
+	__asm__ __volatile__ ("mrs %0, id_aa64pfr0_el1" : "=r" (Pfr0));
+#endif
+	if (((Pfr0 >> 20) & 0x0f) != 0x0f)
+		Features |= CPU_FEATURE_NEON;
+#endif
+	return Features;
+}
+
+/* Read a timestamp counter, or return 0 if there isn't one we can use */
+STATIC UINT64 ReadTimestamp(VOID)
+{
+#if defined(_MSC_VER) && (defined(_M_IX86) || defined(_M_X64))
+	return __rdtsc();
+#elif defined(__i386__) || defined(__x86_64__)
+	return __builtin_ia32_rdtsc();
+#elif defined(_MSC_VER) && defined(_M_ARM64)
+	return (UINT64)_ReadStatusReg(ARM64_CNTVCT);
+#elif defined(__aarch64__)
+	UINT64 Counter;
+	__asm__ __volatile__ ("isb; mrs %0, cntvct_el0" : "=r" (Counter) :: "memory");
+	return Counter;
+#else
+	return 0;
+#endif
+}
+
 /**
-  Compute the MD5 hash of a single file.
+  Validate the currently selected single buffer kernel against known answers.
 
-  @param[in]   Root             A file handle to the root directory.
-  @param[in]   Path             A pointer to the CHAR16 string with the target path.
-  @param[in]   Progress         (Optional) A pointer to a PROGRESS_DATA structure. If provided then
-                                the current progress value will be updated by this call.
-  @param[out]  Hash             A pointer to the 16-byte array that is to receive the hash.
+  @param[in]  Buffer   A scratch buffer of at least MD5_KAT_PATTERN_SIZE bytes.
+
+  @retval TRUE if the kernel produced the expected digests, FALSE otherwise.
+**/
+STATIC BOOLEAN Md5SelfTest(
+	IN UINT8* Buffer
+)
+{
+	HASH_CONTEXT Context;
+	UINTN i;
+
+	// RFC 1321 test suite message, which spans more than one block
+	Md5Init(&Context);
+	Md5Write(&Context, (CONST UINT8*)Md5KatMessage, sizeof(Md5KatMessage) - 1);
+	Md5Final(&Context);
+	if (CompareMem(Context.Buffer, Md5KatDigest[0], MD5_HASHSIZE) != 0)
+		return FALSE;
+
+	// Multiple blocks in a single call, followed by two blocks of padding
+	for (i = 0; i < MD5_KAT_PATTERN_SIZE; i++)
+		Buffer[i] = (UINT8)((i * 7) + (i >> 8));
+	Md5Init(&Context);
+	Md5Write(&Context, Buffer, MD5_KAT_PATTERN_SIZE);
+	Md5Final(&Context);
+	return (CompareMem(Context.Buffer, Md5KatDigest[1], MD5_HASHSIZE) == 0);
+}
+
+/**
+  Validate a multi-buffer engine against the currently selected single buffer kernel,
+  using different data and alignment for each lane.
+
+  @param[in]  Engine   The multi-buffer engine to validate.
+  @param[in]  Buffer   A scratch buffer of at least MD5_MAX_LANES * (MD5_BLOCKSIZE + 1) +
+                       MD5_PROBE_BLOCKS * MD5_BLOCKSIZE bytes, filled with arbitrary data.
+
+  @retval TRUE if all the lanes produced the expected state, FALSE otherwise.
+**/
+STATIC BOOLEAN Md5MbSelfTest(
+	IN CONST MD5_MB_ENGINE* Engine,
+	IN CONST UINT8* Buffer
+)
+{
+	HASH_CONTEXT Lanes[MD5_MAX_LANES], Expected, *Context[MD5_MAX_LANES];
+	CONST UINT8* Data[MD5_MAX_LANES];
+	UINTN i;
+
+	for (i = 0; i < Engine->NumLanes; i++) {
+		Md5Init(&Lanes[i]);
+		Context[i] = &Lanes[i];
+		Data[i] = &Buffer[i * (MD5_BLOCKSIZE + 1)];
+	}
+	Engine->Transform(Context, Data, 4);
+	for (i = 0; i < Engine->NumLanes; i++) {
+		Md5Init(&Expected);
+		Md5TransformBlocks(&Expected, Data[i], 4);
+		if (CompareMem(Lanes[i].State, Expected.State, sizeof(Expected.State)) != 0)
+			return FALSE;
+	}
+	return TRUE;
+}
+
+/**
+  Time how long it takes to hash MD5_PROBE_BLOCKS blocks, for each lane, using either
+  a multi-buffer engine or the currently selected single buffer kernel.
+
+  @param[in]  Engine   The multi-buffer engine to time, or NULL for the single buffer kernel.
+  @param[in]  Buffer   A buffer of at least MD5_MAX_LANES * MD5_PROBE_BLOCKS * MD5_BLOCKSIZE bytes.
+
+  @retval The best elapsed time out of a few runs, in timestamp ticks, or 0 if no timer is available.
+**/
+STATIC UINT64 Md5Probe(
+	IN CONST MD5_MB_ENGINE* Engine,
+	IN CONST UINT8* Buffer
+)
+{
+	HASH_CONTEXT Lanes[MD5_MAX_LANES], *Context[MD5_MAX_LANES];
+	CONST UINT8* Data[MD5_MAX_LANES];
+	UINT64 Start, Elapsed, Best = 0;
+	UINTN i, Run;
+
+	for (i = 0; i < MD5_MAX_LANES; i++) {
+		Md5Init(&Lanes[i]);
+		Context[i] = &Lanes[i];
+		Data[i] = &Buffer[i * MD5_PROBE_BLOCKS * MD5_BLOCKSIZE];
+	}
+	// Keep the best of 3 runs, to limit the influence of cache warm up and interrupts
+	for (Run = 0; Run < 3; Run++) {
+		Start = ReadTimestamp();
+		if (Engine != NULL)
+			Engine->Transform(Context, Data, MD5_PROBE_BLOCKS);
+		else
+			Md5TransformBlocks(Context[0], Data[0], MD5_PROBE_BLOCKS);
+		Elapsed = ReadTimestamp() - Start;
+		if (Run == 0 || Elapsed < Best)
+			Best = Elapsed;
+	}
+	return Best;
+}
 
-  @retval EFI_SUCCESS           The file was successfully processed and the hash has been populated.
-  @retval EFI_INVALID_PARAMETER One or more of the input parameters are invalid or one of the paths
-                                from the hash list points to a directory.
+/**
+  Select the MD5 kernels to use on this platform, by validating each of the kernels
+  that the CPU supports against known answers and keeping the fastest one. A multi-
+  buffer engine is only selected if it provides a higher throughput than the single
+  buffer kernel.
+
+  @retval EFI_SUCCESS           A validated single buffer kernel was selected.
   @retval EFI_OUT_OF_RESOURCES  A memory allocation error occurred.
-  @retval EFI_NOT_FOUND         The target file could not be found on the media.
-  @retval EFI_END_OF_FILE       The file could not be read in full.
-  @retval EFI_ABORTED           User cancelled the operation.
+  @retval EFI_CRC_ERROR         None of the MD5 kernels passed the self-test.
 **/
-EFI_STATUS HashFile(
-	IN CONST EFI_FILE_HANDLE Root,
-	IN CONST CHAR16* Path,
-	OPTIONAL IN PROGRESS_DATA* Progress,
+EFI_STATUS Md5SelectKernels(VOID)
+{
+	CONST MD5_MB_ENGINE* CONST* Engines = Md5MbGetEngines();
+	CONST MD5_MB_ENGINE* SelectedEngine = NULL;
+	CONST MD5_KERNEL* SelectedKernel = NULL;
+	UINT64 Time, KernelTime = 0, EngineTime = 0;
+	UINT32 Features = GetCpuFeatures();
+	UINT8* Buffer;
+	UINTN i;
+
+	Buffer = AllocatePool(MD5_MAX_LANES * MD5_PROBE_BLOCKS * MD5_BLOCKSIZE);
+	if (Buffer == NULL)
+		return EFI_OUT_OF_RESOURCES;
+
+	for (i = 0; i < ARRAY_SIZE(Md5Kernels); i++) {
+		if ((Md5Kernels[i].Features & Features) != Md5Kernels[i].Features)
+			continue;
+		Md5Dispatch.Kernel = &Md5Kernels[i];
+		if (!Md5SelfTest(Buffer)) {
+			PrintWarning(L"MD5 %s kernel failed self-test", Md5Kernels[i].Name);
+			continue;
+		}
+		// With no timer, all times are 0 and the order of preference applies
+		Time = Md5Probe(NULL, Buffer);
+		if (SelectedKernel == NULL || Time < KernelTime) {
+			SelectedKernel = &Md5Kernels[i];
+			KernelTime = Time;
+		}
+	}
+	if (SelectedKernel == NULL) {
+		// Don't leave a kernel that failed validation in use
+		Md5Dispatch.Kernel = &Md5Kernels[ARRAY_SIZE(Md5Kernels) - 1];
+		SafeFree(Buffer);
+		return EFI_CRC_ERROR;
+	}
+	Md5Dispatch.Kernel = SelectedKernel;
+
+	for (i = 0; i < MD5_MAX_LANES * MD5_PROBE_BLOCKS * MD5_BLOCKSIZE; i++)
+		Buffer[i] = (UINT8)((i * 7) + (i >> 8));
+	for (i = 0; Engines[i] != NULL; i++) {
+		if ((Engines[i]->Features & Features) != Engines[i]->Features)
+			continue;
+		if (!Md5MbSelfTest(Engines[i], Buffer)) {
+			PrintWarning(L"MD5 %s multi-buffer engine failed self-test", Engines[i]->Name);
+			continue;
+		}
+		// Compare the throughput per lane, i.e. Time / NumLanes
+		Time = Md5Probe(Engines[i], Buffer);
+		if (KernelTime != 0 && Time >= KernelTime * Engines[i]->NumLanes)
+			continue;
+		if (SelectedEngine == NULL || Time * SelectedEngine->NumLanes < EngineTime * Engines[i]->NumLanes) {
+			SelectedEngine = Engines[i];
+			EngineTime = Time;
+		}
+	}
+	Md5Dispatch.Engine = SelectedEngine;
+
+	SafeFree(Buffer);
+	PrintTest(L"MD5 kernel: %s, multi-buffer: %s", SelectedKernel->Name,
+		(SelectedEngine == NULL) ? L"none" : SelectedEngine->Name);
+	return EFI_SUCCESS;
+}
+
+/**
+  Compute the MD5 hash of a buffer, with the selected single buffer kernel.
+
+  @param[in]  Data              A pointer to the data to hash.
+  @param[in]  Size              The size of the data.
+  @param[out] Hash              A buffer of MD5_HASHSIZE bytes, to receive the hash.
+**/
+VOID Md5HashBuffer(
+	IN CONST VOID* Data,
+	IN CONST UINTN Size,
 	OUT UINT8* Hash
 )
 {
-	STATIC UINTN LastWatchDogReset = 0;
-	EFI_STATUS Status = EFI_INVALID_PARAMETER;
-	EFI_FILE_HANDLE File = NULL;
-	EFI_FILE_INFO* Info = NULL;
-	HASH_CONTEXT Context = { 0 };
-	UINTN Size, ReadSize;
-	UINT64 ReadBytes;
-	UINT8* Buffer = NULL;
-	CHAR16 DisplayPath[PATH_MAX], *StrSize;
+	HASH_CONTEXT Context;
 
-	if ((Root == NULL) || (Path == NULL) || (Hash == NULL))
-		goto out;
+	Md5Init(&Context);
+	Md5Write(&Context, (CONST UINT8*)Data, Size);
+	Md5Final(&Context);
+	CopyMem(Hash, Context.Buffer, MD5_HASHSIZE);
+}
 
-	Buffer = AllocatePool(READ_BUFFERSIZE);
-	if (Buffer == NULL) {
-		Status = EFI_OUT_OF_RESOURCES;
-		goto out;
+/**
+  Set up the read size tuning for the volumes of a session, by aligning reads to
+  the block size reported by each file system, as well as to the cluster size of
+  the volumes that were opened for direct access.
+
+  @param[in/out] Session        A pointer to the HASH_SESSION holding the volumes.
+**/
+VOID InitReadTuning(
+	IN OUT HASH_SESSION* Session
+)
+{
+	READ_TUNING* ReadTuning = &Session->ReadTuning;
+	EFI_FILE_SYSTEM_INFO* Info = NULL;
+	EFI_FILE_HANDLE Root;
+	UINTN i, Size, Alignment = 1;
+
+	for (i = 0; i < Session->NumVolumes; i++) {
+		Root = Session->Volumes[i].Root;
+		if (Root == NULL)
+			continue;
+		Size = 0;
+		if (Root->GetInfo(Root, &gEfiFileSystemInfoGuid, &Size, NULL) == EFI_BUFFER_TOO_SMALL) {
+			Info = AllocatePool(Size);
+			if (Info != NULL && Root->GetInfo(Root, &gEfiFileSystemInfoGuid, &Size, Info) == EFI_SUCCESS &&
+				Info->BlockSize != 0 && (Info->BlockSize & (Info->BlockSize - 1)) == 0)
+				Alignment = MAX(Alignment, Info->BlockSize);
+			if (Info != NULL)
+				SafeFree(Info);
+		}
+		if (Session->Volumes[i].Volume != NULL)
+			Alignment = MAX(Alignment, Session->Volumes[i].Volume->ClusterSize);
 	}
+	// Alignment is a power of two, so it divides all the sizes that are larger
+	ReadTuning->Alignment = MIN(Alignment, READ_BUFFERSIZE_MAX);
+	ReadTuning->Size = MAX(READ_BUFFERSIZE, ReadTuning->Alignment);
+	ReadTuning->Capacity = ReadTuning->Size;
+	ReadTuning->BestSize = ReadTuning->Size;
+	ReadTuning->BestRate = 0;
+	ReadTuning->WindowStart = 0;
+	ReadTuning->WindowBytes = 0;
+	// Without a timestamp counter, we can't measure anything
+	ReadTuning->Step = (ReadTimestamp() == 0) ? 0 : 1;
+}
+
+/**
+  Account for a completed read in the read size tuning. The throughput, which
+  includes hashing, is measured over windows of consecutive reads of the full
+  read size, as the reads from small files or at the end of a file don't depend
+  on it. The read size is doubled for as long as this improves the throughput,
+  or halved if the first increase didn't help, and then settled on the best.
 
-	ZeroMem(Hash, MD5_HASHSIZE);
+  @param[in/out] ReadTuning     A pointer to the READ_TUNING of the session.
+  @param[in]     Requested      The size that was requested for the read.
+  @param[in]     Size           The amount of data that was read.
+**/
+STATIC VOID TuneReadSize(
+	IN OUT READ_TUNING* ReadTuning,
+	IN CONST UINTN Requested,
+	IN CONST UINTN Size
+)
+{
+	UINT64 Now, Rate;
+	UINTN Next, MaxSize;
 
-	// Open the target
-	Status = Root->Open(Root, &File, (CHAR16*)Path, EFI_FILE_MODE_READ, EFI_FILE_READ_ONLY);
+	if (ReadTuning->Step == 0)
+		return;
+
+	Now = ReadTimestamp();
+	if (Requested != ReadTuning->Size || Size != Requested || ReadTuning->WindowStart == 0) {
+		ReadTuning->WindowStart = Now;
+		ReadTuning->WindowBytes = 0;
+		return;
+	}
+	ReadTuning->WindowBytes += Size;
+	if (ReadTuning->WindowBytes < MAX(READ_TUNING_WINDOW, 8 * ReadTuning->Size))
+		return;
+
+	Rate = (ReadTuning->WindowBytes << 10) / MAX(Now - ReadTuning->WindowStart, 1);
+	ReadTuning->WindowStart = Now;
+	ReadTuning->WindowBytes = 0;
+	// Only move away from the best size for a significant improvement
+	if (Rate > ReadTuning->BestRate + ReadTuning->BestRate / 16) {
+		ReadTuning->BestSize = ReadTuning->Size;
+		ReadTuning->BestRate = Rate;
+		Next = (ReadTuning->Step > 0) ? ReadTuning->Size * 2 : ReadTuning->Size / 2;
+	} else if (ReadTuning->Step > 0 && ReadTuning->Size == ReadTuning->BestSize * 2 &&
+		ReadTuning->BestSize == MAX(READ_BUFFERSIZE, ReadTuning->Alignment)) {
+		// Larger reads did not help from the start, so try smaller ones
+		ReadTuning->Step = -1;
+		Next = ReadTuning->BestSize / 2;
+	} else {
+		Next = ReadTuning->BestSize;
+		ReadTuning->Step = 0;
+	}
+
+	MaxSize = MIN(READ_BUFFERSIZE_MAX, ReadTuning->Capacity);
+	if (Next > MaxSize || Next < MAX(READ_BUFFERSIZE_MIN, ReadTuning->Alignment)) {
+		Next = ReadTuning->BestSize;
+		ReadTuning->Step = 0;
+	}
+	ReadTuning->Size = Next;
+}
+
+/* Per-lane data used when hashing multiple files in parallel */
+typedef struct {
+	HASH_BATCH_ENTRY*   Entry;      /* The entry being hashed in this lane (NULL if the lane is idle) */
+	EFI_FILE_HANDLE     File;       /* The handle of the file being hashed */
+	UINT64              FileSize;   /* The size of the file, as reported by GetInfo() */
+	UINT64              ReadBytes;  /* The number of bytes read from the file so far */
+	UINT8*              Buffer;     /* The read buffer holding the data being hashed */
+	UINTN               Pos;        /* The current hashing position in the read buffer */
+	UINTN               Len;        /* The amount of data available in the read buffer */
+	HASH_CONTEXT        Context;    /* The MD5 context for this file */
+	BOOLEAN             Async;      /* Whether the file is being read through ReadEx() */
+	UINT64              ReadOffset; /* The file offset for the next ReadEx() request */
+	UINTN               Head;       /* The index of the next ReadEx() request to complete */
+	UINTN               Current;    /* The index of the read buffer being hashed */
+	UINT8*              ReadBuffer[READ_QUEUE_DEPTH];
+	EFI_FILE_IO_TOKEN   Token[READ_QUEUE_DEPTH];
+	EFI_DISK_IO2_TOKEN  DiskToken[READ_QUEUE_DEPTH];
+	UINTN               RequestSize[READ_QUEUE_DEPTH];  /* Size of a pending request, or 0 if idle */
+	FS_VOLUME*          Volume;     /* The volume to read the file data from, for direct access */
+	CONST FILE_EXTENT*  Extents;    /* The location of the file data on the volume, or NULL */
+	UINTN               NumExtents;
+	UINTN               ExtentIndex;  /* The index of the extent last accessed */
+	UINT64              ExtentStart;  /* The file offset of the extent last accessed */
+	HASH_WORKER*        Worker;     /* The worker hashing the data from the read buffer, if any */
+	UINTN               Ticket;     /* The ticket of the job submitted to Worker, or 0 if none */
+} HASH_LANE;
+
+/**
+  Locate a section of file data on the volume, for a lane that uses direct access.
+
+  @param[in]   Lane             A pointer to the active HASH_LANE.
+  @param[in]   FileOffset       The offset of the data in the file.
+  @param[in]   MaxSize          The maximum amount of data that is wanted.
+  @param[out]  DiskOffset       A pointer to receive the offset of the data on the volume.
+
+  @retval The amount of contiguous data available at DiskOffset, or 0 at the end of the file.
+**/
+STATIC UINTN MapLaneExtent(
+	IN HASH_LANE* Lane,
+	IN CONST UINT64 FileOffset,
+	IN CONST UINTN MaxSize,
+	OUT UINT64* DiskOffset
+)
+{
+	CONST FILE_EXTENT* Extent;
+
+	if (FileOffset >= Lane->FileSize)
+		return 0;
+	// Data is mostly accessed sequentially, so we start from the last extent
+	if (FileOffset < Lane->ExtentStart) {
+		Lane->ExtentIndex = 0;
+		Lane->ExtentStart = 0;
+	}
+	while (Lane->ExtentIndex < Lane->NumExtents &&
+		FileOffset >= Lane->ExtentStart + Lane->Extents[Lane->ExtentIndex].Length) {
+		Lane->ExtentStart += Lane->Extents[Lane->ExtentIndex].Length;
+		Lane->ExtentIndex++;
+	}
+	// GetFileExtents() ensures that the extents cover the whole file, and
+	// OpenLane() checks that the file is still the size they cover
+	V_ASSERT(Lane->ExtentIndex < Lane->NumExtents);
+	Extent = &Lane->Extents[Lane->ExtentIndex];
+	*DiskOffset = Extent->Offset + (FileOffset - Lane->ExtentStart);
+	return (UINTN)MIN(MIN(MaxSize, Lane->ExtentStart + Extent->Length - FileOffset),
+		Lane->FileSize - FileOffset);
+}
+
+/**
+  Queue an asynchronous read of the next section of a file into a lane buffer.
+
+  @param[in]   ReadTuning       A pointer to the READ_TUNING of the session.
+  @param[in]   Lane             A pointer to the active HASH_LANE.
+  @param[in]   Index            The index of the idle lane buffer to read into.
+
+  @retval EFI_SUCCESS           The read was queued, or there is no more data to request.
+  @retval other                 ReadEx() or SetPosition() failed.
+**/
+STATIC EFI_STATUS QueueRead(
+	IN CONST READ_TUNING* ReadTuning,
+	IN HASH_LANE* Lane,
+	IN CONST UINTN Index
+)
+{
+	EFI_STATUS Status;
+	EFI_FILE_IO_TOKEN* Token = &Lane->Token[Index];
+	UINT64 DiskOffset;
+
+	V_ASSERT(Lane->RequestSize[Index] == 0);
+	if (Lane->ReadOffset >= Lane->FileSize)
+		return EFI_SUCCESS;
+
+	Token->Status = EFI_SUCCESS;
+	Token->Buffer = Lane->ReadBuffer[Index];
+	if (Lane->Extents != NULL) {
+		// Direct access, with requests that don't cross extents
+		Token->BufferSize = MapLaneExtent(Lane, Lane->ReadOffset, ReadTuning->Size, &DiskOffset);
+		Lane->DiskToken[Index].Event = Token->Event;
+		Lane->DiskToken[Index].TransactionStatus = EFI_SUCCESS;
+		Status = Lane->Volume->DiskIo2->ReadDiskEx(Lane->Volume->DiskIo2, Lane->Volume->MediaId,
+			DiskOffset, &Lane->DiskToken[Index], Token->BufferSize, Token->Buffer);
+	} else {
+		Token->BufferSize = (UINTN)MIN(ReadTuning->Size, Lane->FileSize - Lane->ReadOffset);
+		// Set the position explicitly, so that we don't depend on whether the
+		// firmware advances it when a request is queued or when it completes.
+		Status = Lane->File->SetPosition(Lane->File, Lane->ReadOffset);
+		if (!EFI_ERROR(Status))
+			Status = Lane->File->ReadEx(Lane->File, Token);
+	}
 	if (EFI_ERROR(Status))
-		goto out;
+		return Status;
+	Lane->RequestSize[Index] = Token->BufferSize;
+	Lane->ReadOffset += Token->BufferSize;
+	return EFI_SUCCESS;
+}
 
-	// Validate that it's a file and not a directory
-	Size = FILE_INFO_SIZE;
-	Info = AllocateZeroPool(Size);
-	if (Info == NULL) {
-		Status = EFI_OUT_OF_RESOURCES;
-		goto out;
+/**
+  Wait for all the pending asynchronous reads of a lane to complete, discard
+  their data, and continue reading the file synchronously from the current
+  hashing position.
+
+  @param[in]   Lane             A pointer to the active HASH_LANE.
+
+  @retval EFI_SUCCESS           The lane was switched to synchronous reads.
+  @retval other                 SetPosition() failed.
+**/
+STATIC EFI_STATUS StopAsyncRead(
+	IN HASH_LANE* Lane
+)
+{
+	UINTN i, Index;
+
+	for (i = 0; i < READ_QUEUE_DEPTH; i++) {
+		if (Lane->RequestSize[i] != 0) {
+			gBS->WaitForEvent(1, &Lane->Token[i].Event, &Index);
+			Lane->RequestSize[i] = 0;
+		}
+	}
+	if (!Lane->Async)
+		return EFI_SUCCESS;
+	Lane->Async = FALSE;
+	return (Lane->Extents != NULL) ? EFI_SUCCESS : Lane->File->SetPosition(Lane->File, Lane->ReadBytes);
+}
+
+/**
+  Read the next section of a file into a lane buffer. When the file system
+  supports ReadEx(), this waits for the oldest pending request and queues a
+  new one into the buffer that was just hashed, so that reading and hashing
+  overlap. Otherwise, or if ReadEx() fails or returns short, this falls back
+  to the synchronous Read().
+
+  @param[in/out] ReadTuning     A pointer to the READ_TUNING of the session.
+  @param[in]     Lane           A pointer to the active HASH_LANE, with all of
+                                its buffered data processed.
+
+  @retval EFI_SUCCESS           Lane->Buffer and Lane->Len were updated with the
+                                data read, with Lane->Len set to 0 at end of file.
+  @retval other                 An error was returned by the file system.
+**/
+STATIC EFI_STATUS ReadLane(
+	IN OUT READ_TUNING* ReadTuning,
+	IN HASH_LANE* Lane
+)
+{
+	EFI_STATUS Status;
+	UINT64 DiskOffset;
+	UINTN Index, Signaled, Requested, Size = 0;
+
+	if (Lane->Async) {
+		// Reuse the buffer we just hashed for the next request
+		if (Lane->Len != 0)
+			QueueRead(ReadTuning, Lane, Lane->Current);
+		Index = Lane->Head;
+		if (Lane->RequestSize[Index] != 0) {
+			gBS->WaitForEvent(1, &Lane->Token[Index].Event, &Signaled);
+			Status = (Lane->Extents != NULL) ? Lane->DiskToken[Index].TransactionStatus :
+				Lane->Token[Index].Status;
+			Size = EFI_ERROR(Status) ? 0 : Lane->Token[Index].BufferSize;
+			Lane->Head = (Index + 1) % READ_QUEUE_DEPTH;
+			Lane->Current = Index;
+			Lane->Buffer = Lane->ReadBuffer[Index];
+			Lane->Pos = 0;
+			Lane->Len = Size;
+			Lane->ReadBytes += Size;
+			TuneReadSize(ReadTuning, Lane->RequestSize[Index], Size);
+			if (EFI_ERROR(Status) || Size == Lane->RequestSize[Index]) {
+				Lane->RequestSize[Index] = 0;
+				return Status;
+			}
+			// Short read, so the requests that follow are at the wrong offset
+			Lane->RequestSize[Index] = 0;
+		}
+		// Also use a synchronous read to confirm that we have reached the end of file
+		Status = StopAsyncRead(Lane);
+		if (EFI_ERROR(Status) || Size != 0)
+			return Status;
+	}
+
+	Lane->Buffer = Lane->ReadBuffer[0];
+	Lane->Pos = 0;
+	if (Lane->Extents != NULL) {
+		Requested = MapLaneExtent(Lane, Lane->ReadBytes, ReadTuning->Size, &DiskOffset);
+		Lane->Len = Requested;
+		Status = (Lane->Len == 0) ? EFI_SUCCESS :
+			ReadVolume(Lane->Volume, DiskOffset, Lane->Len, Lane->Buffer);
+	} else {
+		Requested = ReadTuning->Size;
+		Lane->Len = Requested;
+		Status = Lane->File->Read(Lane->File, &Lane->Len, Lane->Buffer);
 	}
-	Status = File->GetInfo(File, &gEfiFileInfoGuid, &Size, Info);
 	if (EFI_ERROR(Status))
-		goto out;
+		Lane->Len = 0;
+	Lane->ReadBytes += Lane->Len;
+	TuneReadSize(ReadTuning, Requested, Lane->Len);
+	return Status;
+}
+
+/* Open directory that files can be opened from, using only their name */
+typedef struct {
+	EFI_FILE_HANDLE     Handle;     /* The directory handle, or NULL if the entry is unused */
+	EFI_FILE_HANDLE     Root;       /* The root directory that the directory was opened from */
+	UINTN               Len;        /* The length of the directory path, including the last separator */
+	UINTN               LastUsed;   /* The value of the cache tick when the entry was last used */
+	CHAR16              Path[PATH_MAX + 1];
+} DIR_CACHE_ENTRY;
+
+/* Least recently used cache of directory handles */
+typedef struct {
+	DIR_CACHE_ENTRY     Entry[DIR_CACHE_SIZE];
+	UINTN               Tick;
+} DIR_CACHE;
+
+/**
+  Open a file for reading. Rather than having the file system driver walk the
+  whole path for every file, files are opened relative to a cached handle of
+  their parent directory.
+
+  @param[in]   Root             A file handle to the root directory.
+  @param[in]   Cache            (Optional) A pointer to the DIR_CACHE to use.
+  @param[in]   Path             The path of the file, relative to the root directory.
+  @param[out]  File             A pointer to receive the file handle.
+
+  @retval EFI_SUCCESS           The file was opened.
+  @retval EFI_NOT_FOUND         The file could not be found on the media.
+**/
+STATIC EFI_STATUS OpenCachedFile(
+	IN CONST EFI_FILE_HANDLE Root,
+	OPTIONAL IN DIR_CACHE* Cache,
+	IN CHAR16* Path,
+	OUT EFI_FILE_HANDLE* File
+)
+{
+	EFI_STATUS Status;
+	DIR_CACHE_ENTRY* Dir = NULL;
+	UINTN i, Len = 0;
+
+	for (i = 0; Path[i] != L'\0'; i++) {
+		if (Path[i] == L'\\' || Path[i] == L'/')
+			Len = i + 1;
+	}
+
+	// Files from the root directory don't need a cached parent
+	if (Cache != NULL && Len > 1 && Len <= PATH_MAX && !(Len == 2 && Path[0] == L'.')) {
+		for (i = 0; i < DIR_CACHE_SIZE; i++) {
+			if (Cache->Entry[i].Handle != NULL && Cache->Entry[i].Root == Root && Cache->Entry[i].Len == Len &&
+				CompareMem(Cache->Entry[i].Path, Path, Len * sizeof(CHAR16)) == 0) {
+				Dir = &Cache->Entry[i];
+				break;
+			}
+		}
+		if (Dir == NULL) {
+			// Replace the least recently used entry (unused entries have a zero tick)
+			Dir = &Cache->Entry[0];
+			for (i = 1; i < DIR_CACHE_SIZE; i++) {
+				if (Cache->Entry[i].LastUsed < Dir->LastUsed)
+					Dir = &Cache->Entry[i];
+			}
+			if (Dir->Handle != NULL)
+				Dir->Handle->Close(Dir->Handle);
+			Dir->Handle = NULL;
+			Dir->LastUsed = 0;
+			// Some drivers don't accept a trailing separator for directories
+			CopyMem(Dir->Path, Path, Len * sizeof(CHAR16));
+			Dir->Path[Len - 1] = L'\0';
+			if (EFI_ERROR(Root->Open(Root, &Dir->Handle, Dir->Path, EFI_FILE_MODE_READ, 0))) {
+				Dir->Handle = NULL;
+				Dir = NULL;
+			} else {
+				Dir->Path[Len - 1] = Path[Len - 1];
+				Dir->Root = Root;
+				Dir->Len = Len;
+			}
+		}
+		if (Dir != NULL) {
+			Dir->LastUsed = ++Cache->Tick;
+			Status = Dir->Handle->Open(Dir->Handle, File, &Path[Len], EFI_FILE_MODE_READ, EFI_FILE_READ_ONLY);
+			if (!EFI_ERROR(Status))
+				return Status;
+		}
+	}
+
+	// Go through the full path, which also gives us the error to report
+	return Root->Open(Root, File, Path, EFI_FILE_MODE_READ, EFI_FILE_READ_ONLY);
+}
+
+/**
+  Close all the directory handles held by a cache.
+
+  @param[in]   Cache            A pointer to the DIR_CACHE to flush.
+**/
+STATIC VOID FlushDirCache(
+	IN DIR_CACHE* Cache
+)
+{
+	UINTN i;
+
+	for (i = 0; i < DIR_CACHE_SIZE; i++) {
+		if (Cache->Entry[i].Handle != NULL)
+			Cache->Entry[i].Handle->Close(Cache->Entry[i].Handle);
+		Cache->Entry[i].Handle = NULL;
+		Cache->Entry[i].LastUsed = 0;
+	}
+	Cache->Tick = 0;
+}
+
+/**
+  Open a file and assign it to a hashing lane.
+
+  @param[in]   Session          A pointer to the HASH_SESSION holding the volume of the file.
+  @param[in]   Cache            (Optional) A pointer to the DIR_CACHE to open the file from.
+  @param[in]   Lane             A pointer to the idle HASH_LANE to set up.
+  @param[in]   Entry            A pointer to the HASH_BATCH_ENTRY to process.
+  @param[in]   Info             A FILE_INFO_SIZE scratch buffer for the file information.
+
+  @retval EFI_SUCCESS           The file was successfully opened and assigned to the lane.
+  @retval EFI_INVALID_PARAMETER The path from the hash list points to a directory.
+  @retval EFI_BAD_BUFFER_SIZE   The size of the file differs from the one the hash list expects.
+  @retval EFI_NOT_FOUND         The target file could not be found on the media.
+  @retval EFI_NO_MEDIA          The volume holding the file could not be found.
+**/
+STATIC EFI_STATUS OpenLane(
+	IN CONST HASH_SESSION* Session,
+	OPTIONAL IN DIR_CACHE* Cache,
+	IN HASH_LANE* Lane,
+	IN HASH_BATCH_ENTRY* Entry,
+	IN EFI_FILE_INFO* Info
+)
+{
+	EFI_STATUS Status;
+	EFI_FILE_HANDLE File = NULL, Root;
+	DIR_INDEX* Index;
+	FS_VOLUME* Volume;
+	DIR_INDEX_ENTRY* IndexEntry;
+	UINTN i, Size;
+	CHAR16 DisplayPath[PATH_MAX], *StrSize;
+
+	ZeroMem(Entry->Hash, MD5_HASHSIZE);
+
+	V_ASSERT(Entry->Volume < Session->NumVolumes);
+	Root = Session->Volumes[Entry->Volume].Root;
+	Index = Session->Volumes[Entry->Volume].Index;
+	Volume = Session->Volumes[Entry->Volume].Volume;
+	if (Root == NULL)
+		return EFI_NO_MEDIA;
+
+	// Directories, and files that don't have the size that the hash list
+	// expects, can be rejected without being opened, if they were indexed
+	IndexEntry = LookupDirIndex(Index, Entry->Path);
+	if (IndexEntry != NULL && (IndexEntry->Attribute & EFI_FILE_DIRECTORY))
+		return EFI_INVALID_PARAMETER;
+	if (IndexEntry != NULL && Entry->ExpectedSize != HASH_SIZE_UNKNOWN &&
+		IndexEntry->FileSize != Entry->ExpectedSize)
+		return EFI_BAD_BUFFER_SIZE;
+
+	// Open the target
+	Status = OpenCachedFile(Root, Cache, Entry->Path, &File);
+	if (EFI_ERROR(Status))
+		return Status;
+
+	// Get the file information from the index, or else from the driver,
+	// and validate that it's a file and not a directory
+	if (IndexEntry != NULL) {
+		Info->FileSize = IndexEntry->FileSize;
+		Info->Attribute = IndexEntry->Attribute;
+	} else {
+		Size = FILE_INFO_SIZE;
+		ZeroMem(Info, Size);
+		Status = File->GetInfo(File, &gEfiFileInfoGuid, &Size, Info);
+		if (EFI_ERROR(Status))
+			goto out;
+	}
 
 	if (Info->Attribute & EFI_FILE_DIRECTORY) {
 		Status = EFI_INVALID_PARAMETER;
 		goto out;
 	}
 
+	// A truncated or extended file fails without any of its data being read
+	if (Entry->ExpectedSize != HASH_SIZE_UNKNOWN && Info->FileSize != Entry->ExpectedSize) {
+		Status = EFI_BAD_BUFFER_SIZE;
+		goto out;
+	}
+
 	// Print the file we are currently processing, along with its size
 	V_ASSERT(ARRAY_SIZE(DisplayPath) > gConsole.Cols);
 	StrSize = SizeToHumanReadable(Info->FileSize);
 	// We could do without this assert since StrSize is at most 32 and
 	// gConsole.Cols at least COLS_MIN (>32) but in case someone worries...
 	V_ASSERT(gConsole.Cols > SafeStrLen(StrSize) - 1);
-	SafeStrCpy(DisplayPath, ARRAY_SIZE(DisplayPath), Path);
+	SafeStrCpy(DisplayPath, ARRAY_SIZE(DisplayPath), Entry->Path);
 	// The following unconditionally truncates the path to what's needed
 	// to append the size in case it's too long to fit on one line.
 	DisplayPath[gConsole.Cols - SafeStrLen(StrSize) - 1] = 0;
 	SafeStrCat(DisplayPath, ARRAY_SIZE(DisplayPath), StrSize);
 	PrintCentered(DisplayPath, gConsole.Rows / 2 - 1);
 
-	// Compute the MD5 Hash
-	Md5Init(&Context);
-	for (ReadBytes = 0; ; ReadBytes += ReadSize) {
-		ReadSize = READ_BUFFERSIZE;
-		Status = File->Read(File, &ReadSize, Buffer);
-		// Early AMI UEFI v2.0 firmwares, such as the ones found in Dell
-		// Optiplex 390s, are unable to process USB keyboard input when
-		// the USB bus is simultaneously used to read data at high speed.
-		// So we pause these systems, to give them enough time to "breathe"
-		// and process USB keyboard cancellation.
-		if (gPauseAfterRead != 0)
-			Sleep(gPauseAfterRead);
-		if (EFI_ERROR(Status))
-			goto out;
-		if (ReadSize == 0)
+	Lane->Entry = Entry;
+	Lane->File = File;
+	Lane->FileSize = Info->FileSize;
+	Lane->ReadBytes = 0;
+	Lane->Pos = 0;
+	Lane->Len = 0;
+	Md5Init(&Lane->Context);
+
+	// Use the location of the file data on the volume, from when the list was
+	// scheduled, so that it can be read directly. We still go through the file
+	// system driver for files that weren't located, or if what was located
+	// doesn't agree with what the driver reports.
+	Lane->Volume = Volume;
+	Lane->Extents = NULL;
+	Lane->NumExtents = 0;
+	Lane->ExtentIndex = 0;
+	Lane->ExtentStart = 0;
+	if (Volume != NULL && Entry->Location != NULL && Entry->Location->Extents != NULL &&
+		Entry->Location->FileSize == Info->FileSize) {
+		Lane->Extents = Entry->Location->Extents;
+		Lane->NumExtents = Entry->Location->NumExtents;
+	}
+
+	// Queue the initial reads, if the file system or disk supports asynchronous I/O
+	Lane->Async = (Lane->Extents != NULL) ? (Volume->DiskIo2 != NULL) :
+		(File->Revision >= EFI_FILE_PROTOCOL_REVISION2);
+	for (i = 0; i < READ_QUEUE_DEPTH; i++)
+		Lane->Async = Lane->Async && (Lane->Token[i].Event != NULL);
+	Lane->ReadOffset = 0;
+	Lane->Head = 0;
+	Lane->Current = 0;
+	for (i = 0; Lane->Async && i < READ_QUEUE_DEPTH; i++) {
+		if (EFI_ERROR(QueueRead(&Session->ReadTuning, Lane, i)))
 			break;
-		Md5Write(&Context, Buffer, ReadSize);
-		// Update the progress data (if byte type)
-		if (Progress != NULL && Progress->Type == PROGRESS_TYPE_BYTE) {
-			Progress->Current += ReadSize;
-			UpdateProgress(Progress);
-		}
-		// The watchdog timer must be set regularly, otherwise the UEFI firmware
-		// considers the bootloader stalled and resets the system. Do this every
-		// WATCHDOG_RESETSIZE bytes processed, as, with a default watchdog period
-		// of 5 mins (per UEFI specs), it should accomodate even very slow systems.
-		if (LastWatchDogReset++ % (WATCHDOG_RESETSIZE / READ_BUFFERSIZE) == 0)
-			gBS->SetWatchdogTimer(300, 0x11D5, 0, NULL);
-		// Check for user cancel (keypress)
-		if (gST->BootServices->CheckEvent(gST->ConIn->WaitForKey) != EFI_NOT_READY) {
-			Status = EFI_ABORTED;
-			goto out;
-		}
 	}
-	// Report an error if we did not read the expected amount of data
-	if (ReadBytes != Info->FileSize) {
-		Status = EFI_END_OF_FILE;
+
+out:
+	if (EFI_ERROR(Status))
+		File->Close(File);
+	return Status;
+}
+
+/**
+  Release a hashing lane and report the result for the file it was processing.
+
+  @param[in]   Lane             A pointer to the active HASH_LANE to release.
+  @param[in]   Status           The status of the hashing operation for this lane.
+  @param[in]   Progress         (Optional) A pointer to a PROGRESS_DATA structure.
+**/
+STATIC VOID CloseLane(
+	IN HASH_LANE* Lane,
+	IN CONST EFI_STATUS Status,
+	OPTIONAL IN PROGRESS_DATA* Progress
+)
+{
+	// The context and buffer must not be used while a worker is hashing
+	while (Lane->Ticket != 0 && !IsHashJobDone(Lane->Worker, Lane->Ticket))
+		CpuPause();
+	Lane->Ticket = 0;
+	if (Status == EFI_SUCCESS) {
+		Md5Final(&Lane->Context);
+		CopyMem(Lane->Entry->Hash, Lane->Context.Buffer, MD5_HASHSIZE);
+		Lane->Entry->Size = Lane->FileSize;
+		// Update the progress data (if file type)
+		if (Progress != NULL && Progress->Type == PROGRESS_TYPE_FILE)
+			Progress->Current++;
+		UpdateProgress(Progress);
+	}
+	Lane->Entry->Status = Status;
+	// The buffers must not be reused, nor the file closed, while reads are pending
+	StopAsyncRead(Lane);
+	// The extents belong to the schedule of the window
+	Lane->Extents = NULL;
+	Lane->NumExtents = 0;
+	Lane->File->Close(Lane->File);
+	Lane->File = NULL;
+	Lane->Entry = NULL;
+}
+
+/**
+  Compute the MD5 hashes of a batch of files.
+  When a multi-buffer MD5 engine is available, up to NumLanes files are processed
+  in parallel, else the files are processed one at a time. Each lane also opens
+  its next file, and queues the first reads for it, as soon as all the data of
+  its current file has been requested, so that file boundaries don't stall.
+  When the session has workers, each lane is assigned to an application
+  processor, that hashes the data while the BSP keeps reading.
+  Since each lane reads from the volume of its own file, the reads to the
+  different devices of a session are in flight at the same time.
+
+  @param[in/out] Session        A pointer to the HASH_SESSION of the run. For the volumes that
+                                were opened for direct access, file data is read directly from
+                                the disk whenever the location of the file can be resolved.
+  @param[in/out] Entries        An array of HASH_BATCH_ENTRY. On input, Path, Volume and ExpectedSize
+                                must be set for each entry, as well as Status, to EFI_SUCCESS for entries
+                                that should be processed, or to an error code for entries that should
+                                be skipped. On output, Status and Hash are set for each entry.
+  @param[in]     NumEntries     The number of entries in the array.
+  @param[in]     Progress       (Optional) A pointer to a PROGRESS_DATA structure. If provided then
+                                the current progress value will be updated by this call.
+
+  @retval EFI_SUCCESS           The batch was processed. Individual results are set in each entry.
+  @retval EFI_INVALID_PARAMETER One or more of the input parameters are invalid.
+  @retval EFI_OUT_OF_RESOURCES  A memory allocation error occurred.
+  @retval EFI_ABORTED           User cancelled the operation.
+**/
+EFI_STATUS HashFileBatch(
+	IN OUT HASH_SESSION* Session,
+	IN OUT HASH_BATCH_ENTRY* Entries,
+	IN CONST UINTN NumEntries,
+	OPTIONAL IN PROGRESS_DATA* Progress
+)
+{
+	CONST MD5_MB_ENGINE* Engine;
+	EFI_STATUS Status;
+	HASH_WORKERS* Workers;
+	HASH_JOB Job;
+	EFI_FILE_INFO* Info = NULL;
+	DIR_CACHE* Cache = NULL;
+	HASH_LANE LaneData[2 * MD5_MAX_LANES], *Lanes[MD5_MAX_LANES], *NextLanes[MD5_MAX_LANES], *Lane;
+	HASH_CONTEXT Scratch, *Context[MD5_MAX_LANES];
+	CONST UINT8* Data[MD5_MAX_LANES];
+	UINT8* Buffer = NULL;
+	ARENA_MARK Mark = ArenaGetMark();
+	UINTN i, j, Next = 0, Capacity, NumLanes, NumActive, NumReady, NumBlocks;
+
+	if ((Session == NULL) || (Session->NumVolumes == 0) || (Entries == NULL))
+		return EFI_INVALID_PARAMETER;
+	Workers = Session->Workers;
+
+	// The workers use the single buffer kernel, since the multi-buffer engines
+	// may depend on CPU features that the firmware only enabled on the BSP.
+	Engine = (Workers == NULL) ? Md5Dispatch.Engine : NULL;
+	NumLanes = (Workers != NULL) ? Workers->NumWorkers : ((Engine == NULL) ? 1 : Engine->NumLanes);
+	V_ASSERT(NumLanes <= MD5_MAX_LANES);
+	ZeroMem(LaneData, sizeof(LaneData));
+	for (i = 0; i < NumLanes; i++) {
+		Lanes[i] = &LaneData[i];
+		NextLanes[i] = &LaneData[NumLanes + i];
+	}
+
+	// While the read size is being tuned, allocate buffers that leave room to
+	// try larger reads. Then reduce the size until the allocation succeeds.
+	Capacity = Session->ReadTuning.Size;
+	if (Session->ReadTuning.Step > 0) {
+		while (Capacity < READ_BUFFERSIZE_MAX &&
+			Capacity * 2 * 2 * NumLanes * READ_QUEUE_DEPTH <= READ_BUFFERPOOL_MAX)
+			Capacity *= 2;
+	}
+	while (1) {
+		Buffer = ArenaAllocate(2 * NumLanes * READ_QUEUE_DEPTH * Capacity);
+		if (Buffer != NULL || Capacity / 2 < MAX(READ_BUFFERSIZE_MIN, Session->ReadTuning.Alignment))
+			break;
+		Capacity /= 2;
+	}
+	Session->ReadTuning.Capacity = Capacity;
+	Session->ReadTuning.Size = MIN(Session->ReadTuning.Size, Capacity);
+	Session->ReadTuning.BestSize = MIN(Session->ReadTuning.BestSize, Capacity);
+	Info = ArenaAllocate(FILE_INFO_SIZE);
+	// The directory cache is only an optimization, so we can do without it
+	Cache = ArenaAllocate(sizeof(DIR_CACHE));
+	if (Cache != NULL)
+		ZeroMem(Cache, sizeof(DIR_CACHE));
+	if (Buffer == NULL || Info == NULL) {
+		Status = EFI_OUT_OF_RESOURCES;
 		goto out;
 	}
-	Md5Final(&Context);
-	// Update the progress data (if file type)
-	if (Progress != NULL && Progress->Type == PROGRESS_TYPE_FILE)
-		Progress->Current++;
-	UpdateProgress(Progress);
+	for (i = 0; i < 2 * NumLanes; i++) {
+		for (j = 0; j < READ_QUEUE_DEPTH; j++) {
+			LaneData[i].ReadBuffer[j] = &Buffer[(i * READ_QUEUE_DEPTH + j) * Capacity];
+			// Lanes without an event for each request just use synchronous reads
+			if (EFI_ERROR(gBS->CreateEvent(0, 0, NULL, NULL, &LaneData[i].Token[j].Event)))
+				LaneData[i].Token[j].Event = NULL;
+		}
+	}
 
-	CopyMem(Hash, Context.Buffer, MD5_HASHSIZE);
+	while (1) {
+		// Assign the next entries from the batch to any idle lane.
+		// Since lanes are filled in order, files are opened (and
+		// displayed) in the same order as they appear in the list.
+		NumActive = 0;
+		for (i = 0; i < NumLanes; i++) {
+			// Switch to the file that was opened ahead, if any. The lanes are
+			// swapped through pointers, since they may have reads in flight.
+			if (Lanes[i]->Entry == NULL && NextLanes[i]->Entry != NULL) {
+				Lane = Lanes[i];
+				Lanes[i] = NextLanes[i];
+				NextLanes[i] = Lane;
+			}
+			while (Lanes[i]->Entry == NULL && Next < NumEntries) {
+				// Don't process entries that have already been flagged as failed
+				if (!EFI_ERROR(Entries[Next].Status))
+					Entries[Next].Status = OpenLane(Session, Cache, Lanes[i], &Entries[Next], Info);
+				Next++;
+			}
+			if (Lanes[i]->Entry == NULL)
+				continue;
+			NumActive++;
+			// Once all the data of the current file has been requested, open the
+			// next one, so that its first reads overlap with hashing the tail of
+			// the current file, instead of starting after it has been closed.
+			if (Lanes[i]->Async ? (Lanes[i]->ReadOffset < Lanes[i]->FileSize) :
+				(Lanes[i]->ReadBytes < Lanes[i]->FileSize))
+				continue;
+			while (NextLanes[i]->Entry == NULL && Next < NumEntries) {
+				if (!EFI_ERROR(Entries[Next].Status))
+					Entries[Next].Status = OpenLane(Session, Cache, NextLanes[i], &Entries[Next], Info);
+				Next++;
+			}
+		}
+		if (NumActive == 0)
+			break;
+
+		// Read more data for the lanes that have consumed their buffer
+		for (i = 0; i < NumLanes; i++) {
+			if (Lanes[i]->Entry == NULL || Lanes[i]->Pos < Lanes[i]->Len)
+				continue;
+			Status = ReadLane(&Session->ReadTuning, Lanes[i]);
+			// Early AMI UEFI v2.0 firmwares, such as the ones found in Dell
+			// Optiplex 390s, are unable to process USB keyboard input when
+			// the USB bus is simultaneously used to read data at high speed.
+			// So we pause these systems, to give them enough time to "breathe"
+			// and process USB keyboard cancellation.
+			if (gPauseAfterRead != 0)
+				Sleep(gPauseAfterRead);
+			if (EFI_ERROR(Status)) {
+				CloseLane(Lanes[i], Status, Progress);
+				continue;
+			}
+			if (Lanes[i]->Len == 0) {
+				// Report an error if we did not read the expected amount of data
+				CloseLane(Lanes[i], (Lanes[i]->ReadBytes == Lanes[i]->FileSize) ?
+					EFI_SUCCESS : EFI_END_OF_FILE, Progress);
+				continue;
+			}
+			// Update the progress data (if byte type)
+			if (Progress != NULL && Progress->Type == PROGRESS_TYPE_BYTE) {
+				Progress->Current += Lanes[i]->Len;
+				UpdateProgress(Progress);
+			}
+			// The watchdog timer must be set regularly, otherwise the UEFI firmware
+			// considers the bootloader stalled and resets the system. Do this every
+			// WATCHDOG_RESETSIZE bytes processed, as, with a default watchdog period
+			// of 5 mins (per UEFI specs), it should accomodate even very slow systems.
+			// Since the read size varies, we count bytes rather than reads.
+			Session->WatchDogBytes += Lanes[i]->Len;
+			if (Session->WatchDogBytes >= WATCHDOG_RESETSIZE) {
+				Session->WatchDogBytes = 0;
+				gBS->SetWatchdogTimer(300, 0x11D5, 0, NULL);
+			}
+			// Check for user cancel (keypress)
+			if (gST->BootServices->CheckEvent(gST->ConIn->WaitForKey) != EFI_NOT_READY) {
+				Status = EFI_ABORTED;
+				goto out;
+			}
+		}
+
+		// With workers, the data of each lane is handed over to the AP of that
+		// lane, and the buffer is only consumed once the AP is done with it.
+		if (Workers != NULL) {
+			for (i = 0; i < NumLanes; i++) {
+				Lane = Lanes[i];
+				if (Lane->Entry == NULL || Lane->Pos >= Lane->Len)
+					continue;
+				if (Lane->Ticket == 0) {
+					Job.Update = Md5Write;
+					Job.Context = &Lane->Context;
+					Job.Data = &Lane->Buffer[Lane->Pos];
+					Job.Length = Lane->Len - Lane->Pos;
+					Lane->Worker = Workers->Worker[i];
+					Lane->Ticket = SubmitHashJob(Lane->Worker, &Job);
+					// Hash the data ourselves if the ring of the worker is full
+					if (Lane->Ticket == 0) {
+						Md5Write(&Lane->Context, Job.Data, Job.Length);
+						Lane->Pos = Lane->Len;
+					}
+				} else if (IsHashJobDone(Lane->Worker, Lane->Ticket)) {
+					Lane->Ticket = 0;
+					Lane->Pos = Lane->Len;
+				}
+			}
+			continue;
+		}
+
+		// Lanes that hold less than a block of data (end of file) or that have
+		// been left with a partial block (short read) go through the regular
+		// hashing code. All the others are candidates for multi-buffer hashing.
+		NumReady = 0;
+		NumBlocks = Capacity / MD5_BLOCKSIZE;
+		for (i = 0; i < NumLanes; i++) {
+			if (Lanes[i]->Entry == NULL || Lanes[i]->Pos >= Lanes[i]->Len)
+				continue;
+			if (Engine == NULL || Lanes[i]->Len - Lanes[i]->Pos < MD5_BLOCKSIZE ||
+				(Lanes[i]->Context.ByteCount & (MD5_BLOCKSIZE - 1)) != 0) {
+				Md5Write(&Lanes[i]->Context, &Lanes[i]->Buffer[Lanes[i]->Pos], Lanes[i]->Len - Lanes[i]->Pos);
+				Lanes[i]->Pos = Lanes[i]->Len;
+				continue;
+			}
+			NumBlocks = MIN(NumBlocks, (Lanes[i]->Len - Lanes[i]->Pos) / MD5_BLOCKSIZE);
+			Data[NumReady++] = &Lanes[i]->Buffer[Lanes[i]->Pos];
+		}
+		if (NumReady == 0)
+			continue;
+
+		// A single stream is processed faster by the scalar code
+		if (NumReady == 1) {
+			for (i = 0; i < NumLanes; i++) {
+				if (Lanes[i]->Entry == NULL || Lanes[i]->Pos >= Lanes[i]->Len)
+					continue;
+				Md5Write(&Lanes[i]->Context, &Lanes[i]->Buffer[Lanes[i]->Pos], Lanes[i]->Len - Lanes[i]->Pos);
+				Lanes[i]->Pos = Lanes[i]->Len;
+			}
+			continue;
+		}
+
+		// Lanes that don't have data to process duplicate the data from the
+		// first ready lane and have their results discarded into Scratch.
+		for (i = 0; i < NumLanes; i++) {
+			if (Lanes[i]->Entry == NULL || Lanes[i]->Pos >= Lanes[i]->Len) {
+				Context[i] = &Scratch;
+				Data[i] = Data[0];
+			} else {
+				Context[i] = &Lanes[i]->Context;
+				Data[i] = &Lanes[i]->Buffer[Lanes[i]->Pos];
+			}
+		}
+		Engine->Transform(Context, Data, NumBlocks);
+		for (i = 0; i < NumLanes; i++) {
+			if (Context[i] == &Scratch)
+				continue;
+			Lanes[i]->Pos += NumBlocks * MD5_BLOCKSIZE;
+			Lanes[i]->Context.ByteCount += NumBlocks * MD5_BLOCKSIZE;
+		}
+	}
 	Status = EFI_SUCCESS;
 
 out:
-	SafeFree(Buffer);
-	if (File != NULL)
-		File->Close(File);
-	SafeFree(Info);
+	// If we exited early, flag all the entries that didn't get processed
+	for (i = 0; i < 2 * NumLanes; i++) {
+		if (LaneData[i].Entry != NULL)
+			CloseLane(&LaneData[i], Status, NULL);
+	}
+	if (EFI_ERROR(Status)) {
+		for (; Next < NumEntries; Next++) {
+			if (!EFI_ERROR(Entries[Next].Status))
+				Entries[Next].Status = Status;
+		}
+	}
+	for (i = 0; i < 2 * NumLanes; i++) {
+		for (j = 0; j < READ_QUEUE_DEPTH; j++) {
+			if (LaneData[i].Token[j].Event != NULL)
+				gBS->CloseEvent(LaneData[i].Token[j].Event);
+		}
+	}
+	if (Cache != NULL)
+		FlushDirCache(Cache);
+	// The buffers are kept by the arena for the next batch
+	ArenaRelease(Mark);
 	return Status;
 }
@@ -0,0 +1,419 @@
+/*
+ * uefi-md5sum: UEFI MD5Sum validator - Binary index of the hash list
+ * Copyright © 2024 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "boot.h"
+
+/* Identification of the index format. An index of another version is just stale. */
+#define HASH_INDEX_MAGIC    0x5844494D  /* "MIDX" */
+#define HASH_INDEX_VERSION  2
+
+/*
+ * Header of the binary index of a hash list. It is followed by the arrays of the
+ * HASH_LIST, as laid out by GetIndexLayout(), with the byte order of the platform,
+ * which is little endian for all the UEFI architectures.
+ */
+typedef struct {
+	UINT32      Magic;
+	UINT32      Version;
+	UINT64      HashFileSize;   /* The size of the hash list file that the index was created from */
+	UINT8       HashFileDigest[MD5_HASHSIZE];   /* The MD5 hash of that file */
+	UINT8       Digest[MD5_HASHSIZE];           /* The MD5 hash of the arrays that follow the header */
+	UINT64      TotalBytes;
+	UINT32      NumEntries;
+	UINT32      NumDirs;
+	UINT32      PathsSize;      /* The number of characters of the path pool */
+	UINT8       NumVolumes;
+	UINT8       NtfsDirect;
+	UINT8       Reserved[2];
+	CHAR8       VolumeId[HASH_VOLUMES_MAX][VOLUME_ID_MAX + 1];
+} HASH_INDEX_HEADER;
+
+/* Offsets of the arrays of a hash list in its index, from the end of the header */
+typedef struct {
+	UINTN       Digest;
+	UINTN       ExpectedSize;
+	UINTN       DirId;
+	UINTN       NameOffset;
+	UINTN       Dirs;           /* The parent and the name of each directory of the trie */
+	UINTN       Paths;
+	UINTN       VolumeIndex;
+	UINTN       Flags;
+	UINTN       Size;           /* The size of all the arrays */
+} HASH_INDEX_LAYOUT;
+
+/* Lay out the arrays of a hash list in its index, with the wider elements first so that they are aligned */
+STATIC VOID GetIndexLayout(
+	IN CONST UINTN NumEntries,
+	IN CONST UINTN NumDirs,
+	IN CONST UINTN PathsSize,
+	OUT HASH_INDEX_LAYOUT* Layout
+)
+{
+	Layout->Digest = 0;
+	Layout->ExpectedSize = Layout->Digest + NumEntries * MD5_HASHSIZE;
+	Layout->DirId = Layout->ExpectedSize + NumEntries * sizeof(UINT64);
+	Layout->NameOffset = Layout->DirId + NumEntries * sizeof(UINT32);
+	Layout->Dirs = Layout->NameOffset + NumEntries * sizeof(UINT32);
+	Layout->Paths = Layout->Dirs + NumDirs * 2 * sizeof(UINT32);
+	Layout->VolumeIndex = Layout->Paths + PathsSize * sizeof(CHAR16);
+	Layout->Flags = Layout->VolumeIndex + NumEntries;
+	Layout->Size = Layout->Flags + NumEntries;
+}
+
+/* Return the length of a name from the path pool of an index, or PATH_MAX + 1 if it is too long */
+STATIC UINTN GetNameLength(
+	IN CONST CHAR16* Name
+)
+{
+	UINTN Len;
+
+	// The pool was checked to end with a NUL, so this can't read past it
+	for (Len = 0; Len <= PATH_MAX && Name[Len] != L'\0'; Len++);
+	return Len;
+}
+
+/**
+  Validate the arrays from an index, before they are used as the entries of a
+  hash list. Since the index is only checked against the hash list file that it
+  was created from, this makes sure that it can't be used to access data out of
+  the arrays, or to produce paths that are too long, even if it was crafted.
+
+  @param[in]  Header            A pointer to the header of the index.
+  @param[in]  Layout            A pointer to the layout of the arrays.
+  @param[in]  Base              A pointer to the arrays.
+  @param[in]  DirLen            A scratch array of Header->NumDirs elements.
+
+  @retval TRUE if the arrays are valid, FALSE otherwise.
+**/
+STATIC BOOLEAN IsValidIndex(
+	IN CONST HASH_INDEX_HEADER* Header,
+	IN CONST HASH_INDEX_LAYOUT* Layout,
+	IN CONST UINT8* Base,
+	IN UINTN* DirLen
+)
+{
+	CONST UINT32* DirId = (CONST UINT32*)&Base[Layout->DirId];
+	CONST UINT32* NameOffset = (CONST UINT32*)&Base[Layout->NameOffset];
+	CONST UINT32* Dirs = (CONST UINT32*)&Base[Layout->Dirs];
+	CONST CHAR16* Paths = (CONST CHAR16*)&Base[Layout->Paths];
+	UINTN i, Len;
+
+	if (Header->PathsSize == 0 || Paths[Header->PathsSize - 1] != L'\0')
+		return FALSE;
+	// The boot volume has no identifier
+	if (Header->VolumeId[0][0] != '\0')
+		return FALSE;
+	for (i = 0; i < HASH_VOLUMES_MAX; i++) {
+		if (Header->VolumeId[i][VOLUME_ID_MAX] != '\0')
+			return FALSE;
+	}
+
+	// The parent of a directory is always added to the trie before it
+	for (i = 0; i < Header->NumDirs; i++) {
+		if (Dirs[2 * i + 1] >= Header->PathsSize ||
+			(Dirs[2 * i] != HASH_DIR_NONE && Dirs[2 * i] >= i))
+			return FALSE;
+		DirLen[i] = GetNameLength(&Paths[Dirs[2 * i + 1]]) + 1;
+		if (Dirs[2 * i] != HASH_DIR_NONE)
+			DirLen[i] += DirLen[Dirs[2 * i]];
+		if (DirLen[i] > PATH_MAX)
+			return FALSE;
+	}
+
+	for (i = 0; i < Header->NumEntries; i++) {
+		if ((DirId[i] != HASH_DIR_NONE && DirId[i] >= Header->NumDirs) ||
+			NameOffset[i] >= Header->PathsSize ||
+			Base[Layout->VolumeIndex + i] >= Header->NumVolumes ||
+			(Base[Layout->Flags + i] & ~HASH_ENTRY_INVALID_PATH) != 0)
+			return FALSE;
+		Len = GetNameLength(&Paths[NameOffset[i]]);
+		if (DirId[i] != HASH_DIR_NONE)
+			Len += DirLen[DirId[i]];
+		if (Len > PATH_MAX)
+			return FALSE;
+	}
+	return TRUE;
+}
+
+/**
+  Load the entries of a hash list from its binary index, instead of parsing
+  them, if the index was created from the same hash list file. This requires
+  the hash list file to fit in a single window, that is read to compute the
+  key of the index. The index is ignored if it is stale or invalid.
+
+  @param[in]     Root           A file handle to the directory holding the index.
+  @param[in]     Path           The path of the index.
+  @param[in/out] List           A pointer to the HASH_LIST, set up by OpenHashList().
+
+  @retval EFI_SUCCESS           The entries were loaded, and ParseHashList() must not be called.
+  @retval EFI_INVALID_PARAMETER One or more of the input parameters are invalid.
+  @retval EFI_UNSUPPORTED       The hash list file does not fit in a single window.
+  @retval EFI_NOT_FOUND         There is no valid index for the hash list file.
+  @retval EFI_END_OF_FILE       The hash list file could not be read.
+  @retval EFI_OUT_OF_RESOURCES  A memory allocation error occurred.
+**/
+EFI_STATUS LoadHashIndex(
+	IN CONST EFI_FILE_HANDLE Root,
+	IN CONST CHAR16* Path,
+	IN OUT HASH_LIST* List
+)
+{
+	EFI_STATUS Status;
+	EFI_FILE_HANDLE File = NULL;
+	HASH_INDEX_HEADER Header;
+	HASH_INDEX_LAYOUT Layout, MaxLayout;
+	ARENA_MARK Mark, ScratchMark;
+	HASH_DIR* Dir;
+	UINT8 *Base, Digest[MD5_HASHSIZE];
+	UINT32* Dirs;
+	UINTN d, Size, *DirLen;
+
+	if (Root == NULL || Path == NULL || List == NULL || List->File == NULL || List->Buffer == NULL)
+		return EFI_INVALID_PARAMETER;
+	if (List->FileSize > List->BufferSize || List->FileRead != 0)
+		return EFI_UNSUPPORTED;
+
+	// Read the whole hash list file, to compute the key of the index. If there
+	// is no valid index, ParseHashList() parses the data we read. For a
+	// compressed file, the key is computed on the decompressed data.
+	Size = (UINTN)List->FileSize;
+	Status = ReadHashFile(List, List->Buffer, &Size);
+	if (EFI_ERROR(Status) || Size != List->FileSize) {
+		// Let ParseHashList() read the file again, and report the error. A
+		// compressed file can't be rewound, but its errors are final anyway.
+		if (List->Stream == NULL)
+			List->File->SetPosition(List->File, 0);
+		return EFI_END_OF_FILE;
+	}
+	List->DataSize = Size;
+	List->FileRead = Size;
+	Md5HashBuffer(List->Buffer, Size, List->FileDigest);
+	List->HasFileDigest = TRUE;
+
+	// The directory blocks are allocated before the data we read from the index,
+	// which is released on exit, but they are released too if the index is stale.
+	Mark = ArenaGetMark();
+	ScratchMark = Mark;
+	Status = Root->Open(Root, &File, (CHAR16*)Path, EFI_FILE_MODE_READ, 0);
+	if (EFI_ERROR(Status)) {
+		File = NULL;
+		Status = EFI_NOT_FOUND;
+		goto out;
+	}
+	Size = sizeof(Header);
+	Status = File->Read(File, &Size, &Header);
+	if (EFI_ERROR(Status) || Size != sizeof(Header) ||
+		Header.Magic != HASH_INDEX_MAGIC || Header.Version != HASH_INDEX_VERSION ||
+		Header.HashFileSize != List->FileSize ||
+		CompareMem(Header.HashFileDigest, List->FileDigest, MD5_HASHSIZE) != 0) {
+		Status = EFI_NOT_FOUND;
+		goto out;
+	}
+	// A path takes at least one character and its NUL from the pool, as well
+	// as each directory, so the pool bounds everything else.
+	GetIndexLayout(List->MaxEntries, List->BufferSize + 1, List->BufferSize + 1, &MaxLayout);
+	if (Header.NumEntries > List->MaxEntries || Header.PathsSize > List->BufferSize + 1 ||
+		Header.NumDirs > Header.PathsSize || Header.NumVolumes == 0 ||
+		Header.NumVolumes > HASH_VOLUMES_MAX) {
+		Status = EFI_NOT_FOUND;
+		goto out;
+	}
+	GetIndexLayout(Header.NumEntries, Header.NumDirs, Header.PathsSize, &Layout);
+	V_ASSERT(Layout.Size <= MaxLayout.Size);
+
+	for (d = 0; d < Header.NumDirs; d += HASH_DIR_BLOCK_SIZE) {
+		List->DirBlock[d / HASH_DIR_BLOCK_SIZE] = ArenaAllocate(HASH_DIR_BLOCK_SIZE * sizeof(HASH_DIR));
+		if (List->DirBlock[d / HASH_DIR_BLOCK_SIZE] == NULL) {
+			Status = EFI_OUT_OF_RESOURCES;
+			goto out;
+		}
+	}
+	ScratchMark = ArenaGetMark();
+
+	// Read the arrays at once, and make sure there is nothing after them
+	Base = ArenaAllocate(Layout.Size + 1);
+	DirLen = ArenaAllocate((Header.NumDirs + 1) * sizeof(UINTN));
+	if (Base == NULL || DirLen == NULL) {
+		Status = EFI_OUT_OF_RESOURCES;
+		goto out;
+	}
+	Size = Layout.Size + 1;
+	Status = File->Read(File, &Size, Base);
+	Md5HashBuffer(Base, Layout.Size, Digest);
+	if (EFI_ERROR(Status) || Size != Layout.Size ||
+		CompareMem(Header.Digest, Digest, MD5_HASHSIZE) != 0 ||
+		!IsValidIndex(&Header, &Layout, Base, DirLen)) {
+		Status = EFI_NOT_FOUND;
+		goto out;
+	}
+
+	CopyMem(List->Digest, &Base[Layout.Digest], Header.NumEntries * MD5_HASHSIZE);
+	CopyMem(List->ExpectedSize, &Base[Layout.ExpectedSize], Header.NumEntries * sizeof(UINT64));
+	CopyMem(List->DirId, &Base[Layout.DirId], Header.NumEntries * sizeof(UINT32));
+	CopyMem(List->NameOffset, &Base[Layout.NameOffset], Header.NumEntries * sizeof(UINT32));
+	CopyMem(List->Paths, &Base[Layout.Paths], Header.PathsSize * sizeof(CHAR16));
+	CopyMem(List->VolumeIndex, &Base[Layout.VolumeIndex], Header.NumEntries);
+	CopyMem(List->Flags, &Base[Layout.Flags], Header.NumEntries);
+	Dirs = (UINT32*)&Base[Layout.Dirs];
+	for (d = 0; d < Header.NumDirs; d++) {
+		Dir = HASH_LIST_DIR(List, d);
+		Dir->Parent = Dirs[2 * d];
+		Dir->Name = Dirs[2 * d + 1];
+		// The trie is complete, so its buckets are not needed
+		Dir->Next = HASH_DIR_NONE;
+	}
+	List->NumEntries = Header.NumEntries;
+	List->NumDirs = Header.NumDirs;
+	List->PathsSize = Header.PathsSize;
+	List->TotalBytes = Header.TotalBytes;
+	List->NtfsDirect = (Header.NtfsDirect != 0);
+	List->NumVolumes = Header.NumVolumes;
+	CopyMem(List->VolumeId, Header.VolumeId, sizeof(List->VolumeId));
+
+	// The whole file was covered by this single window
+	List->DataParsed = List->DataSize;
+	List->FileParsed = List->FileSize;
+	List->EndOfList = TRUE;
+	List->IsFromIndex = TRUE;
+	Status = EFI_SUCCESS;
+
+out:
+	if (File != NULL)
+		File->Close(File);
+	ArenaRelease(EFI_ERROR(Status) ? Mark : ScratchMark);
+	return Status;
+}
+
+/**
+  Save the entries of a hash list to a binary index, for LoadHashIndex() to use
+  on the next run. This is only possible for a list that was parsed in a single
+  window, and nothing is written if the list was loaded from its index already.
+
+  @param[in]  Root              A file handle to the directory to write the index into.
+  @param[in]  Path              The path of the index.
+  @param[in]  List              A pointer to the HASH_LIST, holding its last window.
+
+  @retval EFI_SUCCESS           The index was written.
+  @retval EFI_INVALID_PARAMETER One or more of the input parameters are invalid.
+  @retval EFI_UNSUPPORTED       The list can not be indexed, or references the index.
+  @retval EFI_OUT_OF_RESOURCES  A memory allocation error occurred.
+  @retval EFI_WRITE_PROTECTED   The volume is read-only.
+**/
+EFI_STATUS SaveHashIndex(
+	IN CONST EFI_FILE_HANDLE Root,
+	IN CONST CHAR16* Path,
+	IN CONST HASH_LIST* List
+)
+{
+	EFI_STATUS Status;
+	EFI_FILE_HANDLE File = NULL;
+	HASH_INDEX_HEADER* Header;
+	HASH_INDEX_LAYOUT Layout;
+	ARENA_MARK Mark;
+	CONST HASH_DIR* Dir;
+	CHAR16* EntryPath;
+	UINT8 *Data, *Base;
+	UINT32* Dirs;
+	UINTN i, j, Size;
+
+	if (Root == NULL || Path == NULL || List == NULL)
+		return EFI_INVALID_PARAMETER;
+	// LoadHashIndex() only computes the key of lists that fit in a single window
+	if (!List->HasFileDigest || List->IsFromIndex || !List->EndOfList ||
+		List->FileParsed != List->FileSize)
+		return EFI_UNSUPPORTED;
+
+	Mark = ArenaGetMark();
+	GetIndexLayout(List->NumEntries, List->NumDirs, List->PathsSize, &Layout);
+	Size = sizeof(HASH_INDEX_HEADER) + Layout.Size;
+	Data = ArenaAllocate(Size);
+	EntryPath = ArenaAllocate((PATH_MAX + 1) * sizeof(CHAR16));
+	if (Data == NULL || EntryPath == NULL) {
+		Status = EFI_OUT_OF_RESOURCES;
+		goto out;
+	}
+
+	// Writing the index must not alter a file that the list validates
+	for (i = 0; i < List->NumEntries; i++) {
+		if (List->VolumeIndex[i] != 0)
+			continue;
+		GetHashEntryPath(List, i, EntryPath);
+		for (j = 0; EntryPath[j] == L'\\' || (EntryPath[j] == L'.' && EntryPath[j + 1] == L'\\'); j++);
+		if (_StriCmp(&EntryPath[j], Path) == 0) {
+			Status = EFI_UNSUPPORTED;
+			goto out;
+		}
+	}
+
+	Header = (HASH_INDEX_HEADER*)Data;
+	ZeroMem(Header, sizeof(HASH_INDEX_HEADER));
+	Header->Magic = HASH_INDEX_MAGIC;
+	Header->Version = HASH_INDEX_VERSION;
+	Header->HashFileSize = List->FileSize;
+	CopyMem(Header->HashFileDigest, List->FileDigest, MD5_HASHSIZE);
+	Header->TotalBytes = List->TotalBytes;
+	Header->NumEntries = (UINT32)List->NumEntries;
+	Header->NumDirs = (UINT32)List->NumDirs;
+	Header->PathsSize = (UINT32)List->PathsSize;
+	Header->NumVolumes = (UINT8)List->NumVolumes;
+	Header->NtfsDirect = List->NtfsDirect ? 1 : 0;
+	CopyMem(Header->VolumeId, List->VolumeId, sizeof(Header->VolumeId));
+
+	Base = &Data[sizeof(HASH_INDEX_HEADER)];
+	CopyMem(&Base[Layout.Digest], List->Digest, List->NumEntries * MD5_HASHSIZE);
+	CopyMem(&Base[Layout.ExpectedSize], List->ExpectedSize, List->NumEntries * sizeof(UINT64));
+	CopyMem(&Base[Layout.DirId], List->DirId, List->NumEntries * sizeof(UINT32));
+	CopyMem(&Base[Layout.NameOffset], List->NameOffset, List->NumEntries * sizeof(UINT32));
+	CopyMem(&Base[Layout.Paths], List->Paths, List->PathsSize * sizeof(CHAR16));
+	CopyMem(&Base[Layout.VolumeIndex], List->VolumeIndex, List->NumEntries);
+	CopyMem(&Base[Layout.Flags], List->Flags, List->NumEntries);
+	Dirs = (UINT32*)&Base[Layout.Dirs];
+	for (i = 0; i < List->NumDirs; i++) {
+		Dir = HASH_LIST_DIR(List, i);
+		Dirs[2 * i] = Dir->Parent;
+		Dirs[2 * i + 1] = Dir->Name;
+	}
+	Md5HashBuffer(Base, Layout.Size, Header->Digest);
+
+	// Replace the existing index, which is stale. If it can't be deleted, it
+	// is overwritten, and any data left after the new one makes it invalid.
+	if (!EFI_ERROR(Root->Open(Root, &File, (CHAR16*)Path, EFI_FILE_MODE_READ | EFI_FILE_MODE_WRITE, 0)))
+		File->Delete(File);
+	File = NULL;
+	Status = Root->Open(Root, &File, (CHAR16*)Path,
+		EFI_FILE_MODE_READ | EFI_FILE_MODE_WRITE | EFI_FILE_MODE_CREATE, 0);
+	if (EFI_ERROR(Status)) {
+		File = NULL;
+		goto out;
+	}
+	i = Size;
+	Status = File->Write(File, &i, Data);
+	if (!EFI_ERROR(Status) && i != Size)
+		Status = EFI_VOLUME_FULL;
+	// Don't leave a partial index behind
+	if (EFI_ERROR(Status)) {
+		File->Delete(File);
+		File = NULL;
+	}
+
+out:
+	if (File != NULL)
+		File->Close(File);
+	ArenaRelease(Mark);
+	return Status;
+}
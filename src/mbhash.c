@@ -0,0 +1,360 @@
+/*
+ * uefi-md5sum: UEFI MD5Sum validator - Multi-buffer MD5 functions
+ * Copyright © 2024 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * MD5 has a fully serial dependency chain within a single stream, which
+ * leaves most of the execution units of a modern CPU idle. However, since
+ * we usually have many files to validate, we can hash several of these at
+ * once, with each independent stream (lane) being held in a separate 32-bit
+ * element of a SIMD register. This is what the kernels below do: they run
+ * the exact same MD5 steps as Md5Transform(), but for 4 (SSE2/NEON) or
+ * 8 (AVX2) files at once.
+ */
+
+#include "boot.h"
+
+#if defined(_M_X64) || defined(__x86_64__)
+#define MD5_MB_X64
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#include <immintrin.h>
+#if defined(__GNUC__) || defined(__clang__)
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define TARGET_AVX2
+#endif
+#elif (defined(_M_ARM64) || defined(__aarch64__)) && (defined(__ARM_NEON) || defined(_MSC_VER))
+/*
+ * NB: EDK2 builds AARCH64 code with -mgeneral-regs-only, which undefines
+ * __ARM_NEON and prevents the use of NEON intrinsics. In that case we just
+ * fall back to single lane hashing.
+ */
+#define MD5_MB_NEON
+#if defined(_MSC_VER)
+#include <arm64_neon.h>
+#else
+#include <arm_neon.h>
+#endif
+#endif
+
+#if defined(MD5_MB_X64) || defined(MD5_MB_NEON)
+
+/*
+ * The 64 MD5 steps, as (function, a, b, c, d, message index, constant, shift),
+ * expanded through the STEP macro provided by each kernel.
+ */
+#define MD5_MB_STEPS(STEP) \
+	STEP(1, a, b, c, d,  0, 0xd76aa478,  7); STEP(1, d, a, b, c,  1, 0xe8c7b756, 12); \
+	STEP(1, c, d, a, b,  2, 0x242070db, 17); STEP(1, b, c, d, a,  3, 0xc1bdceee, 22); \
+	STEP(1, a, b, c, d,  4, 0xf57c0faf,  7); STEP(1, d, a, b, c,  5, 0x4787c62a, 12); \
+	STEP(1, c, d, a, b,  6, 0xa8304613, 17); STEP(1, b, c, d, a,  7, 0xfd469501, 22); \
+	STEP(1, a, b, c, d,  8, 0x698098d8,  7); STEP(1, d, a, b, c,  9, 0x8b44f7af, 12); \
+	STEP(1, c, d, a, b, 10, 0xffff5bb1, 17); STEP(1, b, c, d, a, 11, 0x895cd7be, 22); \
+	STEP(1, a, b, c, d, 12, 0x6b901122,  7); STEP(1, d, a, b, c, 13, 0xfd987193, 12); \
+	STEP(1, c, d, a, b, 14, 0xa679438e, 17); STEP(1, b, c, d, a, 15, 0x49b40821, 22); \
+	STEP(2, a, b, c, d,  1, 0xf61e2562,  5); STEP(2, d, a, b, c,  6, 0xc040b340,  9); \
+	STEP(2, c, d, a, b, 11, 0x265e5a51, 14); STEP(2, b, c, d, a,  0, 0xe9b6c7aa, 20); \
+	STEP(2, a, b, c, d,  5, 0xd62f105d,  5); STEP(2, d, a, b, c, 10, 0x02441453,  9); \
+	STEP(2, c, d, a, b, 15, 0xd8a1e681, 14); STEP(2, b, c, d, a,  4, 0xe7d3fbc8, 20); \
+	STEP(2, a, b, c, d,  9, 0x21e1cde6,  5); STEP(2, d, a, b, c, 14, 0xc33707d6,  9); \
+	STEP(2, c, d, a, b,  3, 0xf4d50d87, 14); STEP(2, b, c, d, a,  8, 0x455a14ed, 20); \
+	STEP(2, a, b, c, d, 13, 0xa9e3e905,  5); STEP(2, d, a, b, c,  2, 0xfcefa3f8,  9); \
+	STEP(2, c, d, a, b,  7, 0x676f02d9, 14); STEP(2, b, c, d, a, 12, 0x8d2a4c8a, 20); \
+	STEP(3, a, b, c, d,  5, 0xfffa3942,  4); STEP(3, d, a, b, c,  8, 0x8771f681, 11); \
+	STEP(3, c, d, a, b, 11, 0x6d9d6122, 16); STEP(3, b, c, d, a, 14, 0xfde5380c, 23); \
+	STEP(3, a, b, c, d,  1, 0xa4beea44,  4); STEP(3, d, a, b, c,  4, 0x4bdecfa9, 11); \
+	STEP(3, c, d, a, b,  7, 0xf6bb4b60, 16); STEP(3, b, c, d, a, 10, 0xbebfbc70, 23); \
+	STEP(3, a, b, c, d, 13, 0x289b7ec6,  4); STEP(3, d, a, b, c,  0, 0xeaa127fa, 11); \
+	STEP(3, c, d, a, b,  3, 0xd4ef3085, 16); STEP(3, b, c, d, a,  6, 0x04881d05, 23); \
+	STEP(3, a, b, c, d,  9, 0xd9d4d039,  4); STEP(3, d, a, b, c, 12, 0xe6db99e5, 11); \
+	STEP(3, c, d, a, b, 15, 0x1fa27cf8, 16); STEP(3, b, c, d, a,  2, 0xc4ac5665, 23); \
+	STEP(4, a, b, c, d,  0, 0xf4292244,  6); STEP(4, d, a, b, c,  7, 0x432aff97, 10); \
+	STEP(4, c, d, a, b, 14, 0xab9423a7, 15); STEP(4, b, c, d, a,  5, 0xfc93a039, 21); \
+	STEP(4, a, b, c, d, 12, 0x655b59c3,  6); STEP(4, d, a, b, c,  3, 0x8f0ccc92, 10); \
+	STEP(4, c, d, a, b, 10, 0xffeff47d, 15); STEP(4, b, c, d, a,  1, 0x85845dd1, 21); \
+	STEP(4, a, b, c, d,  8, 0x6fa87e4f,  6); STEP(4, d, a, b, c, 15, 0xfe2ce6e0, 10); \
+	STEP(4, c, d, a, b,  6, 0xa3014314, 15); STEP(4, b, c, d, a, 13, 0x4e0811a1, 21); \
+	STEP(4, a, b, c, d,  4, 0xf7537e82,  6); STEP(4, d, a, b, c, 11, 0xbd3af235, 10); \
+	STEP(4, c, d, a, b,  2, 0x2ad7d2bb, 15); STEP(4, b, c, d, a,  9, 0xeb86d391, 21)
+
+#endif
+
+#if defined(MD5_MB_X64)
+
+/*
+ * SSE2 kernel (4 lanes)
+ */
+#define SSE2_ROTL(w, s)     _mm_or_si128(_mm_slli_epi32(w, s), _mm_srli_epi32(w, 32 - (s)))
+#define SSE2_F1(x, y, z)    _mm_xor_si128(z, _mm_and_si128(x, _mm_xor_si128(y, z)))
+#define SSE2_F2(x, y, z)    SSE2_F1(z, x, y)
+#define SSE2_F3(x, y, z)    _mm_xor_si128(_mm_xor_si128(x, y), z)
+#define SSE2_F4(x, y, z)    _mm_xor_si128(y, _mm_or_si128(x, _mm_xor_si128(z, Ones)))
+#define SSE2_STEP(f, w, x, y, z, k, t, s) do { \
+	w = _mm_add_epi32(w, _mm_add_epi32(SSE2_F##f(x, y, z), _mm_add_epi32(W[k], _mm_set1_epi32((INT32)t)))); \
+	w = SSE2_ROTL(w, s); w = _mm_add_epi32(w, x); } while(0)
+
+STATIC VOID Md5TransformSse2(
+	IN HASH_CONTEXT** Context,
+	IN CONST UINT8** Data,
+	IN CONST UINTN NumBlocks
+)
+{
+	CONST __m128i Ones = _mm_set1_epi32(-1);
+	__m128i a, b, c, d, a0, b0, c0, d0, W[16], t0, t1, t2, t3;
+	UINTN i, j;
+
+	a = _mm_set_epi32(Context[3]->State[0], Context[2]->State[0], Context[1]->State[0], Context[0]->State[0]);
+	b = _mm_set_epi32(Context[3]->State[1], Context[2]->State[1], Context[1]->State[1], Context[0]->State[1]);
+	c = _mm_set_epi32(Context[3]->State[2], Context[2]->State[2], Context[1]->State[2], Context[0]->State[2]);
+	d = _mm_set_epi32(Context[3]->State[3], Context[2]->State[3], Context[1]->State[3], Context[0]->State[3]);
+
+	for (i = 0; i < NumBlocks; i++) {
+		// Transpose the 4 x 16 message words, so that W[k] holds word k of each lane
+		for (j = 0; j < 4; j++) {
+			t0 = _mm_loadu_si128((CONST __m128i*)&Data[0][i * MD5_BLOCKSIZE + j * 16]);
+			t1 = _mm_loadu_si128((CONST __m128i*)&Data[1][i * MD5_BLOCKSIZE + j * 16]);
+			t2 = _mm_loadu_si128((CONST __m128i*)&Data[2][i * MD5_BLOCKSIZE + j * 16]);
+			t3 = _mm_loadu_si128((CONST __m128i*)&Data[3][i * MD5_BLOCKSIZE + j * 16]);
+			W[4 * j + 0] = _mm_unpacklo_epi32(t0, t1);
+			W[4 * j + 1] = _mm_unpacklo_epi32(t2, t3);
+			W[4 * j + 2] = _mm_unpackhi_epi32(t0, t1);
+			W[4 * j + 3] = _mm_unpackhi_epi32(t2, t3);
+			t0 = _mm_unpacklo_epi64(W[4 * j + 0], W[4 * j + 1]);
+			t1 = _mm_unpackhi_epi64(W[4 * j + 0], W[4 * j + 1]);
+			t2 = _mm_unpacklo_epi64(W[4 * j + 2], W[4 * j + 3]);
+			t3 = _mm_unpackhi_epi64(W[4 * j + 2], W[4 * j + 3]);
+			W[4 * j + 0] = t0;
+			W[4 * j + 1] = t1;
+			W[4 * j + 2] = t2;
+			W[4 * j + 3] = t3;
+		}
+
+		a0 = a; b0 = b; c0 = c; d0 = d;
+		MD5_MB_STEPS(SSE2_STEP);
+		a = _mm_add_epi32(a, a0);
+		b = _mm_add_epi32(b, b0);
+		c = _mm_add_epi32(c, c0);
+		d = _mm_add_epi32(d, d0);
+	}
+
+	for (i = 0; i < 4; i++) {
+		Context[i]->State[0] = (UINT32)_mm_cvtsi128_si32(a);
+		Context[i]->State[1] = (UINT32)_mm_cvtsi128_si32(b);
+		Context[i]->State[2] = (UINT32)_mm_cvtsi128_si32(c);
+		Context[i]->State[3] = (UINT32)_mm_cvtsi128_si32(d);
+		a = _mm_srli_si128(a, 4);
+		b = _mm_srli_si128(b, 4);
+		c = _mm_srli_si128(c, 4);
+		d = _mm_srli_si128(d, 4);
+	}
+}
+
+/*
+ * AVX2 kernel (8 lanes)
+ */
+#define AVX2_ROTL(w, s)     _mm256_or_si256(_mm256_slli_epi32(w, s), _mm256_srli_epi32(w, 32 - (s)))
+#define AVX2_F1(x, y, z)    _mm256_xor_si256(z, _mm256_and_si256(x, _mm256_xor_si256(y, z)))
+#define AVX2_F2(x, y, z)    AVX2_F1(z, x, y)
+#define AVX2_F3(x, y, z)    _mm256_xor_si256(_mm256_xor_si256(x, y), z)
+#define AVX2_F4(x, y, z)    _mm256_xor_si256(y, _mm256_or_si256(x, _mm256_xor_si256(z, Ones)))
+#define AVX2_STEP(f, w, x, y, z, k, t, s) do { \
+	w = _mm256_add_epi32(w, _mm256_add_epi32(AVX2_F##f(x, y, z), _mm256_add_epi32(W[k], _mm256_set1_epi32((INT32)t)))); \
+	w = AVX2_ROTL(w, s); w = _mm256_add_epi32(w, x); } while(0)
+
+TARGET_AVX2 STATIC VOID Md5TransformAvx2(
+	IN HASH_CONTEXT** Context,
+	IN CONST UINT8** Data,
+	IN CONST UINTN NumBlocks
+)
+{
+	CONST __m256i Ones = _mm256_set1_epi32(-1);
+	__m256i a, b, c, d, a0, b0, c0, d0, W[16], r[8], t[8];
+	UINT32 ALIGNED(32) s[4][8];
+	UINTN i, j, k;
+
+	for (k = 0; k < 8; k++) {
+		s[0][k] = Context[k]->State[0];
+		s[1][k] = Context[k]->State[1];
+		s[2][k] = Context[k]->State[2];
+		s[3][k] = Context[k]->State[3];
+	}
+	a = _mm256_load_si256((CONST __m256i*)s[0]);
+	b = _mm256_load_si256((CONST __m256i*)s[1]);
+	c = _mm256_load_si256((CONST __m256i*)s[2]);
+	d = _mm256_load_si256((CONST __m256i*)s[3]);
+
+	for (i = 0; i < NumBlocks; i++) {
+		// Transpose the 8 x 16 message words, so that W[k] holds word k of each lane
+		for (j = 0; j < 2; j++) {
+			for (k = 0; k < 8; k++)
+				r[k] = _mm256_loadu_si256((CONST __m256i*)&Data[k][i * MD5_BLOCKSIZE + j * 32]);
+			t[0] = _mm256_unpacklo_epi32(r[0], r[1]);
+			t[1] = _mm256_unpackhi_epi32(r[0], r[1]);
+			t[2] = _mm256_unpacklo_epi32(r[2], r[3]);
+			t[3] = _mm256_unpackhi_epi32(r[2], r[3]);
+			t[4] = _mm256_unpacklo_epi32(r[4], r[5]);
+			t[5] = _mm256_unpackhi_epi32(r[4], r[5]);
+			t[6] = _mm256_unpacklo_epi32(r[6], r[7]);
+			t[7] = _mm256_unpackhi_epi32(r[6], r[7]);
+			r[0] = _mm256_unpacklo_epi64(t[0], t[2]);
+			r[1] = _mm256_unpackhi_epi64(t[0], t[2]);
+			r[2] = _mm256_unpacklo_epi64(t[1], t[3]);
+			r[3] = _mm256_unpackhi_epi64(t[1], t[3]);
+			r[4] = _mm256_unpacklo_epi64(t[4], t[6]);
+			r[5] = _mm256_unpackhi_epi64(t[4], t[6]);
+			r[6] = _mm256_unpacklo_epi64(t[5], t[7]);
+			r[7] = _mm256_unpackhi_epi64(t[5], t[7]);
+			W[8 * j + 0] = _mm256_permute2x128_si256(r[0], r[4], 0x20);
+			W[8 * j + 1] = _mm256_permute2x128_si256(r[1], r[5], 0x20);
+			W[8 * j + 2] = _mm256_permute2x128_si256(r[2], r[6], 0x20);
+			W[8 * j + 3] = _mm256_permute2x128_si256(r[3], r[7], 0x20);
+			W[8 * j + 4] = _mm256_permute2x128_si256(r[0], r[4], 0x31);
+			W[8 * j + 5] = _mm256_permute2x128_si256(r[1], r[5], 0x31);
+			W[8 * j + 6] = _mm256_permute2x128_si256(r[2], r[6], 0x31);
+			W[8 * j + 7] = _mm256_permute2x128_si256(r[3], r[7], 0x31);
+		}
+
+		a0 = a; b0 = b; c0 = c; d0 = d;
+		MD5_MB_STEPS(AVX2_STEP);
+		a = _mm256_add_epi32(a, a0);
+		b = _mm256_add_epi32(b, b0);
+		c = _mm256_add_epi32(c, c0);
+		d = _mm256_add_epi32(d, d0);
+	}
+
+	_mm256_store_si256((__m256i*)s[0], a);
+	_mm256_store_si256((__m256i*)s[1], b);
+	_mm256_store_si256((__m256i*)s[2], c);
+	_mm256_store_si256((__m256i*)s[3], d);
+	// Avoid AVX to SSE transition penalties
+	_mm256_zeroupper();
+	for (k = 0; k < 8; k++) {
+		Context[k]->State[0] = s[0][k];
+		Context[k]->State[1] = s[1][k];
+		Context[k]->State[2] = s[2][k];
+		Context[k]->State[3] = s[3][k];
+	}
+}
+
+STATIC CONST MD5_MB_ENGINE Md5MbSse2 = { L"SSE2", 4, CPU_FEATURE_SSE2, Md5TransformSse2 };
+STATIC CONST MD5_MB_ENGINE Md5MbAvx2 = { L"AVX2", 8, CPU_FEATURE_AVX2, Md5TransformAvx2 };
+
+#elif defined(MD5_MB_NEON)
+
+/*
+ * NEON kernel (4 lanes)
+ */
+#define NEON_ROTL(w, s)     vsriq_n_u32(vshlq_n_u32(w, s), w, 32 - (s))
+#define NEON_F1(x, y, z)    vbslq_u32(x, y, z)
+#define NEON_F2(x, y, z)    vbslq_u32(z, x, y)
+#define NEON_F3(x, y, z)    veorq_u32(veorq_u32(x, y), z)
+#define NEON_F4(x, y, z)    veorq_u32(y, vornq_u32(x, z))
+#define NEON_STEP(f, w, x, y, z, k, t, s) do { \
+	w = vaddq_u32(w, vaddq_u32(NEON_F##f(x, y, z), vaddq_u32(W[k], vdupq_n_u32(t)))); \
+	w = NEON_ROTL(w, s); w = vaddq_u32(w, x); } while(0)
+
+STATIC VOID Md5TransformNeon(
+	IN HASH_CONTEXT** Context,
+	IN CONST UINT8** Data,
+	IN CONST UINTN NumBlocks
+)
+{
+	uint32x4_t a, b, c, d, a0, b0, c0, d0, W[16];
+	uint32x4x4_t v;
+	UINT32 s[4][4];
+	UINTN i, j, k;
+
+	for (k = 0; k < 4; k++) {
+		s[0][k] = Context[k]->State[0];
+		s[1][k] = Context[k]->State[1];
+		s[2][k] = Context[k]->State[2];
+		s[3][k] = Context[k]->State[3];
+	}
+	a = vld1q_u32(s[0]);
+	b = vld1q_u32(s[1]);
+	c = vld1q_u32(s[2]);
+	d = vld1q_u32(s[3]);
+
+	for (i = 0; i < NumBlocks; i++) {
+		// Gather the message words, so that W[k] holds word k of each lane
+		for (j = 0; j < 16; j += 4) {
+			v.val[0] = vld1q_u32((CONST UINT32*)&Data[0][i * MD5_BLOCKSIZE + j * 4]);
+			v.val[1] = vld1q_u32((CONST UINT32*)&Data[1][i * MD5_BLOCKSIZE + j * 4]);
+			v.val[2] = vld1q_u32((CONST UINT32*)&Data[2][i * MD5_BLOCKSIZE + j * 4]);
+			v.val[3] = vld1q_u32((CONST UINT32*)&Data[3][i * MD5_BLOCKSIZE + j * 4]);
+			// 4x4 transposition
+			W[j + 0] = vtrn1q_u32(v.val[0], v.val[1]);
+			W[j + 1] = vtrn2q_u32(v.val[0], v.val[1]);
+			W[j + 2] = vtrn1q_u32(v.val[2], v.val[3]);
+			W[j + 3] = vtrn2q_u32(v.val[2], v.val[3]);
+			v.val[0] = vreinterpretq_u32_u64(vtrn1q_u64(vreinterpretq_u64_u32(W[j + 0]), vreinterpretq_u64_u32(W[j + 2])));
+			v.val[1] = vreinterpretq_u32_u64(vtrn1q_u64(vreinterpretq_u64_u32(W[j + 1]), vreinterpretq_u64_u32(W[j + 3])));
+			v.val[2] = vreinterpretq_u32_u64(vtrn2q_u64(vreinterpretq_u64_u32(W[j + 0]), vreinterpretq_u64_u32(W[j + 2])));
+			v.val[3] = vreinterpretq_u32_u64(vtrn2q_u64(vreinterpretq_u64_u32(W[j + 1]), vreinterpretq_u64_u32(W[j + 3])));
+			W[j + 0] = v.val[0];
+			W[j + 1] = v.val[1];
+			W[j + 2] = v.val[2];
+			W[j + 3] = v.val[3];
+		}
+
+		a0 = a; b0 = b; c0 = c; d0 = d;
+		MD5_MB_STEPS(NEON_STEP);
+		a = vaddq_u32(a, a0);
+		b = vaddq_u32(b, b0);
+		c = vaddq_u32(c, c0);
+		d = vaddq_u32(d, d0);
+	}
+
+	vst1q_u32(s[0], a);
+	vst1q_u32(s[1], b);
+	vst1q_u32(s[2], c);
+	vst1q_u32(s[3], d);
+	for (k = 0; k < 4; k++) {
+		Context[k]->State[0] = s[0][k];
+		Context[k]->State[1] = s[1][k];
+		Context[k]->State[2] = s[2][k];
+		Context[k]->State[3] = s[3][k];
+	}
+}
+
+STATIC CONST MD5_MB_ENGINE Md5MbNeon = { L"NEON", 4, CPU_FEATURE_NEON, Md5TransformNeon };
+
+#endif
+
+/* All the multi-buffer engines compiled for this architecture, in order of preference */
+STATIC CONST MD5_MB_ENGINE* CONST Md5MbEngines[] = {
+#if defined(MD5_MB_X64)
+	&Md5MbAvx2,
+	&Md5MbSse2,
+#elif defined(MD5_MB_NEON)
+	&Md5MbNeon,
+#endif
+	NULL
+};
+
+/**
+  Return the list of multi-buffer MD5 engines available for this architecture.
+  Note that the CPU may not support all of these (see MD5_MB_ENGINE.Features).
+
+  @retval A NULL terminated array of MD5_MB_ENGINE pointers.
+**/
+CONST MD5_MB_ENGINE* CONST* Md5MbGetEngines(VOID)
+{
+	return Md5MbEngines;
+}
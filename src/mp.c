@@ -0,0 +1,218 @@
+/*
+ * uefi-md5sum: UEFI MD5Sum validator - Hashing on application processors
+ * Copyright © 2024 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "boot.h"
+
+STATIC EFI_GUID MpServicesProtocolGuid = EFI_MP_SERVICES_PROTOCOL_GUID;
+
+/**
+  Main loop of a worker, that runs on an application processor. This must not
+  call any boot services, and only processes the jobs from the ring, until the
+  BSP requests the worker to stop.
+
+  @param[in]  Buffer            A pointer to the HASH_WORKER.
+**/
+STATIC VOID EFIAPI HashWorkerProcedure(
+	IN OUT VOID* Buffer
+)
+{
+	HASH_WORKER* Worker = (HASH_WORKER*)Buffer;
+	HASH_JOB* Job;
+	UINTN Tail = Worker->Tail;
+
+	while (Tail != Worker->Head || !Worker->Stop) {
+		if (Tail == Worker->Head) {
+			CpuPause();
+			continue;
+		}
+		// Don't read the job before we have seen that it was submitted
+		MemoryFence();
+		Job = &Worker->Job[Tail % HASH_RING_SIZE];
+		Job->Update(Job->Context, Job->Data, Job->Length);
+		Tail++;
+		// Make the results visible before the job is reported as completed
+		MemoryFence();
+		Worker->Tail = Tail;
+	}
+}
+
+/**
+  Set up the workers that StartHashWorkers() starts, for the application processors
+  reported by MP Services. This is separate from starting them, so that the workers
+  can be allocated along with the data that must last for the whole run, while the
+  APs are only started once there is data for them to hash.
+
+  @param[out] Workers           A pointer to receive the HASH_WORKERS, allocated from the run arena.
+
+  @retval EFI_SUCCESS           The workers were set up.
+  @retval EFI_INVALID_PARAMETER One or more of the input parameters are invalid.
+  @retval EFI_UNSUPPORTED       MP Services are not available, or there are no APs.
+  @retval EFI_OUT_OF_RESOURCES  A memory allocation error occurred.
+**/
+EFI_STATUS CreateHashWorkers(
+	OUT HASH_WORKERS** Workers
+)
+{
+	EFI_STATUS Status;
+	EFI_MP_SERVICES_PROTOCOL* Mp;
+	UINTN i, Bsp, NumProcessors, NumEnabled;
+
+	if (Workers == NULL)
+		return EFI_INVALID_PARAMETER;
+	*Workers = NULL;
+
+	Status = gBS->LocateProtocol(&MpServicesProtocolGuid, NULL, (VOID**)&Mp);
+	if (EFI_ERROR(Status))
+		return EFI_UNSUPPORTED;
+	Status = Mp->WhoAmI(Mp, &Bsp);
+	if (!EFI_ERROR(Status))
+		Status = Mp->GetNumberOfProcessors(Mp, &NumProcessors, &NumEnabled);
+	if (EFI_ERROR(Status) || NumEnabled < 2)
+		return EFI_UNSUPPORTED;
+
+	*Workers = ArenaAllocate(sizeof(HASH_WORKERS));
+	if (*Workers == NULL)
+		return EFI_OUT_OF_RESOURCES;
+	ZeroMem(*Workers, sizeof(HASH_WORKERS));
+	(*Workers)->Mp = Mp;
+	(*Workers)->Bsp = Bsp;
+	(*Workers)->NumProcessors = NumProcessors;
+
+	// Keep each worker on its own cache lines, to avoid false sharing
+	for (i = 0; i < MIN(NumEnabled - 1, ARRAY_SIZE((*Workers)->Worker)); i++) {
+		(*Workers)->Worker[i] = ArenaAllocate(sizeof(HASH_WORKER));
+		if ((*Workers)->Worker[i] == NULL) {
+			*Workers = NULL;
+			return EFI_OUT_OF_RESOURCES;
+		}
+	}
+	return EFI_SUCCESS;
+}
+
+/**
+  Start application processors, through MP Services, to hash data for the BSP.
+  Since boot services can only be used by the BSP, the workers only hash data
+  that the BSP has read, and must be stopped before boot services are used for
+  anything else than I/O, such as to load an image.
+
+  @param[in/out] Workers        A pointer to the HASH_WORKERS, from CreateHashWorkers().
+
+  @retval EFI_SUCCESS           At least one worker was started.
+  @retval EFI_INVALID_PARAMETER One or more of the input parameters are invalid.
+  @retval EFI_UNSUPPORTED       No AP could be started.
+**/
+EFI_STATUS StartHashWorkers(
+	IN OUT HASH_WORKERS* Workers
+)
+{
+	EFI_STATUS Status;
+	HASH_WORKER* Worker;
+	UINTN i;
+
+	if (Workers == NULL)
+		return EFI_INVALID_PARAMETER;
+
+	for (i = 0; i < Workers->NumProcessors && Workers->NumWorkers < ARRAY_SIZE(Workers->Worker); i++) {
+		Worker = Workers->Worker[Workers->NumWorkers];
+		if (Worker == NULL)
+			break;
+		if (i == Workers->Bsp)
+			continue;
+		ZeroMem(Worker, sizeof(HASH_WORKER));
+		if (EFI_ERROR(gBS->CreateEvent(0, 0, NULL, NULL, &Worker->Event)))
+			break;
+		// Processors that are disabled or busy just fail to start. The event
+		// makes the call non-blocking, with the AP running until we stop it.
+		Status = Workers->Mp->StartupThisAP(Workers->Mp, HashWorkerProcedure, i, Worker->Event, 0, Worker, NULL);
+		if (EFI_ERROR(Status)) {
+			gBS->CloseEvent(Worker->Event);
+			continue;
+		}
+		Workers->NumWorkers++;
+	}
+
+	return (Workers->NumWorkers == 0) ? EFI_UNSUPPORTED : EFI_SUCCESS;
+}
+
+/**
+  Stop the workers, once they have completed the jobs that were submitted.
+
+  @param[in]  Workers           (Optional) A pointer to the HASH_WORKERS to stop.
+**/
+VOID StopHashWorkers(
+	OPTIONAL IN HASH_WORKERS* Workers
+)
+{
+	UINTN i, Index;
+
+	if (Workers == NULL)
+		return;
+
+	for (i = 0; i < Workers->NumWorkers; i++)
+		Workers->Worker[i]->Stop = TRUE;
+	MemoryFence();
+	for (i = 0; i < Workers->NumWorkers; i++) {
+		gBS->WaitForEvent(1, &Workers->Worker[i]->Event, &Index);
+		gBS->CloseEvent(Workers->Worker[i]->Event);
+	}
+	Workers->NumWorkers = 0;
+}
+
+/**
+  Submit a hashing job to a worker.
+
+  @param[in]  Worker            A pointer to the HASH_WORKER.
+  @param[in]  Job               A pointer to the HASH_JOB, that is copied into the ring of the worker.
+
+  @retval A non zero ticket, that IsHashJobDone() can be called with, or 0 if the ring is full.
+**/
+UINTN SubmitHashJob(
+	IN HASH_WORKER* Worker,
+	IN CONST HASH_JOB* Job
+)
+{
+	UINTN Head = Worker->Head;
+
+	if (Head - Worker->Tail >= HASH_RING_SIZE)
+		return 0;
+	CopyMem(&Worker->Job[Head % HASH_RING_SIZE], Job, sizeof(HASH_JOB));
+	// The job must be visible before the AP can see that it was submitted
+	MemoryFence();
+	Worker->Head = ++Head;
+	return Head;
+}
+
+/**
+  Check whether a hashing job has been completed by its worker.
+
+  @param[in]  Worker            A pointer to the HASH_WORKER.
+  @param[in]  Ticket            The ticket returned by SubmitHashJob() for the job.
+
+  @retval TRUE if the job was completed, in which case its results can be used, FALSE otherwise.
+**/
+BOOLEAN IsHashJobDone(
+	IN HASH_WORKER* Worker,
+	IN CONST UINTN Ticket
+)
+{
+	if (Worker->Tail < Ticket)
+		return FALSE;
+	// Don't read the results before we have seen that the job was completed
+	MemoryFence();
+	return TRUE;
+}
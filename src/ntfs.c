@@ -0,0 +1,635 @@
+/*
+ * uefi-md5sum: UEFI MD5Sum validator - NTFS direct access
+ * Copyright © 2024 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "boot.h"
+
+/*
+ * This is a minimal read-only implementation, that only resolves the location
+ * of file data. Compressed, encrypted or sparse files, as well as files whose
+ * attributes span multiple file records, are reported as unsupported, so that
+ * the caller falls back to the firmware file system driver.
+ */
+
+/* Well known file records */
+#define NTFS_MFT_RECORD         0
+#define NTFS_ROOT_RECORD        5
+#define NTFS_UPCASE_RECORD      10
+
+/* Number of entries in the $UpCase table */
+#define NTFS_UPCASE_SIZE        0x10000
+
+/* Size of the blocks that update sequence fixups apply to */
+#define NTFS_FIXUP_BLOCK_SIZE   512
+
+/* Maximum depth of a directory index */
+#define NTFS_INDEX_DEPTH_MAX    32
+
+/* Attribute types */
+#define NTFS_ATTR_LIST          0x20
+#define NTFS_ATTR_DATA          0x80
+#define NTFS_ATTR_INDEX_ROOT    0x90
+#define NTFS_ATTR_INDEX_ALLOC   0xA0
+#define NTFS_ATTR_END           0xFFFFFFFF
+
+/* Attribute flags */
+#define NTFS_ATTR_COMPRESSED    0x0001
+#define NTFS_ATTR_ENCRYPTED     0x4000
+#define NTFS_ATTR_SPARSE        0x8000
+
+/* File record flags */
+#define NTFS_RECORD_IN_USE      0x0001
+#define NTFS_RECORD_DIRECTORY   0x0002
+
+/* Index entry flags */
+#define NTFS_INDEX_SUBNODE      0x0001
+#define NTFS_INDEX_LAST         0x0002
+
+/* Offset of the index node header in an index block */
+#define NTFS_INDX_NODE_OFFSET   24
+
+/* Record number part of a file reference */
+#define NTFS_RECORD_NUMBER(r)   ((r) & 0x0000FFFFFFFFFFFFULL)
+
+/* Name of the directory index attributes */
+STATIC CONST CHAR16 IndexName[] = { L'$', L'I', L'3', L'0' };
+
+/**
+  Read a range of data, given the extents that describe its location on the volume.
+
+  @param[in]  Volume            A pointer to the FS_VOLUME.
+  @param[in]  Extents           The FILE_EXTENT array.
+  @param[in]  NumExtents        The number of extents in the array.
+  @param[in]  Offset            The offset of the data to read.
+  @param[in]  Size              The amount of data to read.
+  @param[out] Buffer            A pointer to the buffer receiving the data.
+
+  @retval EFI_SUCCESS           The data was read.
+  @retval EFI_UNSUPPORTED       The range is not fully described by the extents.
+  @retval other                 The disk could not be read.
+**/
+STATIC EFI_STATUS NtfsReadExtents(
+	IN FS_VOLUME* Volume,
+	IN CONST FILE_EXTENT* Extents,
+	IN CONST UINTN NumExtents,
+	IN UINT64 Offset,
+	IN UINTN Size,
+	OUT UINT8* Buffer
+)
+{
+	EFI_STATUS Status;
+	UINT64 Start = 0;
+	UINTN i, Len;
+
+	for (i = 0; i < NumExtents && Size > 0; Start += Extents[i++].Length) {
+		if (Offset >= Start + Extents[i].Length)
+			continue;
+		Len = (UINTN)MIN(Size, Start + Extents[i].Length - Offset);
+		Status = ReadVolume(Volume, Extents[i].Offset + (Offset - Start), Len, Buffer);
+		if (EFI_ERROR(Status))
+			return Status;
+		Offset += Len;
+		Buffer += Len;
+		Size -= Len;
+	}
+	return (Size == 0) ? EFI_SUCCESS : EFI_UNSUPPORTED;
+}
+
+/**
+  Validate a multi-sector structure, and restore the data that its update sequence replaced.
+
+  @param[in/out] Buffer         The structure to process.
+  @param[in]     Size           The size of the structure.
+  @param[in]     Signature      The expected 4-character signature of the structure.
+
+  @retval EFI_SUCCESS           The structure is valid.
+  @retval EFI_VOLUME_CORRUPTED  The structure is invalid or was not fully written.
+**/
+STATIC EFI_STATUS NtfsApplyFixups(
+	IN OUT UINT8* Buffer,
+	IN CONST UINTN Size,
+	IN CONST CHAR8* Signature
+)
+{
+	UINTN i, Offset = READ_LE16(&Buffer[4]), Count = READ_LE16(&Buffer[6]);
+	UINT8* Block;
+
+	if (CompareMem(Buffer, Signature, 4) != 0 || Count != Size / NTFS_FIXUP_BLOCK_SIZE + 1 ||
+		(Offset & 1) != 0 || Offset + 2 * Count > Size)
+		return EFI_VOLUME_CORRUPTED;
+	for (i = 1; i < Count; i++) {
+		Block = &Buffer[i * NTFS_FIXUP_BLOCK_SIZE - 2];
+		if (Block[0] != Buffer[Offset] || Block[1] != Buffer[Offset + 1])
+			return EFI_VOLUME_CORRUPTED;
+		Block[0] = Buffer[Offset + 2 * i];
+		Block[1] = Buffer[Offset + 2 * i + 1];
+	}
+	return EFI_SUCCESS;
+}
+
+/**
+  Read a file record from the Master File Table into the volume record buffer.
+
+  @param[in]  Volume            A pointer to the FS_VOLUME.
+  @param[in]  Reference         The file reference (record number and sequence number).
+
+  @retval EFI_SUCCESS           The record was read.
+  @retval EFI_NOT_FOUND         The record is not in use or doesn't match the reference.
+  @retval EFI_UNSUPPORTED       The record is an extension record or is out of reach.
+  @retval EFI_VOLUME_CORRUPTED  The record is invalid.
+  @retval other                 The disk could not be read.
+**/
+STATIC EFI_STATUS NtfsReadRecord(
+	IN FS_VOLUME* Volume,
+	IN CONST UINT64 Reference
+)
+{
+	EFI_STATUS Status;
+	UINT8* r = Volume->Record;
+	UINT16 Sequence = (UINT16)(Reference >> 48);
+
+	Status = NtfsReadExtents(Volume, Volume->MftExtents, Volume->NumMftExtents,
+		NTFS_RECORD_NUMBER(Reference) * Volume->RecordSize, Volume->RecordSize, r);
+	if (EFI_ERROR(Status))
+		return Status;
+	Status = NtfsApplyFixups(r, Volume->RecordSize, "FILE");
+	if (EFI_ERROR(Status))
+		return Status;
+	if (READ_LE16(&r[20]) < 24 || READ_LE32(&r[24]) > Volume->RecordSize ||
+		READ_LE16(&r[20]) >= READ_LE32(&r[24]))
+		return EFI_VOLUME_CORRUPTED;
+	if (!(READ_LE16(&r[22]) & NTFS_RECORD_IN_USE) || (Sequence != 0 && Sequence != READ_LE16(&r[16])))
+		return EFI_NOT_FOUND;
+	// Extension records only hold attributes that belong to another record
+	if (READ_LE64(&r[32]) != 0)
+		return EFI_UNSUPPORTED;
+	return EFI_SUCCESS;
+}
+
+/**
+  Look up an attribute in the file record held in the volume record buffer.
+
+  @param[in]  Volume            A pointer to the FS_VOLUME.
+  @param[in]  Type              The attribute type.
+  @param[in]  Name              The attribute name, or NULL for an unnamed attribute.
+  @param[in]  NameLength        The length of the attribute name.
+  @param[out] Attribute         A pointer to receive the address of the attribute.
+
+  @retval EFI_SUCCESS           The attribute was found.
+  @retval EFI_NOT_FOUND         The attribute was not found.
+  @retval EFI_UNSUPPORTED       The attributes of the file span multiple records.
+  @retval EFI_VOLUME_CORRUPTED  The record is invalid.
+**/
+STATIC EFI_STATUS NtfsFindAttribute(
+	IN FS_VOLUME* Volume,
+	IN CONST UINT32 Type,
+	IN CONST CHAR16* Name,
+	IN CONST UINTN NameLength,
+	OUT UINT8** Attribute
+)
+{
+	UINT8* r = Volume->Record;
+	UINT8* a;
+	UINT32 Offset = READ_LE16(&r[20]), End = READ_LE32(&r[24]), Length;
+	UINTN i;
+
+	while (Offset + 8 <= End) {
+		a = &r[Offset];
+		if (READ_LE32(a) == NTFS_ATTR_END)
+			return EFI_NOT_FOUND;
+		Length = READ_LE32(&a[4]);
+		if (Length < 24 || Length > End - Offset || (UINT32)READ_LE16(&a[10]) + 2 * a[9] > Length)
+			return EFI_VOLUME_CORRUPTED;
+		Offset += Length;
+		// We can't tell where the attribute we want resides if there's an attribute list
+		if (READ_LE32(a) == NTFS_ATTR_LIST)
+			return EFI_UNSUPPORTED;
+		if (READ_LE32(a) != Type || a[9] != NameLength)
+			continue;
+		for (i = 0; i < NameLength && READ_LE16(&a[READ_LE16(&a[10]) + 2 * i]) == Name[i]; i++);
+		if (i != NameLength)
+			continue;
+		// Validate the attribute header
+		if (a[8] == 0) {
+			if (READ_LE16(&a[20]) + (UINT64)READ_LE32(&a[16]) > Length)
+				return EFI_VOLUME_CORRUPTED;
+		} else if (Length < 64 || READ_LE16(&a[32]) >= Length) {
+			return EFI_VOLUME_CORRUPTED;
+		}
+		*Attribute = a;
+		return EFI_SUCCESS;
+	}
+	return EFI_VOLUME_CORRUPTED;
+}
+
+/**
+  Convert the runs of a non-resident attribute to an array of extents.
+
+  @param[in]     Volume         A pointer to the FS_VOLUME.
+  @param[in]     Attribute      A pointer to the non-resident attribute.
+  @param[in/out] Extents        A pointer to the (reallocated as needed) FILE_EXTENT array.
+  @param[in/out] NumExtents     A pointer to the number of extents in the array.
+
+  @retval EFI_SUCCESS           The runs were converted.
+  @retval EFI_UNSUPPORTED       The attribute is sparse or only partially described.
+  @retval EFI_VOLUME_CORRUPTED  The runs are invalid.
+  @retval EFI_OUT_OF_RESOURCES  A memory allocation error occurred.
+**/
+STATIC EFI_STATUS NtfsGetRuns(
+	IN FS_VOLUME* Volume,
+	IN CONST UINT8* Attribute,
+	IN OUT FILE_EXTENT** Extents,
+	IN OUT UINTN* NumExtents
+)
+{
+	EFI_STATUS Status;
+	CONST UINT8* p = &Attribute[READ_LE16(&Attribute[32])];
+	CONST UINT8* End = &Attribute[READ_LE32(&Attribute[4])];
+	UINT64 Length, NumVcns = 0;
+	INT64 Lcn = 0, Delta;
+	UINTN i, LengthSize, OffsetSize;
+
+	// Only attributes that are described by a single record are supported
+	if (READ_LE64(&Attribute[16]) != 0)
+		return EFI_UNSUPPORTED;
+
+	while (p < End && *p != 0) {
+		LengthSize = *p & 0x0F;
+		OffsetSize = *p >> 4;
+		if (LengthSize == 0 || LengthSize > 8 || OffsetSize > 8 ||
+			(UINTN)(End - p) < 1 + LengthSize + OffsetSize)
+			return EFI_VOLUME_CORRUPTED;
+		// Runs without an offset are sparse
+		if (OffsetSize == 0)
+			return EFI_UNSUPPORTED;
+		for (Length = 0, i = LengthSize; i > 0; i--)
+			Length = (Length << 8) | p[i];
+		// The offset is signed and relative to the previous run
+		Delta = (p[LengthSize + OffsetSize] & 0x80) ? -1 : 0;
+		for (i = LengthSize + OffsetSize; i > LengthSize; i--)
+			Delta = (INT64)(((UINT64)Delta << 8) | p[i]);
+		Lcn += Delta;
+		if (Length == 0 || Length > Volume->NumClusters || Lcn < 0 ||
+			(UINT64)Lcn + Length > Volume->NumClusters)
+			return EFI_VOLUME_CORRUPTED;
+		Status = AddFileExtent(Extents, NumExtents, (UINT64)Lcn * Volume->ClusterSize,
+			Length * Volume->ClusterSize);
+		if (EFI_ERROR(Status))
+			return Status;
+		NumVcns += Length;
+		p += 1 + LengthSize + OffsetSize;
+	}
+	return (NumVcns == READ_LE64(&Attribute[24]) + 1) ? EFI_SUCCESS : EFI_UNSUPPORTED;
+}
+
+/**
+  Collate a name against the name from a directory index entry, in the same
+  case insensitive manner as NTFS does to sort its directory indexes.
+
+  @param[in]  Volume            A pointer to the FS_VOLUME.
+  @param[in]  Name              The NUL-terminated name to look up.
+  @param[in]  Key               A pointer to the (unterminated) little endian name from the index.
+  @param[in]  KeyLength         The length of the name from the index.
+
+  @retval < 0 if Name comes before the key, 0 if they match, or > 0 if Name comes after the key.
+**/
+STATIC INTN NtfsCollate(
+	IN FS_VOLUME* Volume,
+	IN CONST CHAR16* Name,
+	IN CONST UINT8* Key,
+	IN CONST UINTN KeyLength
+)
+{
+	CHAR16 c1, c2;
+	UINTN i;
+
+	for (i = 0; i < KeyLength && Name[i] != L'\0'; i++) {
+		c1 = Volume->UpCase[Name[i]];
+		c2 = Volume->UpCase[READ_LE16(&Key[2 * i])];
+		if (c1 != c2)
+			return (c1 < c2) ? -1 : 1;
+	}
+	if (Name[i] != L'\0')
+		return 1;
+	return (i < KeyLength) ? -1 : 0;
+}
+
+/**
+  Look up a name in the directory whose file record is held in the volume record buffer.
+
+  @param[in]  Volume            A pointer to the FS_VOLUME.
+  @param[in]  Name              The name to look up.
+  @param[out] Reference         A pointer to receive the file reference of the entry.
+
+  @retval EFI_SUCCESS           The entry was found.
+  @retval EFI_NOT_FOUND         The entry was not found.
+  @retval EFI_UNSUPPORTED       The directory index can't be accessed.
+  @retval EFI_VOLUME_CORRUPTED  The directory index is invalid.
+  @retval EFI_OUT_OF_RESOURCES  A memory allocation error occurred.
+  @retval other                 The disk could not be read.
+**/
+STATIC EFI_STATUS NtfsFindEntry(
+	IN FS_VOLUME* Volume,
+	IN CONST CHAR16* Name,
+	OUT UINT64* Reference
+)
+{
+	EFI_STATUS Status;
+	FILE_EXTENT* IndexExtents = NULL;
+	UINTN NumIndexExtents = 0, Depth, Length = 0, KeyLength, Flags = 0;
+	UINT8 *Root, *Alloc, *Node, *e, *End;
+	UINT64 Vcn;
+	INTN Cmp;
+
+	Status = NtfsFindAttribute(Volume, NTFS_ATTR_INDEX_ROOT, IndexName, ARRAY_SIZE(IndexName), &Root);
+	if (EFI_ERROR(Status))
+		return (Status == EFI_NOT_FOUND) ? EFI_VOLUME_CORRUPTED : Status;
+	if (Root[8] != 0 || READ_LE32(&Root[16]) < 32)
+		return EFI_VOLUME_CORRUPTED;
+	// Large directories also have index blocks, that the root entries point to
+	Status = NtfsFindAttribute(Volume, NTFS_ATTR_INDEX_ALLOC, IndexName, ARRAY_SIZE(IndexName), &Alloc);
+	if (Status == EFI_SUCCESS) {
+		if (Alloc[8] == 0)
+			return EFI_VOLUME_CORRUPTED;
+		Status = NtfsGetRuns(Volume, Alloc, &IndexExtents, &NumIndexExtents);
+	} else if (Status == EFI_NOT_FOUND) {
+		Status = EFI_SUCCESS;
+	}
+	if (EFI_ERROR(Status))
+		goto out;
+
+	// Start with the entries from the index root, held in the record buffer
+	Node = &Root[READ_LE16(&Root[20]) + 16];
+	End = &Root[READ_LE16(&Root[20]) + READ_LE32(&Root[16])];
+	for (Depth = 0; Depth < NTFS_INDEX_DEPTH_MAX; Depth++) {
+		if (READ_LE32(&Node[4]) > (UINTN)(End - Node) || READ_LE32(Node) < 16 ||
+			READ_LE32(Node) >= READ_LE32(&Node[4])) {
+			Status = EFI_VOLUME_CORRUPTED;
+			goto out;
+		}
+		End = &Node[READ_LE32(&Node[4])];
+		// Entries are sorted, and those that have a subnode point to the
+		// index block that holds the names that collate before their own.
+		for (e = &Node[READ_LE32(Node)]; ; e += Length) {
+			if (e + 16 > End || (Length = READ_LE16(&e[8])) < 16 || Length > (UINTN)(End - e)) {
+				Status = EFI_VOLUME_CORRUPTED;
+				goto out;
+			}
+			Flags = READ_LE16(&e[12]);
+			if (!(Flags & NTFS_INDEX_LAST)) {
+				KeyLength = READ_LE16(&e[10]);
+				if (KeyLength < 66 || 16 + KeyLength > Length || 66 + 2 * (UINTN)e[16 + 64] > KeyLength) {
+					Status = EFI_VOLUME_CORRUPTED;
+					goto out;
+				}
+				Cmp = NtfsCollate(Volume, Name, &e[16 + 66], e[16 + 64]);
+				if (Cmp == 0) {
+					*Reference = READ_LE64(e);
+					goto out;
+				}
+				if (Cmp > 0)
+					continue;
+			}
+			break;
+		}
+		if (!(Flags & NTFS_INDEX_SUBNODE) || Length < 24) {
+			Status = EFI_NOT_FOUND;
+			goto out;
+		}
+
+		// Read the index block that the entry points to
+		Vcn = READ_LE64(&e[Length - 8]);
+		Status = NtfsReadExtents(Volume, IndexExtents, NumIndexExtents,
+			Vcn * ((Volume->IndexSize >= Volume->ClusterSize) ? Volume->ClusterSize : NTFS_FIXUP_BLOCK_SIZE),
+			Volume->IndexSize, Volume->Buffer);
+		if (EFI_ERROR(Status))
+			goto out;
+		Status = NtfsApplyFixups(Volume->Buffer, Volume->IndexSize, "INDX");
+		if (EFI_ERROR(Status))
+			goto out;
+		Node = &Volume->Buffer[NTFS_INDX_NODE_OFFSET];
+		End = &Volume->Buffer[Volume->IndexSize];
+	}
+	Status = EFI_VOLUME_CORRUPTED;
+
+out:
+	if (IndexExtents != NULL)
+		FreePool(IndexExtents);
+	return Status;
+}
+
+/**
+  Set up a volume for direct access, if it holds an NTFS file system.
+
+  @param[in/out] Volume         A pointer to the FS_VOLUME, with its disk access fields set.
+  @param[in]     BootSector     The first 512 bytes of the volume.
+
+  @retval EFI_SUCCESS           The volume holds a valid NTFS file system.
+  @retval EFI_UNSUPPORTED       The volume does not hold an NTFS file system we can access.
+  @retval EFI_VOLUME_CORRUPTED  The file system metadata is inconsistent.
+  @retval EFI_OUT_OF_RESOURCES  A memory allocation error occurred.
+  @retval other                 The disk could not be read.
+**/
+EFI_STATUS NtfsMountVolume(
+	IN OUT FS_VOLUME* Volume,
+	IN CONST UINT8* BootSector
+)
+{
+	EFI_STATUS Status;
+	CONST UINT8* b = BootSector;
+	FILE_EXTENT* UpCaseExtents = NULL;
+	UINTN i, NumUpCaseExtents = 0;
+	UINT64 MftOffset, TotalClusters;
+	UINT32 SectorsPerCluster;
+	UINT8* a;
+
+	if (READ_LE16(&b[510]) != 0xAA55 || CompareMem(&b[3], "NTFS    ", 8) != 0)
+		return EFI_UNSUPPORTED;
+
+	Volume->SectorSize = READ_LE16(&b[11]);
+	if (Volume->SectorSize != 512 && Volume->SectorSize != 1024 && Volume->SectorSize != 2048 &&
+		Volume->SectorSize != 4096)
+		return EFI_UNSUPPORTED;
+	// Large cluster sizes are expressed as a negative power of two
+	SectorsPerCluster = (b[13] <= 0x80) ? b[13] : 1U << (256 - b[13]);
+	if (SectorsPerCluster == 0 || (SectorsPerCluster & (SectorsPerCluster - 1)) != 0 ||
+		SectorsPerCluster > (2 * 1024 * 1024) / Volume->SectorSize)
+		return EFI_UNSUPPORTED;
+	Volume->ClusterSize = SectorsPerCluster * Volume->SectorSize;
+	TotalClusters = READ_LE64(&b[40]) / SectorsPerCluster;
+	if (TotalClusters == 0 || TotalClusters > 0xFFFFFFFF)
+		return EFI_UNSUPPORTED;
+	Volume->NumClusters = (UINT32)TotalClusters;
+	// Record sizes are expressed either in clusters or as a negative power of two
+	Volume->RecordSize = ((INT8)b[64] > 0) ? b[64] * Volume->ClusterSize : 1U << (-(INT8)b[64] & 0x1F);
+	Volume->IndexSize = ((INT8)b[68] > 0) ? b[68] * Volume->ClusterSize : 1U << (-(INT8)b[68] & 0x1F);
+	if (Volume->RecordSize < 1024 || Volume->RecordSize > VOLUME_BUFFER_SIZE ||
+		(Volume->RecordSize & (Volume->RecordSize - 1)) != 0 ||
+		Volume->IndexSize < 1024 || Volume->IndexSize > VOLUME_BUFFER_SIZE ||
+		(Volume->IndexSize & (Volume->IndexSize - 1)) != 0)
+		return EFI_UNSUPPORTED;
+	if (READ_LE64(&b[48]) >= Volume->NumClusters)
+		return EFI_VOLUME_CORRUPTED;
+	MftOffset = READ_LE64(&b[48]) * Volume->ClusterSize;
+
+	Volume->Record = AllocatePool(Volume->RecordSize);
+	Volume->UpCase = AllocatePool(NTFS_UPCASE_SIZE * sizeof(CHAR16));
+	if (Volume->Record == NULL || Volume->UpCase == NULL)
+		return EFI_OUT_OF_RESOURCES;
+	Volume->Type = FS_TYPE_NTFS;
+
+	// The first record of the MFT describes the location of the MFT itself
+	Status = AddFileExtent(&Volume->MftExtents, &Volume->NumMftExtents, MftOffset, Volume->RecordSize);
+	if (EFI_ERROR(Status))
+		return Status;
+	Status = NtfsReadRecord(Volume, NTFS_MFT_RECORD);
+	if (EFI_ERROR(Status))
+		return Status;
+	Status = NtfsFindAttribute(Volume, NTFS_ATTR_DATA, NULL, 0, &a);
+	if (EFI_ERROR(Status))
+		return (Status == EFI_NOT_FOUND) ? EFI_VOLUME_CORRUPTED : Status;
+	if (a[8] == 0)
+		return EFI_VOLUME_CORRUPTED;
+	FreePool(Volume->MftExtents);
+	Volume->MftExtents = NULL;
+	Volume->NumMftExtents = 0;
+	Status = NtfsGetRuns(Volume, a, &Volume->MftExtents, &Volume->NumMftExtents);
+	if (EFI_ERROR(Status))
+		return Status;
+
+	// Names are sorted in directory indexes according to the $UpCase table
+	Status = NtfsReadRecord(Volume, NTFS_UPCASE_RECORD);
+	if (EFI_ERROR(Status))
+		return Status;
+	Status = NtfsFindAttribute(Volume, NTFS_ATTR_DATA, NULL, 0, &a);
+	if (EFI_ERROR(Status))
+		return (Status == EFI_NOT_FOUND) ? EFI_VOLUME_CORRUPTED : Status;
+	if (a[8] == 0 || READ_LE64(&a[48]) != NTFS_UPCASE_SIZE * sizeof(CHAR16))
+		return EFI_UNSUPPORTED;
+	Status = NtfsGetRuns(Volume, a, &UpCaseExtents, &NumUpCaseExtents);
+	if (!EFI_ERROR(Status))
+		Status = NtfsReadExtents(Volume, UpCaseExtents, NumUpCaseExtents, 0,
+			NTFS_UPCASE_SIZE * sizeof(CHAR16), (UINT8*)Volume->UpCase);
+	if (UpCaseExtents != NULL)
+		FreePool(UpCaseExtents);
+	if (EFI_ERROR(Status))
+		return Status;
+	// The table is little endian on disk
+	for (i = 0; i < NTFS_UPCASE_SIZE; i++)
+		Volume->UpCase[i] = READ_LE16((UINT8*)&Volume->UpCase[i]);
+
+	Volume->RootDir.Reference = NTFS_ROOT_RECORD;
+	Volume->RootDir.IsDirectory = TRUE;
+	return EFI_SUCCESS;
+}
+
+/**
+  Look up several names in a directory of an NTFS volume. Only the names which
+  result is EFI_NOT_FOUND on input are looked up.
+  See LookupVolumeNames() for the parameters.
+
+  @retval EFI_SUCCESS           The directory was read.
+  @retval other                 The directory could not be read.
+**/
+EFI_STATUS NtfsLookupNames(
+	IN FS_VOLUME* Volume,
+	IN CONST FS_NODE* Dir,
+	IN CONST CHAR16* CONST* Names,
+	IN CONST UINTN NumNames,
+	OUT FS_NODE* Nodes,
+	IN OUT EFI_STATUS* Results
+)
+{
+	EFI_STATUS Status;
+	UINTN i;
+
+	// The names are looked up from the index of the directory record, that
+	// remains in the record buffer, so it is only read once.
+	Status = NtfsReadRecord(Volume, Dir->Reference);
+	if (EFI_ERROR(Status))
+		return Status;
+	if (!(READ_LE16(&Volume->Record[22]) & NTFS_RECORD_DIRECTORY))
+		return EFI_SUCCESS;
+	for (i = 0; i < NumNames; i++) {
+		if (Results[i] != EFI_NOT_FOUND)
+			continue;
+		ZeroMem(&Nodes[i], sizeof(FS_NODE));
+		Results[i] = NtfsFindEntry(Volume, Names[i], &Nodes[i].Reference);
+	}
+	return EFI_SUCCESS;
+}
+
+/**
+  Resolve a file to the list of extents holding its data on an NTFS volume.
+  See GetFileExtents() for the parameters and return values.
+**/
+EFI_STATUS NtfsGetFileExtents(
+	IN FS_VOLUME* Volume,
+	IN CONST FS_NODE* Node,
+	OUT FILE_EXTENT** Extents,
+	OUT UINTN* NumExtents,
+	OUT UINT64* FileSize
+)
+{
+	EFI_STATUS Status;
+	UINT64 Offset, Size;
+	UINT32 Start, Len;
+	UINTN i;
+	UINT8* a;
+
+	Status = NtfsReadRecord(Volume, Node->Reference);
+	if (EFI_ERROR(Status))
+		return Status;
+	if (READ_LE16(&Volume->Record[22]) & NTFS_RECORD_DIRECTORY)
+		return EFI_UNSUPPORTED;
+
+	Status = NtfsFindAttribute(Volume, NTFS_ATTR_DATA, NULL, 0, &a);
+	if (EFI_ERROR(Status))
+		return Status;
+	if (READ_LE16(&a[12]) & (NTFS_ATTR_COMPRESSED | NTFS_ATTR_ENCRYPTED | NTFS_ATTR_SPARSE))
+		return EFI_UNSUPPORTED;
+
+	if (a[8] == 0) {
+		// Small files have their data held in the file record. We can only read
+		// it from the disk if it doesn't overlap data replaced by the fixups.
+		Start = (UINT32)(a - Volume->Record) + READ_LE16(&a[20]);
+		Len = READ_LE32(&a[16]);
+		*FileSize = Len;
+		if (Len == 0)
+			return EFI_SUCCESS;
+		if ((Start / NTFS_FIXUP_BLOCK_SIZE + 1) * NTFS_FIXUP_BLOCK_SIZE - 2 < Start + Len)
+			return EFI_UNSUPPORTED;
+		// Locate the record on the volume
+		Offset = NTFS_RECORD_NUMBER(Node->Reference) * Volume->RecordSize + Start;
+		for (i = 0; i < Volume->NumMftExtents; Offset -= Volume->MftExtents[i++].Length) {
+			if (Offset < Volume->MftExtents[i].Length)
+				break;
+		}
+		if (i >= Volume->NumMftExtents || Volume->MftExtents[i].Length - Offset < Len)
+			return EFI_UNSUPPORTED;
+		return AddFileExtent(Extents, NumExtents, Volume->MftExtents[i].Offset + Offset, Len);
+	}
+
+	// The data past the initialized size is undefined on disk, and reads as zeroes
+	Size = READ_LE64(&a[48]);
+	if (READ_LE64(&a[56]) != Size || READ_LE64(&a[40]) < Size)
+		return EFI_UNSUPPORTED;
+	*FileSize = Size;
+	if (Size == 0)
+		return EFI_SUCCESS;
+	return NtfsGetRuns(Volume, a, Extents, NumExtents);
+}
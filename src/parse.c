@@ -21,41 +21,530 @@
 /* The hash sum list file may provide a comment with the total size of bytes to process */
 STATIC CONST CHAR8 TotalBytesString[] = "md5sum_totalbytes";
 
+/* The hash sum list file may request NTFS volumes to always be read with our own reader */
+STATIC CONST CHAR8 NtfsDirectString[] = "md5sum_ntfs_direct";
+
+/* The hash sum list file may reference files from other volumes, by label or partition GUID */
+STATIC CONST CHAR8 VolumeString[] = "md5sum_volume";
+
+/* The hash sum list file may prevent the binary index of the list from being saved */
+STATIC CONST CHAR8 IndexString[] = "md5sum_index";
+
+/* The hash sum list file may provide a comment with the size of the file of the next entry */
+STATIC CONST CHAR8 SizeString[] = "md5sum_size";
+
+/*
+ * Since md5sum.txt can be very large, the characters that the parser has to
+ * act on (line breaks, control characters and slashes) are looked for, and the
+ * hashes validated, 16 bytes at a time with SSE2 or NEON. Other architectures,
+ * or AARCH64 builds without NEON (see mbhash.c), look for these characters a
+ * word at a time instead.
+ */
+#if defined(_M_X64) || defined(__x86_64__)
+#define PARSE_SSE2
+#include <emmintrin.h>
+#elif (defined(_M_ARM64) || defined(__aarch64__)) && (defined(__ARM_NEON) || defined(_MSC_VER))
+#define PARSE_NEON
+#if defined(_MSC_VER)
+#include <arm64_neon.h>
+#else
+#include <arm_neon.h>
+#endif
+#endif
+
+#if defined(PARSE_SSE2) || defined(PARSE_NEON)
+#define SCAN_BLOCK_SIZE     16
+#endif
+
+#if defined(PARSE_SSE2)
+
+#define SCAN_LOAD(p)        _mm_loadu_si128((CONST __m128i*)(p))
+#define SCAN_MASK(v)        ((UINT32)_mm_movemask_epi8(v))
+#define SCAN_CONTROL(v)     SCAN_MASK(_mm_cmpeq_epi8(_mm_min_epu8(v, _mm_set1_epi8(0x1f)), v))
+#define SCAN_EQUAL(v, c)    SCAN_MASK(_mm_cmpeq_epi8(v, _mm_set1_epi8(c)))
+
+/*
+ * Validate and lowercase a block of hexascii, in place.
+ * Since bytes above 0x7f are negative, signed comparisons reject them.
+ */
+STATIC __inline BOOLEAN LowerHexBlock(
+	IN OUT UINT8* Data
+)
+{
+	__m128i v = SCAN_LOAD(Data), l = _mm_or_si128(v, _mm_set1_epi8(0x20));
+	__m128i Digit = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('0' - 1)),
+		_mm_cmplt_epi8(v, _mm_set1_epi8('9' + 1)));
+	__m128i Alpha = _mm_and_si128(_mm_cmpgt_epi8(l, _mm_set1_epi8('a' - 1)),
+		_mm_cmplt_epi8(l, _mm_set1_epi8('f' + 1)));
+
+	if (SCAN_MASK(_mm_or_si128(Digit, Alpha)) != 0xffff)
+		return FALSE;
+	// Digits already have bit 5 set, so this only changes A-F
+	_mm_storeu_si128((__m128i*)Data, l);
+	return TRUE;
+}
+
+/* Convert two blocks of validated lowercase hexascii to binary */
+STATIC __inline VOID DecodeHexBlocks(
+	IN CONST UINT8* Data,
+	OUT UINT8* Value
+)
+{
+	__m128i v[2], n;
+	UINTN i;
+
+	for (i = 0; i < 2; i++) {
+		// The low nibble of 'a'-'f' is 9 less than the value
+		v[i] = SCAN_LOAD(&Data[i * SCAN_BLOCK_SIZE]);
+		n = _mm_add_epi8(_mm_and_si128(v[i], _mm_set1_epi8(0x0f)),
+			_mm_and_si128(_mm_cmpgt_epi8(v[i], _mm_set1_epi8('9')), _mm_set1_epi8(9)));
+		// Each 16-bit lane holds the high nibble in its low byte
+		v[i] = _mm_and_si128(_mm_or_si128(_mm_slli_epi16(n, 4), _mm_srli_epi16(n, 8)),
+			_mm_set1_epi16(0xff));
+	}
+	_mm_storeu_si128((__m128i*)Value, _mm_packus_epi16(v[0], v[1]));
+}
+
+#elif defined(PARSE_NEON)
+
+/* NEON has no movemask, so we weigh each lane and add the halves */
+STATIC __inline UINT32 NeonMask(
+	IN CONST uint8x16_t v
+)
+{
+	STATIC CONST UINT8 Weight[16] = { 1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128 };
+	uint8x16_t b = vandq_u8(v, vld1q_u8(Weight));
+
+	return vaddv_u8(vget_low_u8(b)) | ((UINT32)vaddv_u8(vget_high_u8(b)) << 8);
+}
+
+#define SCAN_LOAD(p)        vld1q_u8(p)
+#define SCAN_CONTROL(v)     NeonMask(vcltq_u8(v, vdupq_n_u8(' ')))
+#define SCAN_EQUAL(v, c)    NeonMask(vceqq_u8(v, vdupq_n_u8(c)))
+
+/* Validate and lowercase a block of hexascii, in place */
+STATIC __inline BOOLEAN LowerHexBlock(
+	IN OUT UINT8* Data
+)
+{
+	uint8x16_t v = SCAN_LOAD(Data), l = vorrq_u8(v, vdupq_n_u8(0x20));
+	uint8x16_t Digit = vandq_u8(vcgeq_u8(v, vdupq_n_u8('0')), vcleq_u8(v, vdupq_n_u8('9')));
+	uint8x16_t Alpha = vandq_u8(vcgeq_u8(l, vdupq_n_u8('a')), vcleq_u8(l, vdupq_n_u8('f')));
+
+	if (vminvq_u8(vorrq_u8(Digit, Alpha)) == 0)
+		return FALSE;
+	// Digits already have bit 5 set, so this only changes A-F
+	vst1q_u8(Data, l);
+	return TRUE;
+}
+
+/* Convert two blocks of validated lowercase hexascii to binary */
+STATIC __inline VOID DecodeHexBlocks(
+	IN CONST UINT8* Data,
+	OUT UINT8* Value
+)
+{
+	// Split the high and low nibble characters
+	uint8x16x2_t v = vld2q_u8(Data);
+	uint8x16_t n[2];
+	UINTN i;
+
+	for (i = 0; i < 2; i++) {
+		// The low nibble of 'a'-'f' is 9 less than the value
+		n[i] = vaddq_u8(vandq_u8(v.val[i], vdupq_n_u8(0x0f)),
+			vandq_u8(vcgtq_u8(v.val[i], vdupq_n_u8('9')), vdupq_n_u8(9)));
+	}
+	vst1q_u8(Value, vorrq_u8(vshlq_n_u8(n[0], 4), n[1]));
+}
+
+#else
+
+/* Test whether any byte of a word is lower than n, for n <= 0x80 */
+#define SWAR_ONES           (MAX_UINTN / 0xff)
+#define SWAR_HAS_LESS(w, n) ((((w) - SWAR_ONES * (n)) & ~(w) & (SWAR_ONES * 0x80)) != 0)
+#define SWAR_HAS_BYTE(w, c) SWAR_HAS_LESS((w) ^ (SWAR_ONES * (c)), 1)
+#define SWAR_ALIGNED(p)     (((UINTN)(p) & (sizeof(UINTN) - 1)) == 0)
+
+#endif
+
+/**
+  Look for the first control character (i.e. lower than space) of a buffer.
+
+  @param[in]  Data   A pointer to the buffer.
+  @param[in]  Start  The position to start looking from.
+  @param[in]  End    The position to stop looking at.
+
+  @retval The position of the first control character, or End if there is none.
+**/
+STATIC UINTN FindControl(
+	IN CONST UINT8* Data,
+	IN UINTN Start,
+	IN CONST UINTN End
+)
+{
+#if defined(SCAN_BLOCK_SIZE)
+	UINT32 Mask;
+
+	for (; Start + SCAN_BLOCK_SIZE <= End; Start += SCAN_BLOCK_SIZE) {
+		Mask = SCAN_CONTROL(SCAN_LOAD(&Data[Start]));
+		if (Mask != 0)
+			return Start + LowBitSet32(Mask);
+	}
+#else
+	for (; Start < End && !SWAR_ALIGNED(&Data[Start]); Start++) {
+		if (Data[Start] < ' ')
+			return Start;
+	}
+	for (; Start + sizeof(UINTN) <= End; Start += sizeof(UINTN)) {
+		if (SWAR_HAS_LESS(*(CONST UINTN*)&Data[Start], ' '))
+			break;
+	}
+#endif
+	for (; Start < End && Data[Start] >= ' '; Start++);
+	return Start;
+}
+
+/**
+  Convert the slashes of a path to backslashes, up to the first control character.
+
+  @param[in]  Data   A pointer to the buffer holding the path.
+  @param[in]  Start  The position of the start of the path.
+  @param[in]  End    The position to stop at.
+
+  @retval The position of the first control character, or End if there is none.
+**/
+STATIC UINTN ScanPath(
+	IN OUT UINT8* Data,
+	IN UINTN Start,
+	IN CONST UINTN End
+)
+{
+#if defined(SCAN_BLOCK_SIZE)
+	UINT32 Control, Slash;
+	INTN Pos;
+
+	for (; Start + SCAN_BLOCK_SIZE <= End; Start += SCAN_BLOCK_SIZE) {
+		Control = SCAN_CONTROL(SCAN_LOAD(&Data[Start]));
+		Slash = SCAN_EQUAL(SCAN_LOAD(&Data[Start]), '/');
+		Pos = (Control == 0) ? SCAN_BLOCK_SIZE : LowBitSet32(Control);
+		// Only convert the slashes that precede the end of the path
+		for (Slash &= (1U << Pos) - 1; Slash != 0; Slash &= Slash - 1)
+			Data[Start + LowBitSet32(Slash)] = '\\';
+		if (Control != 0)
+			return Start + Pos;
+	}
+#else
+	UINTN i, Word;
+
+	for (; Start < End && !SWAR_ALIGNED(&Data[Start]); Start++) {
+		if (Data[Start] < ' ')
+			return Start;
+		if (Data[Start] == '/')
+			Data[Start] = '\\';
+	}
+	for (; Start + sizeof(UINTN) <= End; Start += sizeof(UINTN)) {
+		Word = *(CONST UINTN*)&Data[Start];
+		if (SWAR_HAS_LESS(Word, ' '))
+			break;
+		if (SWAR_HAS_BYTE(Word, '/')) {
+			for (i = Start; i < Start + sizeof(UINTN); i++) {
+				if (Data[i] == '/')
+					Data[i] = '\\';
+			}
+		}
+	}
+#endif
+	for (; Start < End && Data[Start] >= ' '; Start++) {
+		if (Data[Start] == '/')
+			Data[Start] = '\\';
+	}
+	return Start;
+}
+
+/**
+  Validate a hexascii string and convert it to lowercase, in place.
+  If the string is invalid, the characters that precede the first invalid one
+  are still converted, so that the string can be reported as for byte parsing.
+
+  @param[in]  Data   A pointer to the hexascii string.
+  @param[in]  Size   The size of the string.
+
+  @retval TRUE if the string only contains hexascii characters, FALSE otherwise.
+**/
+STATIC BOOLEAN LowerHexAscii(
+	IN OUT UINT8* Data,
+	IN CONST UINTN Size
+)
+{
+	UINTN i = 0;
+
+#if defined(SCAN_BLOCK_SIZE)
+	// Let the loop below deal with the block that contains an invalid character
+	for (; i + SCAN_BLOCK_SIZE <= Size; i += SCAN_BLOCK_SIZE) {
+		if (!LowerHexBlock(&Data[i]))
+			break;
+	}
+#endif
+	for (; i < Size; i++) {
+		// Convert A-F to lowercase
+		if (Data[i] >= 'A' && Data[i] <= 'F')
+			Data[i] += 0x20;
+		if (!IsValidHexAscii(Data[i]))
+			return FALSE;
+	}
+	return TRUE;
+}
+
+/**
+  Convert a hexascii hash, that was validated by LowerHexAscii(), to binary.
+
+  @param[in]  Data   A pointer to the HASH_HEXASCII_SIZE hexascii string.
+  @param[out] Hash   A pointer to the MD5_HASHSIZE buffer to receive the binary value.
+**/
+STATIC VOID DecodeHexAscii(
+	IN CONST UINT8* Data,
+	OUT UINT8* Hash
+)
+{
+#if defined(SCAN_BLOCK_SIZE)
+	DecodeHexBlocks(Data, Hash);
+#else
+	UINTN i;
+
+	ZeroMem(Hash, MD5_HASHSIZE);
+	for (i = 0; i < HASH_HEXASCII_SIZE; i++) {
+		// The parser should have filtered any invalid string
+		V_ASSERT(IsValidHexAscii(Data[i]));
+		Hash[i / 2] <<= 4;
+		Hash[i / 2] |= Data[i] >= 'a' ? (Data[i] - 'a' + 0x0A) : Data[i] - '0';
+	}
+#endif
+}
+
+/**
+  Parse the "= 0x####" value of an md5sum_totalbytes or md5sum_size comment, as
+  a 64-bit hexascii value. Spaces are allowed anywhere after the prefix.
+
+  @param[in]  Data   A pointer to the data of the window.
+  @param[in]  Pos    The position following the name of the variable.
+  @param[in]  End    The position of the '\n' that terminates the comment.
+  @param[out] Value  A pointer to receive the value.
+
+  @retval TRUE if the value is valid, FALSE otherwise.
+**/
+STATIC BOOLEAN ParseHexValue(
+	IN CONST UINT8* Data,
+	IN UINTN Pos,
+	IN CONST UINTN End,
+	OUT UINT64* Value
+)
+{
+	UINTN NumDigits = 0;
+
+	*Value = 0;
+	// Look for an equal sign
+	while (Pos < End && IsWhiteSpace(Data[Pos]))
+		Pos++;
+	if (Data[Pos++] != '=')
+		return FALSE;
+	// Look for an '0x' prefix and parse a 64-bit hexascii value
+	while (Pos < End && IsWhiteSpace(Data[Pos]))
+		Pos++;
+	if (Pos + 1 >= End || Data[Pos] != '0' || Data[Pos + 1] != 'x')
+		return FALSE;
+	for (Pos += 2; Pos < End; Pos++) {
+		if (Data[Pos] == ' ')
+			continue;
+		if (!IsValidHexAscii(Data[Pos]))
+			return FALSE;
+		NumDigits++;
+		*Value <<= 4;
+		// IsValidHexAscii() above made sure that our character
+		// is in the [0-9] or [A-F] or [a-f] ranges.
+		if (Data[Pos] - '0' < 0xa)
+			*Value |= Data[Pos] - '0';
+		else if (Data[Pos] - 'A' < 6)
+			*Value |= Data[Pos] - 'A' + 0xa;
+		else
+			*Value |= Data[Pos] - 'a' + 0xa;
+	}
+	return (NumDigits != 0 && NumDigits <= 16);
+}
+
 /**
-  Parse a hash sum list file and populate a HASH_LIST structure from it.
+  Parse the "= 0|1" value of an md5sum_ntfs_direct or md5sum_index comment.
+
+  @param[in]  Data   A pointer to the data of the window.
+  @param[in]  Pos    The position following the name of the variable.
+  @param[in]  End    The position of the '\n' that terminates the comment.
+  @param[out] Value  A pointer to receive the value.
+
+  @retval TRUE if the value is valid, FALSE otherwise.
+**/
+STATIC BOOLEAN ParseBoolValue(
+	IN CONST UINT8* Data,
+	IN UINTN Pos,
+	IN CONST UINTN End,
+	OUT BOOLEAN* Value
+)
+{
+	// Look for an equal sign
+	while (Pos < End && IsWhiteSpace(Data[Pos]))
+		Pos++;
+	if (Data[Pos++] != '=')
+		return FALSE;
+	while (Pos < End && IsWhiteSpace(Data[Pos]))
+		Pos++;
+	if (Pos >= End || (Data[Pos] != '0' && Data[Pos] != '1'))
+		return FALSE;
+	*Value = (Data[Pos++] == '1');
+	// Only allow trailing whitespaces after the value
+	while (Pos < End && IsWhiteSpace(Data[Pos]))
+		Pos++;
+	return (Pos >= End);
+}
+
+/**
+  Look up a directory from the trie of a hash list, and add it if needed. The
+  name of a new directory is moved down to the end of the path pool.
+
+  @param[in/out] List      A pointer to the HASH_LIST structure.
+  @param[in]     Parent    The parent directory, or HASH_DIR_NONE.
+  @param[in]     Name      A pointer to the name of the directory, in the path pool.
+  @param[in]     Len       The length of the name.
+  @param[in/out] PoolSize  A pointer to the size of the path pool, which can't be past Name.
+
+  @retval The directory, or HASH_DIR_NONE on allocation error.
+**/
+STATIC UINT32 AddDir(
+	IN OUT HASH_LIST* List,
+	IN CONST UINT32 Parent,
+	IN CONST CHAR16* Name,
+	IN CONST UINTN Len,
+	IN OUT UINTN* PoolSize
+)
+{
+	HASH_DIR* Dir;
+	UINT32 d, Hash = 2166136261U ^ Parent;
+	UINTN i, Bucket;
+
+	// FNV-1a. Unlike the directory index, the names are case sensitive here.
+	for (i = 0; i < Len; i++)
+		Hash = (Hash ^ Name[i]) * 16777619U;
+	Bucket = Hash & (List->NumDirBuckets - 1);
+	for (d = List->DirBucket[Bucket]; d != HASH_DIR_NONE; d = Dir->Next) {
+		Dir = HASH_LIST_DIR(List, d);
+		if (Dir->Parent == Parent && CompareMem(&List->Paths[Dir->Name], Name, Len * sizeof(CHAR16)) == 0 &&
+			List->Paths[Dir->Name + Len] == L'\0')
+			return d;
+	}
+
+	if (List->NumDirs % HASH_DIR_BLOCK_SIZE == 0) {
+		List->DirBlock[List->NumDirs / HASH_DIR_BLOCK_SIZE] = ArenaAllocate(HASH_DIR_BLOCK_SIZE * sizeof(HASH_DIR));
+		if (List->DirBlock[List->NumDirs / HASH_DIR_BLOCK_SIZE] == NULL)
+			return HASH_DIR_NONE;
+	}
+	d = (UINT32)List->NumDirs++;
+	Dir = HASH_LIST_DIR(List, d);
+	Dir->Parent = Parent;
+	Dir->Name = (UINT32)*PoolSize;
+	Dir->Next = List->DirBucket[Bucket];
+	List->DirBucket[Bucket] = d;
+	CopyMem(&List->Paths[*PoolSize], Name, Len * sizeof(CHAR16));
+	List->Paths[*PoolSize + Len] = L'\0';
+	*PoolSize += Len + 1;
+	return d;
+}
+
+/**
+  Split the path of an entry, that was converted at the end of the path pool,
+  into the directories of the trie and the name of the entry. Only the names of
+  the directories that were not in the trie yet are kept in the pool.
+
+  @param[in/out] List      A pointer to the HASH_LIST structure.
+  @param[in]     Entry     The index of the entry.
+  @param[in/out] PoolSize  A pointer to the size of the path pool, where the path starts.
+
+  @retval EFI_SUCCESS           The path was added.
+  @retval EFI_OUT_OF_RESOURCES  A memory allocation error occurred.
+**/
+STATIC EFI_STATUS AddEntryPath(
+	IN OUT HASH_LIST* List,
+	IN CONST UINTN Entry,
+	IN OUT UINTN* PoolSize
+)
+{
+	CONST CHAR16* Path = &List->Paths[*PoolSize];
+	UINT32 Dir = HASH_DIR_NONE;
+	UINTN Len;
+
+	// Since the parser converted all the slashes, we only have backslashes.
+	// Moving the names down can't overwrite the part of the path we parse,
+	// as each name is moved along with at most its separator.
+	while (1) {
+		for (Len = 0; Path[Len] != L'\0' && Path[Len] != L'\\'; Len++);
+		if (Path[Len] == L'\0')
+			break;
+		Dir = AddDir(List, Dir, Path, Len, PoolSize);
+		if (Dir == HASH_DIR_NONE)
+			return EFI_OUT_OF_RESOURCES;
+		Path += Len + 1;
+	}
+	List->DirId[Entry] = Dir;
+	List->NameOffset[Entry] = (UINT32)*PoolSize;
+	CopyMem(&List->Paths[*PoolSize], Path, (Len + 1) * sizeof(CHAR16));
+	*PoolSize += Len + 1;
+	return EFI_SUCCESS;
+}
+
+/**
+  Open a hash sum list file, for its entries to be parsed one window at a time
+  with ParseHashList(), so that they can be processed before the whole file has
+  been read. The buffer for the window of the file, as well as the entries of
+  that window, are allocated from the run arena.
 
   @param[in]  Root   A file handle to the root directory.
   @param[in]  Path   A pointer to the CHAR16 string.
-  @param[out] List   A pointer to the HASH_LIST structure to populate.
+  @param[out] List   A pointer to the HASH_LIST structure to set up.
 
-  @retval EFI_SUCCESS           The file was successfully parsed and the hash list is populated.
+  @retval EFI_SUCCESS           The file was opened and the hash list can be parsed.
   @retval EFI_INVALID_PARAMETER One or more of the input parameters are invalid.
   @retval EFI_OUT_OF_RESOURCES  A memory allocation error occurred.
   @retval EFI_NOT_FOUND         The hash list file does not exist.
   @retval EFI_UNSUPPORTED       The hash list file is too small or too large.
-  @retval EFI_END_OF_FILE       The hash list file could not be read.
-  @retval EFI_ABORTED           The hash list file contains invalid data.
 **/
-EFI_STATUS Parse(
+EFI_STATUS OpenHashList(
 	IN CONST EFI_FILE_HANDLE Root,
 	IN CONST CHAR16* Path,
 	OUT HASH_LIST* List
 )
 {
 	EFI_STATUS Status;
-	EFI_FILE_HANDLE File = NULL;
 	EFI_FILE_INFO* Info = NULL;
-	UINT8* HashFile = NULL;
-	HASH_ENTRY* HashList = NULL;
-	UINTN i, c, Size, HashFileSize, NumLines, NumEntries, NumDigits;
-	UINT64 TotalBytes = 0;
+	ARENA_MARK Mark = ArenaGetMark();
+	CHAR16 GzPath[PATH_MAX + 1];
+	BOOLEAN IsCompressed = FALSE;
+	UINTN Size, MaxEntries;
 
 	if (Root == NULL || Path == NULL || List == NULL)
 		return EFI_INVALID_PARAMETER;
 
-	// Look for the hash file on the boot partition
-	Status = Root->Open(Root, &File, (CHAR16*)Path, EFI_FILE_MODE_READ, EFI_FILE_READ_ONLY);
+	ZeroMem(List, sizeof(HASH_LIST));
+	// The boot volume is always the first volume of the list
+	List->NumVolumes = 1;
+	List->PendingSize = HASH_SIZE_UNKNOWN;
+
+	// Look for the hash file on the boot partition, or for its compressed version
+	Status = Root->Open(Root, &List->File, (CHAR16*)Path, EFI_FILE_MODE_READ, EFI_FILE_READ_ONLY);
+	if (Status == EFI_NOT_FOUND) {
+		UnicodeSPrint(GzPath, ARRAY_SIZE(GzPath), L"%s.gz", Path);
+		if (!EFI_ERROR(Root->Open(Root, &List->File, GzPath, EFI_FILE_MODE_READ, EFI_FILE_READ_ONLY))) {
+			IsCompressed = TRUE;
+			Status = EFI_SUCCESS;
+		}
+	}
 	if (EFI_ERROR(Status)) {
+		List->File = NULL;
 		// A missing md5sum.txt is not really an error, so don't
 		// report it, unless we're running in test mode.
 		if (Status != EFI_NOT_FOUND || gIsTestMode)
@@ -63,88 +552,207 @@ EFI_STATUS Parse(
 		goto out;
 	}
 
-	// Read the whole file into a memory buffer
 	Size = FILE_INFO_SIZE;
-	Info = AllocateZeroPool(Size);
+	Info = ArenaAllocate(Size);
 	if (Info == NULL) {
 		Status = EFI_OUT_OF_RESOURCES;
 		PrintError(L"Unable to allocate memory");
 		goto out;
 	}
-	Status = File->GetInfo(File, &gEfiFileInfoGuid, &Size, Info);
+	ZeroMem(Info, Size);
+	Status = List->File->GetInfo(List->File, &gEfiFileInfoGuid, &Size, Info);
 	if (EFI_ERROR(Status)) {
 		PrintError(L"Unable to get '%s' size", HASH_FILE);
 		goto out;
 	}
-	if (Info->FileSize < HASH_HEXASCII_SIZE + 2) {
+	List->FileSize = Info->FileSize;
+	if (IsCompressed) {
+		// The time it takes to read the list shrinks with the compression
+		// ratio, so we can allow a larger list in that case.
+		Status = OpenGzipStream(List->File, Info->FileSize, &List->Stream, &List->FileSize);
+		if (EFI_ERROR(Status)) {
+			PrintError(L"Unable to decompress '%s'", GzPath);
+			goto out;
+		}
+	}
+	if (List->FileSize < HASH_HEXASCII_SIZE + 2) {
 		Status = EFI_UNSUPPORTED;
 		PrintError(L"'%s' is too small", HASH_FILE);
 		goto out;
 	}
-	if (Info->FileSize > HASH_FILE_SIZE_MAX) {
+	if (List->FileSize > (IsCompressed ? HASH_FILE_GZ_SIZE_MAX : HASH_FILE_SIZE_MAX)) {
 		Status = EFI_UNSUPPORTED;
 		PrintError(L"'%s' is too large", HASH_FILE);
 		goto out;
 	}
-	HashFileSize = (UINTN)Info->FileSize;
-	// +1 so we can add a newline at the end
-	HashFile = AllocatePool(HashFileSize + 1);
-	if (HashFile == NULL) {
+
+	// +1 so we can add a newline after the last line.
+	// Since an entry takes at least a hash, a whitespace, a path character and
+	// a newline, this also bounds the number of entries that a window can hold.
+	List->BufferSize = (UINTN)MIN(List->FileSize, HASH_WINDOW_SIZE);
+	List->Buffer = ArenaAllocate(List->BufferSize + 1);
+	MaxEntries = List->BufferSize / (HASH_HEXASCII_SIZE + 3) + 1;
+	List->MaxEntries = MaxEntries;
+	List->Digest = ArenaAllocate(MaxEntries * MD5_HASHSIZE);
+	List->DirId = ArenaAllocate(MaxEntries * sizeof(UINT32));
+	List->NameOffset = ArenaAllocate(MaxEntries * sizeof(UINT32));
+	List->VolumeIndex = ArenaAllocate(MaxEntries);
+	List->Flags = ArenaAllocate(MaxEntries);
+	List->ExpectedSize = ArenaAllocate(MaxEntries * sizeof(UINT64));
+	// A path never has more UCS-2 characters than UTF-8 bytes, and its NUL
+	// terminator replaces the line break, so the paths fit in a buffer size.
+	// Since each directory of the trie holds at least a NUL in there, this
+	// also bounds the number of directories.
+	List->Paths = ArenaAllocate((List->BufferSize + 1) * sizeof(CHAR16));
+	List->DirBlock = ArenaAllocate(((List->BufferSize + 1) / HASH_DIR_BLOCK_SIZE + 1) * sizeof(HASH_DIR*));
+	for (List->NumDirBuckets = 16; List->NumDirBuckets < MaxEntries; List->NumDirBuckets *= 2);
+	List->DirBucket = ArenaAllocate(List->NumDirBuckets * sizeof(UINT32));
+	if (List->Buffer == NULL || List->Digest == NULL || List->DirId == NULL ||
+		List->NameOffset == NULL || List->VolumeIndex == NULL || List->Flags == NULL ||
+		List->ExpectedSize == NULL || List->Paths == NULL || List->DirBlock == NULL || List->DirBucket == NULL) {
 		Status = EFI_OUT_OF_RESOURCES;
 		PrintError(L"Unable to allocate memory");
 		goto out;
 	}
-	Size = HashFileSize;
-	Status = File->Read(File, &Size, HashFile);
-	if (!EFI_ERROR(Status) && Size != HashFileSize)
+
+out:
+	if (EFI_ERROR(Status)) {
+		CloseHashList(List);
+		ArenaRelease(Mark);
+	}
+	return Status;
+}
+
+/**
+  Read the next data of a hash list file, decompressing it if needed. For a
+  compressed file, the read that reaches the end of the data also validates the
+  end of the stream, so that a file that holds more data than its trailer says,
+  or data that does not match its CRC, is reported as an error.
+
+  @param[in/out] List   A pointer to the HASH_LIST structure, set up by OpenHashList().
+  @param[out]    Buffer A pointer to the buffer to receive the data.
+  @param[in/out] Size   On input, the amount of data to read, which must not go past
+                        List->FileSize. On output, the amount of data that was read.
+
+  @retval EFI_SUCCESS   The data was read.
+  @retval Other         The file could not be read, or its compressed data is invalid.
+**/
+EFI_STATUS ReadHashFile(
+	IN OUT HASH_LIST* List,
+	OUT UINT8* Buffer,
+	IN OUT UINTN* Size
+)
+{
+	EFI_STATUS Status;
+	UINT8 Extra;
+	UINTN ExtraSize = sizeof(Extra);
+
+	if (List == NULL || List->File == NULL || Buffer == NULL || Size == NULL)
+		return EFI_INVALID_PARAMETER;
+
+	if (List->Stream == NULL)
+		return List->File->Read(List->File, Size, Buffer);
+
+	Status = ReadGzipStream(List->Stream, Buffer, Size);
+	if (!EFI_ERROR(Status) && List->FileRead + *Size == List->FileSize) {
+		Status = ReadGzipStream(List->Stream, &Extra, &ExtraSize);
+		if (!EFI_ERROR(Status) && ExtraSize != 0)
+			Status = EFI_VOLUME_CORRUPTED;
+	}
+	return Status;
+}
+
+/**
+  Parse the next window of a hash sum list file, into the entries of the list.
+  Once validated, the hashes are converted to binary and the paths to UCS-2, so
+  that the text of the window is no longer needed. The entries, as well as the
+  directory trie of their paths, are only valid until the next call. Besides
+  md5sum_volume, which applies to the entries that follow it, the directives
+  should be at the beginning of the file, as they may otherwise only be seen
+  after some of the entries have been processed.
+
+  @param[in/out] List   A pointer to the HASH_LIST structure, set up by OpenHashList().
+
+  @retval EFI_SUCCESS           The window was parsed, with List->EndOfList set if it is the last one.
+  @retval EFI_INVALID_PARAMETER One or more of the input parameters are invalid.
+  @retval EFI_UNSUPPORTED       The hash list file has a line that does not fit in a window.
+  @retval EFI_END_OF_FILE       The hash list file could not be read.
+  @retval EFI_ABORTED           The hash list file contains invalid data.
+  @retval EFI_OUT_OF_RESOURCES  A memory allocation error occurred.
+**/
+EFI_STATUS ParseHashList(
+	IN OUT HASH_LIST* List
+)
+{
+	EFI_STATUS Status = EFI_SUCCESS;
+	UINT8* HashFile;
+	UINTN i, c, Size, HashFileSize, HashPos, PathPos, NumEntries, End, Volume;
+	BOOLEAN Flag;
+
+	if (List == NULL || List->File == NULL || List->Buffer == NULL)
+		return EFI_INVALID_PARAMETER;
+
+	List->NumEntries = 0;
+	if (List->EndOfList)
+		return EFI_SUCCESS;
+	HashFile = List->Buffer;
+
+	// Keep the line that the previous window ended in the middle of, and
+	// fill the rest of the buffer with the data that follows. The whole
+	// file may already have been read, by LoadHashIndex().
+	List->DataSize -= List->DataParsed;
+	CopyMem(HashFile, &HashFile[List->DataParsed], List->DataSize);
+	List->DataParsed = 0;
+	Size = (UINTN)MIN(List->BufferSize - List->DataSize, List->FileSize - List->FileRead);
+	if (Size != 0)
+		Status = ReadHashFile(List, &HashFile[List->DataSize], &Size);
+	if (!EFI_ERROR(Status) && Size != MIN(List->BufferSize - List->DataSize, List->FileSize - List->FileRead))
 		Status = EFI_END_OF_FILE;
 	if (EFI_ERROR(Status)) {
 		PrintError(L"Unable to read '%s'", HASH_FILE);
 		goto out;
 	}
-	// Correct to the actual size of our buffer and add a newline
-	HashFile[HashFileSize++] = '\n';
+	List->DataSize += Size;
+	List->FileRead += Size;
+	if (List->FileRead == List->FileSize) {
+		// Add a newline after the last line
+		HashFile[List->DataSize++] = '\n';
+		List->EndOfList = TRUE;
+	}
 
-	// Compute the maximum number of lines/entries we need to allocate
-	NumLines = 1;	// We added a line break
-	for (i = 0; i < HashFileSize - 1; i++) {
-		if (HashFile[i] == '\n') {
-			NumLines++;
-		} else if (HashFile[i] == '\r') {
+	// Validate the data and find the end of the last line of the window
+	HashFileSize = 0;
+	for (i = FindControl(HashFile, 0, List->DataSize); i < List->DataSize;
+		i = FindControl(HashFile, i + 1, List->DataSize)) {
+		if (HashFile[i] == '\r') {
 			// Convert to UNIX style
 			HashFile[i] = '\n';
-			// Don't double count lines with DOS style ending
-			if (HashFile[i + 1] != '\n')
-				NumLines++;
-		} else if (HashFile[i] < ' ' && HashFile[i] != '\t') {
+		}
+		if (HashFile[i] == '\n') {
+			HashFileSize = i + 1;
+		} else if (HashFile[i] != '\t') {
 			// Do not allow any NUL or control characters besides TAB
 			Status = EFI_ABORTED;
 			PrintError(L"'%s' contains invalid data", HASH_FILE);
 			goto out;
 		}
 	}
-
-	// Don't allow files with more than a specific set of entries
-	if (NumLines > HASH_FILE_LINES_MAX) {
+	// If the buffer is full and has no line break, the line can't fit in a window
+	if (HashFileSize == 0) {
 		Status = EFI_UNSUPPORTED;
-		PrintError(L"'%s' contains too many lines", HASH_FILE);
+		PrintError(L"'%s' contains a line that is too long", HASH_FILE);
 		goto out;
 	}
 
-	// Allocate an array of hash entries
-	HashList = AllocateZeroPool(NumLines * sizeof(HASH_ENTRY));
-	if (HashList == NULL) {
-		Status = EFI_OUT_OF_RESOURCES;
-		PrintError(L"Unable to allocate memory");
-		goto out;
-	}
-
-	// Now parse the file to populate the array
+	// Now parse the lines of the window to populate the arrays
 	NumEntries = 0;
+	PathPos = 0;
+	List->NumDirs = 0;
+	SetMem(List->DirBucket, List->NumDirBuckets * sizeof(UINT32), 0xff);
 	for (i = 0; i < HashFileSize; ) {
 		// Ignore whitespaces, control characters or anything non-ASCII
 		// (such as BOMs) that may precede a hash entry or a comment.
-		while ((HashFile[i] <= ' ' || HashFile[i] >= 0x80) && i < HashFileSize)
+		while (i < HashFileSize && (HashFile[i] <= ' ' || HashFile[i] >= 0x80))
 			i++;
 		if (i >= HashFileSize)
 			break;
@@ -156,10 +764,13 @@ EFI_STATUS Parse(
 			// Set c to the start of the comment (skipping the '#' prefix)
 			c = i + 1;
 
-			// Note that because we added a terminating '\n' to the file,
-			// we cannot overflow on the while loop below.
-			while (HashFile[i++] != '\n');
+			// Note that because the window ends with a '\n', we cannot
+			// overflow on the loop below. Since we validated the window,
+			// the only other control character we can find is TAB.
+			for (i = FindControl(HashFile, i, HashFileSize); HashFile[i] != '\n';
+				i = FindControl(HashFile, i + 1, HashFileSize));
 			// i - 1, used below, is the position of the terminating '\n'
+			i++;
 
 			// Skip any leading spaces
 			while (c < i - 1 && IsWhiteSpace(HashFile[c]))
@@ -167,42 +778,85 @@ EFI_STATUS Parse(
 
 			// See if we have a match for "md5sum_totalbytes = 0x########"
 			if (i > c + sizeof(TotalBytesString) - 1 && (CompareMem(&HashFile[c],
-				TotalBytesString, sizeof(TotalBytesString) - 1) == 0)) {
-				NumDigits = 0;
-				// Look for an equal sign
-				c += sizeof(TotalBytesString) - 1;
+				TotalBytesString, sizeof(TotalBytesString) - 1) == 0) &&
+				!ParseHexValue(HashFile, c + sizeof(TotalBytesString) - 1, i - 1, &List->TotalBytes)) {
+				PrintWarning(L"Ignoring invalid md5sum_totalbytes value");
+				List->TotalBytes = 0;
+			}
+
+			// See if we have a match for "md5sum_size = 0x########", which
+			// applies to the entry that follows the comment. Since plain
+			// md5sum ignores comments, this doesn't alter the list for it.
+			if (i > c + sizeof(SizeString) - 1 && (CompareMem(&HashFile[c],
+				SizeString, sizeof(SizeString) - 1) == 0) &&
+				!ParseHexValue(HashFile, c + sizeof(SizeString) - 1, i - 1, &List->PendingSize)) {
+				PrintWarning(L"Ignoring invalid md5sum_size value");
+				List->PendingSize = HASH_SIZE_UNKNOWN;
+			}
+
+			// See if we have a match for "md5sum_ntfs_direct = 0|1"
+			if (i > c + sizeof(NtfsDirectString) - 1 && (CompareMem(&HashFile[c],
+				NtfsDirectString, sizeof(NtfsDirectString) - 1) == 0)) {
+				if (ParseBoolValue(HashFile, c + sizeof(NtfsDirectString) - 1, i - 1, &Flag))
+					List->NtfsDirect = Flag;
+				else
+					PrintWarning(L"Ignoring invalid md5sum_ntfs_direct value");
+			}
+
+			// See if we have a match for "md5sum_index = 0|1", which media
+			// creators can use to let us write the index of the list to the media
+			if (i > c + sizeof(IndexString) - 1 && (CompareMem(&HashFile[c],
+				IndexString, sizeof(IndexString) - 1) == 0)) {
+				if (ParseBoolValue(HashFile, c + sizeof(IndexString) - 1, i - 1, &Flag))
+					List->SaveIndex = Flag;
+				else
+					PrintWarning(L"Ignoring invalid md5sum_index value");
+			}
+
+			// See if we have a match for "md5sum_volume = <label or partition GUID>".
+			// The entries that follow are on that volume, or on the boot volume if
+			// the value is empty. Since ignoring an invalid value would have these
+			// entries checked against the wrong volume, this is an error.
+			if (i > c + sizeof(VolumeString) - 1 && (CompareMem(&HashFile[c],
+				VolumeString, sizeof(VolumeString) - 1) == 0)) {
+				c += sizeof(VolumeString) - 1;
 				while (c < i - 1 && IsWhiteSpace(HashFile[c]))
 					c++;
-				if (HashFile[c++] == '=') {
-					// Look for an '0x' prefix and parse a 64-bit *lowercase*
-					// hexascii value if valid.
-					while (c < i - 1 && IsWhiteSpace(HashFile[c]))
-						c++;
-					if (c < i - 2 && HashFile[c] == '0' && HashFile[c + 1] == 'x') {
-						for (c += 2; c < i - 1; c++) {
-							if (HashFile[c] == ' ')
-								continue;
-							if (!IsValidHexAscii(HashFile[c])) {
-								NumDigits = 0;
-								break;
-							}
-							NumDigits++;
-							TotalBytes <<= 4;
-							// IsValidHexAscii() above made sure that our character
-							// is in the [0-9] or [A-F] or [a-f] ranges.
-							if (HashFile[c] - '0' < 0xa)
-								TotalBytes |= HashFile[c] - '0';
-							else if (HashFile[c] - 'A' < 6)
-								TotalBytes |= HashFile[c] - 'A' + 0xa;
-							else
-								TotalBytes |= HashFile[c] - 'a' + 0xa;
-						}
-					}
+				if (HashFile[c] != '=') {
+					Status = EFI_ABORTED;
+					PrintError(L"Invalid md5sum_volume value");
+					goto out;
 				}
-				if (NumDigits == 0 || NumDigits > 16) {
-					PrintWarning(L"Ignoring invalid md5sum_totalbytes value");
-					TotalBytes = 0;
+				c++;
+				while (c < i - 1 && IsWhiteSpace(HashFile[c]))
+					c++;
+				// Remove trailing whitespaces, since labels may contain spaces
+				for (End = i - 1; End > c && IsWhiteSpace(HashFile[End - 1]); End--);
+				if (End - c > VOLUME_ID_MAX) {
+					Status = EFI_ABORTED;
+					PrintError(L"Invalid md5sum_volume value");
+					goto out;
+				}
+				Volume = 0;
+				if (End != c) {
+					for (Volume = 1; Volume < List->NumVolumes; Volume++) {
+						if (AsciiStrLen(List->VolumeId[Volume]) == End - c &&
+							CompareMem(List->VolumeId[Volume], &HashFile[c], End - c) == 0)
+							break;
+					}
+					if (Volume >= HASH_VOLUMES_MAX) {
+						Status = EFI_UNSUPPORTED;
+						PrintError(L"'%s' references too many volumes", HASH_FILE);
+						goto out;
+					}
+					// Since the window gets reused, keep a copy of the value
+					if (Volume == List->NumVolumes) {
+						CopyMem(List->VolumeId[Volume], &HashFile[c], End - c);
+						List->VolumeId[Volume][End - c] = '\0';
+						List->NumVolumes++;
+					}
 				}
+				List->Volume = Volume;
 			}
 			continue;
 		}
@@ -217,69 +871,124 @@ EFI_STATUS Parse(
 			goto out;
 		}
 
-		// NUL-terminate the hash value, add it to our array and validate it
+		// NUL-terminate the hash value, validate it and add it to our array
 		HashFile[i + HASH_HEXASCII_SIZE] = '\0';
-		HashList[NumEntries].Hash = (CHAR8*)&HashFile[i];
-		for (; HashFile[i] != '\0'; i++) {
-			// Convert A-F to lowercase
-			if (HashFile[i] >= 'A' && HashFile[i] <= 'F')
-				HashFile[i] += 0x20;
-			if (!IsValidHexAscii(HashFile[i])) {
-				Status = EFI_ABORTED;
-				PrintError(L"Invalid data in '%a'", HashList[NumEntries].Hash);
-				goto out;
-			}
+		if (!LowerHexAscii(&HashFile[i], HASH_HEXASCII_SIZE)) {
+			Status = EFI_ABORTED;
+			PrintError(L"Invalid data in '%a'", (CHAR8*)&HashFile[i]);
+			goto out;
 		}
+		DecodeHexAscii(&HashFile[i], List->Digest[NumEntries]);
+		HashPos = i;
+		i += HASH_HEXASCII_SIZE;
 
 		// Skip data between hash and path
 		while (++i < HashFileSize && HashFile[i] < 0x21) {
 			// Anything other than whitespace is illegal
 			if (!IsWhiteSpace(HashFile[i])) {
 				Status = EFI_ABORTED;
-				PrintError(L"Invalid data after '%a'", HashList[NumEntries].Hash);
+				PrintError(L"Invalid data after '%a'", (CHAR8*)&HashFile[HashPos]);
 				goto out;
 			}
 		}
 
 		// Start of path value
 		c = i;
-		while (i < HashFileSize && HashFile[i] != '\n') {
-			if (HashFile[i] == '/') {
-				// Convert slashes to backslashes
-				HashFile[i] = '\\';
-			} else if (HashFile[i] < ' ') {
-				// Anything lower than space (including TAB) is illegal
-				i = c;
-				break;
-			}
-			i++;
-		}
+		// Convert slashes to backslashes, up to the end of the line
+		i = ScanPath(HashFile, i, HashFileSize);
+		// Anything lower than space (including TAB) is illegal
+		if (i >= HashFileSize || HashFile[i] != '\n')
+			i = c;
 		// Check for a path parsing error above or an illegal path length
 		if (i == c || i > c + PATH_MAX) {
 			Status = EFI_ABORTED;
-			PrintError(L"Invalid data after '%a'", HashList[NumEntries].Hash);
+			PrintError(L"Invalid data after '%a'", (CHAR8*)&HashFile[HashPos]);
 			goto out;
 		}
-		// NUL-terminate the path.
-		// Note that we can't overflow here since we added an extra 0x0A to our file.
-		HashFile[i++] = '\0';
-		HashList[NumEntries].Path = (CHAR8*)&HashFile[c];
+		// NUL-terminate the path and convert it to UCS-2, at the end of the pool.
+		// Note that we can't overflow here since the window ends with a 0x0A.
+		HashFile[i] = '\0';
+		List->VolumeIndex[NumEntries] = (UINT8)List->Volume;
+		List->Flags[NumEntries] = 0;
+		List->ExpectedSize[NumEntries] = List->PendingSize;
+		List->PendingSize = HASH_SIZE_UNKNOWN;
+		if (EFI_ERROR(Utf8ToUcs2N((CHAR8*)&HashFile[c], i - c, &List->Paths[PathPos], i - c + 1))) {
+			// Keep the ASCII characters of the path, so that the entry can be reported
+			for (Size = 0; Size < i - c; Size++)
+				List->Paths[PathPos + Size] = (HashFile[c + Size] < 0x80) ? HashFile[c + Size] : L'?';
+			List->Paths[PathPos + Size] = L'\0';
+			List->Flags[NumEntries] = HASH_ENTRY_INVALID_PATH;
+		}
+		Status = AddEntryPath(List, NumEntries, &PathPos);
+		if (EFI_ERROR(Status)) {
+			PrintError(L"Unable to allocate memory");
+			goto out;
+		}
+		i++;
 		NumEntries++;
 	}
 
 	List->NumEntries = NumEntries;
-	List->Buffer = HashFile;
-	List->Entry = HashList;
-	List->TotalBytes = TotalBytes;
+	List->PathsSize = PathPos;
+	List->DataParsed = HashFileSize;
+	// The newline we added after the last line is not part of the file
+	List->FileParsed = List->EndOfList ? List->FileSize : List->FileRead - (List->DataSize - HashFileSize);
 
 out:
-	SafeFree(Info);
-	if (File != NULL)
-		File->Close(File);
-	if (EFI_ERROR(Status)) {
-		SafeFree(HashFile);
-		SafeFree(HashList);
+	if (EFI_ERROR(Status))
+		List->NumEntries = 0;
+	return Status;
+}
+
+/**
+  Get the full path of an entry from the current window of a hash list.
+
+  @param[in]  List   A pointer to the HASH_LIST structure.
+  @param[in]  Index  The index of the entry in the window.
+  @param[out] Path   A buffer of PATH_MAX + 1 characters, to receive the path.
+**/
+VOID GetHashEntryPath(
+	IN CONST HASH_LIST* List,
+	IN CONST UINTN Index,
+	OUT CHAR16* Path
+)
+{
+	CONST CHAR16* Name = &List->Paths[List->NameOffset[Index]];
+	CONST HASH_DIR* Dir;
+	UINTN Len, Pos;
+	UINT32 d;
+
+	// The path is no longer than the original, so we just fill it from its end
+	Pos = StrLen(Name);
+	for (d = List->DirId[Index]; d != HASH_DIR_NONE; d = Dir->Parent) {
+		Dir = HASH_LIST_DIR(List, d);
+		Pos += StrLen(&List->Paths[Dir->Name]) + 1;
+	}
+	V_ASSERT(Pos <= PATH_MAX);
+	Len = StrLen(Name);
+	Pos -= Len;
+	CopyMem(&Path[Pos], Name, (Len + 1) * sizeof(CHAR16));
+	for (d = List->DirId[Index]; d != HASH_DIR_NONE; d = Dir->Parent) {
+		Dir = HASH_LIST_DIR(List, d);
+		Path[--Pos] = L'\\';
+		Len = StrLen(&List->Paths[Dir->Name]);
+		Pos -= Len;
+		CopyMem(&Path[Pos], &List->Paths[Dir->Name], Len * sizeof(CHAR16));
 	}
+}
 
-	return Status;
+/**
+  Close the hash sum list file of a hash list.
+
+  @param[in/out] List   (Optional) A pointer to the HASH_LIST structure.
+**/
+VOID CloseHashList(
+	OPTIONAL IN OUT HASH_LIST* List
+)
+{
+	if (List == NULL || List->File == NULL)
+		return;
+	List->File->Close(List->File);
+	List->File = NULL;
+	List->Stream = NULL;
 }
@@ -0,0 +1,420 @@
+/*
+ * uefi-md5sum: UEFI MD5Sum validator - Hash list scheduling
+ * Copyright © 2024 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "boot.h"
+
+/* Sort key for an entry whose data could not be located on the volume */
+#define OFFSET_UNKNOWN      ((UINT64)-1)
+
+/* Lookup state of a directory from the trie of a hash list, on a volume */
+#define DIR_STATE_NONE      0
+#define DIR_STATE_NEEDED    1
+#define DIR_STATE_FOUND     2
+#define DIR_STATE_FAILED    3
+
+/* Scheduling data for a hash list entry */
+typedef struct {
+	UINTN       Volume;     /* The index of the volume holding the file */
+	UINT64      Offset;     /* The offset of the start of the file data on the volume */
+	UINT64      Size;       /* The size of the file, when its data was located */
+	UINT32      Dir;        /* The directory of the entry, from the trie of the hash list */
+	CONST CHAR16* Name;     /* The name of the entry, from the hash list */
+	UINTN       Index;      /* The index of the entry in the hash list */
+	BOOLEAN     IsDuplicate;    /* The file is the same as the one of an earlier entry */
+} SCHEDULE_ENTRY;
+
+/**
+  Compare two entries for scheduling. Entries are grouped by volume. On each
+  volume, the entries that were located come first, in the order of their data,
+  and then of their size. The others are grouped by directory, in the order that the directories first
+  appear in the hash list, then sorted by file name. Ties are broken by the order
+  from the hash list, so that the schedule is deterministic.
+
+  @param[in]  Entry1            A pointer to the first SCHEDULE_ENTRY.
+  @param[in]  Entry2            A pointer to the second SCHEDULE_ENTRY.
+
+  @retval A negative value if Entry1 should be processed first, positive otherwise.
+**/
+STATIC INTN CompareEntries(
+	IN CONST SCHEDULE_ENTRY* Entry1,
+	IN CONST SCHEDULE_ENTRY* Entry2
+)
+{
+	INTN r;
+
+	if (Entry1->Volume != Entry2->Volume)
+		return (Entry1->Volume < Entry2->Volume) ? -1 : 1;
+	if (Entry1->Offset != Entry2->Offset)
+		return (Entry1->Offset < Entry2->Offset) ? -1 : 1;
+	if (Entry1->Size != Entry2->Size)
+		return (Entry1->Size < Entry2->Size) ? -1 : 1;
+	if (Entry1->Offset == OFFSET_UNKNOWN) {
+		// Since the directories of the trie are added in the order of the list,
+		// comparing them gives us the order in which they first appear. Adding 1
+		// puts the files without a directory (HASH_DIR_NONE) first.
+		if (Entry1->Dir != Entry2->Dir)
+			return (Entry1->Dir + 1 < Entry2->Dir + 1) ? -1 : 1;
+		r = StrCmp(Entry1->Name, Entry2->Name);
+		if (r != 0)
+			return r;
+	}
+	return (Entry1->Index < Entry2->Index) ? -1 : 1;
+}
+
+/* Restore the heap property for the subtree at Root, of a heap of Size entries */
+STATIC VOID SiftDown(
+	IN OUT SCHEDULE_ENTRY* Entries,
+	IN UINTN Root,
+	IN CONST UINTN Size
+)
+{
+	SCHEDULE_ENTRY Tmp;
+	UINTN Child;
+
+	while ((Child = 2 * Root + 1) < Size) {
+		if (Child + 1 < Size && CompareEntries(&Entries[Child], &Entries[Child + 1]) < 0)
+			Child++;
+		if (CompareEntries(&Entries[Root], &Entries[Child]) >= 0)
+			return;
+		Tmp = Entries[Root];
+		Entries[Root] = Entries[Child];
+		Entries[Child] = Tmp;
+		Root = Child;
+	}
+}
+
+/**
+  Locate the data of the entries of a hash list, on the volumes that were opened
+  for direct access. Each directory from the trie of the list is looked up once,
+  from its parent, and all the files of a directory are then looked up at once,
+  so that the directories don't have to be read again for each file.
+
+  @param[in]  Session           A pointer to the HASH_SESSION holding the volumes of the list.
+  @param[in]  List              A pointer to the HASH_LIST to locate.
+  @param[out] Location          An array of List->NumEntries FILE_LOCATION, that must be zeroed,
+                                to receive the location of each entry. The extents are allocated
+                                from the run arena.
+
+  @retval EFI_SUCCESS           The entries were located, as far as possible.
+  @retval EFI_OUT_OF_RESOURCES  A memory allocation error occurred.
+**/
+STATIC EFI_STATUS LocateHashEntries(
+	IN CONST HASH_SESSION* Session,
+	IN CONST HASH_LIST* List,
+	OUT FILE_LOCATION* Location
+)
+{
+	EFI_STATUS Status = EFI_OUT_OF_RESOURCES, *Results;
+	FS_VOLUME* Volume;
+	FS_NODE *DirNode, *Nodes;
+	FILE_EXTENT* Extents;
+	CONST CHAR16** Names;
+	UINT8* DirState;
+	UINT32 p;
+	UINTN i, d, n, v, NumExtents, *DirFirst, *NextInDir;
+	UINT64 Size;
+
+	// This is only scratch data, but the extents we keep are allocated from the
+	// arena as we go, so it must not come from there.
+	DirNode = AllocatePool(List->NumDirs * sizeof(FS_NODE) + 1);
+	DirState = AllocatePool(List->NumDirs + 1);
+	DirFirst = AllocatePool((List->NumDirs + 1) * sizeof(UINTN));
+	NextInDir = AllocatePool(List->NumEntries * sizeof(UINTN));
+	Names = AllocatePool(List->NumEntries * sizeof(CHAR16*));
+	Nodes = AllocatePool(List->NumEntries * sizeof(FS_NODE));
+	Results = AllocatePool(List->NumEntries * sizeof(EFI_STATUS));
+	if (DirNode == NULL || DirState == NULL || DirFirst == NULL || NextInDir == NULL ||
+		Names == NULL || Nodes == NULL || Results == NULL)
+		goto out;
+
+	for (v = 0; v < Session->NumVolumes; v++) {
+		Volume = Session->Volumes[v].Volume;
+		if (Volume == NULL)
+			continue;
+
+		// Chain the entries of the volume by directory, in the order of the list. The
+		// entries that have no directory are chained after the directories of the trie.
+		SetMem(DirFirst, (List->NumDirs + 1) * sizeof(UINTN), 0xff);
+		for (i = List->NumEntries; i-- > 0; ) {
+			if (List->VolumeIndex[i] != v || (List->Flags[i] & HASH_ENTRY_INVALID_PATH))
+				continue;
+			d = (List->DirId[i] == HASH_DIR_NONE) ? List->NumDirs : List->DirId[i];
+			NextInDir[i] = DirFirst[d];
+			DirFirst[d] = i;
+		}
+
+		// Look up the directories that hold entries, along with their parents. Since
+		// the parent of a directory is always added to the trie before it, looking up
+		// the directories in the order of the trie looks up the parents first.
+		ZeroMem(DirState, List->NumDirs);
+		for (d = 0; d < List->NumDirs; d++) {
+			if (DirFirst[d] == HASH_ENTRY_NONE)
+				continue;
+			for (p = (UINT32)d; p != HASH_DIR_NONE && DirState[p] == DIR_STATE_NONE;
+				p = HASH_LIST_DIR(List, p)->Parent)
+				DirState[p] = DIR_STATE_NEEDED;
+		}
+		for (d = 0; d < List->NumDirs; d++) {
+			if (DirState[d] != DIR_STATE_NEEDED)
+				continue;
+			p = HASH_LIST_DIR(List, d)->Parent;
+			DirState[d] = DIR_STATE_FAILED;
+			if ((p == HASH_DIR_NONE || DirState[p] == DIR_STATE_FOUND) &&
+				LookupVolumePath(Volume, (p == HASH_DIR_NONE) ? NULL : &DirNode[p],
+				&List->Paths[HASH_LIST_DIR(List, d)->Name], &DirNode[d]) == EFI_SUCCESS)
+				DirState[d] = DIR_STATE_FOUND;
+		}
+
+		// Then look up the files of each directory at once, and resolve their extents
+		for (d = 0; d <= List->NumDirs; d++) {
+			if (DirFirst[d] == HASH_ENTRY_NONE || (d < List->NumDirs && DirState[d] != DIR_STATE_FOUND))
+				continue;
+			for (n = 0, i = DirFirst[d]; i != HASH_ENTRY_NONE; i = NextInDir[i])
+				Names[n++] = &List->Paths[List->NameOffset[i]];
+			LookupVolumeNames(Volume, (d < List->NumDirs) ? &DirNode[d] : NULL, Names, n, Nodes, Results);
+			for (n = 0, i = DirFirst[d]; i != HASH_ENTRY_NONE; i = NextInDir[i], n++) {
+				// Empty files have no extents, and are just treated as files we can't locate
+				if (Results[n] != EFI_SUCCESS ||
+					GetFileExtents(Volume, &Nodes[n], &Extents, &NumExtents, &Size) != EFI_SUCCESS ||
+					NumExtents == 0)
+					continue;
+				// Keep the extents until the end of the window
+				Location[i].Extents = ArenaAllocate(NumExtents * sizeof(FILE_EXTENT));
+				if (Location[i].Extents != NULL) {
+					CopyMem(Location[i].Extents, Extents, NumExtents * sizeof(FILE_EXTENT));
+					Location[i].NumExtents = NumExtents;
+					Location[i].FileSize = Size;
+				}
+				FreePool(Extents);
+				if (Location[i].Extents == NULL)
+					goto out;
+			}
+		}
+	}
+	Status = EFI_SUCCESS;
+
+out:
+	if (DirNode != NULL)
+		FreePool(DirNode);
+	if (DirState != NULL)
+		FreePool(DirState);
+	if (DirFirst != NULL)
+		FreePool(DirFirst);
+	if (NextInDir != NULL)
+		FreePool(NextInDir);
+	if (Names != NULL)
+		FreePool(Names);
+	if (Nodes != NULL)
+		FreePool(Nodes);
+	if (Results != NULL)
+		FreePool(Results);
+	return Status;
+}
+
+/**
+  Compute the order in which the entries of a hash list should be processed, so
+  that the media is read with as little seeking as possible. When a volume is
+  available for direct access, its files are sorted by the location of their data.
+  Files that can't be located are grouped by directory and sorted by name.
+  The files from different volumes are interleaved, so that all the volumes are
+  read from at the same time.
+  Entries that reference the same file as an earlier entry, either because their
+  data is at the same location, such as for hard links, or because their path
+  resolves to the same entry of the directory index, are left out of the order.
+  The paths that can't be resolved must match exactly instead. These entries are
+  chained to that earlier entry, so that the file is only read once.
+
+  @param[in]  Session           A pointer to the HASH_SESSION holding the volumes of the list.
+  @param[in]  List              A pointer to the HASH_LIST to schedule.
+  @param[out] Order             A pointer to receive an array of List->NumEntries indexes into
+                                the entries of List, in the order they should be processed. The
+                                array is allocated from the run arena.
+  @param[out] NumOrdered        A pointer to receive the number of entries from Order, that
+                                excludes the duplicates.
+  @param[out] Duplicate         A pointer to receive an array of List->NumEntries indexes, with
+                                the next entry from the list that references the same file as
+                                each entry, or HASH_ENTRY_NONE. The array is allocated from the
+                                run arena.
+  @param[out] Location          A pointer to receive an array of List->NumEntries FILE_LOCATION,
+                                with the location of the data of each entry on its volume, if
+                                it could be located. The array is allocated from the run arena.
+
+  @retval EFI_SUCCESS           The schedule was computed.
+  @retval EFI_INVALID_PARAMETER One or more of the input parameters are invalid.
+  @retval EFI_OUT_OF_RESOURCES  A memory allocation error occurred.
+**/
+EFI_STATUS ScheduleHashList(
+	IN CONST HASH_SESSION* Session,
+	IN CONST HASH_LIST* List,
+	OUT UINTN** Order,
+	OUT UINTN* NumOrdered,
+	OUT UINTN** Duplicate,
+	OUT FILE_LOCATION** Location
+)
+{
+	EFI_STATUS Status;
+	SCHEDULE_ENTRY* Entries, Tmp;
+	ARENA_MARK Mark;
+	DIR_INDEX_ENTRY** IndexEntry;
+	CHAR16 *Path, *OtherPath;
+	UINT32 Hash, *PathHash;
+	UINTN i, k, v, n, Value, NumBuckets, *Bucket, *Chain, *Last;
+	UINTN Next[HASH_VOLUMES_MAX], End[HASH_VOLUMES_MAX];
+
+	if (Session == NULL || List == NULL || Order == NULL || NumOrdered == NULL ||
+		Duplicate == NULL || Location == NULL)
+		return EFI_INVALID_PARAMETER;
+
+	*Order = ArenaAllocate(List->NumEntries * sizeof(UINTN));
+	*Duplicate = ArenaAllocate(List->NumEntries * sizeof(UINTN));
+	*Location = ArenaAllocate(List->NumEntries * sizeof(FILE_LOCATION));
+	if (*Order == NULL || *Duplicate == NULL || *Location == NULL)
+		return EFI_OUT_OF_RESOURCES;
+	SetMem(*Duplicate, List->NumEntries * sizeof(UINTN), 0xff);
+	ZeroMem(*Location, List->NumEntries * sizeof(FILE_LOCATION));
+	*NumOrdered = 0;
+
+	// The extents are kept for the lanes, so this must be done before we get our mark
+	Status = LocateHashEntries(Session, List, *Location);
+	if (EFI_ERROR(Status))
+		return Status;
+
+	// Our scratch data is released on exit, leaving only the output arrays allocated
+	Mark = ArenaGetMark();
+	for (NumBuckets = 16; NumBuckets < List->NumEntries; NumBuckets *= 2);
+	Entries = ArenaAllocate(List->NumEntries * sizeof(SCHEDULE_ENTRY));
+	Path = ArenaAllocate((PATH_MAX + 1) * sizeof(CHAR16));
+	OtherPath = ArenaAllocate((PATH_MAX + 1) * sizeof(CHAR16));
+	IndexEntry = ArenaAllocate(List->NumEntries * sizeof(DIR_INDEX_ENTRY*));
+	PathHash = ArenaAllocate(List->NumEntries * sizeof(UINT32));
+	Chain = ArenaAllocate(List->NumEntries * sizeof(UINTN));
+	Last = ArenaAllocate(List->NumEntries * sizeof(UINTN));
+	Bucket = ArenaAllocate(NumBuckets * sizeof(UINTN));
+	if (Entries == NULL || Path == NULL || OtherPath == NULL || IndexEntry == NULL ||
+		PathHash == NULL || Chain == NULL || Last == NULL || Bucket == NULL) {
+		Status = EFI_OUT_OF_RESOURCES;
+		goto out;
+	}
+	SetMem(Bucket, NumBuckets * sizeof(UINTN), 0xff);
+
+	ZeroMem(End, sizeof(End));
+	for (i = 0; i < List->NumEntries; i++) {
+		V_ASSERT(List->VolumeIndex[i] < Session->NumVolumes);
+		Entries[i].Volume = List->VolumeIndex[i];
+		Entries[i].Offset = OFFSET_UNKNOWN;
+		Entries[i].Size = 0;
+		Entries[i].Dir = List->DirId[i];
+		Entries[i].Name = &List->Paths[List->NameOffset[i]];
+		Entries[i].Index = i;
+		Entries[i].IsDuplicate = FALSE;
+		End[Entries[i].Volume]++;
+		if ((*Location)[i].Extents != NULL) {
+			Entries[i].Offset = (*Location)[i].Extents[0].Offset;
+			Entries[i].Size = (*Location)[i].FileSize;
+		}
+	}
+
+	// Chain the entries that can't be located to an earlier entry that resolves
+	// to the same entry of the directory index. The index picks the entry which
+	// name has the same case, if any, so that different files which names only
+	// differ by case, on a case sensitive file system, are told apart. Entries
+	// that the index can't resolve are only chained when their paths are the
+	// same. The expected size must also match, since the result of an entry
+	// which size doesn't match can't be reused. Only the first entry of each
+	// chain is added to the hash table.
+	for (i = 0; i < List->NumEntries; i++) {
+		if (Entries[i].Offset != OFFSET_UNKNOWN || (List->Flags[i] & HASH_ENTRY_INVALID_PATH))
+			continue;
+		GetHashEntryPath(List, i, Path);
+		IndexEntry[i] = LookupDirIndex(Session->Volumes[Entries[i].Volume].Index, Path);
+		Hash = 2166136261U ^ (UINT32)Entries[i].Volume;
+		if (IndexEntry[i] != NULL) {
+			for (Value = (UINTN)IndexEntry[i], k = 0; k < sizeof(UINTN); Value >>= 8, k++)
+				Hash = (Hash ^ (UINT8)Value) * 16777619U;
+		} else {
+			for (k = 0; Path[k] != L'\0'; k++)
+				Hash = (Hash ^ Path[k]) * 16777619U;
+		}
+		for (k = Bucket[Hash & (NumBuckets - 1)]; k != HASH_ENTRY_NONE; k = Chain[k]) {
+			if (PathHash[k] != Hash || Entries[k].Volume != Entries[i].Volume ||
+				IndexEntry[k] != IndexEntry[i] || List->ExpectedSize[k] != List->ExpectedSize[i])
+				continue;
+			if (IndexEntry[i] != NULL)
+				break;
+			GetHashEntryPath(List, k, OtherPath);
+			if (StrCmp(Path, OtherPath) == 0)
+				break;
+		}
+		if (k == HASH_ENTRY_NONE) {
+			PathHash[i] = Hash;
+			Chain[i] = Bucket[Hash & (NumBuckets - 1)];
+			Bucket[Hash & (NumBuckets - 1)] = i;
+			Last[i] = i;
+		} else {
+			(*Duplicate)[Last[k]] = i;
+			Last[k] = i;
+			Entries[i].IsDuplicate = TRUE;
+		}
+	}
+
+	// Heapsort, since there can be a lot of entries and we want to avoid recursion
+	for (i = List->NumEntries / 2; i > 0; i--)
+		SiftDown(Entries, i - 1, List->NumEntries);
+	for (i = List->NumEntries; i > 1; i--) {
+		Tmp = Entries[0];
+		Entries[0] = Entries[i - 1];
+		Entries[i - 1] = Tmp;
+		SiftDown(Entries, 0, i - 1);
+	}
+
+	// Entries which data is at the same location on a volume, and that have the
+	// same size, reference the same file, and were sorted next to one another in
+	// the order of the list. As above, their expected sizes must also match.
+	for (i = 1; i < List->NumEntries; i++) {
+		if (Entries[i].Offset == OFFSET_UNKNOWN || Entries[i].Volume != Entries[i - 1].Volume ||
+			Entries[i].Offset != Entries[i - 1].Offset || Entries[i].Size != Entries[i - 1].Size ||
+			List->ExpectedSize[Entries[i].Index] != List->ExpectedSize[Entries[i - 1].Index])
+			continue;
+		(*Duplicate)[Entries[i - 1].Index] = Entries[i].Index;
+		Entries[i].IsDuplicate = TRUE;
+	}
+
+	// Take an entry from each volume in turn, so that the lanes that are assigned
+	// consecutive entries read from different devices, rather than one at a time.
+	for (v = 0, i = 0; v < HASH_VOLUMES_MAX; v++) {
+		Next[v] = i;
+		i += End[v];
+		End[v] = i;
+	}
+	// The duplicates are skipped, as they are processed along with their first entry.
+	for (i = 0, n = 0; i < List->NumEntries; ) {
+		for (v = 0; v < HASH_VOLUMES_MAX; v++) {
+			for (; Next[v] < End[v] && Entries[Next[v]].IsDuplicate; Next[v]++, i++);
+			if (Next[v] < End[v]) {
+				(*Order)[n++] = Entries[Next[v]++].Index;
+				i++;
+			}
+		}
+	}
+	*NumOrdered = n;
+	Status = EFI_SUCCESS;
+
+out:
+	ArenaRelease(Mark);
+	return Status;
+}
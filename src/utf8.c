@@ -1,6 +1,6 @@
 /*
  * uefi-md5sum: UEFI MD5Sum validator - UTF-8 conversion functions
- * Copyright © 2023 Pete Batard <pete@akeo.ie>
+ * Copyright © 2023-2024 Pete Batard <pete@akeo.ie>
  *
  * This program is free software: you can redistribute it and/or modify
  * it under the terms of the GNU General Public License as published by
@@ -18,76 +18,133 @@
 
 #include "boot.h"
 
+/*
+ * Since paths are mostly made of ASCII characters, runs of these are widened
+ * to UCS-2 16 bytes at a time with SSE2 or NEON, with the same architecture
+ * restrictions as the ones from parse.c.
+ */
+#if defined(_M_X64) || defined(__x86_64__)
+#define UTF8_SSE2
+#include <emmintrin.h>
+#elif (defined(_M_ARM64) || defined(__aarch64__)) && (defined(__ARM_NEON) || defined(_MSC_VER))
+#define UTF8_NEON
+#if defined(_MSC_VER)
+#include <arm64_neon.h>
+#else
+#include <arm_neon.h>
+#endif
+#endif
+
+#if defined(UTF8_SSE2) || defined(UTF8_NEON)
+#define UTF8_BLOCK_SIZE     16
+
 /**
-  Decode a Unicode character from a UTF-8 sequence.
+  Widen a block of UTF-8 data to UCS-2. Only the ASCII characters that start
+  the block are valid in the output, but the whole block is written.
 
-  @param[in]  Start  A pointer to the start of the UTF-8 sequence.
-  @param[out] Size   A pointer to the variable that receives the size of the decoded UTF-8 sequence.
+  @param[in]  Start  A pointer to the UTF8_BLOCK_SIZE block of UTF-8 data.
+  @param[out] Ucs2   A pointer to the UTF8_BLOCK_SIZE output characters.
+
+  @return The number of ASCII characters that start the block.
+**/
+STATIC __inline UINTN WidenAsciiBlock(
+	IN CONST CHAR8* Start,
+	OUT CHAR16* Ucs2
+)
+{
+#if defined(UTF8_SSE2)
+	__m128i v = _mm_loadu_si128((CONST __m128i*)Start);
+	UINT32 Mask = (UINT32)_mm_movemask_epi8(v);
+
+	_mm_storeu_si128((__m128i*)Ucs2, _mm_unpacklo_epi8(v, _mm_setzero_si128()));
+	_mm_storeu_si128((__m128i*)&Ucs2[8], _mm_unpackhi_epi8(v, _mm_setzero_si128()));
+	return (Mask == 0) ? UTF8_BLOCK_SIZE : LowBitSet32(Mask);
+#else
+	uint8x16_t v = vld1q_u8((CONST UINT8*)Start);
+	UINTN i;
+
+	vst1q_u16((UINT16*)Ucs2, vmovl_u8(vget_low_u8(v)));
+	vst1q_u16((UINT16*)&Ucs2[8], vmovl_u8(vget_high_u8(v)));
+	if (vmaxvq_u8(v) < 0x80)
+		return UTF8_BLOCK_SIZE;
+	for (i = 0; (UINT8)Start[i] < 0x80; i++);
+	return i;
+#endif
+}
+#endif
+
+/**
+  Decode a Unicode character from a UTF-8 sequence. Overlong sequences, as well
+  as sequences that encode surrogates or values beyond the Unicode range, are
+  rejected.
+
+  @param[in]  Start    A pointer to the start of the UTF-8 sequence.
+  @param[in]  MaxSize  The maximum size of the UTF-8 sequence.
+  @param[out] Size     A pointer to the variable that receives the size of the decoded UTF-8 sequence.
 
   @return The next Unicode character or (CHAR32)-1 on error.
 **/
 STATIC CHAR32 GetNextUnicodeChar(
 	IN CONST CHAR8* Start,
+	IN CONST UINTN MaxSize,
 	OUT UINTN* Size
 )
 {
-	CHAR32 UnicodeChar = (CHAR32)-1;
+	CONST UINT8* Data = (CONST UINT8*)Start;
+	CHAR32 UnicodeChar, MinChar;
+	UINTN i;
 
-	if (Start == NULL || Size == NULL)
+	if (Start == NULL || Size == NULL || MaxSize == 0)
 		return (CHAR32)-1;
 
-	if ((*Start & 0x80) == 0x00) {
+	if (Data[0] < 0x80) {
 		// Lower ASCII character
 		*Size = 1;
-	} else if ((*Start & 0xE0) == 0xC0) {
+		return Data[0];
+	} else if ((Data[0] & 0xE0) == 0xC0) {
 		// Two-byte UTF-8 character
 		*Size = 2;
-	} else if ((*Start & 0xF0) == 0xE0) {
+		UnicodeChar = Data[0] & 0x1F;
+		MinChar = 0x80;
+	} else if ((Data[0] & 0xF0) == 0xE0) {
 		// Three-byte UTF-8 character
 		*Size = 3;
-	} else if ((*Start & 0xF8) == 0xF0) {
+		UnicodeChar = Data[0] & 0x0F;
+		MinChar = 0x800;
+	} else if ((Data[0] & 0xF8) == 0xF0) {
 		// Four-byte UTF-8 character
 		*Size = 4;
+		UnicodeChar = Data[0] & 0x07;
+		MinChar = 0x10000;
 	} else {
 		// Invalid UTF-8 encoding
 		*Size = 0;
 		return (CHAR32)-1;
 	}
-
-	// Decode the UTF-8 sequence into a 32-bit Unicode character
-	switch (*Size) {
-	case 1:
-		UnicodeChar = *Start;
-		break;
-	case 2:
-		UnicodeChar = (*Start & 0x1F) << 6;
-		UnicodeChar |= (*(Start + 1) & 0x3F);
-		break;
-	case 3:
-		UnicodeChar = (*Start & 0x0F) << 12;
-		UnicodeChar |= (*(Start + 1) & 0x3F) << 6;
-		UnicodeChar |= (*(Start + 2) & 0x3F);
-		break;
-	case 4:
-		UnicodeChar = (*Start & 0x07) << 18;
-		UnicodeChar |= (*(Start + 1) & 0x3F) << 12;
-		UnicodeChar |= (*(Start + 2) & 0x3F) << 6;
-		UnicodeChar |= (*(Start + 3) & 0x3F);
-		break;
-	default:
-		// Invalid UTF-8 encoding
-		*Size = 0;
+	if (*Size > MaxSize)
 		return (CHAR32)-1;
+
+	// Decode the UTF-8 sequence into a 32-bit Unicode character. Since we check
+	// each continuation byte before the next, we also stop on a NUL terminator.
+	for (i = 1; i < *Size; i++) {
+		if ((Data[i] & 0xC0) != 0x80)
+			return (CHAR32)-1;
+		UnicodeChar = (UnicodeChar << 6) | (Data[i] & 0x3F);
 	}
+	if (UnicodeChar < MinChar || (UnicodeChar >= 0xD800 && UnicodeChar <= 0xDFFF) ||
+		UnicodeChar > 0x10FFFF)
+		return (CHAR32)-1;
 
 	// Return the Unicode character
 	return UnicodeChar;
 }
 
 /**
-  Convert a UTF-8 encoded string to a UCS-2 encoded string.
+  Convert a UTF-8 encoded string of known size to a UCS-2 encoded string.
+  Any invalid UTF-8 sequence results in an error.
 
   @param[in]  Utf8String      A pointer to the input UTF-8 encoded string.
+  @param[in]  Utf8StringSize  The size of Utf8String (in CHAR8), not including any NUL terminator.
   @param[out] Ucs2String      A pointer to the output UCS-2 encoded string.
   @param[in]  Ucs2StringSize  The size of the Ucs2String buffer (in CHAR16).
 
@@ -95,8 +152,9 @@ STATIC CHAR32 GetNextUnicodeChar(
   @retval EFI_INVALID_PARAMETER  One or more of the input parameters are invalid.
   @retval EFI_BUFFER_TOO_SMALL   The output buffer is too small to hold the result.
 **/
-EFI_STATUS Utf8ToUcs2(
+EFI_STATUS Utf8ToUcs2N(
 	IN CONST CHAR8* Utf8String,
+	IN CONST UINTN Utf8StringSize,
 	OUT CHAR16* Ucs2String,
 	IN CONST UINTN Ucs2StringSize
 )
@@ -104,16 +162,28 @@ EFI_STATUS Utf8ToUcs2(
 	CHAR32 UnicodeChar;
 	UINTN Size, Index = 0, Ucs2Index = 0;
 
-	if (Utf8String == NULL || Ucs2String == NULL)
+	if (Utf8String == NULL || Ucs2String == NULL || Ucs2StringSize == 0)
 		return EFI_INVALID_PARAMETER;
 
 	// Sanity check
 	V_ASSERT(Ucs2StringSize <= STRING_MAX);
 
 	// Iterate through the UTF-8 string
-	while (Utf8String[Index] != '\0') {
+	while (Index < Utf8StringSize) {
+#if defined(UTF8_BLOCK_SIZE)
+		// Since a UTF-8 sequence never produces more UCS-2 characters than it
+		// has bytes, Ucs2Index can't be past Index.
+		if (Index + UTF8_BLOCK_SIZE <= Utf8StringSize && Ucs2Index + UTF8_BLOCK_SIZE < Ucs2StringSize) {
+			Size = WidenAsciiBlock(&Utf8String[Index], &Ucs2String[Ucs2Index]);
+			Index += Size;
+			Ucs2Index += Size;
+			if (Size == UTF8_BLOCK_SIZE)
+				continue;
+		}
+#endif
+
 		// Decode UTF-8 character to Unicode
-		UnicodeChar = GetNextUnicodeChar(&Utf8String[Index], &Size);
+		UnicodeChar = GetNextUnicodeChar(&Utf8String[Index], Utf8StringSize - Index, &Size);
 
 		// Check for decoding errors
 		if (UnicodeChar == (CHAR32)-1 || Size == 0)
@@ -145,3 +215,26 @@ EFI_STATUS Utf8ToUcs2(
 
 	return EFI_SUCCESS;
 }
+
+/**
+  Convert a UTF-8 encoded string to a UCS-2 encoded string.
+
+  @param[in]  Utf8String      A pointer to the input UTF-8 encoded string.
+  @param[out] Ucs2String      A pointer to the output UCS-2 encoded string.
+  @param[in]  Ucs2StringSize  The size of the Ucs2String buffer (in CHAR16).
+
+  @retval EFI_SUCCESS            The conversion was successful.
+  @retval EFI_INVALID_PARAMETER  One or more of the input parameters are invalid.
+  @retval EFI_BUFFER_TOO_SMALL   The output buffer is too small to hold the result.
+**/
+EFI_STATUS Utf8ToUcs2(
+	IN CONST CHAR8* Utf8String,
+	OUT CHAR16* Ucs2String,
+	IN CONST UINTN Ucs2StringSize
+)
+{
+	if (Utf8String == NULL)
+		return EFI_INVALID_PARAMETER;
+
+	return Utf8ToUcs2N(Utf8String, AsciiStrLen(Utf8String), Ucs2String, Ucs2StringSize);
+}
@@ -0,0 +1,512 @@
+/*
+ * uefi-md5sum: UEFI MD5Sum validator - Direct volume access
+ * Copyright © 2024 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "boot.h"
+
+/* Number of entries by which a FILE_EXTENT array is grown */
+#define EXTENT_ALLOC_INCREMENT  64
+
+/* Maximum length of a name from a path, for all the file systems we support */
+#define VOLUME_NAME_MAX         255
+
+/**
+  Open the volume from a device for direct access, so that file data can be read
+  with large disk reads, rather than through the firmware file system driver.
+
+  @param[in]  DeviceHandle      A handle to the device holding the volume.
+  @param[out] Volume            A pointer to receive the newly allocated FS_VOLUME.
+
+  @retval EFI_SUCCESS           The volume was opened for direct access.
+  @retval EFI_INVALID_PARAMETER One or more of the input parameters are invalid.
+  @retval EFI_UNSUPPORTED       The file system of the volume is not supported.
+  @retval EFI_OUT_OF_RESOURCES  A memory allocation error occurred.
+  @retval other                 The disk could not be accessed.
+**/
+EFI_STATUS OpenVolume(
+	IN CONST EFI_HANDLE DeviceHandle,
+	OUT FS_VOLUME** Volume
+)
+{
+	EFI_STATUS Status;
+	EFI_BLOCK_IO_PROTOCOL* BlockIo;
+	FS_VOLUME* Vol = NULL;
+
+	if (DeviceHandle == NULL || Volume == NULL)
+		return EFI_INVALID_PARAMETER;
+	*Volume = NULL;
+
+	Status = gBS->HandleProtocol(DeviceHandle, &gEfiBlockIoProtocolGuid, (VOID**)&BlockIo);
+	if (EFI_ERROR(Status))
+		return EFI_UNSUPPORTED;
+	if (!BlockIo->Media->MediaPresent)
+		return EFI_NO_MEDIA;
+
+	Vol = AllocateZeroPool(sizeof(FS_VOLUME));
+	if (Vol == NULL)
+		return EFI_OUT_OF_RESOURCES;
+	Vol->MediaId = BlockIo->Media->MediaId;
+	Status = gBS->HandleProtocol(DeviceHandle, &gEfiDiskIoProtocolGuid, (VOID**)&Vol->DiskIo);
+	if (EFI_ERROR(Status)) {
+		Status = EFI_UNSUPPORTED;
+		goto out;
+	}
+	// Asynchronous disk I/O is optional
+	if (EFI_ERROR(gBS->HandleProtocol(DeviceHandle, &gEfiDiskIo2ProtocolGuid, (VOID**)&Vol->DiskIo2)))
+		Vol->DiskIo2 = NULL;
+
+	Vol->Buffer = AllocatePool(VOLUME_BUFFER_SIZE);
+	Vol->Cache = AllocatePool(VOLUME_CACHE_SIZE);
+	if (Vol->Buffer == NULL || Vol->Cache == NULL) {
+		Status = EFI_OUT_OF_RESOURCES;
+		goto out;
+	}
+	// Make sure the cache is not considered valid until it is filled
+	Vol->CacheOffset = (UINT64)-1;
+
+	// The boot sector is all we need to identify the file system
+	Status = ReadVolume(Vol, 0, 512, Vol->Buffer);
+	if (EFI_ERROR(Status))
+		goto out;
+	Status = FatMountVolume(Vol, Vol->Buffer);
+	if (Status == EFI_UNSUPPORTED)
+		Status = NtfsMountVolume(Vol, Vol->Buffer);
+	if (EFI_ERROR(Status))
+		goto out;
+
+	*Volume = Vol;
+
+out:
+	if (EFI_ERROR(Status))
+		CloseVolume(Vol);
+	return Status;
+}
+
+/**
+  Release a volume that was opened with OpenVolume().
+
+  @param[in]  Volume            (Optional) A pointer to the FS_VOLUME to release.
+**/
+VOID CloseVolume(
+	OPTIONAL IN FS_VOLUME* Volume
+)
+{
+	if (Volume == NULL)
+		return;
+	// OpenVolume() may have failed before, or while, allocating these
+	if (Volume->Buffer != NULL)
+		FreePool(Volume->Buffer);
+	if (Volume->Cache != NULL)
+		FreePool(Volume->Cache);
+	// These are only allocated for NTFS
+	if (Volume->MftExtents != NULL)
+		FreePool(Volume->MftExtents);
+	if (Volume->UpCase != NULL)
+		FreePool(Volume->UpCase);
+	if (Volume->Record != NULL)
+		FreePool(Volume->Record);
+	FreePool(Volume);
+}
+
+/**
+  Convert a GUID string in registry format, such as "01234567-89ab-cdef-0123-456789abcdef",
+  with or without braces, to an EFI_GUID.
+
+  @param[in]  String            The GUID string.
+  @param[out] Guid              A pointer to receive the GUID.
+
+  @retval TRUE if the string is a valid GUID, FALSE otherwise.
+**/
+STATIC BOOLEAN StrToGuid(
+	IN CONST CHAR16* String,
+	OUT EFI_GUID* Guid
+)
+{
+	UINT8 Nibble[32];
+	UINTN i, n = 0, Len = SafeStrLen(String);
+
+	if (Len == 38 && String[0] == L'{' && String[37] == L'}') {
+		String++;
+		Len -= 2;
+	}
+	if (Len != 36)
+		return FALSE;
+	for (i = 0; i < Len; i++) {
+		if (i == 8 || i == 13 || i == 18 || i == 23) {
+			if (String[i] != L'-')
+				return FALSE;
+			continue;
+		}
+		if (String[i] >= 0x80 || !IsValidHexAscii((CHAR8)String[i]))
+			return FALSE;
+		if (String[i] <= L'9')
+			Nibble[n++] = (UINT8)(String[i] - L'0');
+		else
+			Nibble[n++] = (UINT8)(_tolower(String[i]) - L'a' + 0x0a);
+	}
+
+	Guid->Data1 = 0;
+	for (i = 0; i < 8; i++)
+		Guid->Data1 = (Guid->Data1 << 4) | Nibble[i];
+	Guid->Data2 = 0;
+	Guid->Data3 = 0;
+	for (i = 0; i < 4; i++) {
+		Guid->Data2 = (UINT16)((Guid->Data2 << 4) | Nibble[8 + i]);
+		Guid->Data3 = (UINT16)((Guid->Data3 << 4) | Nibble[12 + i]);
+	}
+	for (i = 0; i < 8; i++)
+		Guid->Data4[i] = (UINT8)((Nibble[16 + 2 * i] << 4) | Nibble[17 + 2 * i]);
+	return TRUE;
+}
+
+/**
+  Check whether a device is a GPT partition with a specific unique partition GUID.
+
+  @param[in]  DeviceHandle      A handle to the device.
+  @param[in]  Guid              A pointer to the partition GUID.
+
+  @retval TRUE if the device is the partition, FALSE otherwise.
+**/
+STATIC BOOLEAN IsPartition(
+	IN CONST EFI_HANDLE DeviceHandle,
+	IN CONST EFI_GUID* Guid
+)
+{
+	EFI_DEVICE_PATH* Node;
+	HARDDRIVE_DEVICE_PATH* HardDrive;
+	EFI_GUID Signature;
+
+	for (Node = DevicePathFromHandle(DeviceHandle); Node != NULL && !IsDevicePathEnd(Node);
+		Node = NextDevicePathNode(Node)) {
+		if (DevicePathType(Node) != MEDIA_DEVICE_PATH || DevicePathSubType(Node) != MEDIA_HARDDRIVE_DP)
+			continue;
+		HardDrive = (HARDDRIVE_DEVICE_PATH*)Node;
+		if (HardDrive->SignatureType != SIGNATURE_TYPE_GUID)
+			continue;
+		// Device path nodes are packed, so the signature may not be aligned
+		CopyMem(&Signature, HardDrive->Signature, sizeof(Signature));
+		if (COMPARE_GUID(&Signature, Guid))
+			return TRUE;
+	}
+	return FALSE;
+}
+
+/**
+  Locate a volume from its label, or from the unique GUID of its GPT partition.
+
+  @param[in]  Id                The label of the volume, or its partition GUID in registry format,
+                                with or without braces. Labels are compared case insensitively.
+  @param[out] DeviceHandle      A pointer to receive the handle of the device holding the volume.
+
+  @retval EFI_SUCCESS           The volume was found.
+  @retval EFI_INVALID_PARAMETER One or more of the input parameters are invalid.
+  @retval EFI_NOT_FOUND         No volume matches Id.
+  @retval EFI_OUT_OF_RESOURCES  A memory allocation error occurred.
+**/
+EFI_STATUS LocateVolume(
+	IN CONST CHAR16* Id,
+	OUT EFI_HANDLE* DeviceHandle
+)
+{
+	CONST UINTN InfoSize = SIZE_OF_EFI_FILE_SYSTEM_INFO + PATH_MAX * sizeof(CHAR16);
+	EFI_STATUS Status;
+	EFI_HANDLE* Handles = NULL;
+	EFI_SIMPLE_FILE_SYSTEM_PROTOCOL* FileSystem;
+	EFI_FILE_HANDLE Root;
+	EFI_FILE_SYSTEM_INFO* Info = NULL;
+	EFI_GUID Guid;
+	BOOLEAN IsGuid;
+	UINTN i, Size, NumHandles = 0;
+
+	if (Id == NULL || DeviceHandle == NULL)
+		return EFI_INVALID_PARAMETER;
+	*DeviceHandle = NULL;
+	IsGuid = StrToGuid(Id, &Guid);
+
+	Status = gBS->LocateHandleBuffer(ByProtocol, &gEfiSimpleFileSystemProtocolGuid,
+		NULL, &NumHandles, &Handles);
+	if (EFI_ERROR(Status))
+		return EFI_NOT_FOUND;
+
+	// Leave room to terminate labels that the driver didn't terminate
+	Info = AllocatePool(InfoSize + sizeof(CHAR16));
+	if (Info == NULL) {
+		Status = EFI_OUT_OF_RESOURCES;
+		goto out;
+	}
+
+	for (i = 0; i < NumHandles; i++) {
+		if (IsGuid && IsPartition(Handles[i], &Guid))
+			break;
+		// A GUID may also be used as a label, so we check the label regardless
+		if (EFI_ERROR(gBS->HandleProtocol(Handles[i], &gEfiSimpleFileSystemProtocolGuid,
+			(VOID**)&FileSystem)) || EFI_ERROR(FileSystem->OpenVolume(FileSystem, &Root)))
+			continue;
+		Size = InfoSize;
+		ZeroMem(Info, InfoSize + sizeof(CHAR16));
+		Status = Root->GetInfo(Root, &gEfiFileSystemInfoGuid, &Size, Info);
+		Root->Close(Root);
+		if (Status == EFI_SUCCESS && Info->VolumeLabel[0] != L'\0' &&
+			_StriCmp(Info->VolumeLabel, Id) == 0)
+			break;
+	}
+	if (i < NumHandles) {
+		*DeviceHandle = Handles[i];
+		Status = EFI_SUCCESS;
+	} else {
+		Status = EFI_NOT_FOUND;
+	}
+
+out:
+	if (Info != NULL)
+		FreePool(Info);
+	FreePool(Handles);
+	return Status;
+}
+
+/**
+  Read data from a volume.
+
+  @param[in]  Volume            A pointer to the FS_VOLUME to read from.
+  @param[in]  Offset            The byte offset to read from.
+  @param[in]  Size              The number of bytes to read.
+  @param[out] Buffer            A pointer to the buffer receiving the data.
+
+  @retval EFI_SUCCESS           The data was read.
+  @retval other                 The disk could not be read.
+**/
+EFI_STATUS ReadVolume(
+	IN FS_VOLUME* Volume,
+	IN CONST UINT64 Offset,
+	IN CONST UINTN Size,
+	OUT VOID* Buffer
+)
+{
+	return Volume->DiskIo->ReadDisk(Volume->DiskIo, Volume->MediaId, Offset, Size, Buffer);
+}
+
+/**
+  Append a run of data to an array of file extents, merging it with the last extent if contiguous.
+
+  @param[in/out] Extents        A pointer to the (reallocated as needed) FILE_EXTENT array.
+  @param[in/out] NumExtents     A pointer to the number of extents in the array.
+  @param[in]     Offset         The byte offset of the run on the volume.
+  @param[in]     Length         The length of the run, in bytes.
+
+  @retval EFI_SUCCESS           The extent was added.
+  @retval EFI_OUT_OF_RESOURCES  A memory allocation error occurred.
+**/
+EFI_STATUS AddFileExtent(
+	IN OUT FILE_EXTENT** Extents,
+	IN OUT UINTN* NumExtents,
+	IN CONST UINT64 Offset,
+	IN CONST UINT64 Length
+)
+{
+	FILE_EXTENT* NewExtents;
+	UINTN n = *NumExtents;
+
+	if (n > 0 && (*Extents)[n - 1].Offset + (*Extents)[n - 1].Length == Offset) {
+		(*Extents)[n - 1].Length += Length;
+		return EFI_SUCCESS;
+	}
+
+	if (n % EXTENT_ALLOC_INCREMENT == 0) {
+		NewExtents = AllocatePool((n + EXTENT_ALLOC_INCREMENT) * sizeof(FILE_EXTENT));
+		if (NewExtents == NULL)
+			return EFI_OUT_OF_RESOURCES;
+		if (n > 0) {
+			CopyMem(NewExtents, *Extents, n * sizeof(FILE_EXTENT));
+			FreePool(*Extents);
+		}
+		*Extents = NewExtents;
+	}
+	(*Extents)[n].Offset = Offset;
+	(*Extents)[n].Length = Length;
+	*NumExtents = n + 1;
+	return EFI_SUCCESS;
+}
+
+/**
+  Look up several names in a directory of a volume. The directory is only read
+  once for all of the names, or until they have all been found.
+
+  @param[in]  Volume            A pointer to the FS_VOLUME the directory resides on.
+  @param[in]  Dir               (Optional) The FS_NODE of the directory, or NULL for the root.
+  @param[in]  Names             An array of NumNames names, that must not contain separators.
+  @param[in]  NumNames          The number of names to look up.
+  @param[out] Nodes             An array of NumNames FS_NODE, to receive the node of each name.
+  @param[out] Results           An array of NumNames EFI_STATUS, to receive the result of the
+                                lookup of each name, which is EFI_SUCCESS when the name was found,
+                                EFI_NOT_FOUND when it wasn't, EFI_UNSUPPORTED if it can't be
+                                accessed directly, or an error from reading the directory.
+
+  @retval EFI_SUCCESS           The names were looked up.
+  @retval EFI_INVALID_PARAMETER One or more of the input parameters are invalid.
+**/
+EFI_STATUS LookupVolumeNames(
+	IN FS_VOLUME* Volume,
+	OPTIONAL IN CONST FS_NODE* Dir,
+	IN CONST CHAR16* CONST* Names,
+	IN CONST UINTN NumNames,
+	OUT FS_NODE* Nodes,
+	OUT EFI_STATUS* Results
+)
+{
+	EFI_STATUS Status;
+	CONST CHAR16* Name;
+	UINTN i;
+
+	if (Volume == NULL || Names == NULL || Nodes == NULL || Results == NULL)
+		return EFI_INVALID_PARAMETER;
+	if (Dir == NULL)
+		Dir = &Volume->RootDir;
+
+	// Leave the names that refer to a directory itself, or that involve going
+	// up the hierarchy, to the file system driver
+	for (i = 0; i < NumNames; i++) {
+		Name = Names[i];
+		Results[i] = (Name[0] == L'\0' || (Name[0] == L'.' && (Name[1] == L'\0' ||
+			(Name[1] == L'.' && Name[2] == L'\0')))) ? EFI_UNSUPPORTED : EFI_NOT_FOUND;
+	}
+
+	switch (Volume->Type) {
+	case FS_TYPE_FAT12:
+	case FS_TYPE_FAT16:
+	case FS_TYPE_FAT32:
+	case FS_TYPE_EXFAT:
+		Status = FatLookupNames(Volume, Dir, Names, NumNames, Nodes, Results);
+		break;
+	case FS_TYPE_NTFS:
+		Status = NtfsLookupNames(Volume, Dir, Names, NumNames, Nodes, Results);
+		break;
+	default:
+		Status = EFI_UNSUPPORTED;
+		break;
+	}
+	// The names that were not reached get the error
+	for (i = 0; EFI_ERROR(Status) && i < NumNames; i++) {
+		if (Results[i] == EFI_NOT_FOUND)
+			Results[i] = Status;
+	}
+	return EFI_SUCCESS;
+}
+
+/**
+  Look up a path on a volume.
+
+  @param[in]  Volume            A pointer to the FS_VOLUME the path resides on.
+  @param[in]  Dir               (Optional) The FS_NODE of the directory the path is relative to,
+                                or NULL for the root.
+  @param[in]  Path              The path to look up.
+  @param[out] Node              A pointer to receive the FS_NODE of the path.
+
+  @retval EFI_SUCCESS           The path was found.
+  @retval EFI_INVALID_PARAMETER One or more of the input parameters are invalid.
+  @retval EFI_NOT_FOUND         The path could not be located.
+  @retval EFI_UNSUPPORTED       The path can't be accessed directly.
+  @retval EFI_VOLUME_CORRUPTED  The file system metadata is inconsistent.
+  @retval other                 The disk could not be read.
+**/
+EFI_STATUS LookupVolumePath(
+	IN FS_VOLUME* Volume,
+	OPTIONAL IN CONST FS_NODE* Dir,
+	IN CONST CHAR16* Path,
+	OUT FS_NODE* Node
+)
+{
+	EFI_STATUS Status;
+	CHAR16 Name[VOLUME_NAME_MAX + 1];
+	CONST CHAR16* Names[1] = { Name };
+	FS_NODE Parent;
+	UINTN i;
+
+	if (Volume == NULL || Path == NULL || Node == NULL)
+		return EFI_INVALID_PARAMETER;
+
+	*Node = (Dir == NULL) ? Volume->RootDir : *Dir;
+	while (*Path != L'\0') {
+		for (i = 0; Path[i] != L'\0' && Path[i] != L'\\'; i++) {
+			if (i >= VOLUME_NAME_MAX)
+				return EFI_NOT_FOUND;
+			Name[i] = Path[i];
+		}
+		Name[i] = L'\0';
+		Path = (Path[i] == L'\0') ? &Path[i] : &Path[i + 1];
+		if (i == 0 || (i == 1 && Name[0] == L'.'))
+			continue;
+		Parent = *Node;
+		LookupVolumeNames(Volume, &Parent, Names, 1, Node, &Status);
+		if (EFI_ERROR(Status))
+			return Status;
+	}
+	return EFI_SUCCESS;
+}
+
+/**
+  Resolve a file to the list of extents holding its data on a volume.
+
+  @param[in]  Volume            A pointer to the FS_VOLUME the file resides on.
+  @param[in]  Node              The FS_NODE of the file, from LookupVolumeNames() or LookupVolumePath().
+  @param[out] Extents           A pointer to receive the newly allocated FILE_EXTENT array
+                                (NULL for an empty file).
+  @param[out] NumExtents        A pointer to receive the number of extents.
+  @param[out] FileSize          A pointer to receive the size of the file.
+
+  @retval EFI_SUCCESS           The extents were resolved.
+  @retval EFI_UNSUPPORTED       The node is a directory, or the file can't be accessed directly.
+  @retval EFI_VOLUME_CORRUPTED  The file system metadata is inconsistent.
+  @retval EFI_OUT_OF_RESOURCES  A memory allocation error occurred.
+**/
+EFI_STATUS GetFileExtents(
+	IN FS_VOLUME* Volume,
+	IN CONST FS_NODE* Node,
+	OUT FILE_EXTENT** Extents,
+	OUT UINTN* NumExtents,
+	OUT UINT64* FileSize
+)
+{
+	EFI_STATUS Status;
+
+	if (Volume == NULL || Node == NULL || Extents == NULL || NumExtents == NULL || FileSize == NULL)
+		return EFI_INVALID_PARAMETER;
+	*Extents = NULL;
+	*NumExtents = 0;
+	*FileSize = 0;
+
+	switch (Volume->Type) {
+	case FS_TYPE_FAT12:
+	case FS_TYPE_FAT16:
+	case FS_TYPE_FAT32:
+	case FS_TYPE_EXFAT:
+		Status = FatGetFileExtents(Volume, Node, Extents, NumExtents, FileSize);
+		break;
+	case FS_TYPE_NTFS:
+		Status = NtfsGetFileExtents(Volume, Node, Extents, NumExtents, FileSize);
+		break;
+	default:
+		Status = EFI_UNSUPPORTED;
+		break;
+	}
+	if (EFI_ERROR(Status)) {
+		// The lookup may have failed before the first extent was allocated
+		if (*Extents != NULL)
+			SafeFree(*Extents);
+		*NumExtents = 0;
+	}
+	return Status;
+}
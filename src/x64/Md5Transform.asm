@@ -0,0 +1,193 @@
+;------------------------------------------------------------------------------
+;
+; uefi-md5sum: UEFI MD5Sum validator - MD5 transform for x64 (MASM)
+; Copyright © 2024 Pete Batard <pete@akeo.ie>
+;
+; This program is free software: you can redistribute it and/or modify
+; it under the terms of the GNU General Public License as published by
+; the Free Software Foundation, either version 2 of the License, or
+; (at your option) any later version.
+;
+; This program is distributed in the hope that it will be useful,
+; but WITHOUT ANY WARRANTY; without even the implied warranty of
+; MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+; GNU General Public License for more details.
+;
+; You should have received a copy of the GNU General Public License
+; along with this program.  If not, see <http://www.gnu.org/licenses/>.
+;
+;------------------------------------------------------------------------------
+
+;
+; This is the MASM version of Md5Transform.S, for the Visual Studio and EDK2
+; MSFT toolchains. See that file for details, and keep both files in sync.
+;
+
+; F(b, c, d) = d ^ (b & (c ^ d))
+STEP1 MACRO pa, pb, pc, pd, nx, k, s
+	mov	r12d, r&pc&d
+	lea	r&pa&d, [r&pa + rax + ((k XOR 80000000h) - 80000000h)]
+	xor	r12d, r&pd&d
+	and	r12d, r&pb&d
+	mov	eax, [rdx + 4 * nx]
+	xor	r12d, r&pd&d
+	add	r&pa&d, r12d
+	rol	r&pa&d, s
+	add	r&pa&d, r&pb&d
+ENDM
+
+; G(b, c, d) = (b & d) + (c & ~d)
+STEP2 MACRO pa, pb, pc, pd, nx, k, s
+	mov	r12d, r&pd&d
+	lea	r&pa&d, [r&pa + rax + ((k XOR 80000000h) - 80000000h)]
+	not	r12d
+	mov	r13d, r&pd&d
+	and	r12d, r&pc&d
+	and	r13d, r&pb&d
+	add	r&pa&d, r12d
+	mov	eax, [rdx + 4 * nx]
+	add	r&pa&d, r13d
+	rol	r&pa&d, s
+	add	r&pa&d, r&pb&d
+ENDM
+
+; H(b, c, d) = b ^ c ^ d
+STEP3 MACRO pa, pb, pc, pd, nx, k, s
+	mov	r12d, r&pc&d
+	lea	r&pa&d, [r&pa + rax + ((k XOR 80000000h) - 80000000h)]
+	xor	r12d, r&pd&d
+	mov	eax, [rdx + 4 * nx]
+	xor	r12d, r&pb&d
+	add	r&pa&d, r12d
+	rol	r&pa&d, s
+	add	r&pa&d, r&pb&d
+ENDM
+
+; I(b, c, d) = c ^ (b | ~d)
+STEP4 MACRO pa, pb, pc, pd, nx, k, s
+	mov	r12d, r&pd&d
+	lea	r&pa&d, [r&pa + rax + ((k XOR 80000000h) - 80000000h)]
+	not	r12d
+	or	r12d, r&pb&d
+	mov	eax, [rdx + 4 * nx]
+	xor	r12d, r&pc&d
+	add	r&pa&d, r12d
+	rol	r&pa&d, s
+	add	r&pa&d, r&pb&d
+ENDM
+
+	.code
+
+;------------------------------------------------------------------------------
+; VOID
+; EFIAPI
+; Md5TransformAsm (
+;   IN OUT UINT32      *State,      // rcx
+;   IN     CONST UINT8 *Data,       // rdx
+;   IN     UINTN       NumBlocks    // r8
+;   );
+;------------------------------------------------------------------------------
+Md5TransformAsm PROC PUBLIC
+	test	r8, r8
+	jz	Md5Done
+	push	r12
+	push	r13
+	push	r14
+	shl	r8, 6
+	lea	r14, [rdx + r8]
+	mov	r8d, [rcx]
+	mov	r9d, [rcx + 4]
+	mov	r10d, [rcx + 8]
+	mov	r11d, [rcx + 12]
+
+Md5Loop:
+	mov	eax, [rdx]
+
+	STEP1	8, 9, 10, 11,  1, 0d76aa478h,  7
+	STEP1	11, 8, 9, 10,  2, 0e8c7b756h, 12
+	STEP1	10, 11, 8, 9,  3, 0242070dbh, 17
+	STEP1	9, 10, 11, 8,  4, 0c1bdceeeh, 22
+	STEP1	8, 9, 10, 11,  5, 0f57c0fafh,  7
+	STEP1	11, 8, 9, 10,  6, 04787c62ah, 12
+	STEP1	10, 11, 8, 9,  7, 0a8304613h, 17
+	STEP1	9, 10, 11, 8,  8, 0fd469501h, 22
+	STEP1	8, 9, 10, 11,  9, 0698098d8h,  7
+	STEP1	11, 8, 9, 10, 10, 08b44f7afh, 12
+	STEP1	10, 11, 8, 9, 11, 0ffff5bb1h, 17
+	STEP1	9, 10, 11, 8, 12, 0895cd7beh, 22
+	STEP1	8, 9, 10, 11, 13, 06b901122h,  7
+	STEP1	11, 8, 9, 10, 14, 0fd987193h, 12
+	STEP1	10, 11, 8, 9, 15, 0a679438eh, 17
+	STEP1	9, 10, 11, 8,  1, 049b40821h, 22
+
+	STEP2	8, 9, 10, 11,  6, 0f61e2562h,  5
+	STEP2	11, 8, 9, 10, 11, 0c040b340h,  9
+	STEP2	10, 11, 8, 9,  0, 0265e5a51h, 14
+	STEP2	9, 10, 11, 8,  5, 0e9b6c7aah, 20
+	STEP2	8, 9, 10, 11, 10, 0d62f105dh,  5
+	STEP2	11, 8, 9, 10, 15, 002441453h,  9
+	STEP2	10, 11, 8, 9,  4, 0d8a1e681h, 14
+	STEP2	9, 10, 11, 8,  9, 0e7d3fbc8h, 20
+	STEP2	8, 9, 10, 11, 14, 021e1cde6h,  5
+	STEP2	11, 8, 9, 10,  3, 0c33707d6h,  9
+	STEP2	10, 11, 8, 9,  8, 0f4d50d87h, 14
+	STEP2	9, 10, 11, 8, 13, 0455a14edh, 20
+	STEP2	8, 9, 10, 11,  2, 0a9e3e905h,  5
+	STEP2	11, 8, 9, 10,  7, 0fcefa3f8h,  9
+	STEP2	10, 11, 8, 9, 12, 0676f02d9h, 14
+	STEP2	9, 10, 11, 8,  5, 08d2a4c8ah, 20
+
+	STEP3	8, 9, 10, 11,  8, 0fffa3942h,  4
+	STEP3	11, 8, 9, 10, 11, 08771f681h, 11
+	STEP3	10, 11, 8, 9, 14, 06d9d6122h, 16
+	STEP3	9, 10, 11, 8,  1, 0fde5380ch, 23
+	STEP3	8, 9, 10, 11,  4, 0a4beea44h,  4
+	STEP3	11, 8, 9, 10,  7, 04bdecfa9h, 11
+	STEP3	10, 11, 8, 9, 10, 0f6bb4b60h, 16
+	STEP3	9, 10, 11, 8, 13, 0bebfbc70h, 23
+	STEP3	8, 9, 10, 11,  0, 0289b7ec6h,  4
+	STEP3	11, 8, 9, 10,  3, 0eaa127fah, 11
+	STEP3	10, 11, 8, 9,  6, 0d4ef3085h, 16
+	STEP3	9, 10, 11, 8,  9, 004881d05h, 23
+	STEP3	8, 9, 10, 11, 12, 0d9d4d039h,  4
+	STEP3	11, 8, 9, 10, 15, 0e6db99e5h, 11
+	STEP3	10, 11, 8, 9,  2, 01fa27cf8h, 16
+	STEP3	9, 10, 11, 8,  0, 0c4ac5665h, 23
+
+	STEP4	8, 9, 10, 11,  7, 0f4292244h,  6
+	STEP4	11, 8, 9, 10, 14, 0432aff97h, 10
+	STEP4	10, 11, 8, 9,  5, 0ab9423a7h, 15
+	STEP4	9, 10, 11, 8, 12, 0fc93a039h, 21
+	STEP4	8, 9, 10, 11,  3, 0655b59c3h,  6
+	STEP4	11, 8, 9, 10, 10, 08f0ccc92h, 10
+	STEP4	10, 11, 8, 9,  1, 0ffeff47dh, 15
+	STEP4	9, 10, 11, 8,  8, 085845dd1h, 21
+	STEP4	8, 9, 10, 11, 15, 06fa87e4fh,  6
+	STEP4	11, 8, 9, 10,  6, 0fe2ce6e0h, 10
+	STEP4	10, 11, 8, 9, 13, 0a3014314h, 15
+	STEP4	9, 10, 11, 8,  4, 04e0811a1h, 21
+	STEP4	8, 9, 10, 11, 11, 0f7537e82h,  6
+	STEP4	11, 8, 9, 10,  2, 0bd3af235h, 10
+	STEP4	10, 11, 8, 9,  9, 02ad7d2bbh, 15
+	STEP4	9, 10, 11, 8,  0, 0eb86d391h, 21
+
+	add	r8d, [rcx]
+	add	r9d, [rcx + 4]
+	add	r10d, [rcx + 8]
+	add	r11d, [rcx + 12]
+	mov	[rcx], r8d
+	mov	[rcx + 4], r9d
+	mov	[rcx + 8], r10d
+	mov	[rcx + 12], r11d
+	add	rdx, 64
+	cmp	rdx, r14
+	jb	Md5Loop
+
+	pop	r14
+	pop	r13
+	pop	r12
+Md5Done:
+	ret
+Md5TransformAsm ENDP
+
+	END
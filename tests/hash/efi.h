@@ -0,0 +1,217 @@
+/*
+ * uefi-md5sum: UEFI MD5Sum validator - Host shim for the EFI types and macros
+ * Copyright © 2024 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * This header stands in for gnu-efi's <efi.h> so that the hashing code from
+ * src/ can be compiled and run as a regular Linux application. It only provides
+ * what's needed for boot.h and hash.c to build, with the EFI services that the
+ * hashing code calls being implemented by the test application.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define _GNU_EFI
+
+#define IN
+#define OUT
+#define OPTIONAL
+#define CONST               const
+#define STATIC              static
+#if defined(__x86_64__)
+#define EFIAPI              __attribute__((ms_abi))
+#else
+#define EFIAPI
+#endif
+
+typedef void                VOID;
+typedef uint8_t             BOOLEAN;
+typedef int8_t              INT8;
+typedef uint8_t             UINT8;
+typedef int16_t             INT16;
+typedef uint16_t            UINT16;
+typedef int32_t             INT32;
+typedef uint32_t            UINT32;
+typedef int64_t             INT64;
+typedef uint64_t            UINT64;
+typedef intptr_t            INTN;
+typedef uintptr_t           UINTN;
+typedef char                CHAR8;
+typedef uint16_t            CHAR16;
+typedef UINTN               EFI_STATUS;
+typedef VOID*               EFI_HANDLE;
+typedef VOID*               EFI_EVENT;
+
+#define TRUE                ((BOOLEAN)1)
+#define FALSE               ((BOOLEAN)0)
+
+#define EFI_ERROR_MASK      ((UINTN)1 << (sizeof(UINTN) * 8 - 1))
+#define EFIERR(a)           (EFI_ERROR_MASK | (a))
+#define EFI_ERROR(a)        (((INTN)(a)) < 0)
+
+#define EFI_SUCCESS             0
+#define EFI_INVALID_PARAMETER   EFIERR(2)
+#define EFI_UNSUPPORTED         EFIERR(3)
+#define EFI_BAD_BUFFER_SIZE     EFIERR(4)
+#define EFI_BUFFER_TOO_SMALL    EFIERR(5)
+#define EFI_NOT_READY           EFIERR(6)
+#define EFI_OUT_OF_RESOURCES    EFIERR(9)
+#define EFI_NO_MEDIA            EFIERR(12)
+#define EFI_NOT_FOUND           EFIERR(14)
+#define EFI_ABORTED             EFIERR(21)
+#define EFI_CRC_ERROR           EFIERR(27)
+#define EFI_END_OF_FILE         EFIERR(31)
+
+#define EFI_BLACK           0x00
+#define EFI_LIGHTGRAY       0x07
+#define EFI_DARKGRAY        0x08
+#define EFI_LIGHTGREEN      0x0A
+#define EFI_LIGHTRED        0x0C
+#define EFI_YELLOW          0x0E
+#define EFI_WHITE           0x0F
+#define EFI_TEXT_ATTR(f, b) ((f) | ((b) << 4))
+
+typedef struct {
+	UINT32      Data1;
+	UINT16      Data2;
+	UINT16      Data3;
+	UINT8       Data4[8];
+} EFI_GUID;
+
+typedef struct {
+	UINT64      Size;
+	UINT64      FileSize;
+	UINT64      PhysicalSize;
+	UINT8       Time[3 * 16];
+	UINT64      Attribute;
+	CHAR16      FileName[1];
+} EFI_FILE_INFO;
+
+#define SIZE_OF_EFI_FILE_INFO   EFI_FIELD_OFFSET(EFI_FILE_INFO, FileName)
+
+typedef struct {
+	UINT64      Size;
+	BOOLEAN     ReadOnly;
+	UINT64      VolumeSize;
+	UINT64      FreeSpace;
+	UINT32      BlockSize;
+	CHAR16      VolumeLabel[1];
+} EFI_FILE_SYSTEM_INFO;
+#define EFI_FIELD_OFFSET(t, f)  ((UINTN)(&(((t*)0)->f)))
+
+#define EFI_FILE_MODE_READ      0x0000000000000001ULL
+#define EFI_FILE_READ_ONLY      0x0000000000000001ULL
+#define EFI_FILE_DIRECTORY      0x0000000000000010ULL
+
+#define EFI_FILE_PROTOCOL_REVISION2 0x00020000
+
+typedef struct {
+	EFI_EVENT   Event;
+	EFI_STATUS  Status;
+	UINTN       BufferSize;
+	VOID*       Buffer;
+} EFI_FILE_IO_TOKEN;
+
+typedef struct _EFI_FILE_HANDLE* EFI_FILE_HANDLE;
+struct _EFI_FILE_HANDLE {
+	UINT64      Revision;
+	EFI_STATUS  (*Open)(EFI_FILE_HANDLE, EFI_FILE_HANDLE*, CHAR16*, UINT64, UINT64);
+	EFI_STATUS  (*Close)(EFI_FILE_HANDLE);
+	EFI_STATUS  (*Read)(EFI_FILE_HANDLE, UINTN*, VOID*);
+	EFI_STATUS  (*SetPosition)(EFI_FILE_HANDLE, UINT64);
+	EFI_STATUS  (*GetInfo)(EFI_FILE_HANDLE, EFI_GUID*, UINTN*, VOID*);
+	EFI_STATUS  (*ReadEx)(EFI_FILE_HANDLE, EFI_FILE_IO_TOKEN*);
+};
+
+typedef struct {
+	EFI_EVENT   Event;
+	EFI_STATUS  TransactionStatus;
+} EFI_DISK_IO2_TOKEN;
+
+typedef struct _EFI_DISK_IO_PROTOCOL EFI_DISK_IO_PROTOCOL;
+struct _EFI_DISK_IO_PROTOCOL {
+	UINT64      Revision;
+	EFI_STATUS  (*ReadDisk)(EFI_DISK_IO_PROTOCOL*, UINT32, UINT64, UINTN, VOID*);
+};
+
+typedef struct _EFI_DISK_IO2_PROTOCOL EFI_DISK_IO2_PROTOCOL;
+struct _EFI_DISK_IO2_PROTOCOL {
+	UINT64      Revision;
+	EFI_STATUS  (*ReadDiskEx)(EFI_DISK_IO2_PROTOCOL*, UINT32, UINT64, EFI_DISK_IO2_TOKEN*, UINTN, VOID*);
+};
+
+typedef enum {
+	EfiResetCold,
+	EfiResetWarm,
+	EfiResetShutdown
+} EFI_RESET_TYPE;
+
+typedef struct {
+	EFI_STATUS  (*Stall)(UINTN);
+	EFI_STATUS  (*SetWatchdogTimer)(UINTN, UINT64, UINTN, CHAR16*);
+	EFI_STATUS  (*CreateEvent)(UINT32, UINTN, VOID*, VOID*, EFI_EVENT*);
+	EFI_STATUS  (*WaitForEvent)(UINTN, EFI_EVENT*, UINTN*);
+	EFI_STATUS  (*CloseEvent)(EFI_EVENT);
+	EFI_STATUS  (*CheckEvent)(EFI_EVENT);
+} EFI_BOOT_SERVICES;
+
+typedef struct {
+	VOID        (*ResetSystem)(EFI_RESET_TYPE, EFI_STATUS, UINTN, VOID*);
+} EFI_RUNTIME_SERVICES;
+
+typedef struct _SIMPLE_TEXT_OUTPUT_INTERFACE {
+	EFI_STATUS  (*SetAttribute)(struct _SIMPLE_TEXT_OUTPUT_INTERFACE*, UINTN);
+	EFI_STATUS  (*SetCursorPosition)(struct _SIMPLE_TEXT_OUTPUT_INTERFACE*, UINTN, UINTN);
+} SIMPLE_TEXT_OUTPUT_INTERFACE;
+
+typedef struct {
+	EFI_EVENT   WaitForKey;
+} SIMPLE_INPUT_INTERFACE;
+
+typedef struct {
+	SIMPLE_INPUT_INTERFACE*         ConIn;
+	SIMPLE_TEXT_OUTPUT_INTERFACE*   ConOut;
+	EFI_BOOT_SERVICES*              BootServices;
+} EFI_SYSTEM_TABLE;
+
+extern EFI_SYSTEM_TABLE*        gST;
+extern EFI_BOOT_SERVICES*       gBS;
+extern EFI_RUNTIME_SERVICES*    gRT;
+extern EFI_GUID                 gEfiFileInfoGuid;
+extern EFI_GUID                 gEfiFileSystemInfoGuid;
+
+#define CopyMem(d, s, l)    memcpy(d, s, l)
+#define ZeroMem(d, l)       memset(d, 0, l)
+#define CompareMem(a, b, l) memcmp(a, b, l)
+#define AllocatePool(l)     malloc(l)
+#define AllocateZeroPool(l) calloc(1, l)
+#define FreePool(p)         free(p)
+#define CompareGuid(a, b)   memcmp(a, b, sizeof(EFI_GUID))
+
+STATIC __inline UINTN StrLen(CONST CHAR16* s)
+{
+	UINTN Len = 0;
+	while (s[Len] != 0)
+		Len++;
+	return Len;
+}
+
+UINTN Print(IN CONST CHAR16* Format, ...);
@@ -0,0 +1 @@
+/* Empty stand-in for gnu-efi's <efilib.h> (see efi.h) */
@@ -0,0 +1,490 @@
+/*
+ * uefi-md5sum: UEFI MD5Sum validator - Host hash kernel tests and benchmark
+ * Copyright © 2024 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * This application compiles the hashing code from src/ for the host and
+ * checks every MD5 kernel variant, bit for bit, against an independent
+ * reference implementation. When invoked with 'bench', it reports the
+ * throughput of each kernel instead.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+/* Include the source, so that we can access the static MD5 functions */
+#include "../../src/hash.c"
+
+/* Number of random iterations for each of the differential tests */
+#define NUM_ITERATIONS      2000
+
+/* Maximum number of blocks processed by a single multi-buffer transform call */
+#define MB_BLOCKS_MAX       16
+
+/* Minimum duration of each benchmark run, in seconds */
+#define BENCH_DURATION      0.5
+
+/*
+ * Globals and services that hash.c expects from the rest of the application
+ * or from the firmware. None of these are used by the MD5 functions we test.
+ */
+EFI_GUID                gEfiFileInfoGuid = { 0 };
+EFI_GUID                gEfiFileSystemInfoGuid = { 0 };
+BOOLEAN                 gIsTestMode = FALSE;
+UINTN                   gPauseAfterRead = 0;
+UINTN                   gAlertYPos = 0;
+CONSOLE_DIMENSIONS      gConsole = { 80, 25 };
+EFI_SYSTEM_TABLE*       gST = NULL;
+EFI_BOOT_SERVICES*      gBS = NULL;
+EFI_RUNTIME_SERVICES*   gRT = NULL;
+
+UINTN Print(IN CONST CHAR16* Format, ...)
+{
+	UINTN i;
+
+	// Only used by assertions, so we don't bother with the formatting
+	for (i = 0; Format[i] != 0; i++)
+		putchar((char)Format[i]);
+	fflush(stdout);
+	abort();
+	return i;
+}
+
+VOID PrintCentered(IN CONST CHAR16* Message, IN UINTN YPos) {}
+VOID UpdateProgress(IN PROGRESS_DATA* Progress) {}
+CHAR16* SizeToHumanReadable(IN CONST UINT64 Size) { return L""; }
+EFI_STATUS ReadVolume(IN FS_VOLUME* Volume, IN CONST UINT64 Offset, IN CONST UINTN Size,
+	OUT VOID* Buffer) { return EFI_UNSUPPORTED; }
+VOID* ArenaAllocate(IN CONST UINTN Size) { return malloc(Size); }
+ARENA_MARK ArenaGetMark(VOID) { ARENA_MARK Mark = { 0 }; return Mark; }
+VOID ArenaRelease(IN CONST ARENA_MARK Mark) {}
+DIR_INDEX_ENTRY* LookupDirIndex(IN DIR_INDEX* Index, IN CONST CHAR16* Path) { return NULL; }
+UINTN SubmitHashJob(IN HASH_WORKER* Worker, IN CONST HASH_JOB* Job) { return 0; }
+BOOLEAN IsHashJobDone(IN HASH_WORKER* Worker, IN CONST UINTN Ticket) { return TRUE; }
+
+/*
+ * Reference MD5 implementation, written after RFC 1321 and deliberately
+ * kept as different as possible from the code under test: the constants
+ * are derived from the sine function, the message schedule is computed
+ * and the padding is applied on a full copy of the message.
+ */
+STATIC VOID RefMd5(CONST UINT8* Data, UINTN Length, UINT8* Digest)
+{
+	STATIC CONST UINT32 Shift[4][4] = {
+		{ 7, 12, 17, 22 }, { 5, 9, 14, 20 }, { 4, 11, 16, 23 }, { 6, 10, 15, 21 }
+	};
+	UINT32 K[64], State[4] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476 };
+	UINT32 a, b, c, d, f, g, w[16], t;
+	UINTN i, j, PaddedLength = ((Length + 8) / 64 + 1) * 64;
+	UINT64 BitCount = (UINT64)Length * 8;
+	UINT8* Message = calloc(PaddedLength, 1);
+
+	if (Message == NULL)
+		abort();
+	for (i = 0; i < 64; i++)
+		K[i] = (UINT32)(fabs(sin((double)(i + 1))) * 4294967296.0);
+	memcpy(Message, Data, Length);
+	Message[Length] = 0x80;
+	for (i = 0; i < 8; i++)
+		Message[PaddedLength - 8 + i] = (UINT8)(BitCount >> (8 * i));
+
+	for (j = 0; j < PaddedLength; j += 64) {
+		for (i = 0; i < 16; i++)
+			w[i] = Message[j + 4 * i] | (Message[j + 4 * i + 1] << 8) |
+				(Message[j + 4 * i + 2] << 16) | ((UINT32)Message[j + 4 * i + 3] << 24);
+		a = State[0]; b = State[1]; c = State[2]; d = State[3];
+		for (i = 0; i < 64; i++) {
+			switch (i / 16) {
+			case 0: f = (b & c) | (~b & d); g = i; break;
+			case 1: f = (d & b) | (~d & c); g = (5 * i + 1) % 16; break;
+			case 2: f = b ^ c ^ d; g = (3 * i + 5) % 16; break;
+			default: f = c ^ (b | ~d); g = (7 * i) % 16; break;
+			}
+			t = a + f + K[i] + w[g];
+			a = d; d = c; c = b;
+			b += (t << Shift[i / 16][i % 4]) | (t >> (32 - Shift[i / 16][i % 4]));
+		}
+		State[0] += a; State[1] += b; State[2] += c; State[3] += d;
+	}
+	for (i = 0; i < 16; i++)
+		Digest[i] = (UINT8)(State[i / 4] >> (8 * (i % 4)));
+	free(Message);
+}
+
+/* xorshift64* PRNG, so that failures are reproducible from the seed */
+STATIC UINT64 RandomState = 0x5eed5eed5eed5eedULL;
+
+STATIC UINT64 Random(VOID)
+{
+	RandomState ^= RandomState >> 12;
+	RandomState ^= RandomState << 25;
+	RandomState ^= RandomState >> 27;
+	return RandomState * 0x2545f4914f6cdd1dULL;
+}
+
+STATIC VOID RandomFill(UINT8* Buffer, UINTN Length)
+{
+	UINTN i;
+
+	for (i = 0; i < Length; i++)
+		Buffer[i] = (UINT8)(Random() >> 56);
+}
+
+/* Kernel names are CHAR16 strings, which printf() can't display directly */
+STATIC CONST char* KernelName(CONST CHAR16* Name)
+{
+	STATIC char String[32];
+	UINTN i;
+
+	for (i = 0; Name[i] != 0 && i < sizeof(String) - 1; i++)
+		String[i] = (char)Name[i];
+	String[i] = 0;
+	return String;
+}
+#define EngineName(Engine)  KernelName((Engine)->Name)
+
+STATIC double GetTime(VOID)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+STATIC VOID DigestToString(CONST UINT8* Digest, char* String)
+{
+	UINTN i;
+
+	for (i = 0; i < MD5_HASHSIZE; i++)
+		sprintf(&String[2 * i], "%02x", Digest[i]);
+}
+
+/*
+ * Allocate a buffer that ends right before an inaccessible page, so that
+ * any read past the end of the data we provide results in a crash.
+ */
+STATIC UINT8* AllocateGuarded(UINTN Length, VOID** Base, UINTN* BaseSize)
+{
+	UINTN PageSize = (UINTN)sysconf(_SC_PAGESIZE);
+	UINTN Size = ((Length + PageSize - 1) / PageSize + 1) * PageSize;
+	UINT8* p = mmap(NULL, Size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	if (p == MAP_FAILED)
+		abort();
+	mprotect(p + Size - PageSize, PageSize, PROT_NONE);
+	*Base = p;
+	*BaseSize = Size;
+	return p + Size - PageSize - Length;
+}
+
+/* Validate the reference implementation against the RFC 1321 test suite */
+STATIC int TestReference(VOID)
+{
+	STATIC CONST char* Vectors[][2] = {
+		{ "", "d41d8cd98f00b204e9800998ecf8427e" },
+		{ "a", "0cc175b9c0f1b6a831c399e269772661" },
+		{ "abc", "900150983cd24fb0d6963f7d28e17f72" },
+		{ "message digest", "f96b697d7cb7938d525a2f31aaf161d0" },
+		{ "abcdefghijklmnopqrstuvwxyz", "c3fcd3d76192e4007dfb496cca67e13b" },
+		{ "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789",
+		  "d174ab98d277d9f5a5611c2c9f419d9f" },
+		{ "1234567890123456789012345678901234567890"
+		  "1234567890123456789012345678901234567890",
+		  "57edf4a22be3c955ac49da2e2107b67a" },
+	};
+	UINT8 Digest[MD5_HASHSIZE];
+	char String[2 * MD5_HASHSIZE + 1];
+	int i, Errors = 0;
+
+	for (i = 0; i < (int)ARRAY_SIZE(Vectors); i++) {
+		RefMd5((CONST UINT8*)Vectors[i][0], strlen(Vectors[i][0]), Digest);
+		DigestToString(Digest, String);
+		if (strcmp(String, Vectors[i][1]) != 0) {
+			printf("  Reference MD5(\"%s\") = %s, expected %s\n", Vectors[i][0], String, Vectors[i][1]);
+			Errors++;
+		}
+	}
+	printf("%-40s%s\n", "Reference implementation (RFC 1321)", Errors ? "FAIL" : "PASS");
+	return Errors;
+}
+
+/* Hash Data through Md5Write() calls of random sizes */
+STATIC VOID ScalarMd5(CONST UINT8* Data, UINTN Length, UINT8* Digest)
+{
+	HASH_CONTEXT Context;
+	UINTN Chunk, Pos = 0;
+
+	Md5Init(&Context);
+	while (Pos < Length) {
+		switch (Random() % 4) {
+		case 0: Chunk = 1 + Random() % MD5_BLOCKSIZE; break;
+		case 1: Chunk = MD5_BLOCKSIZE; break;
+		case 2: Chunk = 1 + Random() % (4 * MD5_BLOCKSIZE); break;
+		default: Chunk = Length - Pos; break;
+		}
+		Chunk = MIN(Chunk, Length - Pos);
+		Md5Write(&Context, &Data[Pos], Chunk);
+		Pos += Chunk;
+	}
+	Md5Final(&Context);
+	CopyMem(Digest, Context.Buffer, MD5_HASHSIZE);
+}
+
+/*
+ * Check the scalar code against the reference, for random data and lengths.
+ * Lengths around the block size ensure that the two-block padding path of
+ * Md5Final() is exercised, and the random write sizes ensure the same for
+ * the partial block path of Md5Write(). Since the data is placed right at
+ * the end of a guarded buffer, any overread also results in a crash.
+ */
+STATIC int TestScalar(CONST MD5_KERNEL* Kernel)
+{
+	STATIC CONST UINTN Lengths[] = {
+		0, 1, 55, 56, 57, 63, 64, 65, 119, 120, 121, 127, 128, 129, 1000, 4095, 4096, 65537
+	};
+	UINT8 Expected[MD5_HASHSIZE], Digest[MD5_HASHSIZE];
+	UINT8* Data;
+	VOID* Base;
+	UINTN i, Length, BaseSize;
+	char Name[64];
+	int Errors = 0;
+
+	Md5Dispatch.Kernel = Kernel;
+	for (i = 0; i < ARRAY_SIZE(Lengths) + NUM_ITERATIONS && Errors < 10; i++) {
+		Length = (i < ARRAY_SIZE(Lengths)) ? Lengths[i] : Random() % (8 * MD5_BLOCKSIZE + 1);
+		Data = AllocateGuarded(Length, &Base, &BaseSize);
+		RandomFill(Data, Length);
+		RefMd5(Data, Length, Expected);
+		ScalarMd5(Data, Length, Digest);
+		if (CompareMem(Digest, Expected, MD5_HASHSIZE) != 0) {
+			printf("  Scalar mismatch for length %zu\n", (size_t)Length);
+			Errors++;
+		}
+		munmap(Base, BaseSize);
+	}
+	snprintf(Name, sizeof(Name), "Scalar %s (Md5Write/Md5Final)", KernelName(Kernel->Name));
+	printf("%-40s%s\n", Name, Errors ? "FAIL" : "PASS");
+	return Errors;
+}
+
+/*
+ * Check a multi-buffer engine by running its transform on lanes with random
+ * states, data alignments and block counts, and comparing each lane against
+ * the scalar transform. Then hash full messages of random lengths, using the
+ * engine for the bulk of the data, and compare the digests to the reference.
+ */
+STATIC int TestEngine(CONST MD5_MB_ENGINE* Engine)
+{
+	HASH_CONTEXT Expected[MD5_MAX_LANES], Lanes[MD5_MAX_LANES], *Context[MD5_MAX_LANES];
+	CONST UINT8* Data[MD5_MAX_LANES];
+	UINT8* Buffers[MD5_MAX_LANES];
+	UINT8 Digest[MD5_HASHSIZE], Reference[MD5_HASHSIZE];
+	UINTN i, k, n, NumBlocks, Length[MD5_MAX_LANES], Blocks;
+	char Name[64];
+	int Errors = 0;
+
+	for (i = 0; i < Engine->NumLanes; i++) {
+		Buffers[i] = malloc(MB_BLOCKS_MAX * MD5_BLOCKSIZE + 64);
+		Context[i] = &Lanes[i];
+	}
+
+	for (n = 0; n < NUM_ITERATIONS && Errors < 10; n++) {
+		NumBlocks = 1 + Random() % MB_BLOCKS_MAX;
+		for (i = 0; i < Engine->NumLanes; i++) {
+			Md5Init(&Lanes[i]);
+			for (k = 0; k < 4; k++)
+				Lanes[i].State[k] = (UINT32)Random();
+			Data[i] = &Buffers[i][Random() % 64];
+			RandomFill((UINT8*)Data[i], NumBlocks * MD5_BLOCKSIZE);
+			Expected[i] = Lanes[i];
+			for (k = 0; k < NumBlocks; k++)
+				Md5TransformBlocks(&Expected[i], &Data[i][k * MD5_BLOCKSIZE], 1);
+		}
+		Engine->Transform(Context, Data, NumBlocks);
+		for (i = 0; i < Engine->NumLanes; i++) {
+			if (CompareMem(Lanes[i].State, Expected[i].State, sizeof(Lanes[i].State)) != 0) {
+				printf("  %s transform mismatch for lane %zu (%zu blocks)\n",
+					EngineName(Engine), (size_t)i, (size_t)NumBlocks);
+				Errors++;
+			}
+		}
+	}
+
+	for (n = 0; n < NUM_ITERATIONS / 10 && Errors < 10; n++) {
+		for (i = 0; i < Engine->NumLanes; i++) {
+			Md5Init(&Lanes[i]);
+			Length[i] = Random() % (MB_BLOCKS_MAX * MD5_BLOCKSIZE);
+			Data[i] = &Buffers[i][Random() % 64];
+			RandomFill((UINT8*)Data[i], Length[i]);
+		}
+		// All lanes process the same number of blocks, as HashFileBatch() does
+		Blocks = MB_BLOCKS_MAX;
+		for (i = 0; i < Engine->NumLanes; i++)
+			Blocks = MIN(Blocks, Length[i] / MD5_BLOCKSIZE);
+		if (Blocks != 0) {
+			Engine->Transform(Context, Data, Blocks);
+			for (i = 0; i < Engine->NumLanes; i++)
+				Lanes[i].ByteCount += Blocks * MD5_BLOCKSIZE;
+		}
+		for (i = 0; i < Engine->NumLanes; i++) {
+			Md5Write(&Lanes[i], &Data[i][Blocks * MD5_BLOCKSIZE], Length[i] - Blocks * MD5_BLOCKSIZE);
+			Md5Final(&Lanes[i]);
+			CopyMem(Digest, Lanes[i].Buffer, MD5_HASHSIZE);
+			RefMd5(Data[i], Length[i], Reference);
+			if (CompareMem(Digest, Reference, MD5_HASHSIZE) != 0) {
+				printf("  %s digest mismatch for lane %zu (length %zu)\n",
+					EngineName(Engine), (size_t)i, (size_t)Length[i]);
+				Errors++;
+			}
+		}
+	}
+
+	for (i = 0; i < Engine->NumLanes; i++)
+		free(Buffers[i]);
+	snprintf(Name, sizeof(Name), "Multi-buffer %s (%zu lanes)", EngineName(Engine), (size_t)Engine->NumLanes);
+	printf("%-40s%s\n", Name, Errors ? "FAIL" : "PASS");
+	return Errors;
+}
+
+/* Report the throughput of Md5Write() for a given write size and alignment */
+STATIC VOID BenchScalar(CONST MD5_KERNEL* Kernel, UINT8* Buffer, UINTN Size, UINTN Alignment)
+{
+	HASH_CONTEXT Context;
+	UINT64 Bytes = 0;
+	double Start, Elapsed;
+
+	Md5Dispatch.Kernel = Kernel;
+	Md5Init(&Context);
+	Start = GetTime();
+	do {
+		// Bench in chunks of 16 MB, to keep timing overhead low for small sizes
+		for (UINTN i = 0; i < (16 * 1024 * 1024) / Size; i++) {
+			Md5Write(&Context, &Buffer[Alignment], Size);
+			Bytes += Size;
+		}
+		Elapsed = GetTime() - Start;
+	} while (Elapsed < BENCH_DURATION);
+	Md5Final(&Context);
+	printf("  %-8s %8zu %8zu %10.1f\n", KernelName(Kernel->Name), (size_t)Size, (size_t)Alignment, Bytes / Elapsed / 1e6);
+}
+
+/* Report the aggregated throughput of a multi-buffer engine over all its lanes */
+STATIC VOID BenchEngine(CONST MD5_MB_ENGINE* Engine, UINT8* Buffer, UINTN Size, UINTN Alignment)
+{
+	HASH_CONTEXT Lanes[MD5_MAX_LANES], *Context[MD5_MAX_LANES];
+	CONST UINT8* Data[MD5_MAX_LANES];
+	UINT64 Bytes = 0;
+	UINTN i, NumBlocks = Size / MD5_BLOCKSIZE;
+	double Start, Elapsed;
+
+	if (NumBlocks == 0)
+		return;
+	for (i = 0; i < Engine->NumLanes; i++) {
+		Md5Init(&Lanes[i]);
+		Context[i] = &Lanes[i];
+		Data[i] = &Buffer[Alignment + i * Size];
+	}
+	Start = GetTime();
+	do {
+		for (i = 0; i < (16 * 1024 * 1024) / Size; i++) {
+			Engine->Transform(Context, Data, NumBlocks);
+			Bytes += (UINT64)NumBlocks * MD5_BLOCKSIZE * Engine->NumLanes;
+		}
+		Elapsed = GetTime() - Start;
+	} while (Elapsed < BENCH_DURATION);
+	printf("  %-8s %8zu %8zu %10.1f\n", EngineName(Engine), (size_t)Size, (size_t)Alignment, Bytes / Elapsed / 1e6);
+}
+
+STATIC VOID Bench(CONST MD5_KERNEL** Kernels, UINTN NumKernels, CONST MD5_MB_ENGINE** Engines, UINTN NumEngines)
+{
+	STATIC CONST UINTN Sizes[] = { 64, 512, 4096, 64 * 1024, READ_BUFFERSIZE };
+	STATIC CONST UINTN Alignments[] = { 0, 1, 4, 32 };
+	UINT8* Buffer = malloc(MD5_MAX_LANES * READ_BUFFERSIZE + 64);
+	UINTN i, j, k;
+
+	if (Buffer == NULL)
+		abort();
+	RandomFill(Buffer, MD5_MAX_LANES * READ_BUFFERSIZE + 64);
+	printf("  %-8s %8s %8s %10s\n", "Kernel", "Size", "Align", "MB/s");
+	for (i = 0; i < ARRAY_SIZE(Sizes); i++) {
+		for (j = 0; j < ARRAY_SIZE(Alignments); j++) {
+			for (k = 0; k < NumKernels; k++)
+				BenchScalar(Kernels[k], Buffer, Sizes[i], Alignments[j]);
+			for (k = 0; k < NumEngines; k++)
+				BenchEngine(Engines[k], Buffer, Sizes[i], Alignments[j]);
+		}
+	}
+	free(Buffer);
+}
+
+/*
+ * Get the single buffer kernels and multi-buffer engines that can run on the
+ * current CPU. Unlike Md5SelectKernels(), this retains all of them.
+ */
+STATIC VOID GetTestKernels(CONST MD5_KERNEL** Kernels, UINTN* NumKernels,
+	CONST MD5_MB_ENGINE** Engines, UINTN* NumEngines)
+{
+	CONST MD5_MB_ENGINE* CONST* AllEngines = Md5MbGetEngines();
+	UINT32 Features = GetCpuFeatures();
+	UINTN i;
+
+	*NumKernels = 0;
+	for (i = 0; i < ARRAY_SIZE(Md5Kernels); i++)
+		if ((Md5Kernels[i].Features & Features) == Md5Kernels[i].Features)
+			Kernels[(*NumKernels)++] = &Md5Kernels[i];
+	*NumEngines = 0;
+	for (i = 0; AllEngines[i] != NULL; i++)
+		if ((AllEngines[i]->Features & Features) == AllEngines[i]->Features)
+			Engines[(*NumEngines)++] = AllEngines[i];
+}
+
+int main(int argc, char** argv)
+{
+	CONST MD5_KERNEL* Kernels[ARRAY_SIZE(Md5Kernels)];
+	CONST MD5_MB_ENGINE* Engines[MD5_MAX_LANES];
+	UINTN i, NumKernels, NumEngines;
+	int Errors = 0;
+
+	setvbuf(stdout, NULL, _IOLBF, 0);
+	GetTestKernels(Kernels, &NumKernels, Engines, &NumEngines);
+
+	if (argc > 1 && strcmp(argv[1], "bench") == 0) {
+		Bench(Kernels, NumKernels, Engines, NumEngines);
+		return 0;
+	}
+
+	if (argc > 1)
+		RandomState = strtoull(argv[1], NULL, 0);
+	printf("Using seed 0x%llx\n", (unsigned long long)RandomState);
+	Errors += TestReference();
+	for (i = 0; i < NumKernels; i++)
+		Errors += TestScalar(Kernels[i]);
+
+	// The multi-buffer engines are checked against the kernel selected at startup
+	if (Md5SelectKernels() != EFI_SUCCESS) {
+		printf("%-40s%s\n", "Startup kernel selection", "FAIL");
+		return 1;
+	}
+	printf("Selected kernel: %s", KernelName(Md5Dispatch.Kernel->Name));
+	printf(", multi-buffer: %s\n", (Md5Dispatch.Engine == NULL) ? "none" : EngineName(Md5Dispatch.Engine));
+	for (i = 0; i < NumEngines; i++)
+		Errors += TestEngine(Engines[i]);
+	return (Errors == 0) ? 0 : 1;
+}
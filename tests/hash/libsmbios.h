@@ -0,0 +1 @@
+/* Empty stand-in for gnu-efi's <libsmbios.h> (see efi.h) */